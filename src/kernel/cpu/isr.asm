@@ -6,11 +6,14 @@ bits    64
 global asm_finalize_sched
 asm_finalize_sched:
   ; rdi = switch stack pointer
-  ; rsi = next pagedir
+  ; rsi = next pagedir (cr3 value, 0 if it's the same one)
   ; rdx = old task pointer (for cleanup)
 
   mov rsp, rdi
+  test rsi, rsi
+  jz .same_pagedir
   mov cr3, rsi
+.same_pagedir:
 
   ; cleanup (WILL check task state, dw)
   mov rdi, rdx
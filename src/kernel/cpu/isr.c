@@ -125,15 +125,35 @@ uint64_t handle_syscall_tssrsp(uint64_t rsp) {
   return (size_t)iretqRsp;
 }
 
+// File-backed areas take locks that preemptible tasks can sleep on, so page
+// faults from userspace or system calls (with interrupts on) are handled with
+// interrupts enabled as well
+bool isrFaultPreemptible(AsmPassedInterrupt *cpu) {
+  if (cpu->interrupt != 14 || !tasksInitiated)
+    return false;
+  if (cpu->cs & 3)
+    return true;
+  return currentTask->systemCallInProgress && cpu->rflags & (1 << 9);
+}
+
 uint64_t handle_tssrsp(uint64_t rsp) {
   if (!tasksInitiated)
     return rsp;
 
   AsmPassedInterrupt *cpu = (AsmPassedInterrupt *)rsp;
 
+  // Preemptible page faults can't stay at the top of the TSS stack, as the
+  // scheduler puts the frame of whatever interrupts them right there. User
+  // ones move to the (idle) syscall stack, syscall ones stay where they are
+  uint64_t top = currentTask->whileTssRsp;
+  if (isrFaultPreemptible(cpu)) {
+    if (!(cpu->cs & 3))
+      return rsp;
+    top = currentTask->whileSyscallRsp;
+  }
+
   AsmPassedInterrupt *iretqRsp =
-      (AsmPassedInterrupt *)(currentTask->whileTssRsp -
-                             sizeof(AsmPassedInterrupt));
+      (AsmPassedInterrupt *)(top - sizeof(AsmPassedInterrupt));
   memcpy(iretqRsp, cpu, sizeof(AsmPassedInterrupt));
 
   return (size_t)iretqRsp;
@@ -169,6 +189,19 @@ void handle_interrupt(uint64_t rsp) {
     }
     }
   } else if (cpu->interrupt >= 0 && cpu->interrupt <= 31) { // ISR
+    if (cpu->interrupt == 14) {
+      uint64_t err_pos;
+      asm volatile("movq %%cr2, %0" : "=r"(err_pos));
+      bool preemptible = isrFaultPreemptible(cpu);
+      if (preemptible)
+        asm volatile("sti");
+      bool resolved = VirtualPageFault(err_pos, cpu->error);
+      if (preemptible)
+        asm volatile("cli");
+      if (resolved)
+        return; // copy-on-write, etc
+    }
+
     if (currentTask->systemCallInProgress)
       debugf("[isr] Happened from system call!\n");
 
@@ -7,7 +7,7 @@
 void cpuid(uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
   asm volatile("cpuid \n"
                : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
-               : "a"(*eax)
+               : "a"(*eax), "c"(*ecx)
                : "memory");
 }
 
@@ -41,6 +41,13 @@ void outportl(uint16_t portid, uint32_t value) {
   __asm__ __volatile__("outl %%eax, %%dx" : : "d"(portid), "a"(value));
 }
 
+uint64_t rdtsc() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  return (uint64_t)low << 0 | (uint64_t)high << 32;
+}
+
 uint64_t rdmsr(uint32_t msrid) {
   uint32_t low;
   uint32_t high;
@@ -1,11 +1,14 @@
 #include <ahci.h>
 #include <bootloader.h>
+#include <disk.h>
 #include <isr.h>
 #include <linked_list.h>
 #include <malloc.h>
 #include <paging.h>
 #include <pmm.h>
 #include <string.h>
+#include <system.h>
+#include <task.h>
 #include <timer.h>
 #include <util.h>
 #include <vmm.h>
@@ -54,41 +57,160 @@ void ahciCmdStop(HBA_PORT *port) {
 
 /* Command port operations: */
 
-int ahciCmdFind(HBA_PORT *port) {
-  // If not set in SACT and CI, the slot is free
-  uint32_t slots = (port->sact | port->ci);
+// The port queues are shared with ahciInterruptHandler(), so they are only
+// ever touched with interrupts off
+uint64_t ahciQueueLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void ahciQueueUnlock(uint64_t rflags) {
+  if (rflags & RFLAGS_IF)
+    asm volatile("sti" ::: "memory");
+}
+
+// Hands out a free command slot, waiting for one if needed. The last slot is
+// kept for issuers that can't sleep: sleepers only release theirs once they're
+// scheduled again, which never happens with interrupts off
+int ahciSlotAcquire(AhciPortQueue *queue, bool sleep) {
+  uint32_t usable =
+      queue->slots >= 32 ? (uint32_t)-1 : ((1U << queue->slots) - 1);
+  if (sleep && queue->slots > 1)
+    usable &= ~(1U << (queue->slots - 1));
+
+  while (true) {
+    uint64_t rflags = ahciQueueLock();
+    uint32_t free = usable & ~queue->busy;
+    if (free) {
+      int slot = __builtin_ctz(free);
+      queue->busy |= 1U << slot;
+      ahciQueueUnlock(rflags);
+      return slot;
+    }
+    ahciQueueUnlock(rflags);
+    asm volatile("pause");
+  }
+}
+
+void ahciSlotRelease(AhciPortQueue *queue, int slot) {
+  uint64_t rflags = ahciQueueLock();
+  queue->done &= ~(1U << slot);
+  queue->failed &= ~(1U << slot);
+  queue->waiters[slot] = 0;
+  queue->busy &= ~(1U << slot);
+  ahciQueueUnlock(rflags);
+}
+
+// Restarts the command engine after an error. Clearing ST makes the HBA drop
+// everything outstanding (PxCI and PxSACT included)
+void ahciPortRecover(HBA_PORT *port) {
+  ahciCmdStop(port);
+  port->serr = port->serr;
+  port->is = port->is;
+
+  if (port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) {
+    // Command list override, to get rid of the stuck BSY/DRQ
+    port->cmd |= (1 << 3);
+    int spin = 0;
+    while (port->cmd & (1 << 3) && spin < 1000000)
+      spin++;
+  }
+
+  ahciCmdStart(port);
+}
+
+// Reaps every finished command of the port and wakes its issuer up (has to be
+// called with interrupts off)
+void ahciPortServiceUnsafe(ahci *ahciPtr, uint32_t portId) {
+  AhciPortQueue *queue = &ahciPtr->queues[portId];
+  HBA_PORT      *port = &ahciPtr->mem->ports[portId];
+
+  uint32_t is = port->is;
+  port->is = is; // acknowledge
+
+  uint32_t active = port->ci | port->sact;
+  uint32_t finished = queue->issued & ~active;
+  if (is & HBA_PxIS_ERRORS) {
+    debugf("[pci::ahci] Port error: port{%d} is{%x} tfd{%x} serr{%x}\n",
+           portId, is, port->tfd, port->serr);
+    // whatever was still outstanding is lost (NCQ aborts them all)
+    queue->failed |= queue->issued & active;
+    finished = queue->issued;
+    ahciPortRecover(port);
+  }
+  if (!finished)
+    return;
+
+  queue->issued &= ~finished;
+  queue->done |= finished;
   for (int i = 0; i < 32; i++) {
-    if ((slots & 1) == 0)
-      return i;
-    slots >>= 1;
+    if (!(finished & (1U << i)) || !queue->waiters[i])
+      continue;
+    Task *task = queue->waiters[i];
+    queue->waiters[i] = 0;
+    if (task->state == TASK_STATE_WAITING_DISK)
+      task->state = TASK_STATE_READY;
   }
-  printf("Cannot find free command list entry\n");
-  return -1;
 }
 
-bool ahciCmdIssue(HBA_PORT *port, int slot) {
-  port->ci = 1 << slot; // Issue command
+// Drops the references ahciSetUpPRDT() took on the pages behind the entries
+void ahciReleasePRDT(HBA_CMD_TBL *cmdtbl, int entries) {
+  for (int i = 0; i < entries; i++) {
+    HBA_PRDT_ENTRY *entry = &cmdtbl->prdt_entry[i];
+    size_t          phys = COMBINE_64(entry->dbau, entry->dba);
+    size_t          end = phys + entry->dbc + 1;
+    for (size_t page = phys & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE)
+      PhysicalRelease(page);
+  }
+}
 
-  // Wait for completion
-  while (1) {
-    // In some longer duration reads, it may be helpful to spin on the DPS bit
-    // in the PxIS port field as well (1 << 5)
-    if ((port->ci & (1 << slot)) == 0)
-      break;
-    if (port->is & HBA_PxIS_TFES) // Task file error
-    {
-      printf("[pci::ahci] Read disk error\n");
-      return false;
+// Same as above, for a slot's command that's done with (before the slot's
+// released, as its table gets reused right away)
+void ahciSlotReleasePRDT(ahci *ahciPtr, uint32_t portId, int slot) {
+  HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)ahciPtr->clbVirt[portId];
+  HBA_CMD_TBL    *cmdtbl = (HBA_CMD_TBL *)((size_t)ahciPtr->ctbaVirt[portId] +
+                                        slot * AHCI_CMD_TBL_SIZE);
+  ahciReleasePRDT(cmdtbl, cmdheader[slot].prdtl);
+}
+
+// Sends a prepared slot off & waits for it to complete. The slot is released
+// afterwards, returns false on a disk error
+bool ahciCmdIssue(ahci *ahciPtr, uint32_t portId, int slot, bool sleep) {
+  AhciPortQueue *queue = &ahciPtr->queues[portId];
+  HBA_PORT      *port = &ahciPtr->mem->ports[portId];
+  uint32_t       bit = 1U << slot;
+
+  uint64_t rflags = ahciQueueLock();
+  if (sleep) {
+    queue->waiters[slot] = currentTask;
+    currentTask->state = TASK_STATE_WAITING_DISK;
+  }
+  queue->issued |= bit;
+  if (queue->ncq)
+    port->sact = bit; // has to be set before PxCI
+  port->ci = bit;     // Issue command
+  ahciQueueUnlock(rflags);
+
+  if (sleep) {
+    // the scheduler skips us until ahciInterruptHandler() reaps the slot
+    while (currentTask->state == TASK_STATE_WAITING_DISK)
+      asm volatile("pause" ::: "memory");
+  } else {
+    while (!(queue->done & bit)) {
+      rflags = ahciQueueLock();
+      ahciPortServiceUnsafe(ahciPtr, portId);
+      ahciQueueUnlock(rflags);
     }
   }
 
-  // Check again
-  if (port->is & HBA_PxIS_TFES) {
+  bool ok = !(queue->failed & bit);
+  ahciSlotReleasePRDT(ahciPtr, portId, slot);
+  ahciSlotRelease(queue, slot);
+  if (!ok)
     printf("[pci::ahci] Read disk error\n");
-    return false;
-  }
 
-  return true;
+  return ok;
 }
 
 /* Set up AHCI parts for reading/writing: */
@@ -102,39 +224,86 @@ HBA_CMD_HEADER *ahciSetUpCmdHeader(ahci *ahciPtr, uint32_t portId,
   cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t); // Command FIS size
   cmdheader->w = (uint8_t)write; // 0 = read, 1 = write
   cmdheader->prdtl = prdt;       // PRDT entries count
+  cmdheader->prdbc = 0;
 
   return cmdheader;
 }
 
-HBA_CMD_TBL *ahciSetUpCmdTable(ahci *ahciPtr, HBA_CMD_HEADER *cmdheader,
-                               uint32_t portId) {
-  HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)ahciPtr->ctbaVirt[portId];
-  memset(cmdtbl, 0,
-         sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
+HBA_CMD_TBL *ahciSetUpCmdTable(ahci *ahciPtr, uint32_t portId,
+                               uint32_t cmdslot) {
+  HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL *)((size_t)ahciPtr->ctbaVirt[portId] +
+                                        cmdslot * AHCI_CMD_TBL_SIZE);
+  memset(cmdtbl, 0, AHCI_CMD_TBL_SIZE);
   return cmdtbl;
 }
 
-void ahciSetUpPRDT(HBA_CMD_HEADER *cmdheader, HBA_CMD_TBL *cmdtbl,
-                   uint16_t *buff, uint32_t *count) {
-  // 8K bytes (16 sectors) per PRDT
-  int i = 0;
-  for (i = 0; i < cmdheader->prdtl - 1; i++) {
-    size_t targPhys = VirtualToPhysical((size_t)buff);
-    cmdtbl->prdt_entry[i].dba = SPLIT_64_LOWER(targPhys);
-    cmdtbl->prdt_entry[i].dbau = SPLIT_64_HIGHER(targPhys);
-    cmdtbl->prdt_entry[i].dbc =
-        8 * 1024 - 1; // 8K bytes (this value should always be set to 1 less
-                      // than the actual value)
-    cmdtbl->prdt_entry[i].i = 1;
-    buff += 4 * 1024; // 4K words
-    *count -= 16;     // 16 sectors
+// Describes the segments (any virtually contiguous buffers, kernel or user)
+// page by page, coalescing physically adjacent pages into the same entry.
+// Every page is referenced till the command's done, so it can't be freed
+// (ex: by munmap() on another thread) while the device is using it. Returns
+// the amount of entries used, or -1 if the device can't reach them directly
+// (misaligned or too scattered)
+int ahciSetUpPRDT(HBA_CMD_TBL *cmdtbl, BlockSegment *segments, int cnt,
+                  bool write) {
+  int    entries = 0;
+  size_t physEnd = 0;
+  size_t entryBytes = 0;
+  for (int i = 0; i < cnt; i++) {
+    size_t virt = (size_t)segments[i].buff;
+    size_t bytes = segments[i].bytes;
+    if (virt & 1) // data base addresses have to be word aligned
+      goto fail;
+
+    while (bytes) {
+      size_t len = PAGE_SIZE - (virt % PAGE_SIZE);
+      if (len > bytes)
+        len = bytes;
+
+      // lazily backed & copy-on-write pages have to be resolved first, just
+      // like a CPU copy would (the device can't page fault)
+      volatile uint8_t *touch = (volatile uint8_t *)virt;
+      if (write)
+        (void)*touch;
+      else
+        *touch = *touch;
+
+      size_t phys = VirtualToPhysical(virt);
+      if (!phys)
+        goto fail;
+
+      if (entries && phys == physEnd &&
+          entryBytes + len <= AHCI_PRDT_BYTES_MAX) {
+        if (!(phys % PAGE_SIZE)) // (once per page of an entry)
+          PhysicalShare(phys);
+        entryBytes += len;
+      } else {
+        if (entries == AHCI_PRDT_MAX)
+          goto fail;
+        PhysicalShare(phys);
+        if (entries) // finish the previous one
+          cmdtbl->prdt_entry[entries - 1].dbc = entryBytes - 1;
+        cmdtbl->prdt_entry[entries].dba = SPLIT_64_LOWER(phys);
+        cmdtbl->prdt_entry[entries].dbau = SPLIT_64_HIGHER(phys);
+        entryBytes = len;
+        entries++;
+      }
+
+      physEnd = phys + len;
+      virt += len;
+      bytes -= len;
+    }
   }
-  size_t targPhys = VirtualToPhysical((size_t)buff);
-  // Last entry
-  cmdtbl->prdt_entry[i].dba = SPLIT_64_LOWER(targPhys);
-  cmdtbl->prdt_entry[i].dbau = SPLIT_64_HIGHER(targPhys);
-  cmdtbl->prdt_entry[i].dbc = (*count << 9) - 1; // 512 bytes per sector
-  cmdtbl->prdt_entry[i].i = 1;
+
+  // byte counts are always stored 1 less than the actual value
+  cmdtbl->prdt_entry[entries - 1].dbc = entryBytes - 1;
+  cmdtbl->prdt_entry[entries - 1].i = 1; // interrupt once it's all done
+  return entries;
+
+fail:
+  if (entries)
+    cmdtbl->prdt_entry[entries - 1].dbc = entryBytes - 1;
+  ahciReleasePRDT(cmdtbl, entries);
+  return -1;
 }
 
 /* Port initialization (used only on startup): */
@@ -165,8 +334,8 @@ int ahciPortType(HBA_PORT *port) {
 void ahciPortRebase(ahci *ahciPtr, HBA_PORT *port, int portno) {
   ahciCmdStop(port); // Stop command engine
 
-  // enable (all) interrupts
-  port->ie = 1;
+  // completions (queued & not) and errors get reported
+  port->ie = HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_ERRORS;
 
   // Command list offset: 1K*portno
   // Command list entry size = 32
@@ -188,18 +357,18 @@ void ahciPortRebase(ahci *ahciPtr, HBA_PORT *port, int portno) {
   port->fbu = SPLIT_64_HIGHER(fbPhys);
   // memset((void *)(port->fb), 0, 256); already 0'd
 
-  // Command table offset: 40K + 8K*portno
-  // Command table size = 256*32 = 8K per port
+  // Command table size = AHCI_CMD_TBL_SIZE*32 = 44K per port
   HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER *)clbVirt;
-  void           *ctbaVirt = VirtualAllocate(2); // 2 pages = 8192 bytes //!
+  uint32_t ctbaPages = DivRoundUp(AHCI_CMD_TBL_SIZE * 32, BLOCK_SIZE);
+  void    *ctbaVirt = VirtualAllocate(ctbaPages); //!
   ahciPtr->ctbaVirt[portno] = ctbaVirt;
   size_t ctbaPhys = (size_t)VirtualToPhysical((size_t)ctbaVirt);
-  memset(ctbaVirt, 0, 8192);
+  memset(ctbaVirt, 0, ctbaPages * BLOCK_SIZE);
   for (int i = 0; i < 32; i++) {
-    cmdheader[i].prdtl = 8; // 8 prdt entries per command table
-                            // 256 bytes per command table, 64+16+48+16*8
-    // Command table offset: 40K + 8K*portno + cmdheader_index*256
-    size_t ctbaPhysCurr = ctbaPhys + i * 256;
+    cmdheader[i].prdtl = AHCI_PRDT_MAX; // 640 bytes per command table,
+                                        // 64+16+48+16*32 (128-byte aligned)
+    // Command table offset: cmdheader_index*AHCI_CMD_TBL_SIZE
+    size_t ctbaPhysCurr = ctbaPhys + i * AHCI_CMD_TBL_SIZE;
     cmdheader[i].ctba = SPLIT_64_LOWER(ctbaPhysCurr);
     cmdheader[i].ctbau = SPLIT_64_HIGHER(ctbaPhysCurr);
     // memset((void *)cmdheader[i].ctba, 0, 256); already 0'd
@@ -221,6 +390,76 @@ void ahciPortRebase(ahci *ahciPtr, HBA_PORT *port, int portno) {
   ahciPtr->sata |= (1 << portno);
 }
 
+// Await for port to stop being "busy" and send results
+bool ahciPortReady(HBA_PORT *port) {
+  int spin = 0;
+  while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000)
+    spin++;
+
+  if (spin == 1000000) {
+    printf("[pci::ahci] Port is hung ATA_DEV_BUSY{%d} ATA_DEV_DRQ{%d}\n",
+           port->tfd & ATA_DEV_BUSY, port->tfd & ATA_DEV_DRQ);
+    return false;
+  }
+
+  return true;
+}
+
+// Sizes the port's queue: NCQ is used when both the HBA and the drive support
+// it (and the controller isn't known to break it). Returns the capacity (in
+// sectors)
+uint64_t ahciPortIdentify(ahci *ahciPtr, uint32_t portId) {
+  AhciPortQueue *queue = &ahciPtr->queues[portId];
+  HBA_PORT      *port = &ahciPtr->mem->ports[portId];
+  uint32_t       cap = ahciPtr->mem->cap;
+
+  queue->ncq = false;
+  queue->slots = AHCI_CAP_NCS(cap);
+
+  uint16_t *identify = (uint16_t *)VirtualAllocate(1);
+  memset(identify, 0, BLOCK_SIZE);
+
+  BlockSegment segment = {.buff = (uint8_t *)identify, .bytes = SECTOR_SIZE};
+  int          slot = ahciSlotAcquire(queue, false);
+  HBA_CMD_TBL *cmdtbl = ahciSetUpCmdTable(ahciPtr, portId, slot);
+  int          prdt = ahciSetUpPRDT(cmdtbl, &segment, 1, false);
+  ahciSetUpCmdHeader(ahciPtr, portId, slot, prdt, false);
+
+  FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
+  cmdfis->fis_type = FIS_TYPE_REG_H2D;
+  cmdfis->c = 1; // Command
+  cmdfis->command = ATA_CMD_IDENTIFY;
+
+  bool ok = false;
+  if (ahciPortReady(port))
+    ok = ahciCmdIssue(ahciPtr, portId, slot, false);
+  else {
+    ahciSlotReleasePRDT(ahciPtr, portId, slot);
+    ahciSlotRelease(queue, slot);
+  }
+
+  // word 76 bit 8: NCQ supported, word 75 bits 4:0: queue depth - 1
+  if (ok && cap & AHCI_CAP_SNCQ && identify[76] != 0xFFFF &&
+      identify[76] & (1 << 8) &&
+      !(ahciPtr->bsdInfo->quirks & AHCI_Q_NONCQ)) {
+    uint32_t depth = (identify[75] & 0x1F) + 1;
+    queue->ncq = true;
+    if (depth < queue->slots)
+      queue->slots = depth;
+  }
+
+  // words 100-103: LBA48 capacity
+  uint64_t sectors = 0;
+  if (ok)
+    sectors = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+              ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+  VirtualFree(identify, 1);
+
+  debugf("[pci::ahci] Port %d queue: slots{%d} ncq{%d}\n", portId,
+         queue->slots, queue->ncq);
+  return sectors;
+}
+
 void ahciPortProbe(ahci *ahciPtr, HBA_MEM *abar) {
   uint32_t pi = abar->pi;
   for (int i = 0; i < 32; i++) {
@@ -229,6 +468,13 @@ void ahciPortProbe(ahci *ahciPtr, HBA_MEM *abar) {
       if (dt == AHCI_DEV_SATA) {
         debugf("[pci::ahci] SATA drive found at port %d\n", i);
         ahciPortRebase(ahciPtr, &abar->ports[i], i);
+        uint64_t sectors = ahciPortIdentify(ahciPtr, i);
+
+        // sleepers can't have the last slot (see ahciSlotAcquire())
+        AhciPortQueue *queue = &ahciPtr->queues[i];
+        uint32_t       depth = queue->slots > 1 ? queue->slots - 1 : 1;
+        blockDeviceRegister(ahciBlockTransfer, ahciPtr, i, sectors,
+                            AHCI_SECTORS_MAX, depth);
       } else if (dt == AHCI_DEV_SATAPI) {
         debugf("[pci::ahci] (unsupported) SATAPI drive found at port %d\n", i);
       } else if (dt == AHCI_DEV_SEMB) {
@@ -243,41 +489,46 @@ void ahciPortProbe(ahci *ahciPtr, HBA_MEM *abar) {
   }
 }
 
-// Await for port to stop being "busy" and send results
-bool ahciPortReady(HBA_PORT *port) {
-  int spin = 0;
-  while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000)
-    spin++;
-
-  if (spin == 1000000) {
-    printf("[pci::ahci] Port is hung ATA_DEV_BUSY{%d} ATA_DEV_DRQ{%d}\n",
-           port->tfd & ATA_DEV_BUSY, port->tfd & ATA_DEV_DRQ);
-    return false;
+// Moves data between the bounce buffer & the (scattered) segments
+void ahciBounceCopy(uint8_t *bounce, BlockSegment *segments, int cnt,
+                    bool in) {
+  for (int i = 0; i < cnt; i++) {
+    if (in)
+      memcpy(bounce, segments[i].buff, segments[i].bytes);
+    else
+      memcpy(segments[i].buff, bounce, segments[i].bytes);
+    bounce += segments[i].bytes;
   }
-
-  return true;
 }
 
-bool ahciRead(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
-              uint32_t starth, uint32_t count, uint8_t *buff) {
-  port->is = (uint32_t)-1; // Clear pending interrupt bits
-  int slot = ahciCmdFind(port);
-  if (slot == -1)
-    return false;
-
-  HBA_CMD_HEADER *cmdheader =
-      ahciSetUpCmdHeader(ahciPtr, portId, slot, AHCI_CALC_PRDT(count), false);
-  HBA_CMD_TBL *cmdtbl = ahciSetUpCmdTable(ahciPtr, cmdheader, portId);
-
-  // todo: look this up
-  uint32_t countSec = count;
-  ahciSetUpPRDT(cmdheader, cmdtbl, (uint16_t *)buff, &countSec);
+// Queues up a DMA transfer on a free slot & waits for it to complete. Buffers
+// the device can't reach directly go through a bounce buffer
+bool ahciTransfer(ahci *ahciPtr, uint32_t portId, HBA_PORT *port,
+                  uint32_t startl, uint32_t starth, uint32_t count,
+                  BlockSegment *segments, int cnt, bool write) {
+  AhciPortQueue *queue = &ahciPtr->queues[portId];
+  bool           sleep = taskCanSleep();
+  int            slot = ahciSlotAcquire(queue, sleep);
+  uint32_t       bytes = count * SECTOR_SIZE;
+
+  // DMA straight from/into the caller's buffer whenever possible
+  HBA_CMD_TBL *cmdtbl = ahciSetUpCmdTable(ahciPtr, portId, slot);
+  uint8_t     *bounce = 0;
+  uint32_t     bouncePages = DivRoundUp(bytes, PAGE_SIZE);
+  int          prdt = ahciSetUpPRDT(cmdtbl, segments, cnt, write);
+  if (prdt < 0) {
+    bounce = (uint8_t *)VirtualAllocate(bouncePages);
+    if (write)
+      ahciBounceCopy(bounce, segments, cnt, true);
+    BlockSegment segment = {.buff = bounce, .bytes = bytes};
+    prdt = ahciSetUpPRDT(cmdtbl, &segment, 1, write);
+  }
+  ahciSetUpCmdHeader(ahciPtr, portId, slot, prdt, write);
 
   FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
 
   cmdfis->fis_type = FIS_TYPE_REG_H2D;
   cmdfis->c = 1; // Command
-  cmdfis->command = ATA_CMD_READ_DMA_EX;
 
   cmdfis->lba0 = (uint8_t)startl;
   cmdfis->lba1 = (uint8_t)(startl >> 8);
@@ -288,60 +539,76 @@ bool ahciRead(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
   cmdfis->lba4 = (uint8_t)starth;
   cmdfis->lba5 = (uint8_t)(starth >> 8);
 
-  cmdfis->countl = count & 0xFF;
-  cmdfis->counth = (count >> 8) & 0xFF;
+  if (queue->ncq) {
+    cmdfis->command =
+        write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    // the sector count moves to the features, the count holds the tag
+    cmdfis->featurel = count & 0xFF;
+    cmdfis->featureh = (count >> 8) & 0xFF;
+    cmdfis->countl = slot << 3;
+  } else {
+    cmdfis->command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+    cmdfis->countl = count & 0xFF;
+    cmdfis->counth = (count >> 8) & 0xFF;
+  }
 
-  if (!ahciPortReady(port))
-    return false;
+  // with nothing else in flight, the device should be idle already
+  bool ok = false;
+  if (queue->issued || ahciPortReady(port))
+    ok = ahciCmdIssue(ahciPtr, portId, slot, sleep);
+  else {
+    ahciSlotReleasePRDT(ahciPtr, portId, slot);
+    ahciSlotRelease(queue, slot);
+  }
 
-  return ahciCmdIssue(port, slot);
+  if (bounce) {
+    if (ok && !write)
+      ahciBounceCopy(bounce, segments, cnt, false);
+    VirtualFree(bounce, bouncePages);
+  }
+
+  return ok;
+}
+
+bool ahciRead(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
+              uint32_t starth, uint32_t count, uint8_t *buff) {
+  BlockSegment segment = {.buff = buff, .bytes = count * SECTOR_SIZE};
+  return ahciTransfer(ahciPtr, portId, port, startl, starth, count, &segment,
+                      1, false);
 }
 
 bool ahciWrite(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
                uint32_t starth, uint32_t count, uint8_t *buff) {
-  port->is = (uint32_t)-1; // Clear pending interrupt bits
-  int slot = ahciCmdFind(port);
-  if (slot == -1)
-    return false;
-
-  HBA_CMD_HEADER *cmdheader =
-      ahciSetUpCmdHeader(ahciPtr, portId, slot, AHCI_CALC_PRDT(count), true);
-  HBA_CMD_TBL *cmdtbl = ahciSetUpCmdTable(ahciPtr, cmdheader, portId);
-
-  ahciSetUpPRDT(cmdheader, cmdtbl, (uint16_t *)buff, &count);
-
-  FIS_REG_H2D *cmdfis = (FIS_REG_H2D *)(&cmdtbl->cfis);
-
-  cmdfis->fis_type = FIS_TYPE_REG_H2D;
-  cmdfis->c = 1; // Command
-  cmdfis->command = ATA_CMD_WRITE_DMA_EX;
-
-  cmdfis->lba0 = (uint8_t)startl;
-  cmdfis->lba1 = (uint8_t)(startl >> 8);
-  cmdfis->lba2 = (uint8_t)(startl >> 16);
-  cmdfis->device = 1 << 6; // LBA mode
-
-  cmdfis->lba3 = (uint8_t)(startl >> 24);
-  cmdfis->lba4 = (uint8_t)starth;
-  cmdfis->lba5 = (uint8_t)(starth >> 8);
-
-  cmdfis->countl = count & 0xFF;
-  cmdfis->counth = (count >> 8) & 0xFF;
-
-  if (!ahciPortReady(port))
-    return false;
+  BlockSegment segment = {.buff = buff, .bytes = count * SECTOR_SIZE};
+  return ahciTransfer(ahciPtr, portId, port, startl, starth, count, &segment,
+                      1, true);
+}
 
-  return ahciCmdIssue(port, slot);
+// Block device layer entry point (one device per SATA port)
+bool ahciBlockTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                       BlockSegment *segments, int cnt, bool write) {
+  ahci *ahciPtr = (ahci *)device->driver;
+  return ahciTransfer(ahciPtr, device->port, &ahciPtr->mem->ports[device->port],
+                      SPLIT_64_LOWER(LBA), SPLIT_64_HIGHER(LBA), sectors,
+                      segments, cnt, write);
 }
 
 void ahciInterruptHandler(AsmPassedInterrupt *regs) {
   PCI *browse = firstPCI;
   while (browse) {
     if (browse->driver == PCI_DRIVER_AHCI) {
-      ahci *ahciPtr = browse->extra;
-      // printf("[pci::ahci] Interrupt hit!\n");
-      ahciPtr->mem->is = ahciPtr->mem->is;
-      ahciPtr->mem->ports[0].is = ahciPtr->mem->ports[0].is;
+      ahci    *ahciPtr = browse->extra;
+      uint32_t is = ahciPtr->mem->is;
+      for (int i = 0; i < 32; i++) {
+        if (!(is & (1U << i)))
+          continue;
+        if (ahciPtr->sata & (1U << i))
+          ahciPortServiceUnsafe(ahciPtr, i);
+        else
+          ahciPtr->mem->ports[i].is = ahciPtr->mem->ports[i].is;
+      }
+      // only after the ports (which keep it asserted otherwise)
+      ahciPtr->mem->is = is;
     }
 
     browse = browse->next;
@@ -368,7 +635,7 @@ bool initiateAHCI(PCIdevice *device) {
   if (!(command_status & (1 << 1)))
     command_status |= (1 << 1);
   if (command_status & (1 << 10))
-    command_status |= (1 << 10);
+    command_status &= ~(1 << 10);
   ConfigWriteDword(device->bus, device->slot, device->function, PCI_COMMAND,
                    command_status);
 
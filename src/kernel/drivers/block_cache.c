@@ -0,0 +1,331 @@
+#include <block_cache.h>
+#include <bootloader.h>
+#include <disk.h>
+#include <malloc.h>
+#include <pmm.h>
+#include <system.h>
+#include <util.h>
+#include <vmm.h>
+
+// Block buffer cache: sits between the filesystems and getDiskBytes(), so
+// hot metadata (inodes, directories, indirect blocks, FATs) stays in memory.
+// Chunks are keyed by (device, LBA) and recycled in LRU order
+// Copyright (C) 2024 Panagiotis
+
+#define BLOCK_CACHE_DEBUG 0
+
+Spinlock LOCK_BLOCK_CACHE = ATOMIC_FLAG_INIT;
+
+void initiateBlockCache() {
+  memset(&blockCache, 0, sizeof(BlockCache));
+
+  size_t capacity = physicalBuddy.freePages / BLOCK_CACHE_RAM_SHARE;
+  if (capacity < BLOCK_CACHE_MIN)
+    capacity = BLOCK_CACHE_MIN;
+  if (capacity > BLOCK_CACHE_MAX)
+    capacity = BLOCK_CACHE_MAX;
+  blockCache.capacity = capacity;
+
+  debugf("[block_cache] Up to %ldKB of disk chunks will be cached\n",
+         capacity * BLOCK_CACHE_SECTORS * SECTOR_SIZE / 1024);
+}
+
+uint32_t blockCacheHash(uint32_t device, uint32_t chunk) {
+  return (chunk ^ (device * 0x9e3779b1)) % BLOCK_CACHE_BUCKETS;
+}
+
+/* LRU list helpers (LOCK_BLOCK_CACHE has to be held) */
+
+void blockCacheLruRemove(BlockCacheEntry *entry) {
+  if (entry->lruPrev)
+    entry->lruPrev->lruNext = entry->lruNext;
+  else
+    blockCache.lruFirst = entry->lruNext;
+  if (entry->lruNext)
+    entry->lruNext->lruPrev = entry->lruPrev;
+  else
+    blockCache.lruLast = entry->lruPrev;
+  entry->lruPrev = 0;
+  entry->lruNext = 0;
+}
+
+void blockCacheLruPush(BlockCacheEntry *entry) {
+  entry->lruPrev = 0;
+  entry->lruNext = blockCache.lruFirst;
+  if (blockCache.lruFirst)
+    blockCache.lruFirst->lruPrev = entry;
+  else
+    blockCache.lruLast = entry;
+  blockCache.lruFirst = entry;
+}
+
+void blockCacheUnhash(BlockCacheEntry *entry) {
+  BlockCacheEntry **browse =
+      &blockCache.buckets[blockCacheHash(entry->device, entry->chunk)];
+  while (*browse && *browse != entry)
+    browse = &(*browse)->hashNext;
+  if (*browse)
+    *browse = entry->hashNext;
+  entry->hashNext = 0;
+}
+
+BlockCacheEntry *blockCacheLookup(uint32_t device, uint32_t chunk) {
+  BlockCacheEntry *browse =
+      blockCache.buckets[blockCacheHash(device, chunk)];
+  while (browse) {
+    if (browse->device == device && browse->chunk == chunk)
+      return browse;
+    browse = browse->hashNext;
+  }
+  return 0;
+}
+
+// a new chunk: fresh while under capacity (or when everything's pinned),
+// else the least recently used one
+BlockCacheEntry *blockCacheAllocate() {
+  BlockCacheEntry *victim = 0;
+  if (blockCache.entries >= blockCache.capacity) {
+    victim = blockCache.lruLast;
+    while (victim && (victim->refs || victim->loading))
+      victim = victim->lruPrev;
+  }
+
+  if (victim) {
+    blockCacheLruRemove(victim);
+    blockCacheUnhash(victim);
+    blockCache.evictions++;
+    return victim;
+  }
+
+  size_t phys = PhysicalAllocatePage();
+  if (!phys) {
+    debugf("[block_cache] Nothing to evict (everything's pinned)!\n");
+    panic();
+  }
+  BlockCacheEntry *entry = (BlockCacheEntry *)malloc(sizeof(BlockCacheEntry));
+  memset(entry, 0, sizeof(BlockCacheEntry));
+  entry->data = (uint8_t *)(phys + bootloader.hhdmOffset);
+  blockCache.entries++;
+  return entry;
+}
+
+void blockCacheInsert(BlockCacheEntry *entry) {
+  uint32_t bucket = blockCacheHash(entry->device, entry->chunk);
+  entry->hashNext = blockCache.buckets[bucket];
+  blockCache.buckets[bucket] = entry;
+  blockCacheLruPush(entry);
+}
+
+// A new entry for the chunk, hashed but still loading (and pinned), so others
+// wait on it instead of issuing the same read
+BlockCacheEntry *blockCacheReserve(uint32_t device, uint32_t chunk) {
+  BlockCacheEntry *entry = blockCacheAllocate();
+  entry->device = device;
+  entry->chunk = chunk;
+  entry->refs = 1;
+  entry->loading = true;
+  blockCacheInsert(entry);
+  return entry;
+}
+
+// Returns the chunk's entry pinned, to be blockCacheUnpin()'d when done with.
+// Called & returns with LOCK_BLOCK_CACHE held, but drops it for the disk read
+// (or while waiting on someone else's)
+BlockCacheEntry *blockCacheFetch(uint32_t device, uint32_t chunk) {
+  BlockCacheEntry *entry = blockCacheLookup(device, chunk);
+  if (entry) {
+    blockCache.hits++;
+    blockCacheLruRemove(entry);
+    blockCacheLruPush(entry);
+    entry->refs++;
+    if (entry->loading) {
+      spinlockRelease(&LOCK_BLOCK_CACHE);
+      while (entry->loading)
+        asm volatile("pause");
+      spinlockAcquire(&LOCK_BLOCK_CACHE);
+    }
+    return entry;
+  }
+
+  blockCache.misses++;
+  entry = blockCacheReserve(device, chunk);
+  spinlockRelease(&LOCK_BLOCK_CACHE);
+  getDiskBytes(device, entry->data, chunk * BLOCK_CACHE_SECTORS,
+               BLOCK_CACHE_SECTORS);
+  spinlockAcquire(&LOCK_BLOCK_CACHE);
+  entry->loading = false;
+  return entry;
+}
+
+void blockCacheUnpin(BlockCacheEntry *entry) {
+  spinlockAcquire(&LOCK_BLOCK_CACHE);
+  entry->refs--;
+  spinlockRelease(&LOCK_BLOCK_CACHE);
+}
+
+// Same as getDiskBytesUnaligned(), just served from the cache whenever
+// possible. The copy itself happens unlocked, as the target might be a user
+// buffer that has to be faulted in (through the cache)
+void blockCacheReadUnaligned(uint32_t device, uint8_t *target_address,
+                             uint32_t LBA, size_t offset, size_t length) {
+  size_t chunkSize = BLOCK_CACHE_SECTORS * SECTOR_SIZE;
+  size_t pos = (size_t)LBA * SECTOR_SIZE + offset; // in bytes
+
+  while (length) {
+    uint32_t chunk = pos / chunkSize;
+    size_t   inChunk = pos % chunkSize;
+    size_t   cnt = chunkSize - inChunk;
+    if (cnt > length)
+      cnt = length;
+
+    spinlockAcquire(&LOCK_BLOCK_CACHE);
+    BlockCacheEntry *entry = blockCacheFetch(device, chunk);
+    spinlockRelease(&LOCK_BLOCK_CACHE);
+    memcpy(target_address, entry->data + inChunk, cnt);
+    blockCacheUnpin(entry);
+
+    target_address += cnt;
+    pos += cnt;
+    length -= cnt;
+  }
+}
+
+// Same as getDiskBytes(), just served from the cache whenever possible
+void blockCacheRead(uint32_t device, uint8_t *target_address, uint32_t LBA,
+                    size_t sector_count) {
+  blockCacheReadUnaligned(device, target_address, LBA, 0,
+                          sector_count * SECTOR_SIZE);
+}
+
+// Brings in the chunks (not already cached) of a range, with one disk command
+// per run of missing chunks instead of one per chunk
+void blockCachePrefetch(uint32_t device, uint32_t LBA, size_t sector_count) {
+  if (!sector_count)
+    return;
+
+  uint32_t first = LBA / BLOCK_CACHE_SECTORS;
+  uint32_t last = (LBA + sector_count - 1) / BLOCK_CACHE_SECTORS;
+  size_t   runMax = READ_AHEAD_MAX / (BLOCK_CACHE_SECTORS * SECTOR_SIZE);
+  uint8_t *run = 0;
+
+  // never let a single prefetch wipe out most of the cache
+  if (runMax > blockCache.capacity / 4)
+    runMax = blockCache.capacity / 4;
+  if (!runMax)
+    runMax = 1;
+  BlockCacheEntry **entries =
+      (BlockCacheEntry **)malloc(runMax * sizeof(BlockCacheEntry *));
+
+  spinlockAcquire(&LOCK_BLOCK_CACHE);
+  uint32_t chunk = first;
+  while (chunk <= last) {
+    if (blockCacheLookup(device, chunk)) {
+      chunk++;
+      continue;
+    }
+
+    // reserved (loading) right away, so the run can be read unlocked
+    size_t cnt = 0;
+    while (cnt < runMax && (chunk + cnt) <= last &&
+           !blockCacheLookup(device, chunk + cnt)) {
+      entries[cnt] = blockCacheReserve(device, chunk + cnt);
+      cnt++;
+    }
+    spinlockRelease(&LOCK_BLOCK_CACHE);
+
+    if (!run)
+      run = (uint8_t *)VirtualAllocate(runMax);
+    getDiskBytes(device, run, chunk * BLOCK_CACHE_SECTORS,
+                 cnt * BLOCK_CACHE_SECTORS);
+    for (size_t i = 0; i < cnt; i++)
+      memcpy(entries[i]->data, run + i * BLOCK_CACHE_SECTORS * SECTOR_SIZE,
+             BLOCK_CACHE_SECTORS * SECTOR_SIZE);
+
+    spinlockAcquire(&LOCK_BLOCK_CACHE);
+    for (size_t i = 0; i < cnt; i++) {
+      entries[i]->loading = false;
+      entries[i]->refs--;
+    }
+    blockCache.prefetched += cnt;
+    chunk += cnt;
+  }
+  spinlockRelease(&LOCK_BLOCK_CACHE);
+
+  free(entries);
+  if (run)
+    VirtualFree(run, runMax);
+}
+
+// Has to be called whenever something's written to the disk behind the
+// cache's back
+void blockCacheInvalidate(uint32_t device, uint32_t LBA, size_t sector_count) {
+  if (!sector_count)
+    return;
+
+  uint32_t first = LBA / BLOCK_CACHE_SECTORS;
+  uint32_t last = (LBA + sector_count - 1) / BLOCK_CACHE_SECTORS;
+  spinlockAcquire(&LOCK_BLOCK_CACHE);
+  for (uint32_t chunk = first; chunk <= last; chunk++) {
+    BlockCacheEntry *entry = blockCacheLookup(device, chunk);
+    if (!entry)
+      continue;
+    blockCacheUnhash(entry);
+    blockCacheLruRemove(entry);
+    // least recently used, so it's recycled first
+    entry->lruPrev = blockCache.lruLast;
+    if (blockCache.lruLast)
+      blockCache.lruLast->lruNext = entry;
+    else
+      blockCache.lruFirst = entry;
+    blockCache.lruLast = entry;
+  }
+  spinlockRelease(&LOCK_BLOCK_CACHE);
+}
+
+/* Sequential read-ahead */
+
+// Feeds a read() of [ptr, ptr + len) to the file's detector. Returns whether
+// it continues a sequential stream of small reads (to be served from the
+// cache), with [*start, *end) set to what has to be prefetched right now
+// (empty while the current window still covers the read). The window doubles
+// on every refill and collapses on the first seek
+bool blockCacheReadAhead(ReadAhead *ra, size_t ptr, size_t len, size_t *start,
+                         size_t *end) {
+  bool sequential = ptr == ra->next;
+  ra->next = ptr + len;
+  *start = 0;
+  *end = 0;
+
+  if (!sequential) {
+    ra->window = 0;
+    ra->ahead = 0;
+    return false;
+  }
+
+  // reads this big already get the most out of the disk by going straight to
+  // their destination
+  if (len >= READ_AHEAD_MAX)
+    return false;
+
+  if ((ptr + len) <= ra->ahead)
+    return true;
+
+  ra->window = ra->window ? ra->window * 2 : READ_AHEAD_MIN;
+  if (ra->window > READ_AHEAD_MAX)
+    ra->window = READ_AHEAD_MAX;
+
+  *start = ra->ahead > ptr ? ra->ahead : ptr;
+  *end = ptr + len + ra->window;
+  ra->ahead = *end;
+  return true;
+}
+
+int blockCacheStats(char *out, size_t limit) {
+  return snprintf(out, limit,
+                  "entries %ld\ncapacity %ld\nchunk_size %d\nhits %ld\n"
+                  "misses %ld\nevictions %ld\nprefetched %ld\n",
+                  blockCache.entries, blockCache.capacity,
+                  BLOCK_CACHE_SECTORS * SECTOR_SIZE, blockCache.hits,
+                  blockCache.misses, blockCache.evictions,
+                  blockCache.prefetched);
+}
@@ -0,0 +1,237 @@
+#include <block_device.h>
+#include <disk.h>
+#include <malloc.h>
+#include <paging.h>
+#include <system.h>
+#include <task.h>
+#include <timer.h>
+#include <util.h>
+
+// Block device layer: every disk (whatever drives it) gets registered here,
+// along with a request queue. Pending requests are kept sorted by LBA, sent
+// off in C-LOOK elevator order (unless one's deadline passed) and merged with
+// their consecutive neighbours, so concurrent readers end up sharing commands
+// Copyright (C) 2024 Panagiotis
+
+#define BLOCK_DEVICE_DEBUG 0
+
+BlockDevice *blockDeviceRegister(BlockTransfer transfer, void *driver,
+                                 uint32_t port, uint64_t sectors,
+                                 uint32_t maxSectors, uint32_t depth) {
+  if (blockDevicesCnt >= BLOCK_DEVICES_MAX) {
+    debugf("[block] Too many block devices, ignoring one!\n");
+    return 0;
+  }
+
+  BlockDevice *device = (BlockDevice *)malloc(sizeof(BlockDevice));
+  memset(device, 0, sizeof(BlockDevice));
+  device->id = blockDevicesCnt;
+  device->name[0] = 's';
+  device->name[1] = 'd';
+  device->name[2] = 'a' + device->id;
+  device->sectors = sectors;
+  device->maxSectors = maxSectors;
+  device->depth = depth ? depth : 1;
+  device->transfer = transfer;
+  device->driver = driver;
+  device->port = port;
+  atomic_flag_clear(&device->LOCK_QUEUE);
+
+  blockDevices[blockDevicesCnt++] = device;
+  debugf("[block] Registered /dev/%s: size{%ldMB} max{%d} depth{%d}\n",
+         device->name, sectors * SECTOR_SIZE / 1024 / 1024, maxSectors,
+         device->depth);
+  return device;
+}
+
+BlockDevice *blockDeviceGet(uint32_t id) {
+  if (id >= blockDevicesCnt)
+    return 0;
+  return blockDevices[id];
+}
+
+/* Request queue (LOCK_QUEUE has to be held) */
+
+void blockDeviceWakeUnsafe(BlockRequest *request) {
+  if (!request->sleeping)
+    return;
+  request->sleeping = false;
+  request->waiter->state = TASK_STATE_READY;
+}
+
+void blockDeviceEnqueueUnsafe(BlockDevice *device, BlockRequest *request) {
+  BlockRequest **link = &device->queue;
+  while (*link && (*link)->LBA <= request->LBA)
+    link = &(*link)->next;
+  request->next = *link;
+  *link = request;
+}
+
+// Only requests whose buffers are reachable from here can be dispatched: user
+// ones have to go out from their own address space
+bool blockDeviceReachableUnsafe(BlockRequest *request) {
+  return !request->pagedir || request->pagedir == currentTask->pagedir;
+}
+
+// The request to go next: an expired one (oldest first), else the first one
+// past the head, wrapping around to the lowest LBA. Returns 0 if there's
+// nothing this task can dispatch
+BlockRequest *blockDevicePickUnsafe(BlockDevice *device) {
+  BlockRequest *oldest = 0;
+  BlockRequest *ahead = 0;
+  BlockRequest *lowest = 0;
+  for (BlockRequest *browse = device->queue; browse; browse = browse->next) {
+    if (!blockDeviceReachableUnsafe(browse))
+      continue;
+    if (!lowest)
+      lowest = browse;
+    if (!oldest || browse->expires < oldest->expires)
+      oldest = browse;
+    if (!ahead && browse->LBA >= device->head)
+      ahead = browse;
+  }
+
+  if (oldest && oldest->expires <= timerTicks)
+    return oldest;
+  return ahead ? ahead : lowest;
+}
+
+// Takes the picked request, along with the consecutive ones right after it,
+// out of the queue. Returns how many were taken
+int blockDeviceBatchUnsafe(BlockDevice *device, BlockRequest *first,
+                           BlockRequest **batch) {
+  BlockRequest **link = &device->queue;
+  while (*link != first)
+    link = &(*link)->next;
+
+  int           cnt = 0;
+  uint32_t      sectors = 0;
+  BlockRequest *browse = first;
+  while (browse && cnt < BLOCK_MERGE_MAX) {
+    if (cnt && (browse->write != first->write ||
+                browse->LBA != first->LBA + sectors ||
+                sectors + browse->sectors > device->maxSectors ||
+                !blockDeviceReachableUnsafe(browse)))
+      break;
+    browse->state = BLOCK_REQUEST_DISPATCHED;
+    batch[cnt++] = browse;
+    sectors += browse->sectors;
+    browse = browse->next;
+  }
+
+  *link = browse;
+  return cnt;
+}
+
+// Sends the batch starting at first off to the driver & completes it.
+// LOCK_QUEUE is dropped while the command is in flight
+void blockDeviceDispatchUnsafe(BlockDevice *device, BlockRequest *first) {
+  BlockRequest *batch[BLOCK_MERGE_MAX];
+  BlockSegment  segments[BLOCK_MERGE_MAX];
+  int           cnt = blockDeviceBatchUnsafe(device, first, batch);
+
+  uint64_t LBA = batch[0]->LBA;
+  bool     write = batch[0]->write;
+  uint32_t sectors = 0;
+  for (int i = 0; i < cnt; i++) {
+    segments[i].buff = batch[i]->buff;
+    segments[i].bytes = batch[i]->sectors * SECTOR_SIZE;
+    sectors += batch[i]->sectors;
+  }
+
+  device->inflight++;
+  device->dispatches++;
+  device->merged += cnt - 1;
+  device->head = LBA + sectors;
+  spinlockRelease(&device->LOCK_QUEUE);
+
+#if BLOCK_DEVICE_DEBUG
+  debugf("[block] %s: LBA{%lx} sectors{%d} requests{%d} write{%d}\n",
+         device->name, LBA, sectors, cnt, write);
+#endif
+  bool ok = device->transfer(device, LBA, sectors, segments, cnt, write);
+
+  spinlockAcquire(&device->LOCK_QUEUE);
+  device->inflight--;
+  for (int i = 0; i < cnt; i++) {
+    batch[i]->state = ok ? BLOCK_REQUEST_DONE : BLOCK_REQUEST_FAILED;
+    blockDeviceWakeUnsafe(batch[i]);
+  }
+}
+
+// Queues up a single request (of up to maxSectors) & waits for it. Whoever's
+// waiting while the driver has room dispatches the next batch, so there's no
+// need for a separate I/O thread
+bool blockDeviceSubmit(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                       uint8_t *buff, bool write) {
+  // can't wait on anybody else (they might never get scheduled)
+  if (!taskCanSleep()) {
+    BlockSegment segment = {.buff = buff, .bytes = sectors * SECTOR_SIZE};
+    return device->transfer(device, LBA, sectors, &segment, 1, write);
+  }
+
+  BlockRequest request = {0};
+  request.LBA = LBA;
+  request.sectors = sectors;
+  request.buff = buff;
+  request.write = write;
+  request.expires = timerTicks + BLOCK_REQUEST_EXPIRE;
+  request.state = BLOCK_REQUEST_QUEUED;
+  request.waiter = currentTask;
+  if ((size_t)buff < USER_STACK_BOTTOM)
+    request.pagedir = currentTask->pagedir;
+
+  spinlockAcquire(&device->LOCK_QUEUE);
+  device->requests++;
+  blockDeviceEnqueueUnsafe(device, &request);
+  while (request.state < BLOCK_REQUEST_DONE) {
+    BlockRequest *first = 0;
+    if (device->inflight < device->depth)
+      first = blockDevicePickUnsafe(device);
+    if (first) {
+      blockDeviceDispatchUnsafe(device, first);
+      continue;
+    }
+
+    // until ours completes, or there's room for us to dispatch (ours is
+    // always reachable, so it's never left behind)
+    request.sleeping = true;
+    currentTask->state = TASK_STATE_WAITING_DISK;
+    spinlockRelease(&device->LOCK_QUEUE);
+    while (currentTask->state == TASK_STATE_WAITING_DISK)
+      asm volatile("pause" ::: "memory");
+    spinlockAcquire(&device->LOCK_QUEUE);
+  }
+
+  // hand the rest of the queue over to somebody still waiting
+  if (device->inflight < device->depth) {
+    for (BlockRequest *browse = device->queue; browse; browse = browse->next) {
+      if (browse->sleeping) {
+        blockDeviceWakeUnsafe(browse);
+        break;
+      }
+    }
+  }
+  spinlockRelease(&device->LOCK_QUEUE);
+
+  return request.state == BLOCK_REQUEST_DONE;
+}
+
+// Synchronous transfer of any size, split up into commands the device takes
+bool blockDeviceTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                         uint8_t *buff, bool write) {
+  bool ok = true;
+  while (sectors) {
+    uint32_t cnt = sectors;
+    if (cnt > device->maxSectors)
+      cnt = device->maxSectors;
+    if (!blockDeviceSubmit(device, LBA, cnt, buff, write))
+      ok = false;
+
+    LBA += cnt;
+    buff += cnt * SECTOR_SIZE;
+    sectors -= cnt;
+  }
+
+  return ok;
+}
@@ -1,4 +1,5 @@
-#include <ahci.h>
+#include <block_cache.h>
+#include <block_device.h>
 #include <disk.h>
 #include <malloc.h>
 #include <util.h>
@@ -10,10 +11,8 @@ uint16_t mbr_partition_indexes[] = {MBR_PARTITION_1, MBR_PARTITION_2,
                                     MBR_PARTITION_3, MBR_PARTITION_4};
 
 bool openDisk(uint32_t disk, uint8_t partition, mbr_partition *out) {
-  disk = disk; // future plans
-
   uint8_t *rawArr = (uint8_t *)malloc(SECTOR_SIZE);
-  getDiskBytes(rawArr, 0x0, 1);
+  getDiskBytes(disk, rawArr, 0x0, 1);
   // *out = *(mbr_partition *)(&rawArr[mbr_partition_indexes[partition]]);
   bool ret = validateMbr(rawArr);
   if (!ret)
@@ -28,61 +27,67 @@ bool validateMbr(uint8_t *mbrSector) {
   return mbrSector[510] == 0x55 && mbrSector[511] == 0xaa;
 }
 
-void diskBytes(uint8_t *target_address, uint32_t LBA, uint32_t sector_count,
-               bool write) {
-  // todo: yeah, this STILL is NOT ideal
-
-  PCI *browse = firstPCI;
-  while (browse) {
-    if (browse->driver == PCI_DRIVER_AHCI && ((ahci *)browse->extra)->sata)
-      break;
-
-    browse = browse->next;
-  }
-
-  if (!browse) {
-    memset(target_address, 0, sector_count * SECTOR_SIZE);
-    return;
+bool diskBytes(uint32_t disk, uint8_t *target_address, uint32_t LBA,
+               size_t sector_count, bool write) {
+  BlockDevice *device = blockDeviceGet(disk);
+  if (!device) {
+    if (!write)
+      memset(target_address, 0, sector_count * SECTOR_SIZE);
+    return false;
   }
 
-  ahci *target = (ahci *)browse->extra;
-  int   pos = 0;
-  while (!(target->sata & (1 << pos)))
-    pos++;
-
-  if (write)
-    ahciWrite(target, pos, &target->mem->ports[pos], LBA, 0, sector_count,
-              target_address);
-  else
-    ahciRead(target, pos, &target->mem->ports[pos], LBA, 0, sector_count,
-             target_address);
+  return blockDeviceTransfer(device, LBA, sector_count, target_address, write);
 }
 
-void getDiskBytes(uint8_t *target_address, uint32_t LBA, size_t sector_count) {
-  // calculated by: (bytesPerPRDT * PRDTamnt) / SECTOR_SIZE
-  //                (    8192     *    32   ) /     512
-  int max = 512;
+void getDiskBytes(uint32_t disk, uint8_t *target_address, uint32_t LBA,
+                  size_t sector_count) {
+  diskBytes(disk, target_address, LBA, sector_count, false);
+}
 
-  size_t chunks = sector_count / max;
-  size_t remainder = sector_count % max;
-  if (chunks)
-    for (size_t i = 0; i < chunks; i++)
-      diskBytes(target_address + i * max * SECTOR_SIZE, LBA + i * max, max,
-                false);
+// Reads length bytes, starting offset bytes into LBA. Whole sectors get DMA'd
+// straight into target_address, only the partial ones at either edge go
+// through a temporary sector
+void getDiskBytesUnaligned(uint32_t disk, uint8_t *target_address,
+                           uint32_t LBA, size_t offset, size_t length) {
+  LBA += offset / SECTOR_SIZE;
+  offset %= SECTOR_SIZE;
+
+  uint8_t *sector = 0;
+  if (offset || length % SECTOR_SIZE)
+    sector = (uint8_t *)malloc(SECTOR_SIZE);
+
+  if (offset && length) {
+    size_t len = SECTOR_SIZE - offset;
+    if (len > length)
+      len = length;
+    getDiskBytes(disk, sector, LBA, 1);
+    memcpy(target_address, sector + offset, len);
+    target_address += len;
+    length -= len;
+    LBA++;
+  }
 
-  if (remainder)
-    diskBytes(target_address + chunks * max * SECTOR_SIZE, LBA + chunks * max,
-              remainder, false);
+  size_t whole = length / SECTOR_SIZE;
+  if (whole) {
+    getDiskBytes(disk, target_address, LBA, whole);
+    target_address += whole * SECTOR_SIZE;
+    length -= whole * SECTOR_SIZE;
+    LBA += whole;
+  }
 
-  // for (int i = 0; i < sector_count; i++)
-  //   diskBytes(target_address + i * 512, LBA + i, 1, false);
+  if (length) {
+    getDiskBytes(disk, sector, LBA, 1);
+    memcpy(target_address, sector, length);
+  }
 
-  // diskBytes(target_address, LBA, sector_count, false);
+  if (sector)
+    free(sector);
 }
 
-void setDiskBytes(const uint8_t *target_address, uint32_t LBA,
+void setDiskBytes(uint32_t disk, const uint8_t *target_address, uint32_t LBA,
                   uint8_t sector_count) {
   // bad solution but idc, my code is safe
   uint8_t *rw_target_address = (uint8_t *)((size_t)target_address);
-  diskBytes(rw_target_address, LBA, sector_count, true);
+  diskBytes(disk, rw_target_address, LBA, sector_count, true);
+  blockCacheInvalidate(disk, LBA, sector_count);
 }
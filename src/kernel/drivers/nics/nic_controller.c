@@ -7,6 +7,7 @@
 #include <nic_controller.h>
 #include <rtl8139.h>
 #include <rtl8169.h>
+#include <slab.h>
 #include <system.h>
 #include <util.h>
 
@@ -17,6 +18,7 @@ void initiateNetworking() {
   // start off with no first NIC and no selected one
   // rest on device-specific initialization
   selectedNIC = 0;
+  socketCache = slabCacheCreate("Socket", sizeof(Socket), 0, 0);
   debugf("[networking] Ready to scan for NICs..\n");
 }
 
@@ -0,0 +1,466 @@
+#include <block_device.h>
+#include <bootloader.h>
+#include <disk.h>
+#include <isr.h>
+#include <malloc.h>
+#include <nvme.h>
+#include <paging.h>
+#include <pmm.h>
+#include <system.h>
+#include <task.h>
+#include <util.h>
+#include <vmm.h>
+
+// NVMe driver: the first namespace of every controller becomes a block device,
+// served by an I/O queue pair with PRP lists built straight from the caller's
+// page frames. Issuers sleep until the interrupt handler reaps their command,
+// or poll the completion queue when they can't, same as AHCI
+// Copyright (C) 2024 Panagiotis
+
+#define NVME_DEBUG 0
+
+uint32_t nvmeRead(NVMe *nvme, uint32_t reg) {
+  return *(volatile uint32_t *)(nvme->regs + reg);
+}
+
+void nvmeWrite(NVMe *nvme, uint32_t reg, uint32_t value) {
+  *(volatile uint32_t *)(nvme->regs + reg) = value;
+}
+
+void nvmeWrite64(NVMe *nvme, uint32_t reg, uint64_t value) {
+  nvmeWrite(nvme, reg, SPLIT_64_LOWER(value));
+  nvmeWrite(nvme, reg + 4, SPLIT_64_HIGHER(value));
+}
+
+// The queues are shared with nvmeInterruptHandler(), so they are only ever
+// touched with interrupts off
+uint64_t nvmeLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void nvmeUnlock(uint64_t rflags) {
+  if (rflags & RFLAGS_IF)
+    asm volatile("sti" ::: "memory");
+}
+
+void nvmeQueueInit(NVMe *nvme, NVMeQueue *queue, uint16_t id, uint16_t size,
+                   bool prpLists) {
+  memset(queue, 0, sizeof(NVMeQueue));
+  queue->id = id;
+  queue->size = size;
+  queue->phase = 1;
+
+  size_t sqPages = DivRoundUp(size * sizeof(NVMeCommand), PAGE_SIZE);
+  size_t cqPages = DivRoundUp(size * sizeof(NVMeCompletion), PAGE_SIZE);
+  queue->sq = (volatile NVMeCommand *)VirtualAllocate(sqPages);
+  queue->cq = (volatile NVMeCompletion *)VirtualAllocate(cqPages);
+  memset((void *)queue->sq, 0, sqPages * PAGE_SIZE);
+  memset((void *)queue->cq, 0, cqPages * PAGE_SIZE);
+  if (prpLists)
+    queue->prpLists = (uint64_t *)VirtualAllocate(size);
+
+  size_t doorbells = (size_t)nvme->regs + NVME_REG_DOORBELLS;
+  queue->sqDoorbell =
+      (volatile uint32_t *)(doorbells + (2 * id) * nvme->doorbellStride);
+  queue->cqDoorbell =
+      (volatile uint32_t *)(doorbells + (2 * id + 1) * nvme->doorbellStride);
+}
+
+// Hands out a free slot, waiting for one if needed. One entry of the ring
+// always stays empty & the last slot is kept for issuers that can't sleep
+int nvmeSlotAcquire(NVMeQueue *queue, bool sleep) {
+  uint32_t slots = queue->size - 1;
+  uint64_t usable = (1ULL << slots) - 1;
+  if (sleep && slots > 1)
+    usable &= ~(1ULL << (slots - 1));
+
+  while (true) {
+    uint64_t rflags = nvmeLock();
+    uint64_t free = usable & ~queue->busy;
+    if (free) {
+      int slot = __builtin_ctzll(free);
+      queue->busy |= 1ULL << slot;
+      nvmeUnlock(rflags);
+      return slot;
+    }
+    nvmeUnlock(rflags);
+    asm volatile("pause");
+  }
+}
+
+void nvmeSlotRelease(NVMeQueue *queue, int slot) {
+  uint64_t rflags = nvmeLock();
+  queue->done &= ~(1ULL << slot);
+  queue->waiters[slot] = 0;
+  queue->busy &= ~(1ULL << slot);
+  nvmeUnlock(rflags);
+}
+
+// Reaps every new completion entry (interrupts have to be off)
+void nvmeServiceUnsafe(NVMeQueue *queue) {
+  bool reaped = false;
+  while ((queue->cq[queue->cqHead].status & 1) == queue->phase) {
+    volatile NVMeCompletion *completion = &queue->cq[queue->cqHead];
+    uint16_t                 slot = completion->cid;
+    if (slot < queue->size) {
+      queue->status[slot] = completion->status >> 1;
+      queue->done |= 1ULL << slot;
+      Task *waiter = queue->waiters[slot];
+      if (waiter && waiter->state == TASK_STATE_WAITING_DISK)
+        waiter->state = TASK_STATE_READY;
+    }
+
+    if (++queue->cqHead == queue->size) {
+      queue->cqHead = 0;
+      queue->phase ^= 1;
+    }
+    reaped = true;
+  }
+
+  if (reaped)
+    *queue->cqDoorbell = queue->cqHead;
+}
+
+// Sends a command off on a slot & waits for it to complete. The slot stays
+// taken (for the caller to clean up after it & release), returns the status
+// (0 on success)
+uint16_t nvmeCmdIssue(NVMeQueue *queue, int slot, NVMeCommand *cmd,
+                      bool sleep) {
+  cmd->cid = slot;
+
+  uint64_t rflags = nvmeLock();
+  if (sleep) {
+    queue->waiters[slot] = currentTask;
+    currentTask->state = TASK_STATE_WAITING_DISK;
+  }
+  memcpy((void *)&queue->sq[queue->sqTail], cmd, sizeof(NVMeCommand));
+  queue->sqTail = (queue->sqTail + 1) % queue->size;
+  asm volatile("" ::: "memory"); // the entry has to be there before the bell
+  *queue->sqDoorbell = queue->sqTail;
+  nvmeUnlock(rflags);
+
+  uint64_t bit = 1ULL << slot;
+  if (sleep) {
+    // the scheduler skips us until nvmeInterruptHandler() reaps the slot
+    while (currentTask->state == TASK_STATE_WAITING_DISK)
+      asm volatile("pause" ::: "memory");
+  } else {
+    while (!(queue->done & bit)) {
+      rflags = nvmeLock();
+      nvmeServiceUnsafe(queue);
+      nvmeUnlock(rflags);
+    }
+  }
+
+  return queue->status[slot];
+}
+
+// Admin commands are only sent on startup, so they're always polled
+uint16_t nvmeAdmin(NVMe *nvme, NVMeCommand *cmd) {
+  int      slot = nvmeSlotAcquire(&nvme->admin, false);
+  uint16_t status = nvmeCmdIssue(&nvme->admin, slot, cmd, false);
+  nvmeSlotRelease(&nvme->admin, slot);
+  return status;
+}
+
+// Drops the references nvmeSetUpPRP() took on the first pages of a command
+void nvmeReleasePRP(NVMeQueue *queue, int slot, NVMeCommand *cmd,
+                    size_t pages) {
+  uint64_t *list = (uint64_t *)((size_t)queue->prpLists + slot * PAGE_SIZE);
+  if (pages)
+    PhysicalRelease(cmd->prp1 & ~(PAGE_SIZE - 1));
+  for (size_t i = 1; i < pages; i++)
+    PhysicalRelease(list[i - 1]);
+}
+
+// Describes the segments with PRPs (the first one & a list of the rest, when
+// there are more than two pages). Every page but the first has to start on a
+// page boundary & every page but the last has to end on one. Each page is
+// referenced till nvmeReleasePRP(), so it can't be freed (ex: by munmap() on
+// another thread) under the device. Returns the amount of pages, or 0 if the
+// segments don't line up like that
+size_t nvmeSetUpPRP(NVMeQueue *queue, int slot, NVMeCommand *cmd,
+                    BlockSegment *segments, int cnt, bool write) {
+  uint64_t *list = (uint64_t *)((size_t)queue->prpLists + slot * PAGE_SIZE);
+  size_t    listMax = PAGE_SIZE / sizeof(uint64_t);
+  size_t    pages = 0;
+  bool      pageEnded = true; // the previous page went up to its boundary
+  for (int i = 0; i < cnt; i++) {
+    size_t virt = (size_t)segments[i].buff;
+    size_t bytes = segments[i].bytes;
+    if (virt & 3) // dword aligned
+      goto fail;
+
+    while (bytes) {
+      size_t len = PAGE_SIZE - (virt % PAGE_SIZE);
+      if (len > bytes)
+        len = bytes;
+
+      // lazily backed & copy-on-write pages have to be resolved first (the
+      // device can't page fault)
+      volatile uint8_t *touch = (volatile uint8_t *)virt;
+      if (write)
+        (void)*touch;
+      else
+        *touch = *touch;
+
+      size_t phys = VirtualToPhysical(virt);
+      if (!phys)
+        goto fail;
+
+      if (!pages)
+        cmd->prp1 = phys;
+      else if (!pageEnded || phys % PAGE_SIZE || pages > listMax)
+        goto fail;
+      else
+        list[pages - 1] = phys;
+      PhysicalShare(phys);
+
+      pageEnded = !((phys + len) % PAGE_SIZE);
+      pages++;
+      virt += len;
+      bytes -= len;
+    }
+  }
+
+  if (pages == 2)
+    cmd->prp2 = list[0];
+  else if (pages > 2)
+    cmd->prp2 = VirtualToPhysical((size_t)list);
+  return pages;
+
+fail:
+  nvmeReleasePRP(queue, slot, cmd, pages);
+  return 0;
+}
+
+// Moves data between the bounce buffer & the (scattered) segments
+void nvmeBounceCopy(uint8_t *bounce, BlockSegment *segments, int cnt,
+                    bool in) {
+  for (int i = 0; i < cnt; i++) {
+    if (in)
+      memcpy(bounce, segments[i].buff, segments[i].bytes);
+    else
+      memcpy(segments[i].buff, bounce, segments[i].bytes);
+    bounce += segments[i].bytes;
+  }
+}
+
+// Block device layer entry point. Buffers that can't be described with PRPs
+// go through a bounce buffer
+bool nvmeTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                  BlockSegment *segments, int cnt, bool write) {
+  NVMe      *nvme = (NVMe *)device->driver;
+  NVMeQueue *queue = &nvme->io;
+  bool       sleep = taskCanSleep();
+  int        slot = nvmeSlotAcquire(queue, sleep);
+  uint32_t   bytes = sectors * SECTOR_SIZE;
+
+  NVMeCommand cmd = {0};
+  cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+  cmd.nsid = nvme->nsid;
+  cmd.cdw10 = SPLIT_64_LOWER(LBA);
+  cmd.cdw11 = SPLIT_64_HIGHER(LBA);
+  cmd.cdw12 = sectors - 1; // 0's based
+
+  uint8_t *bounce = 0;
+  uint32_t bouncePages = DivRoundUp(bytes, PAGE_SIZE);
+  size_t   pages = nvmeSetUpPRP(queue, slot, &cmd, segments, cnt, write);
+  if (!pages) {
+    bounce = (uint8_t *)VirtualAllocate(bouncePages);
+    if (write)
+      nvmeBounceCopy(bounce, segments, cnt, true);
+    BlockSegment segment = {.buff = bounce, .bytes = bytes};
+    cmd.prp2 = 0;
+    pages = nvmeSetUpPRP(queue, slot, &cmd, &segment, 1, write);
+  }
+
+  uint16_t status = nvmeCmdIssue(queue, slot, &cmd, sleep);
+  nvmeReleasePRP(queue, slot, &cmd, pages);
+  nvmeSlotRelease(queue, slot);
+  if (status)
+    printf("[nvme] Disk error! status{%x}\n", status);
+
+  if (bounce) {
+    if (!status && !write)
+      nvmeBounceCopy(bounce, segments, cnt, false);
+    VirtualFree(bounce, bouncePages);
+  }
+
+  return !status;
+}
+
+void nvmeInterruptHandler(AsmPassedInterrupt *regs) {
+  PCI *browse = firstPCI;
+  while (browse) {
+    if (browse->driver == PCI_DRIVER_NVME) {
+      NVMe *nvme = browse->extra;
+      nvmeServiceUnsafe(&nvme->admin);
+      if (nvme->io.size)
+        nvmeServiceUnsafe(&nvme->io);
+    }
+
+    browse = browse->next;
+  }
+}
+
+// Finds out about the first namespace. Only 512 byte sectors are supported
+bool nvmeIdentify(NVMe *nvme) {
+  uint8_t    *identify = (uint8_t *)VirtualAllocate(1);
+  NVMeCommand cmd = {0};
+  bool        ret = false;
+
+  memset(identify, 0, PAGE_SIZE);
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.prp1 = VirtualToPhysical((size_t)identify);
+  cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
+  if (nvmeAdmin(nvme, &cmd)) {
+    debugf("[nvme] Couldn't identify the controller!\n");
+    goto cleanup;
+  }
+
+  // MDTS (byte 77): max transfer, in units of the minimum page size (4K)
+  nvme->maxSectors = NVME_SECTORS_MAX;
+  uint8_t mdts = identify[77];
+  if (mdts && mdts < 16) {
+    uint32_t limit = (1U << mdts) * (PAGE_SIZE / SECTOR_SIZE);
+    if (limit < nvme->maxSectors)
+      nvme->maxSectors = limit;
+  }
+
+  memset(identify, 0, PAGE_SIZE);
+  nvme->nsid = 1;
+  cmd.nsid = nvme->nsid;
+  cmd.cdw10 = NVME_IDENTIFY_NAMESPACE;
+  if (nvmeAdmin(nvme, &cmd)) {
+    debugf("[nvme] Couldn't identify namespace %d!\n", nvme->nsid);
+    goto cleanup;
+  }
+
+  // NSZE (bytes 0-7), FLBAS (byte 26) picks one of the LBA formats (from byte
+  // 128 onwards, 4 bytes each, LBADS in the third)
+  nvme->sectors = *(uint64_t *)identify;
+  uint8_t format = identify[26] & 0xF;
+  uint8_t lbads = identify[128 + format * 4 + 2];
+  if ((1U << lbads) != SECTOR_SIZE) {
+    debugf("[nvme] Unsupported sector size! size{%d}\n", 1U << lbads);
+    goto cleanup;
+  }
+
+  ret = nvme->sectors != 0;
+
+cleanup:
+  VirtualFree(identify, 1);
+  return ret;
+}
+
+bool nvmeCreateIoQueues(NVMe *nvme, uint16_t size) {
+  NVMeQueue *queue = &nvme->io;
+  nvmeQueueInit(nvme, queue, 1, size, true);
+
+  // completion queue first (physically contiguous, interrupts on vector 0)
+  NVMeCommand cmd = {0};
+  cmd.opcode = NVME_ADMIN_CREATE_CQ;
+  cmd.prp1 = VirtualToPhysical((size_t)queue->cq);
+  cmd.cdw10 = ((uint32_t)(size - 1) << 16) | queue->id;
+  cmd.cdw11 = (1 << 1) | (1 << 0);
+  if (nvmeAdmin(nvme, &cmd)) {
+    debugf("[nvme] Couldn't create the I/O completion queue!\n");
+    return false;
+  }
+
+  memset(&cmd, 0, sizeof(NVMeCommand));
+  cmd.opcode = NVME_ADMIN_CREATE_SQ;
+  cmd.prp1 = VirtualToPhysical((size_t)queue->sq);
+  cmd.cdw10 = ((uint32_t)(size - 1) << 16) | queue->id;
+  cmd.cdw11 = ((uint32_t)queue->id << 16) | (1 << 0);
+  if (nvmeAdmin(nvme, &cmd)) {
+    debugf("[nvme] Couldn't create the I/O submission queue!\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool initiateNVMe(PCIdevice *device) {
+  if (device->progIF != NVME_PROG_IF)
+    return false;
+
+  PCIgeneralDevice details = {0};
+  GetGeneralDevice(device, &details);
+  uint64_t base = GetBarAddress(&details, 0);
+  if (!base)
+    return false;
+
+  debugf("[pci::nvme] Detected controller! base{%lx}\n", base);
+
+  // Enable PCI Bus Mastering, memory access & pin based interrupts
+  uint32_t command_status = COMBINE_WORD(device->status, device->command);
+  command_status |= (1 << 1) | (1 << 2);
+  command_status &= ~(1 << 10);
+  ConfigWriteDword(device->bus, device->slot, device->function, PCI_COMMAND,
+                   command_status);
+
+  NVMe *nvme = (NVMe *)malloc(sizeof(NVMe));
+  memset(nvme, 0, sizeof(NVMe));
+  nvme->regs = (volatile uint8_t *)(bootloader.hhdmOffset + base);
+
+  uint64_t cap = COMBINE_64(nvmeRead(nvme, NVME_REG_CAP + 4),
+                            nvmeRead(nvme, NVME_REG_CAP));
+  nvme->doorbellStride = 4 << NVME_CAP_DSTRD(cap);
+
+  // disable the controller, to set up the admin queues
+  nvmeWrite(nvme, NVME_REG_CC, nvmeRead(nvme, NVME_REG_CC) & ~NVME_CC_EN);
+  while (nvmeRead(nvme, NVME_REG_CSTS) & NVME_CSTS_RDY)
+    asm volatile("pause");
+
+  uint16_t adminSize = NVME_ADMIN_QUEUE_SIZE;
+  nvmeQueueInit(nvme, &nvme->admin, 0, adminSize, false);
+  nvmeWrite(nvme, NVME_REG_AQA, ((adminSize - 1) << 16) | (adminSize - 1));
+  nvmeWrite64(nvme, NVME_REG_ASQ, VirtualToPhysical((size_t)nvme->admin.sq));
+  nvmeWrite64(nvme, NVME_REG_ACQ, VirtualToPhysical((size_t)nvme->admin.cq));
+
+  // everything's polled until the I/O queues are up
+  nvmeWrite(nvme, NVME_REG_INTMS, 1);
+  nvmeWrite(nvme, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+  while (!(nvmeRead(nvme, NVME_REG_CSTS) & NVME_CSTS_RDY)) {
+    if (nvmeRead(nvme, NVME_REG_CSTS) & NVME_CSTS_CFS) {
+      debugf("[pci::nvme] Controller fatal status on enable!\n");
+      goto error;
+    }
+    asm volatile("pause");
+  }
+
+  if (!nvmeIdentify(nvme))
+    goto error;
+
+  uint16_t size = NVME_CAP_MQES(cap) + 1;
+  if (size > NVME_QUEUE_SIZE_MAX)
+    size = NVME_QUEUE_SIZE_MAX;
+  if (size < 3) {
+    debugf("[pci::nvme] Queues too small! size{%d}\n", size);
+    goto error;
+  }
+  if (!nvmeCreateIoQueues(nvme, size))
+    goto error;
+
+  PCI *pci = lookupPCIdevice(device);
+  setupPCIdeviceDriver(pci, PCI_DRIVER_NVME, PCI_DRIVER_CATEGORY_STORAGE);
+  pci->extra = nvme;
+  pci->irqHandler =
+      registerIRQhandler(details.interruptLine, &nvmeInterruptHandler);
+  nvmeWrite(nvme, NVME_REG_INTMC, 1);
+
+  // one ring entry always stays empty, one slot is kept for pollers
+  debugf("[pci::nvme] Ready: queue{%d} max{%d}\n", size, nvme->maxSectors);
+  nvme->device = blockDeviceRegister(nvmeTransfer, nvme, nvme->nsid,
+                                     nvme->sectors, nvme->maxSectors,
+                                     size - 2);
+  return true;
+
+error:
+  free(nvme);
+  return false;
+}
@@ -2,8 +2,10 @@
 #include <linked_list.h>
 #include <malloc.h>
 #include <nic_controller.h>
+#include <nvme.h>
 #include <pci.h>
 #include <system.h>
+#include <virtio_blk.h>
 
 // PCI driver
 // Copyright (C) 2024 Panagiotis
@@ -136,6 +138,18 @@ void GetGeneralDevice(PCIdevice *device, PCIgeneralDevice *out) {
   out->maxLatency = EXPORT_BYTE(minGrant_maxLatency, false);
 }
 
+// Physical address behind a memory BAR (64-bit ones included)
+uint64_t GetBarAddress(PCIgeneralDevice *details, uint8_t bar) {
+  uint32_t low = details->bar[bar];
+  if (low & PCI_BAR_IO)
+    return 0;
+
+  uint64_t address = low & 0xFFFFFFF0;
+  if (low & PCI_BAR_64 && bar < 5)
+    address |= (uint64_t)details->bar[bar + 1] << 32;
+  return address;
+}
+
 void initiatePCI() {
   PCIdevice *device = (PCIdevice *)malloc(sizeof(PCIdevice));
 
@@ -164,6 +178,10 @@ void initiatePCI() {
         case PCI_CLASS_CODE_MASS_STORAGE_CONTROLLER:
           if (device->subclass_id == 0x6)
             initiateAHCI(device);
+          else if (device->subclass_id == NVME_SUBCLASS)
+            initiateNVMe(device);
+          else
+            initiateVirtioBlk(device);
           break;
         default:
           break;
@@ -0,0 +1,188 @@
+#include <bootloader.h>
+#include <malloc.h>
+#include <paging.h>
+#include <pci.h>
+#include <system.h>
+#include <util.h>
+#include <virtio.h>
+#include <vmm.h>
+
+// Modern virtio-pci transport: finds the configuration structures through the
+// vendor specific capabilities, negotiates features & sets up split
+// virtqueues for the device drivers (ex: virtio-blk) sitting on top of it
+// Copyright (C) 2024 Panagiotis
+
+uint8_t virtioPciByte(PCIdevice *device, uint8_t offset) {
+  uint16_t word = ConfigReadWord(device->bus, device->slot, device->function,
+                                 offset & ~1);
+  return EXPORT_BYTE(word, !(offset & 1));
+}
+
+uint32_t virtioPciDword(PCIdevice *device, uint8_t offset) {
+  return COMBINE_WORD(ConfigReadWord(device->bus, device->slot,
+                                     device->function, offset + 2),
+                      ConfigReadWord(device->bus, device->slot,
+                                     device->function, offset));
+}
+
+// Walks the capability list for the structures we need. Devices lacking them
+// are legacy-only, which isn't supported
+bool virtioFindStructures(VirtioDevice *virtio, PCIdevice *device,
+                          PCIgeneralDevice *details) {
+  uint8_t cap = details->capabilitiesPtr & ~0x3;
+  while (cap) {
+    uint8_t id = virtioPciByte(device, cap);
+    uint8_t next = virtioPciByte(device, cap + 1);
+    if (id == PCI_CAP_ID_VENDOR) {
+      uint8_t  type = virtioPciByte(device, cap + 3);
+      uint8_t  bar = virtioPciByte(device, cap + 4);
+      uint32_t offset = virtioPciDword(device, cap + 8);
+      uint64_t base = bar < 6 ? GetBarAddress(details, bar) : 0;
+      size_t   virt = bootloader.hhdmOffset + base + offset;
+      if (base) {
+        switch (type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+          virtio->common = (volatile VirtioPciCommonCfg *)virt;
+          break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+          virtio->notifyBase = virt;
+          virtio->notifyMultiplier = virtioPciDword(device, cap + 16);
+          break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+          virtio->isr = (volatile uint8_t *)virt;
+          break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+          virtio->config = (volatile uint8_t *)virt;
+          break;
+        }
+      }
+    }
+    cap = next & ~0x3;
+  }
+
+  return virtio->common && virtio->notifyBase && virtio->isr;
+}
+
+// Resets the device & negotiates features (VIRTIO_F_VERSION_1 is implied),
+// leaving it ready for its queues to be set up
+bool virtioInitiate(VirtioDevice *virtio, PCIdevice *device,
+                    PCIgeneralDevice *details, uint64_t wanted) {
+  memset(virtio, 0, sizeof(VirtioDevice));
+  if (!virtioFindStructures(virtio, device, details)) {
+    debugf("[virtio] Legacy-only device, unsupported!\n");
+    return false;
+  }
+
+  // Enable PCI Bus Mastering & memory access (if not already)
+  uint32_t command_status = COMBINE_WORD(device->status, device->command);
+  command_status |= (1 << 1) | (1 << 2);
+  ConfigWriteDword(device->bus, device->slot, device->function, PCI_COMMAND,
+                   command_status);
+
+  volatile VirtioPciCommonCfg *common = virtio->common;
+  common->device_status = 0; // reset
+  while (common->device_status)
+    asm volatile("pause");
+  common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+  common->device_status |= VIRTIO_STATUS_DRIVER;
+
+  common->device_feature_select = 0;
+  uint64_t offered = common->device_feature;
+  common->device_feature_select = 1;
+  offered |= (uint64_t)common->device_feature << 32;
+
+  wanted |= 1ULL << VIRTIO_F_VERSION_1;
+  virtio->features = offered & wanted;
+  if (!virtioHasFeature(virtio, VIRTIO_F_VERSION_1)) {
+    debugf("[virtio] Device doesn't offer VIRTIO_F_VERSION_1!\n");
+    goto error;
+  }
+
+  common->driver_feature_select = 0;
+  common->driver_feature = SPLIT_64_LOWER(virtio->features);
+  common->driver_feature_select = 1;
+  common->driver_feature = SPLIT_64_HIGHER(virtio->features);
+
+  common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+  if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+    debugf("[virtio] Features rejected! features{%lx}\n", virtio->features);
+    goto error;
+  }
+
+  return true;
+
+error:
+  common->device_status |= VIRTIO_STATUS_FAILED;
+  return false;
+}
+
+bool virtioHasFeature(VirtioDevice *virtio, uint32_t bit) {
+  return virtio->features & (1ULL << bit);
+}
+
+// Allocates & hands over the rings of a queue (capped at VIRTQ_SIZE_MAX
+// entries). The device doesn't get to use it before virtioReady()
+bool virtioQueueSetup(VirtioDevice *virtio, Virtqueue *queue, uint16_t index) {
+  volatile VirtioPciCommonCfg *common = virtio->common;
+  memset(queue, 0, sizeof(Virtqueue));
+
+  common->queue_select = index;
+  uint16_t size = common->queue_size;
+  if (!size)
+    return false;
+  if (size > VIRTQ_SIZE_MAX)
+    size = VIRTQ_SIZE_MAX;
+
+  // descriptors, then the available ring & the (4-byte aligned) used ring
+  size_t availOffset = sizeof(VirtqDesc) * size;
+  size_t usedOffset = availOffset + sizeof(VirtqAvail) +
+                      sizeof(uint16_t) * (size + 1);
+  usedOffset = DivRoundUp(usedOffset, 4) * 4;
+  size_t total = usedOffset + sizeof(VirtqUsed) +
+                 sizeof(VirtqUsedElem) * size + sizeof(uint16_t);
+
+  size_t pages = DivRoundUp(total, PAGE_SIZE);
+  void  *rings = VirtualAllocate(pages);
+  memset(rings, 0, pages * PAGE_SIZE);
+  size_t phys = VirtualToPhysical((size_t)rings);
+
+  queue->index = index;
+  queue->size = size;
+  queue->desc = (VirtqDesc *)rings;
+  queue->avail = (volatile VirtqAvail *)((size_t)rings + availOffset);
+  queue->used = (volatile VirtqUsed *)((size_t)rings + usedOffset);
+  queue->notify = (volatile uint16_t *)(virtio->notifyBase +
+                                        common->queue_notify_off *
+                                            virtio->notifyMultiplier);
+
+  common->queue_size = size;
+  common->queue_msix_vector = VIRTIO_MSI_NO_VECTOR; // plain INTx
+  common->queue_desc_lo = SPLIT_64_LOWER(phys);
+  common->queue_desc_hi = SPLIT_64_HIGHER(phys);
+  common->queue_driver_lo = SPLIT_64_LOWER(phys + availOffset);
+  common->queue_driver_hi = SPLIT_64_HIGHER(phys + availOffset);
+  common->queue_device_lo = SPLIT_64_LOWER(phys + usedOffset);
+  common->queue_device_hi = SPLIT_64_HIGHER(phys + usedOffset);
+  common->queue_enable = 1;
+
+  return true;
+}
+
+void virtioReady(VirtioDevice *virtio) {
+  virtio->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+// Makes a descriptor chain available to the device (without notifying it)
+void virtioQueuePublish(Virtqueue *queue, uint16_t head) {
+  queue->avail->ring[queue->avail->idx % queue->size] = head;
+  asm volatile("" ::: "memory"); // the entry has to be there before the idx
+  queue->avail->idx++;
+}
+
+// Kicks the device, unless it said it's going through the ring anyway (every
+// notification is a VM exit under a hypervisor)
+void virtioQueueNotify(Virtqueue *queue) {
+  asm volatile("mfence" ::: "memory"); // idx store before the flags load
+  if (!(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY))
+    *queue->notify = queue->index;
+}
@@ -0,0 +1,368 @@
+#include <block_device.h>
+#include <disk.h>
+#include <isr.h>
+#include <malloc.h>
+#include <paging.h>
+#include <pmm.h>
+#include <system.h>
+#include <task.h>
+#include <util.h>
+#include <virtio_blk.h>
+#include <vmm.h>
+
+// virtio-blk driver: requests go through up to VIRTIO_BLK_QUEUES_MAX split
+// virtqueues, with one ring descriptor (and an indirect table) per request.
+// Issuers sleep until the interrupt handler reaps theirs, or poll when they
+// can't, same as AHCI
+// Copyright (C) 2024 Panagiotis
+
+#define VIRTIO_BLK_DEBUG 0
+
+// The queues are shared with virtioBlkInterruptHandler(), so they are only
+// ever touched with interrupts off
+uint64_t virtioBlkLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void virtioBlkUnlock(uint64_t rflags) {
+  if (rflags & RFLAGS_IF)
+    asm volatile("sti" ::: "memory");
+}
+
+// Hands out a free slot on the least busy queue, waiting for one if needed.
+// The last slot of every queue is kept for issuers that can't sleep
+int virtioBlkSlotAcquire(VirtioBlk *blk, bool sleep, VirtioBlkQueue **out) {
+  while (true) {
+    uint64_t        rflags = virtioBlkLock();
+    VirtioBlkQueue *best = 0;
+    uint64_t        bestFree = 0;
+    int             bestCnt = 0;
+    for (uint32_t i = 0; i < blk->queuesCnt; i++) {
+      VirtioBlkQueue *queue = &blk->queues[i];
+      uint16_t        size = queue->vq.size;
+      uint64_t usable = size >= 64 ? (uint64_t)-1 : ((1ULL << size) - 1);
+      if (sleep && size > 1)
+        usable &= ~(1ULL << (size - 1));
+
+      uint64_t free = usable & ~queue->busy;
+      int      cnt = 0;
+      for (uint64_t left = free; left; left &= left - 1)
+        cnt++;
+      if (cnt > bestCnt) {
+        best = queue;
+        bestFree = free;
+        bestCnt = cnt;
+      }
+    }
+
+    if (best) {
+      int slot = __builtin_ctzll(bestFree);
+      best->busy |= 1ULL << slot;
+      virtioBlkUnlock(rflags);
+      *out = best;
+      return slot;
+    }
+    virtioBlkUnlock(rflags);
+    asm volatile("pause");
+  }
+}
+
+void virtioBlkSlotRelease(VirtioBlkQueue *queue, int slot) {
+  uint64_t rflags = virtioBlkLock();
+  queue->done &= ~(1ULL << slot);
+  queue->waiters[slot] = 0;
+  queue->busy &= ~(1ULL << slot);
+  virtioBlkUnlock(rflags);
+}
+
+// Reaps whatever the device is done with (interrupts have to be off)
+void virtioBlkServiceUnsafe(VirtioBlkQueue *queue) {
+  Virtqueue *vq = &queue->vq;
+  while (vq->lastUsed != vq->used->idx) {
+    uint32_t slot = vq->used->ring[vq->lastUsed % vq->size].id;
+    vq->lastUsed++;
+    if (slot >= vq->size)
+      continue;
+
+    queue->done |= 1ULL << slot;
+    Task *waiter = queue->waiters[slot];
+    if (waiter && waiter->state == TASK_STATE_WAITING_DISK)
+      waiter->state = TASK_STATE_READY;
+  }
+}
+
+// Drops the references virtioBlkSetUpTable() took on the pages behind the
+// descriptors
+void virtioBlkReleaseTable(VirtqDesc *table, int entries) {
+  for (int i = 0; i < entries; i++) {
+    size_t end = table[i].addr + table[i].len;
+    for (size_t page = table[i].addr & ~(PAGE_SIZE - 1); page < end;
+         page += PAGE_SIZE)
+      PhysicalRelease(page);
+  }
+}
+
+// Describes the segments page by page, coalescing physically adjacent pages
+// into the same descriptor. Every page is referenced till the request's done,
+// so it can't be freed (ex: by munmap() on another thread) under the device.
+// Returns the amount of descriptors used, or -1 if the device can't take that
+// many
+int virtioBlkSetUpTable(VirtioBlk *blk, VirtqDesc *table,
+                        BlockSegment *segments, int cnt, bool write) {
+  int    entries = 0;
+  size_t physEnd = 0;
+  for (int i = 0; i < cnt; i++) {
+    size_t virt = (size_t)segments[i].buff;
+    size_t bytes = segments[i].bytes;
+    while (bytes) {
+      size_t len = PAGE_SIZE - (virt % PAGE_SIZE);
+      if (len > bytes)
+        len = bytes;
+
+      // lazily backed & copy-on-write pages have to be resolved first (the
+      // device can't page fault)
+      volatile uint8_t *touch = (volatile uint8_t *)virt;
+      if (write)
+        (void)*touch;
+      else
+        *touch = *touch;
+
+      size_t phys = VirtualToPhysical(virt);
+      if (!phys)
+        goto fail;
+
+      if (entries && phys == physEnd &&
+          table[entries - 1].len + len <= blk->sizeMax) {
+        if (!(phys % PAGE_SIZE)) // (once per page of a descriptor)
+          PhysicalShare(phys);
+        table[entries - 1].len += len;
+      } else {
+        if (entries == blk->segmentsMax)
+          goto fail;
+        PhysicalShare(phys);
+        table[entries].addr = phys;
+        table[entries].len = len;
+        entries++;
+      }
+
+      physEnd = phys + len;
+      virt += len;
+      bytes -= len;
+    }
+  }
+
+  return entries;
+
+fail:
+  virtioBlkReleaseTable(table, entries);
+  return -1;
+}
+
+// Moves data between the bounce buffer & the (scattered) segments
+void virtioBlkBounceCopy(uint8_t *bounce, BlockSegment *segments, int cnt,
+                         bool in) {
+  for (int i = 0; i < cnt; i++) {
+    if (in)
+      memcpy(bounce, segments[i].buff, segments[i].bytes);
+    else
+      memcpy(segments[i].buff, bounce, segments[i].bytes);
+    bounce += segments[i].bytes;
+  }
+}
+
+// Block device layer entry point: puts a request on the least busy queue &
+// waits for it to complete. Buffers the device can't take directly go through
+// a bounce buffer
+bool virtioBlkTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                       BlockSegment *segments, int cnt, bool write) {
+  VirtioBlk *blk = (VirtioBlk *)device->driver;
+  if (write && blk->readonly)
+    return false;
+
+  bool            sleep = taskCanSleep();
+  VirtioBlkQueue *queue = 0;
+  int             slot = virtioBlkSlotAcquire(blk, sleep, &queue);
+  VirtioBlkSlot  *entry = &queue->slots[slot];
+  uint32_t        bytes = sectors * SECTOR_SIZE;
+
+  // header, data, status
+  VirtqDesc *table = entry->table;
+  uint8_t   *bounce = 0;
+  uint32_t   bouncePages = DivRoundUp(bytes, PAGE_SIZE);
+  int        data = virtioBlkSetUpTable(blk, &table[1], segments, cnt, write);
+  if (data < 0) {
+    bounce = (uint8_t *)VirtualAllocate(bouncePages);
+    if (write)
+      virtioBlkBounceCopy(bounce, segments, cnt, true);
+    BlockSegment segment = {.buff = bounce, .bytes = bytes};
+    data = virtioBlkSetUpTable(blk, &table[1], &segment, 1, write);
+  }
+
+  bool ok = false;
+  if (data < 0) {
+    debugf("[virtio::blk] Request too scattered! sectors{%d}\n", sectors);
+    virtioBlkSlotRelease(queue, slot);
+    goto cleanup;
+  }
+
+  entry->header.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  entry->header.reserved = 0;
+  entry->header.sector = LBA;
+  entry->status = 0xFF;
+
+  table[0].addr = VirtualToPhysical((size_t)&entry->header);
+  table[0].len = sizeof(VirtioBlkHeader);
+  for (int i = 0; i <= data; i++) {
+    table[i].flags = VIRTQ_DESC_F_NEXT;
+    table[i].next = i + 1;
+  }
+  for (int i = 1; i <= data; i++) {
+    if (!write) // the device fills them in
+      table[i].flags |= VIRTQ_DESC_F_WRITE;
+  }
+  table[data + 1].addr = VirtualToPhysical((size_t)&entry->status);
+  table[data + 1].len = 1;
+  table[data + 1].flags = VIRTQ_DESC_F_WRITE;
+  table[data + 1].next = 0;
+
+  VirtqDesc *desc = &queue->vq.desc[slot];
+  desc->addr = VirtualToPhysical((size_t)table);
+  desc->len = (data + 2) * sizeof(VirtqDesc);
+  desc->flags = VIRTQ_DESC_F_INDIRECT;
+  desc->next = 0;
+
+  uint64_t rflags = virtioBlkLock();
+  if (sleep) {
+    queue->waiters[slot] = currentTask;
+    currentTask->state = TASK_STATE_WAITING_DISK;
+  }
+  virtioQueuePublish(&queue->vq, slot);
+  virtioQueueNotify(&queue->vq);
+  virtioBlkUnlock(rflags);
+
+  uint64_t bit = 1ULL << slot;
+  if (sleep) {
+    // the scheduler skips us until virtioBlkInterruptHandler() reaps the slot
+    while (currentTask->state == TASK_STATE_WAITING_DISK)
+      asm volatile("pause" ::: "memory");
+  } else {
+    while (!(queue->done & bit)) {
+      rflags = virtioBlkLock();
+      virtioBlkServiceUnsafe(queue);
+      virtioBlkUnlock(rflags);
+    }
+  }
+
+  // (the slot's entry is someone else's as soon as it's released)
+  ok = entry->status == VIRTIO_BLK_S_OK;
+  if (!ok)
+    printf("[virtio::blk] Disk error! status{%d}\n", entry->status);
+  virtioBlkReleaseTable(&table[1], data);
+  virtioBlkSlotRelease(queue, slot);
+
+cleanup:
+  if (bounce) {
+    if (ok && !write)
+      virtioBlkBounceCopy(bounce, segments, cnt, false);
+    VirtualFree(bounce, bouncePages);
+  }
+
+  return ok;
+}
+
+void virtioBlkInterruptHandler(AsmPassedInterrupt *regs) {
+  PCI *browse = firstPCI;
+  while (browse) {
+    if (browse->driver == PCI_DRIVER_VIRTIO_BLK) {
+      VirtioBlk *blk = browse->extra;
+      uint8_t    isr = *blk->virtio.isr; // reading acknowledges it
+      if (isr & VIRTIO_ISR_QUEUE) {
+        for (uint32_t i = 0; i < blk->queuesCnt; i++)
+          virtioBlkServiceUnsafe(&blk->queues[i]);
+      }
+    }
+
+    browse = browse->next;
+  }
+}
+
+bool initiateVirtioBlk(PCIdevice *device) {
+  if (device->vendor_id != VIRTIO_PCI_VENDOR ||
+      (device->device_id != VIRTIO_BLK_DEVICE &&
+       device->device_id != VIRTIO_BLK_DEVICE_TRANSITIONAL))
+    return false;
+
+  debugf("[pci::virtio::blk] Detected device! id{%x}\n", device->device_id);
+
+  PCIgeneralDevice details = {0};
+  GetGeneralDevice(device, &details);
+
+  VirtioBlk *blk = (VirtioBlk *)malloc(sizeof(VirtioBlk));
+  memset(blk, 0, sizeof(VirtioBlk));
+
+  uint64_t wanted = (1ULL << VIRTIO_F_INDIRECT_DESC) |
+                    (1ULL << VIRTIO_BLK_F_SIZE_MAX) |
+                    (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+                    (1ULL << VIRTIO_BLK_F_RO) | (1ULL << VIRTIO_BLK_F_MQ);
+  VirtioDevice *virtio = &blk->virtio;
+  if (!virtioInitiate(virtio, device, &details, wanted))
+    goto error;
+  if (!virtioHasFeature(virtio, VIRTIO_F_INDIRECT_DESC) || !virtio->config) {
+    debugf("[pci::virtio::blk] No indirect descriptors, unsupported!\n");
+    goto error;
+  }
+
+  volatile VirtioBlkConfig *config = (volatile VirtioBlkConfig *)virtio->config;
+  blk->segmentsMax = VIRTIO_BLK_SEGMENTS_MAX;
+  if (virtioHasFeature(virtio, VIRTIO_BLK_F_SEG_MAX) && config->seg_max &&
+      config->seg_max < blk->segmentsMax)
+    blk->segmentsMax = config->seg_max;
+  blk->sizeMax = 4 * 1024 * 1024;
+  if (virtioHasFeature(virtio, VIRTIO_BLK_F_SIZE_MAX) && config->size_max &&
+      config->size_max < blk->sizeMax)
+    blk->sizeMax = config->size_max;
+  blk->readonly = virtioHasFeature(virtio, VIRTIO_BLK_F_RO);
+
+  uint32_t queues = 1;
+  if (virtioHasFeature(virtio, VIRTIO_BLK_F_MQ) && config->num_queues > 1)
+    queues = config->num_queues;
+  if (queues > VIRTIO_BLK_QUEUES_MAX)
+    queues = VIRTIO_BLK_QUEUES_MAX;
+
+  uint32_t depth = 0;
+  for (uint32_t i = 0; i < queues; i++) {
+    VirtioBlkQueue *queue = &blk->queues[i];
+    if (!virtioQueueSetup(virtio, &queue->vq, i))
+      break;
+    size_t pages =
+        DivRoundUp(sizeof(VirtioBlkSlot) * queue->vq.size, PAGE_SIZE);
+    queue->slots = (VirtioBlkSlot *)VirtualAllocate(pages);
+    memset(queue->slots, 0, pages * PAGE_SIZE);
+    depth += queue->vq.size > 1 ? queue->vq.size - 1 : 1;
+    blk->queuesCnt++;
+  }
+  if (!blk->queuesCnt) {
+    debugf("[pci::virtio::blk] No usable queues!\n");
+    goto error;
+  }
+
+  PCI *pci = lookupPCIdevice(device);
+  setupPCIdeviceDriver(pci, PCI_DRIVER_VIRTIO_BLK, PCI_DRIVER_CATEGORY_STORAGE);
+  pci->extra = blk;
+  pci->irqHandler =
+      registerIRQhandler(details.interruptLine, &virtioBlkInterruptHandler);
+  virtioReady(virtio);
+
+  debugf("[pci::virtio::blk] Ready: queues{%d} segments{%d} ro{%d}\n",
+         blk->queuesCnt, blk->segmentsMax, blk->readonly);
+  blk->device = blockDeviceRegister(virtioBlkTransfer, blk, 0,
+                                    config->capacity, VIRTIO_BLK_SECTORS_MAX,
+                                    depth);
+  return true;
+
+error:
+  free(blk);
+  return false;
+}
@@ -1,7 +1,9 @@
+#include <block_cache.h>
 #include <bootloader.h>
 #include <console.h>
 #include <disk.h>
 #include <elf.h>
+#include <ext2.h>
 #include <fakefs.h>
 #include <fastSyscall.h>
 #include <fb.h>
@@ -21,6 +23,7 @@
 #include <rtc.h>
 #include <serial.h>
 #include <shell.h>
+#include <slab.h>
 #include <string.h>
 #include <syscalls.h>
 #include <system.h>
@@ -43,6 +46,7 @@ void _start(void) {
 
   initialiseBootloaderParser();
   initiateSerial();
+  initiateMemoryOps();
 
   // Framebuffer doesn't depend on paging, limine prepares it anyways
   initiateVGA();
@@ -52,6 +56,7 @@ void _start(void) {
   // None of the two depend on paging
   initiatePMM();
   initiateVMM();
+  initiateSlab();
 
   initiateGDT();
   initiateISR();
@@ -63,12 +68,16 @@ void _start(void) {
   initiateTimer(1000);
   initiateNetworking();
   initiatePCI();
+  initiateBlockCache();
+  initiateVfs();
   firstMountPoint = 0;
   fsMount("/", CONNECTOR_AHCI, 0, 1);
   fsMount("/boot/", CONNECTOR_AHCI, 0, 0);
+  fsMount("/tmp/", CONNECTOR_TMPFS, 0, 0);
 
   // any filesystem operations depend on currentTask
   initiateTasks();
+  initiateExt2Writeback();
 
   // just in case there's another font preference
   psfLoadFromFile(DEFAULT_FONT_PATH);
@@ -1,10 +1,13 @@
 #include <arp.h>
+#include <bootloader.h>
 #include <elf.h>
+#include <ext2.h>
 #include <fb.h>
 #include <icmp.h>
 #include <malloc.h>
 #include <md5.h>
 #include <ne2k.h>
+#include <paging.h>
 #include <pci.h>
 #include <socket.h>
 #include <string.h>
@@ -24,6 +27,224 @@
 
 extern void weirdTests();
 
+// heavy (& slow) boot-time benchmarks, opt-in
+#define TESTING_BENCHMARKS 0
+
+// cycles per millisecond, measured against the (1000hz) PIT
+uint64_t testingTscPerMs() {
+  uint64_t edge = timerTicks;
+  while (timerTicks == edge)
+    ;
+  uint64_t start = rdtsc();
+  sleep(10);
+  return (rdtsc() - start) / 10;
+}
+
+#define TESTING_PMM_FRAMES 4096
+size_t testingPmmFrames[TESTING_PMM_FRAMES];
+
+// old first-fit bitmap scan vs the buddy allocator, one pageframe at a time
+void testingBenchmarkPmm() {
+  uint64_t tscPerMs = testingTscPerMs();
+
+  // nobody else should touch the allocator meanwhile
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  uint64_t start = rdtsc();
+  for (int i = 0; i < TESTING_PMM_FRAMES; i++) {
+    size_t block = FindFreeRegion(&physical, 1);
+    MarkBlocks(&physical, block, 1, 1);
+    testingPmmFrames[i] = block;
+  }
+  uint64_t bitmapCycles = rdtsc() - start;
+  for (int i = 0; i < TESTING_PMM_FRAMES; i++)
+    MarkBlocks(&physical, testingPmmFrames[i], 1, 0);
+
+  start = rdtsc();
+  for (int i = 0; i < TESTING_PMM_FRAMES; i++)
+    testingPmmFrames[i] = PhysicalAllocate(1);
+  uint64_t buddyCycles = rdtsc() - start;
+  for (int i = 0; i < TESTING_PMM_FRAMES; i++)
+    PhysicalFree(testingPmmFrames[i], 1);
+  if (rflags & (1 << 9)) // IF
+    asm volatile("sti" ::: "memory");
+
+  debugf("[testing::pmm] %d pageframes: bitmap{%ld allocs/s} buddy{%ld "
+         "allocs/s}\n",
+         TESTING_PMM_FRAMES,
+         TESTING_PMM_FRAMES * tscPerMs * 1000 / (bitmapCycles + 1),
+         TESTING_PMM_FRAMES * tscPerMs * 1000 / (buddyCycles + 1));
+}
+
+#define TESTING_MEM_MAX 0x100000    // 1MiB
+#define TESTING_MEM_TOTAL 0x400000  // bytes moved per size & variant
+#define TESTING_MEM_VARIANTS 6
+
+typedef enum TESTING_MEM {
+  TESTING_MEM_MEMCPY_REP = 0,
+  TESTING_MEM_MEMCPY_UNROLLED = 1,
+  TESTING_MEM_MEMSET_REP = 2,
+  TESTING_MEM_MEMSET_UNROLLED = 3,
+  TESTING_MEM_MEMMOVE = 4, // overlapping, backwards
+  TESTING_MEM_MEMCMP = 5,
+} TESTING_MEM;
+
+char *testingMemNames[TESTING_MEM_VARIANTS] = {
+    "memcpy(rep)", "memcpy(unrolled)", "memset(rep)",
+    "memset(unrolled)", "memmove", "memcmp"};
+
+void testingMemRun(TESTING_MEM variant, uint8_t *a, uint8_t *b, size_t size) {
+  switch (variant) {
+  case TESTING_MEM_MEMCPY_REP:
+    memcpyRep(a, b, size);
+    break;
+  case TESTING_MEM_MEMCPY_UNROLLED:
+    memcpyUnrolled(a, b, size);
+    break;
+  case TESTING_MEM_MEMSET_REP:
+    memsetRep(a, 0x69, size);
+    break;
+  case TESTING_MEM_MEMSET_UNROLLED:
+    memsetUnrolled(a, 0x69, size);
+    break;
+  case TESTING_MEM_MEMMOVE:
+    memmove(a + 8, a, size);
+    break;
+  case TESTING_MEM_MEMCMP:
+    memcmp(a, b, size);
+    break;
+  }
+}
+
+// MB/s of every memory operation variant, from 16 bytes up to 1MiB
+void testingBenchmarkMem() {
+  uint64_t tscPerMs = testingTscPerMs();
+  uint8_t *a = malloc(TESTING_MEM_MAX + 64);
+  uint8_t *b = malloc(TESTING_MEM_MAX + 64);
+  memset(a, 0, TESTING_MEM_MAX + 64);
+  memset(b, 0, TESTING_MEM_MAX + 64); // memcmp() goes all the way
+
+  debugf("[testing::mem] erms{%d} fsrm{%d}\n", memErms, memFsrm);
+  for (int variant = 0; variant < TESTING_MEM_VARIANTS; variant++) {
+    for (size_t size = 16; size <= TESTING_MEM_MAX; size *= 4) {
+      size_t   rounds = TESTING_MEM_TOTAL / size;
+      uint64_t start = rdtsc();
+      for (size_t i = 0; i < rounds; i++)
+        testingMemRun(variant, a, b, size);
+      uint64_t cycles = rdtsc() - start;
+      debugf("[testing::mem] %-16s %7ld bytes: %6ld MB/s\n",
+             testingMemNames[variant], size,
+             TESTING_MEM_TOTAL * tscPerMs * 1000 / (cycles + 1) / 0x100000);
+    }
+  }
+
+  // page helpers, on page-aligned memory
+  size_t   page = PhysicalAllocatePage();
+  size_t   other = PhysicalAllocatePage();
+  void    *pageVirt = (void *)(page + bootloader.hhdmOffset);
+  void    *otherVirt = (void *)(other + bootloader.hhdmOffset);
+  size_t   rounds = TESTING_MEM_TOTAL / PAGE_SIZE;
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < rounds; i++)
+    copyPage(pageVirt, otherVirt);
+  uint64_t copyCycles = rdtsc() - start;
+  start = rdtsc();
+  for (size_t i = 0; i < rounds; i++)
+    zeroPage(pageVirt);
+  uint64_t zeroCycles = rdtsc() - start;
+  debugf("[testing::mem] copyPage{%ld MB/s} zeroPage{%ld MB/s}\n",
+         TESTING_MEM_TOTAL * tscPerMs * 1000 / (copyCycles + 1) / 0x100000,
+         TESTING_MEM_TOTAL * tscPerMs * 1000 / (zeroCycles + 1) / 0x100000);
+
+  PhysicalFreePage(page);
+  PhysicalFreePage(other);
+  free(a);
+  free(b);
+}
+
+#define TESTING_STAT_ROOT "/usr"
+#define TESTING_STAT_PATHS 1000
+#define TESTING_STAT_ROUNDS 10
+char *testingStatPaths[TESTING_STAT_PATHS];
+
+// breadth-first walk, the array itself being the queue
+int testingCollectPaths() {
+  int cnt = 0;
+  testingStatPaths[cnt] = malloc(sizeof(TESTING_STAT_ROOT));
+  memcpy(testingStatPaths[cnt++], TESTING_STAT_ROOT, sizeof(TESTING_STAT_ROOT));
+
+  uint8_t *dirents = malloc(4096);
+  for (int i = 0; i < cnt && cnt < TESTING_STAT_PATHS; i++) {
+    OpenFile *dir = fsKernelOpen(testingStatPaths[i], FS_MODE_READ, 0);
+    if (!dir)
+      continue;
+
+    int len = 0;
+    while (dir->handlers->getdents64 && cnt < TESTING_STAT_PATHS &&
+           (len = dir->handlers->getdents64(dir, currentTask,
+                                            (struct linux_dirent64 *)dirents,
+                                            4096)) > 0) {
+      for (int off = 0; off < len && cnt < TESTING_STAT_PATHS;) {
+        struct linux_dirent64 *dirent =
+            (struct linux_dirent64 *)(dirents + off);
+        off += dirent->d_reclen;
+        if (strEql(dirent->d_name, ".") || strEql(dirent->d_name, ".."))
+          continue;
+
+        size_t baseLen = strlength(testingStatPaths[i]);
+        size_t nameLen = strlength(dirent->d_name);
+        char  *path = malloc(baseLen + 1 + nameLen + 1);
+        memcpy(path, testingStatPaths[i], baseLen);
+        path[baseLen] = '/';
+        memcpy(path + baseLen + 1, dirent->d_name, nameLen + 1);
+        testingStatPaths[cnt++] = path;
+      }
+    }
+    fsKernelClose(dir);
+  }
+
+  free(dirents);
+  return cnt;
+}
+
+// stat() of the same paths over and over: only the first round should ever
+// have to touch the disk (inode cache)
+void testingBenchmarkStat() {
+  int cnt = testingCollectPaths();
+
+  uint64_t tscPerMs = testingTscPerMs();
+  stat     statbuf = {0};
+  uint64_t firstCycles = 0;
+  uint64_t start = rdtsc();
+  for (int round = 0; round < TESTING_STAT_ROUNDS; round++) {
+    for (int i = 0; i < cnt; i++)
+      fsStatByFilename(currentTask, testingStatPaths[i], &statbuf);
+    if (!round)
+      firstCycles = rdtsc() - start;
+  }
+  uint64_t restCycles = rdtsc() - start - firstCycles;
+
+  debugf("[testing::stat] %d paths under %s: first{%ld stats/s} "
+         "rest{%ld stats/s}\n",
+         cnt, TESTING_STAT_ROOT, cnt * tscPerMs * 1000 / (firstCycles + 1),
+         (TESTING_STAT_ROUNDS - 1) * cnt * tscPerMs * 1000 /
+             (restCycles + 1));
+
+  MountPoint *mnt = fsDetermineMountPoint(TESTING_STAT_ROOT);
+  if (mnt && mnt->filesystem == FS_EXT2) {
+    Ext2InodeCache *cache = &EXT2_PTR(mnt->fsInfo)->inodeCache;
+    debugf("[testing::stat] inode cache: cached{%ld} hits{%ld} misses{%ld} "
+           "evictions{%ld}\n",
+           cache->cnt, cache->hits, cache->misses, cache->evictions);
+  }
+  debugf("[testing::stat] dcache: cached{%ld} hits{%ld} negative{%ld} "
+         "misses{%ld}\n",
+         dcache.cnt, dcache.hits, dcache.negativeHits, dcache.misses);
+
+  for (int i = 0; i < cnt; i++)
+    free(testingStatPaths[i]);
+}
+
 // char *argv[] = {"/doom", "-iwad", "/DOOM.WAD"};
 // char *argv[] = {"/usr/bin/busybox", "sh"};
 // char *argv[] = {"/usr/bin/bash"};
@@ -31,6 +252,11 @@ extern void weirdTests();
 // char *argv[] = {"/a.out"};
 // char *argv[] = {"/usr/bin/doom", "-iwad", "/usr/bin/doom.wad"};
 void testingInit() {
+#if TESTING_BENCHMARKS
+  testingBenchmarkPmm();
+  testingBenchmarkMem();
+  testingBenchmarkStat();
+#endif
   // netSocketConnect(selectedNIC, SOCKET_PROT_UDP, (uint8_t[]){10, 0, 2, 15},
   //                   5643, 69);
   // weirdTests();
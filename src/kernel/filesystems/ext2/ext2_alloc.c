@@ -0,0 +1,249 @@
+#include <ext2.h>
+#include <malloc.h>
+#include <system.h>
+#include <util.h>
+
+// Block & inode allocation (through the group bitmaps) and file block
+// mappings. Everything's modified through dirty buffers, so LOCK_WRITE has to
+// be held throughout
+// Copyright (C) 2024 Panagiotis
+
+// First block the block bitmaps account for (the superblock's own one)
+#define EXT2_FIRST_DATA_BLOCK(ext2) ((ext2)->superblock.superblock_idx)
+
+size_t ext2GroupBlocks(Ext2 *ext2, size_t group) {
+  size_t first = EXT2_FIRST_DATA_BLOCK(ext2) +
+                 group * ext2->superblock.blocks_per_group;
+  size_t left = ext2->superblock.total_blocks - first;
+  return left < ext2->superblock.blocks_per_group
+             ? left
+             : ext2->superblock.blocks_per_group;
+}
+
+// Takes the first clear bit in [from, cnt) of a bitmap block (-1 if none)
+int64_t ext2BitmapTake(Ext2 *ext2, uint32_t bitmapBlock, size_t from,
+                       size_t cnt) {
+  uint8_t *bitmap = ext2BufferGet(ext2, 0, bitmapBlock, bitmapBlock, true);
+  for (size_t i = from; i < cnt; i++) {
+    if (!(i % 8) && (i + 8) <= cnt && bitmap[i / 8] == 0xFF) {
+      i += 7; // (whole byte's taken)
+      continue;
+    }
+    if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+      bitmap[i / 8] |= 1 << (i % 8);
+      return i;
+    }
+  }
+  return -1;
+}
+
+void ext2BitmapClear(Ext2 *ext2, uint32_t bitmapBlock, size_t index) {
+  uint8_t *bitmap = ext2BufferGet(ext2, 0, bitmapBlock, bitmapBlock, true);
+  if (!(bitmap[index / 8] & (1 << (index % 8))))
+    debugf("[ext2::alloc] Freeing something that's free! bitmap{%d} "
+           "index{%ld}\n",
+           bitmapBlock, index);
+  bitmap[index / 8] &= ~(1 << (index % 8));
+}
+
+// First free block at (or after) goal, wrapping around the groups
+uint32_t ext2BlockAllocate(Ext2 *ext2, uint32_t goal) {
+  size_t first = EXT2_FIRST_DATA_BLOCK(ext2);
+  size_t perGroup = ext2->superblock.blocks_per_group;
+  if (goal < first || goal >= ext2->superblock.total_blocks)
+    goal = first;
+
+  size_t start = (goal - first) / perGroup;
+  // (the goal's group gets a second look from its start, at the end)
+  for (size_t i = 0; i <= ext2->blockGroups; i++) {
+    size_t group = (start + i) % ext2->blockGroups;
+    if (!ext2->bgdts[group].free_blocks)
+      continue;
+
+    size_t  from = i ? 0 : (goal - first) % perGroup;
+    int64_t bit = ext2BitmapTake(ext2, ext2->bgdts[group].block_bitmap, from,
+                                 ext2GroupBlocks(ext2, group));
+    if (bit < 0)
+      continue;
+
+    ext2->bgdts[group].free_blocks--;
+    ext2->superblock.free_blocks--;
+    ext2->metaDirty = true;
+    return first + group * perGroup + bit;
+  }
+
+  debugf("[ext2::alloc] Out of blocks!\n");
+  return 0;
+}
+
+void ext2BlockFree(Ext2 *ext2, uint32_t block) {
+  size_t rel = block - EXT2_FIRST_DATA_BLOCK(ext2);
+  size_t group = rel / ext2->superblock.blocks_per_group;
+  ext2BitmapClear(ext2, ext2->bgdts[group].block_bitmap,
+                  rel % ext2->superblock.blocks_per_group);
+  ext2->bgdts[group].free_blocks++;
+  ext2->superblock.free_blocks++;
+  ext2->metaDirty = true;
+
+  // whatever was pending for it (as metadata) doesn't matter anymore
+  ext2BufferForget(ext2, 0, block);
+}
+
+// Free inode, preferably in the same group as its parent directory
+uint32_t ext2InodeAllocate(Ext2 *ext2, uint32_t parent, bool directory) {
+  size_t start = INODE_TO_BLOCK_GROUP(ext2, parent);
+  for (size_t i = 0; i < ext2->blockGroups; i++) {
+    size_t group = (start + i) % ext2->blockGroups;
+    if (!ext2->bgdts[group].free_inodes)
+      continue;
+
+    // (the first group begins with the reserved ones)
+    size_t  from = group ? 0 : ext2->superblock.extended.first_inode - 1;
+    int64_t bit = ext2BitmapTake(ext2, ext2->bgdts[group].inode_bitmap, from,
+                                 ext2->superblock.inodes_per_group);
+    if (bit < 0)
+      continue;
+
+    ext2->bgdts[group].free_inodes--;
+    if (directory)
+      ext2->bgdts[group].num_dirs++;
+    ext2->superblock.free_inodes--;
+    ext2->metaDirty = true;
+    return group * ext2->superblock.inodes_per_group + bit + 1;
+  }
+
+  debugf("[ext2::alloc] Out of inodes!\n");
+  return 0;
+}
+
+void ext2InodeFree(Ext2 *ext2, uint32_t inode, bool directory) {
+  size_t group = INODE_TO_BLOCK_GROUP(ext2, inode);
+  ext2BitmapClear(ext2, ext2->bgdts[group].inode_bitmap,
+                  INODE_TO_INDEX(ext2, inode));
+  ext2->bgdts[group].free_inodes++;
+  if (directory)
+    ext2->bgdts[group].num_dirs--;
+  ext2->superblock.free_inodes++;
+  ext2->metaDirty = true;
+}
+
+// Zeroed indirect block for a file, close to where its data goes
+uint32_t ext2IndirectAllocate(Ext2 *ext2, Ext2Inode *ino, uint32_t goal) {
+  uint32_t block = ext2BlockAllocate(ext2, goal);
+  if (!block)
+    return 0;
+  ext2BufferGet(ext2, 0, block, block, false);
+  ino->num_sectors += ext2->blockSize / SECTOR_SIZE;
+  return block;
+}
+
+// Points a file's logical block to a physical one, allocating whatever
+// indirect blocks are missing on the way
+void ext2BlockMapSet(Ext2 *ext2, Ext2Inode *ino, size_t logical,
+                     uint32_t physical) {
+  size_t itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
+  if (logical < 12) {
+    ino->blocks[logical] = physical;
+    return;
+  }
+  logical -= 12;
+
+  int levels = 1;
+  if (logical >= itemsPerBlock) {
+    logical -= itemsPerBlock;
+    levels++;
+    if (logical >= itemsPerBlock * itemsPerBlock) {
+      logical -= itemsPerBlock * itemsPerBlock;
+      levels++;
+    }
+  }
+
+  uint32_t block = ino->blocks[11 + levels];
+  if (!block) {
+    block = ext2IndirectAllocate(ext2, ino, physical);
+    if (!block)
+      return;
+    ino->blocks[11 + levels] = block;
+  }
+
+  while (true) {
+    uint32_t *entries = (uint32_t *)ext2BufferGet(ext2, 0, block, block, true);
+    size_t    span = 1;
+    for (int i = 1; i < levels; i++)
+      span *= itemsPerBlock;
+    uint32_t *slot = &entries[(logical / span) % itemsPerBlock];
+    if (!--levels) {
+      *slot = physical;
+      return;
+    }
+    if (!*slot) {
+      *slot = ext2IndirectAllocate(ext2, ino, physical);
+      if (!*slot)
+        return;
+    }
+    block = *slot;
+  }
+}
+
+// Frees everything from logical block from onwards under an indirect block
+// (at level, covering the ones from base). Returns whether it's now empty
+// (and freed itself)
+bool ext2IndirectRelease(Ext2 *ext2, Ext2Inode *ino, uint32_t block,
+                         int level, size_t base, size_t from) {
+  size_t itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
+  size_t span = 1;
+  for (int i = 1; i < level; i++)
+    span *= itemsPerBlock;
+
+  uint32_t *entries = (uint32_t *)ext2BufferGet(ext2, 0, block, block, true);
+  bool      empty = true;
+  for (size_t i = 0; i < itemsPerBlock; i++) {
+    size_t start = base + i * span;
+    if (!entries[i])
+      continue;
+    if ((start + span) <= from) { // kept as a whole
+      empty = false;
+      continue;
+    }
+
+    if (level == 1 || ext2IndirectRelease(ext2, ino, entries[i], level - 1,
+                                          start, from)) {
+      if (level == 1) {
+        ext2BlockFree(ext2, entries[i]);
+        ino->num_sectors -= ext2->blockSize / SECTOR_SIZE;
+      }
+      entries[i] = 0;
+    } else
+      empty = false;
+  }
+
+  if (empty) {
+    ext2BlockFree(ext2, block);
+    ino->num_sectors -= ext2->blockSize / SECTOR_SIZE;
+  }
+  return empty;
+}
+
+// Frees a file's blocks from logical block from onwards (the size is up to
+// the caller)
+void ext2BlocksRelease(Ext2 *ext2, Ext2Inode *ino, size_t from) {
+  size_t itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
+  for (size_t i = from; i < 12; i++) {
+    if (!ino->blocks[i])
+      continue;
+    ext2BlockFree(ext2, ino->blocks[i]);
+    ino->num_sectors -= ext2->blockSize / SECTOR_SIZE;
+    ino->blocks[i] = 0;
+  }
+
+  size_t base = 12;
+  size_t span = itemsPerBlock;
+  for (int level = 1; level <= 3; level++) {
+    uint32_t block = ino->blocks[11 + level];
+    if (block && (base + span) > from &&
+        ext2IndirectRelease(ext2, ino, block, level, base, from))
+      ino->blocks[11 + level] = 0;
+    base += span;
+    span *= itemsPerBlock;
+  }
+}
@@ -13,12 +13,13 @@ bool ext2Mount(MountPoint *mount) {
   Ext2 *ext2 = EXT2_PTR(mount->fsInfo);
 
   // base offset
+  ext2->disk = mount->disk;
   ext2->offsetBase = mount->mbr.lba_first_sector;
   ext2->offsetSuperblock = mount->mbr.lba_first_sector + 2;
 
   // get superblock
   uint8_t tmp[sizeof(Ext2Superblock)] = {0};
-  getDiskBytes(tmp, ext2->offsetSuperblock, 2);
+  getDiskBytes(ext2->disk, tmp, ext2->offsetSuperblock, 2);
 
   // store it
   memcpy(&ext2->superblock, tmp, sizeof(Ext2Superblock));
@@ -83,7 +84,7 @@ bool ext2Mount(MountPoint *mount) {
   // remember, very max is block size
   ext2->offsetBGDT = BLOCK_TO_LBA(ext2, 0, ext2->superblock.superblock_idx + 1);
   ext2->bgdts = (Ext2BlockGroup *)malloc(ext2->blockSize);
-  getDiskBytes((void *)ext2->bgdts, ext2->offsetBGDT,
+  getDiskBytes(ext2->disk, (void *)ext2->bgdts, ext2->offsetBGDT,
                DivRoundUp(ext2->blockSize, SECTOR_SIZE));
 
   ext2->inodeSize = ext2->superblock.extended.inode_size;
@@ -102,16 +103,22 @@ bool ext2Open(MountPoint *mount, OpenFile *fd, char *filename) {
   Ext2 *ext2 = EXT2_PTR(mount->fsInfo);
 
   uint32_t inode = ext2TraversePath(ext2, filename, EXT2_ROOT_INODE, true);
+  if (inode && (fd->flags & O_CREAT) && (fd->flags & O_EXCL))
+    return false;
+  if (!inode && (fd->flags & O_CREAT))
+    inode = ext2Create(mount, filename, fd->mode);
   if (!inode)
     return false;
 
   Ext2OpenFd *dir = (Ext2OpenFd *)malloc(sizeof(Ext2OpenFd));
   memset(dir, 0, sizeof(Ext2OpenFd));
 
-  Ext2Inode *inodeFetched = ext2InodeFetch(ext2, inode);
+  Ext2Inode *inodeFetched = ext2InodeGet(ext2, inode);
   fd->dir = dir;
 
   dir->inodeNum = inode;
+  dir->generation = ext2->generation;
+  ext2InodeOpen(ext2, inode);
   memcpy(&dir->inode, inodeFetched, sizeof(Ext2Inode));
 
   if ((dir->inode.permission & 0xF000) == EXT2_S_IFDIR) {
@@ -120,100 +127,119 @@ bool ext2Open(MountPoint *mount, OpenFile *fd, char *filename) {
     memcpy(fd->dirname, filename, len);
   }
 
-  ext2BlockFetchInit(ext2, &dir->lookup);
-
   // pointers & stuff
   dir->ptr = 0;
 
-  free(inodeFetched);
+  ext2InodePut(ext2, inodeFetched);
+
+  if ((fd->flags & O_TRUNC) && (fd->flags & O_ACCMODE) != O_RDONLY &&
+      (dir->inode.permission & 0xF000) == EXT2_S_IFREG)
+    ext2Truncate(mount, fd, 0);
   return true;
 }
 
+// Picks up whatever changed (through any fd) since it last looked
+void ext2OpenFdRefresh(Ext2 *ext2, Ext2OpenFd *dir) {
+  uint64_t generation = ext2->generation;
+  if (dir->generation == generation)
+    return;
+
+  Ext2Inode *inode = ext2InodeGet(ext2, dir->inodeNum);
+  memcpy(&dir->inode, inode, sizeof(Ext2Inode));
+  ext2InodePut(ext2, inode);
+  ext2ExtentMapFree(&dir->extents);
+  dir->generation = generation;
+}
+
+// Pulls the file's [start, end) byte range into the block cache, a run of
+// consecutive blocks at a time
+void ext2Prefetch(Ext2 *ext2, Ext2OpenFd *dir, size_t start, size_t end) {
+  size_t block = start / ext2->blockSize;
+  size_t last = DivRoundUp(end, ext2->blockSize);
+  while (block < last) {
+    size_t   run = 0;
+    uint32_t phys = ext2ExtentLookup(ext2, dir, block, &run);
+    if (!run)
+      break;
+    if (run > last - block)
+      run = last - block;
+    if (phys) // (holes have nothing to read)
+      blockCachePrefetch(ext2->disk, BLOCK_TO_LBA(ext2, 0, phys),
+                         run * ext2->blockSize / SECTOR_SIZE);
+    block += run;
+  }
+}
+
 int ext2Read(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit) {
   Ext2       *ext2 = EXT2_PTR(mount->fsInfo);
   Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+  ext2OpenFdRefresh(ext2, dir);
 
   size_t filesize = ext2GetFilesize(fd);
   if (dir->ptr >= filesize)
     return 0;
-
-  size_t    blocksRequired = DivRoundUp(limit, ext2->blockSize);
-  uint32_t *blocks =
-      ext2BlockChain(ext2, dir, dir->ptr / ext2->blockSize, blocksRequired);
-  uint8_t *bytes = (uint8_t *)malloc(ext2->blockSize);
+  if (limit > filesize - dir->ptr)
+    limit = filesize - dir->ptr;
+
+  // sequential streams are prefetched into (and then served from) the block
+  // cache, everything else goes straight to the destination
+  size_t aheadStart = 0;
+  size_t aheadEnd = 0;
+  bool   sequential = blockCacheReadAhead(&dir->readAhead, dir->ptr, limit,
+                                          &aheadStart, &aheadEnd);
+  if (aheadEnd > filesize)
+    aheadEnd = filesize;
+  if (aheadEnd > aheadStart)
+    ext2Prefetch(ext2, dir, aheadStart, aheadEnd);
 
   int curr = 0; // will be used to return
 
-  // optimization: we can use consecutive sectors to make our life easier
-  int consecStart = -1;
-  int consecEnd = 0;
-
-  // +1 for starting
-  for (int i = 0; i < (blocksRequired + 1); i++) {
-    if (!blocks[i])
+  while (curr < limit) {
+    // optimization: consecutive blocks are read in one go
+    size_t   run = 0;
+    uint32_t phys =
+        ext2ExtentLookup(ext2, dir, dir->ptr / ext2->blockSize, &run);
+    if (!run)
       break;
-    bool last = i == (blocksRequired - 1);
-    if (consecStart < 0) {
-      // nothing consecutive yet
-      if (!last && blocks[i + 1] == (blocks[i] + 1)) {
-        // consec starts here
-        consecStart = i;
-        continue;
-      }
-    } else {
-      // we are in a consecutive that started since consecStart
-      if (last || blocks[i + 1] != (blocks[i] + 1))
-        consecEnd = i; // either last or the end
-      else             // otherwise, we good
-        continue;
-    }
-
-    uint32_t offsetStarting = dir->ptr % ext2->blockSize; // remainder
-    if (consecEnd) {
-      // optimized consecutive cluster reading
-      int      needed = consecEnd - consecStart + 1;
-      uint8_t *optimizedBytes = malloc(needed * ext2->blockSize);
-      getDiskBytes(optimizedBytes, BLOCK_TO_LBA(ext2, 0, blocks[consecStart]),
-                   (needed * ext2->blockSize) / SECTOR_SIZE);
-
-      for (uint32_t i = offsetStarting; i < (needed * ext2->blockSize); i++) {
-        if (curr >= limit || dir->ptr >= filesize) {
-          free(optimizedBytes);
-          goto cleanup;
-        }
-
-        if (buff)
-          buff[curr] = optimizedBytes[i];
-
-        dir->ptr++;
-        curr++;
-      }
-
-      free(optimizedBytes);
-    } else {
-      getDiskBytes(bytes, BLOCK_TO_LBA(ext2, 0, blocks[i]),
-                   ext2->blockSize / SECTOR_SIZE);
 
-      for (uint32_t i = offsetStarting; i < ext2->blockSize; i++) {
-        if (curr >= limit || dir->ptr >= filesize)
-          goto cleanup;
-
-        if (buff)
-          buff[curr] = bytes[i];
-
-        dir->ptr++;
-        curr++;
+    size_t skip = dir->ptr % ext2->blockSize; // remainder
+
+    // what's written but not flushed yet is in dirty buffers
+    size_t logical = dir->ptr / ext2->blockSize;
+    size_t clean = ext2BufferCleanRun(ext2, dir->inodeNum, logical, run);
+    if (!clean) {
+      size_t len = ext2->blockSize - skip;
+      if (len > limit - curr)
+        len = limit - curr;
+      if (buff && !ext2BufferRead(ext2, dir->inodeNum, logical, skip,
+                                  buff + curr, len)) {
+        // flushed in the meantime, it's on the disk now
+        ext2OpenFdRefresh(ext2, dir);
+        continue;
       }
+      dir->ptr += len;
+      curr += len;
+      continue;
     }
-
-    // traverse
-    consecStart = -1;
-    consecEnd = 0;
+    run = clean;
+
+    size_t len = run * ext2->blockSize - skip;
+    if (len > limit - curr)
+      len = limit - curr;
+
+    if (buff && !phys) // holes read as zeroes
+      memset(buff + curr, 0, len);
+    else if (buff && sequential)
+      blockCacheReadUnaligned(ext2->disk, buff + curr,
+                              BLOCK_TO_LBA(ext2, 0, phys), skip, len);
+    else if (buff) // straight into the destination, no intermediate copies
+      getDiskBytesUnaligned(ext2->disk, buff + curr,
+                            BLOCK_TO_LBA(ext2, 0, phys), skip, len);
+
+    dir->ptr += len;
+    curr += len;
   }
 
-cleanup:
-  free(bytes);
-  free(blocks);
   // debugf("[fd:%d id:%d] read %d bytes\n", fd->id, currentTask->id, curr);
   // debugf("%d / %d\n", dir->ptr, dir->inode.size);
   return curr;
@@ -221,6 +247,7 @@ cleanup:
 
 bool ext2Seek(MountPoint *mount, OpenFile *fd, uint32_t target) {
   Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+  ext2OpenFdRefresh(EXT2_PTR(mount->fsInfo), dir);
 
   if (target > ext2GetFilesize(fd))
     return false;
@@ -230,6 +257,7 @@ bool ext2Seek(MountPoint *mount, OpenFile *fd, uint32_t target) {
 
 size_t ext2GetFilesize(OpenFile *fd) {
   Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+  ext2OpenFdRefresh(EXT2_PTR(fd->mountPoint->fsInfo), dir);
   return COMBINE_64(dir->inode.size_high, dir->inode.size);
 }
 
@@ -268,11 +296,11 @@ bool ext2Stat(Ext2 *ext2, char *filename, struct stat *target) {
   uint32_t inodeNum = ext2TraversePath(ext2, filename, EXT2_ROOT_INODE, true);
   if (!inodeNum)
     return false;
-  Ext2Inode *inode = ext2InodeFetch(ext2, inodeNum);
+  Ext2Inode *inode = ext2InodeGet(ext2, inodeNum);
 
   ext2StatInternal(inode, inodeNum, target);
 
-  free(inode);
+  ext2InodePut(ext2, inode);
   return true;
 }
 
@@ -280,16 +308,17 @@ bool ext2Lstat(Ext2 *ext2, char *filename, struct stat *target) {
   uint32_t inodeNum = ext2TraversePath(ext2, filename, EXT2_ROOT_INODE, false);
   if (!inodeNum)
     return false;
-  Ext2Inode *inode = ext2InodeFetch(ext2, inodeNum);
+  Ext2Inode *inode = ext2InodeGet(ext2, inodeNum);
 
   ext2StatInternal(inode, inodeNum, target);
 
-  free(inode);
+  ext2InodePut(ext2, inode);
   return true;
 }
 
 bool ext2StatFd(Ext2 *ext2, OpenFile *fd, struct stat *target) {
   Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+  ext2OpenFdRefresh(ext2, dir);
   ext2StatInternal(&dir->inode, dir->inodeNum, target);
   return true;
 }
@@ -306,7 +335,7 @@ int ext2Readlink(Ext2 *ext2, char *path, char *buf, int size) {
 
   int ret = -1;
 
-  Ext2Inode *inode = ext2InodeFetch(ext2, inodeNum);
+  Ext2Inode *inode = ext2InodeGet(ext2, inodeNum);
   if ((inode->permission & 0xF000) != 0xA000) {
     ret = -EINVAL;
     goto cleanup;
@@ -327,14 +356,16 @@ int ext2Readlink(Ext2 *ext2, char *path, char *buf, int size) {
   ret = toCopy;
 
 cleanup:
-  free(inode);
+  ext2InodePut(ext2, inode);
   return ret;
 }
 
 bool ext2Close(MountPoint *mount, OpenFile *fd) {
   Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
 
-  ext2BlockFetchCleanup(&dir->lookup);
+  ext2ExtentMapFree(&dir->extents);
+  // (frees it, if it was unlinked meanwhile)
+  ext2InodeClose(EXT2_PTR(mount->fsInfo), dir->inodeNum);
 
   free(fd->dir);
   return true;
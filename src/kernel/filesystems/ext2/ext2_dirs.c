@@ -7,6 +7,7 @@
 int ext2Getdents64(OpenFile *file, void *start, unsigned int hardlimit) {
   Ext2       *ext2 = EXT2_PTR(file->mountPoint->fsInfo);
   Ext2OpenFd *edir = EXT2_DIR_PTR(file->dir);
+  ext2OpenFdRefresh(ext2, edir);
 
   if ((edir->inode.permission & 0xF000) != EXT2_S_IFDIR)
     return -ENOTDIR;
@@ -20,18 +21,24 @@ int ext2Getdents64(OpenFile *file, void *start, unsigned int hardlimit) {
   int dirsAvailable = 0;
   while (true) {
     size_t block =
-        ext2BlockFetch(ext2, ino, &edir->lookup, edir->ptr / ext2->blockSize);
+        ext2ExtentLookup(ext2, edir, edir->ptr / ext2->blockSize, 0);
     if (!block)
       break;
     Ext2Directory *dir =
         (Ext2Directory *)((size_t)names + (edir->ptr % ext2->blockSize));
 
-    getDiskBytes(names, BLOCK_TO_LBA(ext2, 0, block),
-                 ext2->blockSize / SECTOR_SIZE);
+    ext2MetaRead(ext2, block, 0, names, ext2->blockSize);
 
     while (((size_t)dir - (size_t)names) < ext2->blockSize) {
       if (++dirsAvailable >= COMBINE_64(ino->size_high, ino->size))
         break;
+      if (dir->size < 8)
+        break;
+      if (!dir->inode) { // unused (or an htree node's filler)
+        edir->ptr += dir->size;
+        dir = (void *)((size_t)dir + dir->size);
+        continue;
+      }
       size_t reclen = 23 + dir->filenameLength + 1;
       if ((allocatedlimit + reclen + 2) > hardlimit)
         goto cleanup; // todo: error code special
@@ -0,0 +1,139 @@
+#include <ext2.h>
+#include <malloc.h>
+#include <system.h>
+#include <util.h>
+
+// Per open file extent map: logical blocks get resolved (and merged into
+// physically consecutive runs) a whole indirect block at a time, the first
+// time anything past the already mapped region is accessed. Lookups are then
+// a binary search over the runs, for files of any size
+// Copyright (C) 2024 Panagiotis
+
+void ext2ExtentAppend(Ext2ExtentMap *map, uint32_t physical) {
+  uint32_t logical = map->mapped++;
+
+  if (map->cnt) {
+    Ext2Extent *last = &map->extents[map->cnt - 1];
+    if ((!last->physical && !physical) ||
+        (last->physical && physical == (last->physical + last->length))) {
+      last->length++;
+      return;
+    }
+  }
+
+  if (map->cnt == map->capacity) {
+    map->capacity = map->capacity ? map->capacity * 2 : 16;
+    map->extents = (Ext2Extent *)realloc(map->extents,
+                                         map->capacity * sizeof(Ext2Extent));
+  }
+
+  Ext2Extent *extent = &map->extents[map->cnt++];
+  extent->logical = logical;
+  extent->physical = physical;
+  extent->length = 1;
+}
+
+// Maps everything up to (and including) block, if it's within the file
+void ext2ExtentMapExtend(Ext2 *ext2, Ext2OpenFd *fd, size_t block) {
+  Ext2ExtentMap *map = &fd->extents;
+  Ext2Inode     *ino = &fd->inode;
+
+  size_t total = DivRoundUp(COMBINE_64(ino->size_high, ino->size),
+                            ext2->blockSize);
+  if (!total)
+    return;
+  if (block >= total)
+    block = total - 1;
+
+  size_t    itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
+  uint32_t *leaf = 0;
+  while (map->mapped <= block) {
+    size_t curr = map->mapped;
+    if (curr < 12) {
+      ext2ExtentAppend(map, ino->blocks[curr]);
+      continue;
+    }
+
+    // find the (last level) indirect block holding curr
+    size_t   rel = curr - 12;
+    size_t   leafStart = 12;
+    uint32_t leafBlock = 0;
+    if (rel < itemsPerBlock)
+      leafBlock = ino->blocks[12];
+    else if ((rel -= itemsPerBlock) < itemsPerBlock * itemsPerBlock) {
+      leafStart += itemsPerBlock + (rel / itemsPerBlock) * itemsPerBlock;
+      leafBlock =
+          ext2IndirectFetch(ext2, ino->blocks[13], rel / itemsPerBlock);
+    } else {
+      rel -= itemsPerBlock * itemsPerBlock;
+      leafStart += itemsPerBlock + itemsPerBlock * itemsPerBlock +
+                   (rel / itemsPerBlock) * itemsPerBlock;
+      uint32_t doubly = ext2IndirectFetch(
+          ext2, ino->blocks[14], rel / (itemsPerBlock * itemsPerBlock));
+      leafBlock = ext2IndirectFetch(ext2, doubly,
+                                    (rel / itemsPerBlock) % itemsPerBlock);
+    }
+
+    if (!leaf)
+      leaf = (uint32_t *)malloc(ext2->blockSize);
+    if (leafBlock)
+      ext2MetaRead(ext2, leafBlock, 0, (uint8_t *)leaf, ext2->blockSize);
+    else // a hole all the way
+      memset(leaf, 0, ext2->blockSize);
+
+    for (size_t i = curr - leafStart; i < itemsPerBlock && map->mapped < total;
+         i++)
+      ext2ExtentAppend(map, leaf[i]);
+  }
+
+  if (leaf)
+    free(leaf);
+}
+
+// Physical block behind a logical one (0 for holes & past the end). *run (if
+// given) is set to how many blocks from there on are physically consecutive
+// (or a hole as well), as far as mapped
+uint32_t ext2ExtentLookup(Ext2 *ext2, Ext2OpenFd *fd, size_t block,
+                          size_t *run) {
+  Ext2ExtentMap *map = &fd->extents;
+  if (block >= map->mapped)
+    ext2ExtentMapExtend(ext2, fd, block);
+  if (block >= map->mapped) {
+    if (run)
+      *run = 0;
+    return 0;
+  }
+
+  // last extent starting at (or before) block
+  size_t low = 0;
+  size_t high = map->cnt - 1;
+  while (low < high) {
+    size_t mid = (low + high + 1) / 2;
+    if (map->extents[mid].logical <= block)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  Ext2Extent *extent = &map->extents[low];
+  size_t      in = block - extent->logical;
+  if (run)
+    *run = extent->length - in;
+  return extent->physical ? extent->physical + in : 0;
+}
+
+void ext2ExtentMapDuplicate(Ext2ExtentMap *target, Ext2ExtentMap *source) {
+  memcpy(target, source, sizeof(Ext2ExtentMap));
+  if (!source->capacity)
+    return;
+
+  target->extents =
+      (Ext2Extent *)malloc(source->capacity * sizeof(Ext2Extent));
+  memcpy(target->extents, source->extents, source->cnt * sizeof(Ext2Extent));
+}
+
+void ext2ExtentMapFree(Ext2ExtentMap *map) {
+  if (map->extents)
+    free(map->extents);
+  memset(map, 0, sizeof(Ext2ExtentMap));
+}
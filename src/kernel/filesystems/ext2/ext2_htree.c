@@ -0,0 +1,457 @@
+#include <ext2.h>
+#include <malloc.h>
+#include <system.h>
+#include <util.h>
+
+// Directory lookups that don't scan every block: hashed (dir_index/htree)
+// directories are searched through their index, the rest get an in-memory
+// name hash table built on the first scan
+// Copyright (C) 2024 Panagiotis
+
+#define EXT2_HTREE_DEBUG 0
+
+/* Name hashes, bit for bit the same as the ones in the reference ext2/3 */
+
+#define EXT2_HASH_ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define EXT2_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s)                                    \
+  (a += f(b, c, d) + (x), a = EXT2_HASH_ROL(a, s))
+
+#define EXT2_MD4_K1 0
+#define EXT2_MD4_K2 013240474631U
+#define EXT2_MD4_K3 015666365641U
+
+void ext2HashHalfMD4(uint32_t buf[4], uint32_t *in) {
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0] + EXT2_MD4_K1, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1] + EXT2_MD4_K1, 7);
+  EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2] + EXT2_MD4_K1, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3] + EXT2_MD4_K1, 19);
+  EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4] + EXT2_MD4_K1, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5] + EXT2_MD4_K1, 7);
+  EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6] + EXT2_MD4_K1, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7] + EXT2_MD4_K1, 19);
+
+  EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2, 5);
+  EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2, 9);
+  EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+  EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2, 5);
+  EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2, 9);
+  EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+  EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3, 9);
+  EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+  EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3, 3);
+  EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3, 9);
+  EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+  EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+void ext2HashTEA(uint32_t buf[4], uint32_t *in) {
+  uint32_t sum = 0;
+  uint32_t b0 = buf[0], b1 = buf[1];
+  uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+  for (int n = 0; n < 16; n++) {
+    sum += 0x9E3779B9;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  }
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+// The name's characters count as signed (the historical x86 default) unless
+// the filesystem says otherwise
+int ext2HashChar(char *name, size_t i, bool unsign) {
+  return unsign ? (int)(uint8_t)name[i] : (int)(int8_t)name[i];
+}
+
+uint32_t ext2HashLegacy(char *name, size_t len, bool unsign) {
+  uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  for (size_t i = 0; i < len; i++) {
+    int      c = ext2HashChar(name, i, unsign);
+    uint32_t hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+void ext2HashBuff(char *name, size_t len, uint32_t *buf, int num,
+                  bool unsign) {
+  uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+  pad |= pad << 16;
+
+  uint32_t val = pad;
+  if (len > num * 4)
+    len = num * 4;
+  for (size_t i = 0; i < len; i++) {
+    val = ext2HashChar(name, i, unsign) + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+uint32_t ext2HtreeHash(Ext2 *ext2, uint8_t version, char *name, size_t len) {
+  uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint32_t in[8];
+
+  uint32_t seed[4];
+  memcpy(seed, (void *)ext2->superblock.extended.hash_seed, sizeof(seed));
+  if (seed[0] || seed[1] || seed[2] || seed[3])
+    memcpy(buf, seed, sizeof(buf));
+
+  bool unsign = version >= EXT2_HASH_UNSIGNED;
+  if (unsign)
+    version -= EXT2_HASH_UNSIGNED;
+
+  uint32_t hash = 0;
+  switch (version) {
+  case EXT2_HASH_LEGACY:
+    hash = ext2HashLegacy(name, len, unsign);
+    break;
+  case EXT2_HASH_HALF_MD4:
+    for (size_t i = 0; i < len; i += 32) {
+      ext2HashBuff(name + i, len - i, in, 8, unsign);
+      ext2HashHalfMD4(buf, in);
+    }
+    hash = buf[1];
+    break;
+  case EXT2_HASH_TEA:
+    for (size_t i = 0; i < len; i += 16) {
+      ext2HashBuff(name + i, len - i, in, 4, unsign);
+      ext2HashTEA(buf, in);
+    }
+    hash = buf[0];
+    break;
+  }
+
+  // the lowest bit marks hash collisions in the index
+  hash &= ~1;
+  if (hash == (0x7fffffffU << 1))
+    hash = (0x7fffffffU - 1) << 1;
+  return hash;
+}
+
+/* Hashed (htree) directories */
+
+// Looks the name up in a single (linear) directory block
+bool ext2DirBlockSearch(Ext2 *ext2, uint8_t *names, char *search,
+                        size_t searchLength, uint32_t *ret) {
+  size_t offset = 0;
+  while (offset < ext2->blockSize) {
+    Ext2Directory *dir = (Ext2Directory *)(names + offset);
+    if (dir->size < 8)
+      break;
+    if (dir->inode && dir->filenameLength == searchLength &&
+        memcmp(dir->filename, search, searchLength) == 0) {
+      *ret = dir->inode;
+      return true;
+    }
+    offset += dir->size;
+  }
+  return false;
+}
+
+bool ext2DirBlockRead(Ext2 *ext2, Ext2Inode *ino, size_t logical,
+                      uint8_t *target) {
+  uint32_t block = ext2BlockFetch(ext2, ino, logical);
+  if (!block)
+    return false;
+  ext2MetaRead(ext2, block, 0, target, ext2->blockSize);
+  return true;
+}
+
+// Walks the index down to the leaf holding the name's hash. Returns false if
+// the index can't be used (so the caller has to fall back to scanning), else
+// *ret is the inode found (0 if the name doesn't exist)
+bool ext2HtreeLookup(Ext2 *ext2, Ext2Inode *ino, char *search,
+                     size_t searchLength, uint32_t *ret) {
+  bool     usable = false;
+  uint8_t *node = (uint8_t *)malloc(ext2->blockSize);
+  uint8_t *leaf = (uint8_t *)malloc(ext2->blockSize);
+  *ret = 0;
+
+  if (!ext2DirBlockRead(ext2, ino, 0, node))
+    goto cleanup;
+
+  // past the (fake) "." & ".." entries
+  Ext2HtreeRootInfo *info = (Ext2HtreeRootInfo *)(node + 24);
+  if (info->reserved_zero || info->indirect_levels >= EXT2_HTREE_LEVELS_MAX ||
+      info->hash_version > EXT2_HASH_TEA) {
+    debugf("[ext2::htree] Unsupported index! version{%d} levels{%d}\n",
+           info->hash_version, info->indirect_levels);
+    goto cleanup;
+  }
+
+  uint8_t version = info->hash_version;
+  if (ext2->superblock.extended.flags & EXT2_FLAGS_UNSIGNED_HASH)
+    version += EXT2_HASH_UNSIGNED;
+  uint32_t hash = ext2HtreeHash(ext2, version, search, searchLength);
+
+  size_t          levels = info->indirect_levels;
+  Ext2HtreeEntry *entries =
+      (Ext2HtreeEntry *)(node + 24 + info->info_length);
+  while (true) {
+    Ext2HtreeCountLimit *countLimit = (Ext2HtreeCountLimit *)entries;
+    size_t               count = countLimit->count;
+    if (!count || count > countLimit->limit) {
+      debugf("[ext2::htree] Corrupted index! count{%ld} limit{%d}\n", count,
+             countLimit->limit);
+      goto cleanup;
+    }
+
+    // last entry with a hash <= ours (the first one covers everything below)
+    size_t low = 0;
+    size_t high = count - 1;
+    while (low < high) {
+      size_t mid = (low + high + 1) / 2;
+      if (entries[mid].hash <= hash)
+        low = mid;
+      else
+        high = mid - 1;
+    }
+
+    if (levels--) {
+      if (!ext2DirBlockRead(ext2, ino, entries[low].block & 0x0FFFFFFF, node))
+        goto cleanup;
+      entries = (Ext2HtreeEntry *)(node + 8); // past the (empty) entry
+      continue;
+    }
+
+    // leaves of colliding hashes continue on the next one, marked by bit 0
+    usable = true;
+    while (true) {
+      if (!ext2DirBlockRead(ext2, ino, entries[low].block & 0x0FFFFFFF,
+                            leaf)) {
+        usable = false;
+        break;
+      }
+      if (ext2DirBlockSearch(ext2, leaf, search, searchLength, ret))
+        break;
+      if (++low >= count || entries[low].hash != (hash | 1))
+        break;
+    }
+    break;
+  }
+
+#if EXT2_HTREE_DEBUG
+  debugf("[ext2::htree] Lookup: name{%.*s} hash{%x} inode{%d}\n",
+         (int)searchLength, search, hash, *ret);
+#endif
+
+cleanup:
+  free(node);
+  free(leaf);
+  return usable;
+}
+
+/* In-memory indices of linear directories */
+
+// FNV-1a, same as the dcache's
+uint32_t ext2DirIndexHash(char *name, size_t nameLen) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < nameLen; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void ext2DirIndexFree(Ext2DirIndex *index) {
+  for (size_t i = 0; i < index->bucketsCnt; i++) {
+    Ext2DirIndexEntry *browse = index->buckets[i];
+    while (browse) {
+      Ext2DirIndexEntry *next = browse->next;
+      free(browse);
+      browse = next;
+    }
+  }
+  free(index->buckets);
+  free(index);
+}
+
+// Scans the whole directory (once), hashing every name in it
+Ext2DirIndex *ext2DirIndexBuild(Ext2 *ext2, uint32_t dirInode,
+                                Ext2Inode *ino) {
+  size_t   blocks = COMBINE_64(ino->size_high, ino->size) / ext2->blockSize;
+  uint8_t *names = (uint8_t *)malloc(ext2->blockSize);
+
+  // everything goes in a list first, so the table can be sized properly
+  Ext2DirIndexEntry *list = 0;
+  size_t             cnt = 0;
+  for (size_t i = 0; i < blocks; i++) {
+    if (!ext2DirBlockRead(ext2, ino, i, names))
+      continue;
+
+    size_t offset = 0;
+    while (offset < ext2->blockSize) {
+      Ext2Directory *dir = (Ext2Directory *)(names + offset);
+      if (dir->size < 8)
+        break;
+      offset += dir->size;
+      if (!dir->inode)
+        continue;
+
+      Ext2DirIndexEntry *entry = (Ext2DirIndexEntry *)malloc(
+          sizeof(Ext2DirIndexEntry) + dir->filenameLength);
+      entry->hash = ext2DirIndexHash(dir->filename, dir->filenameLength);
+      entry->inode = dir->inode;
+      entry->nameLen = dir->filenameLength;
+      memcpy(entry->name, dir->filename, dir->filenameLength);
+      entry->next = list;
+      list = entry;
+      cnt++;
+    }
+  }
+  free(names);
+
+  Ext2DirIndex *index = (Ext2DirIndex *)malloc(sizeof(Ext2DirIndex));
+  memset(index, 0, sizeof(Ext2DirIndex));
+  index->dirInode = dirInode;
+  index->bucketsCnt = 16;
+  while (index->bucketsCnt < cnt)
+    index->bucketsCnt *= 2;
+  index->buckets = (Ext2DirIndexEntry **)malloc(index->bucketsCnt *
+                                                sizeof(Ext2DirIndexEntry *));
+  memset(index->buckets, 0, index->bucketsCnt * sizeof(Ext2DirIndexEntry *));
+
+  while (list) {
+    Ext2DirIndexEntry *next = list->next;
+    size_t             bucket = list->hash & (index->bucketsCnt - 1);
+    list->next = index->buckets[bucket];
+    index->buckets[bucket] = list;
+    list = next;
+  }
+
+#if EXT2_HTREE_DEBUG
+  debugf("[ext2::htree] Indexed directory: inode{%d} entries{%ld}\n",
+         dirInode, cnt);
+#endif
+  return index;
+}
+
+// LOCK_DIR_INDEX has to be held
+Ext2DirIndex *ext2DirIndexFindUnsafe(Ext2 *ext2, uint32_t dirInode) {
+  Ext2DirIndex **browse = &ext2->dirIndexFirst;
+  while (*browse) {
+    Ext2DirIndex *index = *browse;
+    if (index->dirInode == dirInode) {
+      // move it to the front
+      *browse = index->next;
+      index->next = ext2->dirIndexFirst;
+      ext2->dirIndexFirst = index;
+      return index;
+    }
+    browse = &index->next;
+  }
+  return 0;
+}
+
+uint32_t ext2DirIndexSearchUnsafe(Ext2DirIndex *index, char *search,
+                                  size_t searchLength) {
+  uint32_t           hash = ext2DirIndexHash(search, searchLength);
+  Ext2DirIndexEntry *browse = index->buckets[hash & (index->bucketsCnt - 1)];
+  while (browse) {
+    if (browse->hash == hash && browse->nameLen == searchLength &&
+        memcmp(browse->name, search, searchLength) == 0)
+      return browse->inode;
+    browse = browse->next;
+  }
+  return 0;
+}
+
+uint32_t ext2DirIndexLookup(Ext2 *ext2, uint32_t dirInode, Ext2Inode *ino,
+                            char *search, size_t searchLength) {
+  spinlockAcquire(&ext2->LOCK_DIR_INDEX);
+  Ext2DirIndex *index = ext2DirIndexFindUnsafe(ext2, dirInode);
+  if (index) {
+    uint32_t ret = ext2DirIndexSearchUnsafe(index, search, searchLength);
+    spinlockRelease(&ext2->LOCK_DIR_INDEX);
+    return ret;
+  }
+  spinlockRelease(&ext2->LOCK_DIR_INDEX);
+
+  // (disk reads ahead, can't be done with the lock held)
+  uint64_t      generation = ext2->generation;
+  Ext2DirIndex *built = ext2DirIndexBuild(ext2, dirInode, ino);
+
+  spinlockAcquire(&ext2->LOCK_DIR_INDEX);
+  index = ext2DirIndexFindUnsafe(ext2, dirInode);
+  if (index) // someone beat us to it
+    ext2DirIndexFree(built);
+  else if (generation != ext2->generation) {
+    // the directory might've changed while it was being read, don't keep it
+    uint32_t ret = ext2DirIndexSearchUnsafe(built, search, searchLength);
+    spinlockRelease(&ext2->LOCK_DIR_INDEX);
+    ext2DirIndexFree(built);
+    return ret;
+  } else {
+    index = built;
+    index->next = ext2->dirIndexFirst;
+    ext2->dirIndexFirst = index;
+    ext2->dirIndexCnt++;
+  }
+  uint32_t ret = ext2DirIndexSearchUnsafe(index, search, searchLength);
+
+  // evict the least recently used one(s)
+  Ext2DirIndex *victims = 0;
+  if (ext2->dirIndexCnt > EXT2_DIR_INDEX_MAX) {
+    Ext2DirIndex *last = ext2->dirIndexFirst;
+    for (size_t i = 1; i < EXT2_DIR_INDEX_MAX; i++)
+      last = last->next;
+    victims = last->next;
+    last->next = 0;
+    ext2->dirIndexCnt = EXT2_DIR_INDEX_MAX;
+  }
+  spinlockRelease(&ext2->LOCK_DIR_INDEX);
+
+  while (victims) {
+    Ext2DirIndex *next = victims->next;
+    ext2DirIndexFree(victims);
+    victims = next;
+  }
+
+  return ret;
+}
+
+// After a directory's entries change (the generation bump keeps lookups that
+// were already reading it from caching what they saw)
+void ext2DirIndexInvalidate(Ext2 *ext2, uint32_t dirInode) {
+  ext2->generation++;
+
+  spinlockAcquire(&ext2->LOCK_DIR_INDEX);
+  Ext2DirIndex *index = ext2DirIndexFindUnsafe(ext2, dirInode);
+  if (index) {
+    ext2->dirIndexFirst = index->next; // (it was moved to the front)
+    ext2->dirIndexCnt--;
+  }
+  spinlockRelease(&ext2->LOCK_DIR_INDEX);
+
+  if (index)
+    ext2DirIndexFree(index);
+}
@@ -0,0 +1,151 @@
+#include <ext2.h>
+#include <malloc.h>
+#include <system.h>
+#include <util.h>
+
+// Inode cache: every lookup (path traversal, stat, open) used to read the
+// inode straight off the disk. Now they're kept in memory, referenced by
+// whoever uses them & recycled (LRU) once unused
+// Copyright (C) 2024 Panagiotis
+
+#define EXT2_INODE_CACHE_DEBUG 0
+
+#define EXT2_INODE_CACHED(inode)                                               \
+  ((Ext2InodeCached *)((size_t)(inode) - offsetof(Ext2InodeCached, inode)))
+
+uint32_t ext2InodeHash(uint32_t inodeNum) {
+  return inodeNum % EXT2_INODE_CACHE_BUCKETS;
+}
+
+/* LRU list helpers (LOCK_CACHE has to be held) */
+
+void ext2InodeLruRemove(Ext2InodeCache *cache, Ext2InodeCached *entry) {
+  if (entry->lruPrev)
+    entry->lruPrev->lruNext = entry->lruNext;
+  else
+    cache->lruFirst = entry->lruNext;
+  if (entry->lruNext)
+    entry->lruNext->lruPrev = entry->lruPrev;
+  else
+    cache->lruLast = entry->lruPrev;
+  entry->lruPrev = 0;
+  entry->lruNext = 0;
+}
+
+void ext2InodeLruPush(Ext2InodeCache *cache, Ext2InodeCached *entry) {
+  entry->lruPrev = 0;
+  entry->lruNext = cache->lruFirst;
+  if (cache->lruFirst)
+    cache->lruFirst->lruPrev = entry;
+  else
+    cache->lruLast = entry;
+  cache->lruFirst = entry;
+}
+
+// gets rid of the least recently used inodes nobody references
+void ext2InodeTrim(Ext2InodeCache *cache) {
+  while (cache->unused > EXT2_INODE_CACHE_MAX) {
+    Ext2InodeCached *victim = cache->lruLast;
+    ext2InodeLruRemove(cache, victim);
+
+    Ext2InodeCached **browse =
+        &cache->buckets[ext2InodeHash(victim->inodeNum)];
+    while (*browse != victim)
+      browse = &(*browse)->hashNext;
+    *browse = victim->hashNext;
+
+    cache->unused--;
+    cache->cnt--;
+    cache->evictions++;
+    free(victim);
+  }
+}
+
+// Returns a (referenced) in-memory copy of the inode, which has to be given
+// back with ext2InodePut() & should never be modified. Misses are inserted as
+// loading, so the read itself happens without LOCK_CACHE held (& others
+// asking for the same inode wait on it)
+Ext2Inode *ext2InodeGet(Ext2 *ext2, uint32_t inodeNum) {
+  Ext2InodeCache *cache = &ext2->inodeCache;
+  spinlockAcquire(&cache->LOCK_CACHE);
+
+  Ext2InodeCached *browse = cache->buckets[ext2InodeHash(inodeNum)];
+  while (browse) {
+    if (browse->inodeNum == inodeNum)
+      break;
+    browse = browse->hashNext;
+  }
+
+  if (browse) {
+    if (!browse->refs++) {
+      ext2InodeLruRemove(cache, browse);
+      cache->unused--;
+    }
+    cache->hits++;
+    spinlockRelease(&cache->LOCK_CACHE);
+    while (browse->loading)
+      asm volatile("pause");
+    return &browse->inode;
+  }
+
+  cache->misses++;
+  Ext2InodeCached *entry = (Ext2InodeCached *)malloc(sizeof(Ext2InodeCached));
+  memset(entry, 0, sizeof(Ext2InodeCached));
+  entry->inodeNum = inodeNum;
+  entry->refs = 1;
+  entry->loading = true;
+
+  uint32_t bucket = ext2InodeHash(inodeNum);
+  entry->hashNext = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  cache->cnt++;
+  spinlockRelease(&cache->LOCK_CACHE);
+
+  Ext2Inode fetched;
+  ext2InodeFetch(ext2, inodeNum, &fetched);
+
+  spinlockAcquire(&cache->LOCK_CACHE);
+  if (!entry->updated)
+    memcpy(&entry->inode, &fetched, sizeof(Ext2Inode));
+  entry->loading = false;
+  spinlockRelease(&cache->LOCK_CACHE);
+
+#if EXT2_INODE_CACHE_DEBUG
+  debugf("[ext2::inode] Cached: inode{%d} cnt{%ld}\n", inodeNum, cache->cnt);
+#endif
+  return &entry->inode;
+}
+
+void ext2InodePut(Ext2 *ext2, Ext2Inode *inode) {
+  Ext2InodeCache  *cache = &ext2->inodeCache;
+  Ext2InodeCached *entry = EXT2_INODE_CACHED(inode);
+
+  spinlockAcquire(&cache->LOCK_CACHE);
+  if (!entry->refs) {
+    debugf("[ext2::inode] Tried to put an unreferenced inode! inode{%d}\n",
+           entry->inodeNum);
+    panic();
+  }
+  if (!--entry->refs) {
+    ext2InodeLruPush(cache, entry);
+    cache->unused++;
+    ext2InodeTrim(cache);
+  }
+  spinlockRelease(&cache->LOCK_CACHE);
+}
+
+// Keeps the cached copy (if there is one) in line with what was just written
+void ext2InodeCacheUpdate(Ext2 *ext2, uint32_t inodeNum, Ext2Inode *inode) {
+  Ext2InodeCache *cache = &ext2->inodeCache;
+  spinlockAcquire(&cache->LOCK_CACHE);
+  Ext2InodeCached *browse = cache->buckets[ext2InodeHash(inodeNum)];
+  while (browse) {
+    if (browse->inodeNum == inodeNum) {
+      memcpy(&browse->inode, inode, sizeof(Ext2Inode));
+      browse->updated = browse->loading; // (the read can't overwrite it)
+      break;
+    }
+    browse = browse->hashNext;
+  }
+  spinlockRelease(&cache->LOCK_CACHE);
+}
@@ -5,68 +5,37 @@
 #include <timer.h>
 #include <util.h>
 
-Ext2Inode *ext2InodeFetch(Ext2 *ext2, size_t inode) {
+// Reads an inode off the disk, use ext2InodeGet() instead (cached)
+void ext2InodeFetch(Ext2 *ext2, size_t inode, Ext2Inode *target) {
   uint32_t group = INODE_TO_BLOCK_GROUP(ext2, inode);
   uint32_t index = INODE_TO_INDEX(ext2, inode);
 
-  size_t leftovers = index * ext2->inodeSize;
-  size_t leftoversLba = leftovers / SECTOR_SIZE;
-  size_t leftoversRem = leftovers % SECTOR_SIZE;
-
-  // large enough just in case
-  size_t len = DivRoundUp(ext2->inodeSize * 4, SECTOR_SIZE) * SECTOR_SIZE;
-  size_t lba =
-      BLOCK_TO_LBA(ext2, 0, ext2->bgdts[group].inode_table) + leftoversLba;
-
-  uint8_t *buf = (uint8_t *)malloc(len);
-  getDiskBytes(buf, lba, len / SECTOR_SIZE);
-  Ext2Inode *tmp = (Ext2Inode *)(buf + leftoversRem);
-
-  Ext2Inode *ret = (Ext2Inode *)malloc(ext2->inodeSize);
-  memcpy(ret, tmp, ext2->inodeSize);
-
-  free(buf);
-  return ret;
+  // (through the inode table's dirty buffer, if it's got one)
+  size_t offset = index * ext2->inodeSize;
+  ext2MetaRead(ext2,
+               ext2->bgdts[group].inode_table + offset / ext2->blockSize,
+               offset % ext2->blockSize, (uint8_t *)target, sizeof(Ext2Inode));
 }
 
 uint32_t ext2Traverse(Ext2 *ext2, size_t initInode, char *search,
                       size_t searchLength) {
-  uint32_t   ret = 0;
-  Ext2Inode *ino = ext2InodeFetch(ext2, initInode);
-  uint8_t   *names = (uint8_t *)malloc(ext2->blockSize);
-
-  Ext2LookupControl control = {0};
-  size_t            blockNum = 0;
-
-  ext2BlockFetchInit(ext2, &control);
+  uint64_t generation = fsDcacheGeneration();
+  uint64_t cached = 0;
+  if (fsDcacheLookup(ext2, initInode, search, searchLength, &cached))
+    return cached;
 
-  int dirsAvailable = 0;
-  while (true) {
-    size_t block = ext2BlockFetch(ext2, ino, &control, blockNum);
-    blockNum++;
-    if (!block)
-      break;
-    Ext2Directory *dir = (Ext2Directory *)names;
-
-    getDiskBytes(names, BLOCK_TO_LBA(ext2, 0, block),
-                 ext2->blockSize / SECTOR_SIZE);
-
-    while (((size_t)dir - (size_t)names) < ext2->blockSize) {
-      if (++dirsAvailable >= COMBINE_64(ino->size_high, ino->size))
-        break;
-      if (dir->filenameLength == searchLength &&
-          memcmp(dir->filename, search, searchLength) == 0) {
-        ret = dir->inode;
-        goto cleanup;
-      }
-      dir = (void *)((size_t)dir + dir->size);
-    }
-  }
-
-cleanup:
-  ext2BlockFetchCleanup(&control);
-  free(ino);
-  free(names);
+  // hashed directories are looked up through their index, everything else
+  // (or indices we can't make sense of) through an in-memory name table
+  uint32_t   ret = 0;
+  Ext2Inode *ino = ext2InodeGet(ext2, initInode);
+  if (!(ino->flags & EXT2_INDEX_FL) ||
+      !(ext2->superblock.extended.optional_feature & EXT2_O_F_DIR_INDEX) ||
+      !ext2HtreeLookup(ext2, ino, search, searchLength, &ret))
+    ret = ext2DirIndexLookup(ext2, initInode, ino, search, searchLength);
+  ext2InodePut(ext2, ino);
+
+  // (even if it wasn't found)
+  fsDcacheInsert(ext2, initInode, search, searchLength, ret, generation);
   return ret;
 }
 
@@ -92,26 +61,26 @@ uint32_t ext2TraversePath(Ext2 *ext2, char *path, size_t initInode,
       if (!curr)
         return curr;
 
-      Ext2Inode *inode = ext2InodeFetch(ext2, curr);
+      Ext2Inode *inode = ext2InodeGet(ext2, curr);
       if ((inode->permission & 0xF000) == EXT2_S_IFLNK && (!last || follow)) {
         if (inode->size > 60) {
           debugf("[ext2::traverse::symlink] Todo! size{%d}\n", inode->size);
-          free(inode);
+          ext2InodePut(ext2, inode);
           return 0;
         }
+        // the (cached) inode can't be touched, so work on a copy
+        char  link[62] = {0};
         char *start = (char *)inode->blocks;
         if (start[0] != '/') {
-          // overriding but we won't need it anyways
-          start = (char *)((size_t)inode->blocks - 1);
-          start[0] = '/';
-          start[inode->size + 1] = 0;
-          curr = ext2TraversePath(ext2, start, prev, true); // recursion
+          link[0] = '/';
+          memcpy(link + 1, start, inode->size);
+          curr = ext2TraversePath(ext2, link, prev, true); // recursion
         } else {
-          start[inode->size] = 0;
-          curr = ext2TraversePath(ext2, start, EXT2_ROOT_INODE, true);
+          memcpy(link, start, inode->size);
+          curr = ext2TraversePath(ext2, link, EXT2_ROOT_INODE, true);
         }
       }
-      free(inode);
+      ext2InodePut(ext2, inode);
 
       // return fail or last's success
       if (!curr || i == (len - 1))
@@ -5,9 +5,8 @@
 
 // *tmp has to be of blockSizeRounded
 void ext2BlkIdBitmapFetch(Ext2 *ext2, uint8_t *tmp, size_t group) {
-  // group is 0, because it's NOT relative, it's ABSOLUTE!
-  getDiskBytes(tmp, BLOCK_TO_LBA(ext2, 0, ext2->bgdts[group].block_bitmap),
-               ext2->blockSize / SECTOR_SIZE);
+  // (it might not be written back yet)
+  ext2MetaRead(ext2, ext2->bgdts[group].block_bitmap, 0, tmp, ext2->blockSize);
 }
 
 bool ext2BlkIdBitmapGet(Ext2 *ext2, uint8_t *tmp, size_t index) {
@@ -18,75 +17,39 @@ bool ext2BlkIdBitmapGet(Ext2 *ext2, uint8_t *tmp, size_t index) {
   return ret;
 }
 
-void ext2BlockFetchInit(Ext2 *ext2, Ext2LookupControl *control) {
-  control->tmp1 = (uint32_t *)malloc(ext2->blockSize);
-  control->tmp2 = (uint32_t *)malloc(ext2->blockSize);
-}
+// Entry index of an indirect block (through the block cache, no thrashing on
+// whatever the previous lookup needed)
+uint32_t ext2IndirectFetch(Ext2 *ext2, uint32_t block, size_t index) {
+  if (!block)
+    return 0;
 
-void ext2BlockFetchCleanup(Ext2LookupControl *control) {
-  if (control->tmp1)
-    free(control->tmp1);
-  if (control->tmp2)
-    free(control->tmp2);
-  control->tmp1Block = 0;
-  control->tmp2Block = 0;
+  uint32_t ret = 0;
+  ext2MetaRead(ext2, block, index * sizeof(uint32_t), (uint8_t *)&ret,
+               sizeof(uint32_t));
+  return ret;
 }
 
-uint32_t ext2BlockFetch(Ext2 *ext2, Ext2Inode *ino, Ext2LookupControl *control,
-                        size_t curr) {
-  uint32_t itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
-  size_t   baseSingly = 12 + itemsPerBlock;
-  size_t   baseDoubly = baseSingly + ext2->blockSize * itemsPerBlock;
+// Physical block behind a file's logical one (0 for holes), the slow way
+uint32_t ext2BlockFetch(Ext2 *ext2, Ext2Inode *ino, size_t curr) {
+  size_t itemsPerBlock = ext2->blockSize / sizeof(uint32_t);
   if (curr < 12)
     return ino->blocks[curr];
-  else if (curr < baseSingly) {
-    if (!ino->blocks[12])
-      return 0;
-    size_t tmp1block = BLOCK_TO_LBA(ext2, 0, ino->blocks[12]);
-    if (control->tmp1Block != tmp1block) {
-      control->tmp1Block = tmp1block;
-      // control->tmp1 = (uint32_t *)malloc(ext2->blockSize);
-      getDiskBytes((void *)control->tmp1, tmp1block,
-                   ext2->blockSize / SECTOR_SIZE);
-    }
-    return control->tmp1[curr - 12];
-  } else if (curr < baseDoubly) {
-    if (!ino->blocks[13])
-      return 0;
-    size_t tmp1block = BLOCK_TO_LBA(ext2, 0, ino->blocks[13]);
-    if (control->tmp1Block != tmp1block) {
-      control->tmp1Block = tmp1block;
-      // control->tmp2 = (uint32_t *)malloc(ext2->blockSize);
-      getDiskBytes((void *)control->tmp1, tmp1block,
-                   ext2->blockSize / SECTOR_SIZE);
-    }
+  curr -= 12;
 
-    size_t   at = curr - baseSingly;
-    uint32_t index = at / itemsPerBlock;
-    uint32_t rem = at % itemsPerBlock;
-    size_t   tmp2block = BLOCK_TO_LBA(ext2, 0, control->tmp1[index]);
-    if (!control->tmp1[index])
-      return 0;
-    if (control->tmp2Block != tmp2block) {
-      control->tmp2Block = tmp2block;
-      getDiskBytes((void *)control->tmp2, tmp2block,
-                   ext2->blockSize / SECTOR_SIZE);
-    }
-    return control->tmp2[rem];
-  }
+  if (curr < itemsPerBlock)
+    return ext2IndirectFetch(ext2, ino->blocks[12], curr);
+  curr -= itemsPerBlock;
 
-  debugf("[ext2] TODO! Triply Indirect Block Pointer!\n");
-  panic();
-  return 0;
-}
-
-uint32_t *ext2BlockChain(Ext2 *ext2, Ext2OpenFd *fd, size_t curr,
-                         size_t blocks) {
-  uint32_t *ret = (uint32_t *)malloc((1 + blocks) * sizeof(uint32_t));
-  for (int i = 0; i < (1 + blocks); i++) // will take care of curr too
-  {
-    ret[i] = ext2BlockFetch(ext2, &fd->inode, &fd->lookup, curr);
-    curr++;
+  if (curr < itemsPerBlock * itemsPerBlock) {
+    uint32_t singly =
+        ext2IndirectFetch(ext2, ino->blocks[13], curr / itemsPerBlock);
+    return ext2IndirectFetch(ext2, singly, curr % itemsPerBlock);
   }
-  return ret;
+  curr -= itemsPerBlock * itemsPerBlock;
+
+  uint32_t doubly = ext2IndirectFetch(ext2, ino->blocks[14],
+                                      curr / (itemsPerBlock * itemsPerBlock));
+  uint32_t singly = ext2IndirectFetch(
+      ext2, doubly, (curr / itemsPerBlock) % itemsPerBlock);
+  return ext2IndirectFetch(ext2, singly, curr % itemsPerBlock);
 }
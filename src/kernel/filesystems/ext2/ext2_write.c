@@ -0,0 +1,528 @@
+#include <block_cache.h>
+#include <ext2.h>
+#include <linked_list.h>
+#include <malloc.h>
+#include <page_cache.h>
+#include <string.h>
+#include <system.h>
+#include <timer.h>
+#include <util.h>
+
+// Writing, creating, truncating & unlinking (regular) files. All of it lands
+// in dirty buffers under LOCK_WRITE, file data without any blocks allocated
+// for it till it's flushed
+// Copyright (C) 2024 Panagiotis
+
+#define EXT2_DIR_REC_LEN(nameLen) ((8 + (nameLen) + 3) & ~3)
+
+uint32_t ext2Time() { return timerTicks / 1000; }
+
+// (the cached one can't be modified)
+void ext2InodeCopy(Ext2 *ext2, uint32_t inodeNum, Ext2Inode *target) {
+  Ext2Inode *inode = ext2InodeGet(ext2, inodeNum);
+  memcpy(target, inode, sizeof(Ext2Inode));
+  ext2InodePut(ext2, inode);
+}
+
+// Writes an inode back (into its inode table block) & updates the cached copy
+// everyone else sees
+void ext2InodeStore(Ext2 *ext2, uint32_t inodeNum, Ext2Inode *inode) {
+  uint32_t group = INODE_TO_BLOCK_GROUP(ext2, inodeNum);
+  size_t   offset = INODE_TO_INDEX(ext2, inodeNum) * ext2->inodeSize;
+  uint32_t block = ext2->bgdts[group].inode_table + offset / ext2->blockSize;
+
+  uint8_t *data = ext2BufferGet(ext2, 0, block, block, true);
+  memcpy(data + offset % ext2->blockSize, inode, sizeof(Ext2Inode));
+  ext2InodeCacheUpdate(ext2, inodeNum, inode);
+}
+
+// Splits a path into its parent directory (returned) & last component
+uint32_t ext2PathParent(Ext2 *ext2, char *path, char **name,
+                        size_t *nameLen) {
+  size_t len = strlength(path);
+  while (len > 1 && path[len - 1] == '/')
+    len--;
+  size_t start = len;
+  while (start && path[start - 1] != '/')
+    start--;
+
+  *name = path + start;
+  *nameLen = len - start;
+  if (!*nameLen || *nameLen > 255)
+    return 0;
+  if (start <= 1)
+    return EXT2_ROOT_INODE;
+
+  char *parentPath = (char *)malloc(start);
+  memcpy(parentPath, path, start - 1);
+  parentPath[start - 1] = '\0';
+  uint32_t parent = ext2TraversePath(ext2, parentPath, EXT2_ROOT_INODE, true);
+  free(parentPath);
+  if (!parent)
+    return 0;
+
+  Ext2Inode *inode = ext2InodeGet(ext2, parent);
+  if ((inode->permission & 0xF000) != EXT2_S_IFDIR)
+    parent = 0;
+  ext2InodePut(ext2, inode);
+  return parent;
+}
+
+// Links a name to an inode: in the first gap big enough for it, or a newly
+// appended block. An htree directory's index doesn't know about it, so it's
+// turned into a plain one (just like any other ext2 implementation would)
+bool ext2DirAdd(Ext2 *ext2, uint32_t dirInode, char *name, size_t nameLen,
+                uint32_t inode, uint8_t type) {
+  Ext2Inode dir;
+  ext2InodeCopy(ext2, dirInode, &dir);
+
+  size_t         needed = EXT2_DIR_REC_LEN(nameLen);
+  size_t         blocks = COMBINE_64(dir.size_high, dir.size) / ext2->blockSize;
+  uint8_t       *scan = (uint8_t *)malloc(ext2->blockSize);
+  Ext2Directory *entry = 0;
+  for (size_t i = 0; i < blocks && !entry; i++) {
+    uint32_t physical = ext2BlockFetch(ext2, &dir, i);
+    if (!physical)
+      continue;
+    ext2MetaRead(ext2, physical, 0, scan, ext2->blockSize);
+
+    size_t offset = 0;
+    while (offset < ext2->blockSize) {
+      Ext2Directory *curr = (Ext2Directory *)(scan + offset);
+      if (curr->size < 8)
+        break;
+      size_t used = curr->inode ? EXT2_DIR_REC_LEN(curr->filenameLength) : 0;
+      if ((curr->size - used) >= needed) {
+        uint8_t *data = ext2BufferGet(ext2, 0, physical, physical, true);
+        entry = (Ext2Directory *)(data + offset);
+        if (used) { // split it
+          Ext2Directory *split = (Ext2Directory *)(data + offset + used);
+          split->size = entry->size - used;
+          entry->size = used;
+          entry = split;
+        }
+        break;
+      }
+      offset += curr->size;
+    }
+  }
+  free(scan);
+
+  if (!entry) {
+    uint32_t last = blocks ? ext2BlockFetch(ext2, &dir, blocks - 1) : 0;
+    uint32_t physical = ext2BlockAllocate(ext2, last ? last + 1 : 0);
+    if (!physical)
+      return false;
+    ext2BlockMapSet(ext2, &dir, blocks, physical);
+    dir.num_sectors += ext2->blockSize / SECTOR_SIZE;
+    dir.size += ext2->blockSize;
+
+    entry = (Ext2Directory *)ext2BufferGet(ext2, 0, physical, physical, false);
+    entry->size = ext2->blockSize;
+  }
+
+  entry->inode = inode;
+  entry->filenameLength = nameLen;
+  entry->type = type;
+  memcpy(entry->filename, name, nameLen);
+
+  dir.flags &= ~EXT2_INDEX_FL;
+  dir.mtime = dir.ctime = ext2Time();
+  ext2InodeStore(ext2, dirInode, &dir);
+  ext2DirIndexInvalidate(ext2, dirInode);
+  fsDcacheInvalidate(ext2, dirInode, name, nameLen);
+  return true;
+}
+
+// Unlinks a name (merging its entry into the previous one), returns its inode
+uint32_t ext2DirRemove(Ext2 *ext2, uint32_t dirInode, char *name,
+                       size_t nameLen) {
+  Ext2Inode dir;
+  ext2InodeCopy(ext2, dirInode, &dir);
+
+  size_t   blocks = COMBINE_64(dir.size_high, dir.size) / ext2->blockSize;
+  uint8_t *scan = (uint8_t *)malloc(ext2->blockSize);
+  uint32_t ret = 0;
+  for (size_t i = 0; i < blocks && !ret; i++) {
+    uint32_t physical = ext2BlockFetch(ext2, &dir, i);
+    if (!physical)
+      continue;
+    ext2MetaRead(ext2, physical, 0, scan, ext2->blockSize);
+
+    size_t offset = 0;
+    size_t prev = 0;
+    while (offset < ext2->blockSize) {
+      Ext2Directory *curr = (Ext2Directory *)(scan + offset);
+      if (curr->size < 8)
+        break;
+      if (curr->inode && curr->filenameLength == nameLen &&
+          memcmp(curr->filename, name, nameLen) == 0) {
+        uint8_t       *data = ext2BufferGet(ext2, 0, physical, physical, true);
+        Ext2Directory *target = (Ext2Directory *)(data + offset);
+        ret = target->inode;
+        if (offset)
+          ((Ext2Directory *)(data + prev))->size += target->size;
+        else // first one of the block
+          target->inode = 0;
+        break;
+      }
+      prev = offset;
+      offset += curr->size;
+    }
+  }
+  free(scan);
+
+  if (!ret)
+    return 0;
+
+  dir.mtime = dir.ctime = ext2Time();
+  ext2InodeStore(ext2, dirInode, &dir);
+  ext2DirIndexInvalidate(ext2, dirInode);
+  fsDcacheInvalidate(ext2, dirInode, name, nameLen);
+  return ret;
+}
+
+// A block a write only partly covers, read in before LOCK_WRITE is taken
+typedef struct Ext2WritePrefill {
+  size_t   logical;
+  uint32_t physical; // 0 if nothing was read (hole, or a dirty buffer's there)
+  uint8_t *data;
+} Ext2WritePrefill;
+
+void ext2WritePrefillBlock(Ext2 *ext2, uint32_t inodeNum, size_t logical,
+                           Ext2WritePrefill *target) {
+  target->logical = logical;
+  target->physical = 0;
+  if (!ext2BufferCleanRun(ext2, inodeNum, logical, 1))
+    return;
+
+  Ext2Inode inode;
+  ext2InodeCopy(ext2, inodeNum, &inode);
+  uint32_t physical = ext2BlockFetch(ext2, &inode, logical);
+  if (!physical)
+    return;
+  blockCacheRead(ext2->disk, target->data, BLOCK_TO_LBA(ext2, 0, physical),
+                 ext2->blockSize / SECTOR_SIZE);
+  target->physical = physical;
+}
+
+// Reads the first & last blocks of a write of cnt bytes at offset, if they're
+// only partly overwritten (the disk reads & block map lookups of
+// ext2BufferGet() would otherwise happen with LOCK_WRITE held)
+void ext2WritePrefill(Ext2 *ext2, uint32_t inodeNum, size_t offset, size_t cnt,
+                      Ext2WritePrefill *prefill) {
+  size_t first = offset / ext2->blockSize;
+  size_t last = (offset + cnt - 1) / ext2->blockSize;
+  prefill[0].physical = prefill[1].physical = 0;
+  if (offset % ext2->blockSize || (first == last && cnt < ext2->blockSize))
+    ext2WritePrefillBlock(ext2, inodeNum, first, &prefill[0]);
+  if (last != first && (offset + cnt) % ext2->blockSize)
+    ext2WritePrefillBlock(ext2, inodeNum, last, &prefill[1]);
+}
+
+// What was read for a block (if it's still what's behind it)
+uint8_t *ext2WritePrefilled(Ext2WritePrefill *prefill, size_t logical,
+                            uint32_t physical) {
+  for (int i = 0; i < 2; i++) {
+    if (physical && prefill[i].physical == physical &&
+        prefill[i].logical == logical)
+      return prefill[i].data;
+  }
+  return 0;
+}
+
+int ext2Write(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit) {
+  Ext2       *ext2 = EXT2_PTR(mount->fsInfo);
+  Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+
+  uint16_t type = dir->inode.permission & 0xF000;
+  if (type == EXT2_S_IFDIR)
+    return -EISDIR;
+  if (type != EXT2_S_IFREG)
+    return -EINVAL;
+  if (limit <= 0)
+    return 0;
+
+  // user memory is copied in before LOCK_WRITE (its fault might have to read
+  // this very file), a bounded chunk at a time
+  size_t           chunk = limit < EXT2_WRITE_CHUNK ? limit : EXT2_WRITE_CHUNK;
+  uint8_t         *bounce = (uint8_t *)malloc(chunk);
+  Ext2WritePrefill prefill[2];
+  prefill[0].data = (uint8_t *)malloc(ext2->blockSize * 2);
+  prefill[1].data = prefill[0].data + ext2->blockSize;
+  int curr = 0;
+  while (curr < limit) {
+    size_t cnt = limit - curr;
+    if (cnt > chunk)
+      cnt = chunk;
+    memcpy(bounce, buff + curr, cnt);
+
+    // (appends only learn where they land under the lock, so they guess)
+    uint64_t seq = ext2->dirtySeq;
+    size_t   offset = dir->ptr;
+    if (fd->flags & O_APPEND) {
+      Ext2Inode *cached = ext2InodeGet(ext2, dir->inodeNum);
+      offset = COMBINE_64(cached->size_high, cached->size);
+      ext2InodePut(ext2, cached);
+    }
+    ext2WritePrefill(ext2, dir->inodeNum, offset, cnt, prefill);
+
+    spinlockAcquire(&ext2->LOCK_WRITE);
+    // no buffer was touched meanwhile, so what was read is still current
+    bool prefilled = seq == ext2->dirtySeq;
+    ext2OpenFdRefresh(ext2, dir);
+
+    Ext2Inode inode;
+    ext2InodeCopy(ext2, dir->inodeNum, &inode);
+    size_t size = COMBINE_64(inode.size_high, inode.size);
+    if (fd->flags & O_APPEND)
+      dir->ptr = size;
+
+    size_t done = 0;
+    while (done < cnt) {
+      size_t logical = dir->ptr / ext2->blockSize;
+      size_t skip = dir->ptr % ext2->blockSize;
+      size_t len = ext2->blockSize - skip;
+      if (len > cnt - done)
+        len = cnt - done;
+
+      // only what's not overwritten as a whole has to be read first
+      uint32_t physical = ext2BlockFetch(ext2, &inode, logical);
+      if (!physical && !ext2BufferReserve(ext2, dir->inodeNum, logical))
+        break; // out of space
+      bool     partial = len != ext2->blockSize;
+      bool     fill = partial && logical * ext2->blockSize < size;
+      uint8_t *contents =
+          fill && prefilled ? ext2WritePrefilled(prefill, logical, physical)
+                            : 0;
+      uint8_t *data = ext2BufferGetFrom(ext2, dir->inodeNum, logical,
+                                        physical, fill, contents);
+      memcpy(data + skip, bounce + done, len);
+
+      dir->ptr += len;
+      done += len;
+    }
+
+    bool grown = dir->ptr > size;
+    if (grown) {
+      inode.size = dir->ptr & 0xFFFFFFFF;
+      inode.size_high = dir->ptr >> 32;
+    }
+    inode.mtime = inode.ctime = ext2Time();
+    ext2InodeStore(ext2, dir->inodeNum, &inode);
+    memcpy(&dir->inode, &inode, sizeof(Ext2Inode));
+    if (grown) // (the extent map only covers the old size)
+      ext2->generation++;
+    spinlockRelease(&ext2->LOCK_WRITE);
+
+    curr += done;
+    if (done < cnt)
+      break;
+  }
+  free(bounce);
+  free(prefill[0].data);
+
+  if (ext2->dirtyCnt > EXT2_DIRTY_MAX)
+    ext2Flush(ext2);
+
+  // whatever's mapped has to be read in again
+  pageCacheInvalidate(mount, dir->inodeNum);
+  return curr ? curr : -ENOSPC;
+}
+
+int ext2Truncate(MountPoint *mount, OpenFile *fd, size_t length) {
+  Ext2       *ext2 = EXT2_PTR(mount->fsInfo);
+  Ext2OpenFd *dir = EXT2_DIR_PTR(fd->dir);
+
+  uint16_t type = dir->inode.permission & 0xF000;
+  if (type == EXT2_S_IFDIR)
+    return -EISDIR;
+  if (type != EXT2_S_IFREG)
+    return -EINVAL;
+
+  spinlockAcquire(&ext2->LOCK_WRITE);
+  Ext2Inode inode;
+  ext2InodeCopy(ext2, dir->inodeNum, &inode);
+  size_t size = COMBINE_64(inode.size_high, inode.size);
+
+  if (length < size) {
+    size_t keep = DivRoundUp(length, ext2->blockSize);
+    ext2BufferForget(ext2, dir->inodeNum, keep);
+    ext2BlocksRelease(ext2, &inode, keep);
+
+    // the rest of the last block has to read as zeroes if it grows again
+    size_t   tail = length % ext2->blockSize;
+    size_t   logical = length / ext2->blockSize;
+    uint32_t physical = ext2BlockFetch(ext2, &inode, logical);
+    if (tail &&
+        (physical || !ext2BufferCleanRun(ext2, dir->inodeNum, logical, 1))) {
+      uint8_t *data =
+          ext2BufferGet(ext2, dir->inodeNum, logical, physical, true);
+      memset(data + tail, 0, ext2->blockSize - tail);
+    }
+  }
+
+  inode.size = length & 0xFFFFFFFF;
+  inode.size_high = length >> 32;
+  inode.mtime = inode.ctime = ext2Time();
+  ext2InodeStore(ext2, dir->inodeNum, &inode);
+  ext2->generation++;
+  spinlockRelease(&ext2->LOCK_WRITE);
+
+  pageCacheInvalidate(mount, dir->inodeNum);
+  return 0;
+}
+
+// Creates an (empty) regular file, returns its inode (or the existing one's)
+uint32_t ext2Create(MountPoint *mount, char *path, int mode) {
+  Ext2 *ext2 = EXT2_PTR(mount->fsInfo);
+
+  char    *name = 0;
+  size_t   nameLen = 0;
+  uint32_t parent = ext2PathParent(ext2, path, &name, &nameLen);
+  if (!parent)
+    return 0;
+
+  spinlockAcquire(&ext2->LOCK_WRITE);
+  // (someone could've beaten us to it)
+  uint32_t inodeNum = ext2Traverse(ext2, parent, name, nameLen);
+  if (inodeNum)
+    goto cleanup;
+
+  inodeNum = ext2InodeAllocate(ext2, parent, false);
+  if (!inodeNum)
+    goto cleanup;
+
+  Ext2Inode inode = {0};
+  inode.permission = EXT2_S_IFREG | ((mode & 07777) ? (mode & 07777) : 0644);
+  inode.hard_links = 1;
+  inode.atime = inode.ctime = inode.mtime = ext2Time();
+  ext2InodeStore(ext2, inodeNum, &inode);
+
+  if (!ext2DirAdd(ext2, parent, name, nameLen, inodeNum, EXT2_FT_REG_FILE)) {
+    ext2InodeFree(ext2, inodeNum, false);
+    inodeNum = 0;
+  }
+
+cleanup:
+  spinlockRelease(&ext2->LOCK_WRITE);
+  return inodeNum;
+}
+
+// Frees an inode with no links left, along with its blocks (LOCK_WRITE has to
+// be held)
+void ext2InodeDelete(Ext2 *ext2, uint32_t inodeNum) {
+  Ext2Inode inode;
+  ext2InodeCopy(ext2, inodeNum, &inode);
+  uint16_t type = inode.permission & 0xF000;
+
+  ext2BufferForget(ext2, inodeNum, 0);
+  // (fast symlinks keep their target where the block pointers would be)
+  if (type != EXT2_S_IFLNK || inode.num_sectors)
+    ext2BlocksRelease(ext2, &inode, 0);
+  inode.size = 0;
+  inode.size_high = 0;
+  inode.dtime = ext2Time();
+  ext2InodeFree(ext2, inodeNum, false);
+  ext2InodeStore(ext2, inodeNum, &inode);
+  ext2->generation++;
+}
+
+// LOCK_OPEN_INODES has to be held
+Ext2OpenInode *ext2OpenInodeFindUnsafe(Ext2 *ext2, uint32_t inode) {
+  Ext2OpenInode *browse = ext2->openInodes;
+  while (browse) {
+    if (browse->inode == inode)
+      return browse;
+    browse = browse->next;
+  }
+  return 0;
+}
+
+void ext2InodeOpen(Ext2 *ext2, uint32_t inode) {
+  spinlockAcquire(&ext2->LOCK_OPEN_INODES);
+  Ext2OpenInode *open = ext2OpenInodeFindUnsafe(ext2, inode);
+  if (!open) {
+    open = (Ext2OpenInode *)malloc(sizeof(Ext2OpenInode));
+    memset(open, 0, sizeof(Ext2OpenInode));
+    open->inode = inode;
+    open->next = ext2->openInodes;
+    ext2->openInodes = open;
+  }
+  open->opens++;
+  spinlockRelease(&ext2->LOCK_OPEN_INODES);
+}
+
+void ext2InodeClose(Ext2 *ext2, uint32_t inode) {
+  spinlockAcquire(&ext2->LOCK_OPEN_INODES);
+  Ext2OpenInode *open = ext2OpenInodeFindUnsafe(ext2, inode);
+  if (!open || --open->opens) {
+    spinlockRelease(&ext2->LOCK_OPEN_INODES);
+    return;
+  }
+  LinkedListUnregister((void **)&ext2->openInodes, open);
+  spinlockRelease(&ext2->LOCK_OPEN_INODES);
+
+  if (open->orphan) {
+    spinlockAcquire(&ext2->LOCK_WRITE);
+    ext2InodeDelete(ext2, inode);
+    spinlockRelease(&ext2->LOCK_WRITE);
+  }
+  free(open);
+}
+
+// The name goes away right away, the inode (if that was its last link) only
+// once nothing has it open anymore, just like on any other unix
+int ext2Unlink(MountPoint *mount, char *path) {
+  Ext2 *ext2 = EXT2_PTR(mount->fsInfo);
+
+  char    *name = 0;
+  size_t   nameLen = 0;
+  uint32_t parent = ext2PathParent(ext2, path, &name, &nameLen);
+  if (!parent)
+    return -ENOENT;
+
+  int ret = 0;
+  spinlockAcquire(&ext2->LOCK_WRITE);
+  uint32_t inodeNum = ext2Traverse(ext2, parent, name, nameLen);
+  if (!inodeNum) {
+    ret = -ENOENT;
+    goto cleanup;
+  }
+
+  Ext2Inode inode;
+  ext2InodeCopy(ext2, inodeNum, &inode);
+  if ((inode.permission & 0xF000) == EXT2_S_IFDIR) {
+    ret = -EISDIR;
+    goto cleanup;
+  }
+
+  ext2DirRemove(ext2, parent, name, nameLen);
+  inode.ctime = ext2Time();
+  if (inode.hard_links)
+    inode.hard_links--;
+  ext2InodeStore(ext2, inodeNum, &inode);
+  ext2->generation++;
+
+  if (!inode.hard_links) {
+    spinlockAcquire(&ext2->LOCK_OPEN_INODES);
+    Ext2OpenInode *open = ext2OpenInodeFindUnsafe(ext2, inodeNum);
+    if (open)
+      open->orphan = true;
+    spinlockRelease(&ext2->LOCK_OPEN_INODES);
+    if (!open)
+      ext2InodeDelete(ext2, inodeNum);
+  }
+
+cleanup:
+  spinlockRelease(&ext2->LOCK_WRITE);
+  // (a page cache that isn't mapped anywhere would keep it open forever)
+  if (!ret)
+    pageCacheInvalidate(mount, inodeNum);
+  return ret;
+}
+
+bool ext2Sync(MountPoint *mount) {
+  ext2Flush(EXT2_PTR(mount->fsInfo));
+  return true;
+}
@@ -0,0 +1,422 @@
+#include <block_cache.h>
+#include <disk.h>
+#include <ext2.h>
+#include <malloc.h>
+#include <system.h>
+#include <task.h>
+#include <timer.h>
+#include <util.h>
+
+// Dirty buffers & their writeback: every modification stays in memory (where
+// ext2 reads look first) till it's flushed. Flushing allocates the blocks of
+// file data written since the last one, then writes everything out sorted by
+// block, with physically consecutive buffers going out in a single request
+// Copyright (C) 2024 Panagiotis
+
+#define EXT2_WRITEBACK_DEBUG 0
+
+uint32_t ext2BufferHash(uint32_t inode, uint32_t block) {
+  return (block ^ (inode * 0x9e3779b1)) % EXT2_DIRTY_BUCKETS;
+}
+
+// LOCK_DIRTY has to be held
+Ext2Buffer *ext2BufferFindUnsafe(Ext2 *ext2, uint32_t inode, uint32_t block) {
+  Ext2Buffer *browse = ext2->dirty[ext2BufferHash(inode, block)];
+  while (browse) {
+    if (browse->inode == inode && browse->block == block)
+      return browse;
+    browse = browse->next;
+  }
+  return 0;
+}
+
+// Dirty buffer of a metadata (inode 0) or file data block, created if there
+// isn't one yet: copied from contents (if given), filled from the disk (if
+// fill is set & there's a physical block behind it) or zeroed. New
+// unallocated data buffers take up one of the reserved blocks (see
+// ext2BufferReserve()). LOCK_WRITE has to be held, which is also what keeps
+// the buffer around
+uint8_t *ext2BufferGetFrom(Ext2 *ext2, uint32_t inode, uint32_t block,
+                           uint32_t physical, bool fill, uint8_t *contents) {
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  Ext2Buffer *buffer = ext2BufferFindUnsafe(ext2, inode, block);
+  if (buffer)
+    buffer->seq = ++ext2->dirtySeq;
+  spinlockRelease(&ext2->LOCK_DIRTY);
+  if (buffer)
+    return buffer->data;
+
+  buffer = (Ext2Buffer *)malloc(sizeof(Ext2Buffer));
+  memset(buffer, 0, sizeof(Ext2Buffer));
+  buffer->inode = inode;
+  buffer->block = block;
+  buffer->physical = physical;
+  buffer->data = (uint8_t *)malloc(ext2->blockSize);
+  if (contents)
+    memcpy(buffer->data, contents, ext2->blockSize);
+  else if (fill && physical)
+    blockCacheRead(ext2->disk, buffer->data, BLOCK_TO_LBA(ext2, 0, physical),
+                   ext2->blockSize / SECTOR_SIZE);
+  else
+    memset(buffer->data, 0, ext2->blockSize);
+
+  if (inode && !physical)
+    ext2->reservedBlocks++;
+
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  buffer->seq = ++ext2->dirtySeq;
+  uint32_t bucket = ext2BufferHash(inode, block);
+  buffer->next = ext2->dirty[bucket];
+  ext2->dirty[bucket] = buffer;
+  ext2->dirtyCnt++;
+  spinlockRelease(&ext2->LOCK_DIRTY);
+
+  return buffer->data;
+}
+
+uint8_t *ext2BufferGet(Ext2 *ext2, uint32_t inode, uint32_t block,
+                       uint32_t physical, bool fill) {
+  return ext2BufferGetFrom(ext2, inode, block, physical, fill, 0);
+}
+
+// Copies out of a dirty buffer, if there is one. Goes through a bounce
+// buffer, as target might be user memory whose fault reads from this file
+bool ext2BufferRead(Ext2 *ext2, uint32_t inode, uint32_t block, size_t offset,
+                    uint8_t *target, size_t length) {
+  if (!ext2->dirtyCnt)
+    return false;
+
+  uint8_t *bounce = (uint8_t *)malloc(length);
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  Ext2Buffer *buffer = ext2BufferFindUnsafe(ext2, inode, block);
+  if (buffer)
+    memcpy(bounce, buffer->data + offset, length);
+  spinlockRelease(&ext2->LOCK_DIRTY);
+
+  if (buffer)
+    memcpy(target, bounce, length);
+  free(bounce);
+  return buffer != 0;
+}
+
+// How many of a file's blocks (up to run) starting at block have no dirty
+// buffer, so they can be read from the disk directly
+size_t ext2BufferCleanRun(Ext2 *ext2, uint32_t inode, uint32_t block,
+                          size_t run) {
+  if (!ext2->dirtyCnt)
+    return run;
+
+  size_t ret = 0;
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  while (ret < run && !ext2BufferFindUnsafe(ext2, inode, block + ret))
+    ret++;
+  spinlockRelease(&ext2->LOCK_DIRTY);
+  return ret;
+}
+
+// Whether a file data block with nothing allocated behind it can get a dirty
+// buffer: it has one already, or there's a free block left that isn't spoken
+// for by other unallocated data. Writers check this (under LOCK_WRITE) so
+// running out of space fails the write instead of losing the data on flush
+bool ext2BufferReserve(Ext2 *ext2, uint32_t inode, uint32_t block) {
+  if (ext2->reservedBlocks < ext2->superblock.free_blocks)
+    return true;
+  return !ext2BufferCleanRun(ext2, inode, block, 1);
+}
+
+// Drops dirty buffers without writing them: a file's data from logical block
+// from onwards, or (with inode 0) the metadata block from
+void ext2BufferForget(Ext2 *ext2, uint32_t inode, uint32_t from) {
+  Ext2Buffer *dropped = 0;
+
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  for (size_t i = 0; i < EXT2_DIRTY_BUCKETS; i++) {
+    if (!inode)
+      i = ext2BufferHash(0, from);
+
+    Ext2Buffer **browse = &ext2->dirty[i];
+    while (*browse) {
+      Ext2Buffer *buffer = *browse;
+      bool        match = inode
+                              ? (buffer->inode == inode && buffer->block >= from)
+                              : (!buffer->inode && buffer->block == from);
+      if (!match) {
+        browse = &buffer->next;
+        continue;
+      }
+      *browse = buffer->next;
+      buffer->next = dropped;
+      dropped = buffer;
+      ext2->dirtyCnt--;
+      if (buffer->inode && !buffer->physical)
+        ext2->reservedBlocks--;
+    }
+
+    if (!inode)
+      break;
+  }
+  spinlockRelease(&ext2->LOCK_DIRTY);
+
+  while (dropped) {
+    Ext2Buffer *next = dropped->next;
+    free(dropped->data);
+    free(dropped);
+    dropped = next;
+  }
+}
+
+// Metadata reads, which have to see what hasn't been written back yet
+void ext2MetaRead(Ext2 *ext2, uint32_t block, size_t offset, uint8_t *target,
+                  size_t length) {
+  if (!ext2BufferRead(ext2, 0, block, offset, target, length))
+    blockCacheReadUnaligned(ext2->disk, target, BLOCK_TO_LBA(ext2, 0, block),
+                            offset, length);
+}
+
+/* Flushing (set up under LOCK_WRITE) */
+
+typedef bool (*Ext2BufferAfter)(Ext2Buffer *a, Ext2Buffer *b);
+
+bool ext2BufferAfterLogical(Ext2Buffer *a, Ext2Buffer *b) {
+  return a->inode > b->inode || (a->inode == b->inode && a->block > b->block);
+}
+
+bool ext2BufferAfterPhysical(Ext2Buffer *a, Ext2Buffer *b) {
+  return a->physical > b->physical;
+}
+
+// (shell sort, there's no qsort around)
+void ext2BufferSort(Ext2Buffer **buffers, size_t cnt, Ext2BufferAfter after) {
+  for (size_t gap = cnt / 2; gap; gap /= 2) {
+    for (size_t i = gap; i < cnt; i++) {
+      Ext2Buffer *curr = buffers[i];
+      size_t      j = i;
+      while (j >= gap && after(buffers[j - gap], curr)) {
+        buffers[j] = buffers[j - gap];
+        j -= gap;
+      }
+      buffers[j] = curr;
+    }
+  }
+}
+
+// Every dirty buffer (matching unallocated, if set) in an array
+Ext2Buffer **ext2BufferCollect(Ext2 *ext2, bool unallocated, size_t *cnt) {
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  Ext2Buffer **ret =
+      (Ext2Buffer **)malloc((ext2->dirtyCnt + 1) * sizeof(Ext2Buffer *));
+  *cnt = 0;
+  for (size_t i = 0; i < EXT2_DIRTY_BUCKETS; i++) {
+    for (Ext2Buffer *browse = ext2->dirty[i]; browse; browse = browse->next) {
+      if (!unallocated || !browse->physical)
+        ret[(*cnt)++] = browse;
+    }
+  }
+  spinlockRelease(&ext2->LOCK_DIRTY);
+  return ret;
+}
+
+// Delayed allocation: a file's unallocated blocks get allocated in (logical)
+// order, every one right after the previous, starting next to whatever
+// precedes them
+void ext2FlushAllocate(Ext2 *ext2) {
+  size_t       cnt = 0;
+  Ext2Buffer **buffers = ext2BufferCollect(ext2, true, &cnt);
+  ext2BufferSort(buffers, cnt, ext2BufferAfterLogical);
+
+  size_t i = 0;
+  while (i < cnt) {
+    uint32_t   inodeNum = buffers[i]->inode;
+    Ext2Inode  inode;
+    Ext2Inode *cached = ext2InodeGet(ext2, inodeNum);
+    memcpy(&inode, cached, sizeof(Ext2Inode));
+    ext2InodePut(ext2, cached);
+
+    uint32_t goal = 0;
+    for (; i < cnt && buffers[i]->inode == inodeNum; i++) {
+      Ext2Buffer *buffer = buffers[i];
+      if (!goal && buffer->block)
+        goal = ext2BlockFetch(ext2, &inode, buffer->block - 1);
+      if (goal)
+        goal++;
+      else // the start of the inode's block group
+        goal = ext2->superblock.superblock_idx +
+               INODE_TO_BLOCK_GROUP(ext2, inodeNum) *
+                   ext2->superblock.blocks_per_group;
+
+      uint32_t physical = ext2BlockAllocate(ext2, goal);
+      if (!physical) {
+        debugf("[ext2::writeback] Out of space, data lost! inode{%d} "
+               "block{%d}\n",
+               inodeNum, buffer->block);
+        goal = 0;
+        continue;
+      }
+      ext2BlockMapSet(ext2, &inode, buffer->block, physical);
+      inode.num_sectors += ext2->blockSize / SECTOR_SIZE;
+      buffer->physical = physical;
+      ext2->reservedBlocks--;
+      goal = physical;
+    }
+
+    ext2InodeStore(ext2, inodeNum, &inode);
+  }
+
+  if (cnt)
+    ext2->generation++;
+  free(buffers);
+}
+
+// A run of physically consecutive buffers, copied out for the disk write
+typedef struct Ext2FlushRun {
+  uint32_t physical;
+  size_t   cnt;
+  uint8_t *data;
+} Ext2FlushRun;
+
+// Which buffer (& version of it) went out, so it can be dropped afterwards
+typedef struct Ext2FlushKey {
+  uint32_t inode;
+  uint32_t block;
+  uint64_t seq;
+} Ext2FlushKey;
+
+// Everything's allocated & copied out under LOCK_WRITE, but written without
+// it (the dirty buffers stay up for readers meanwhile). Buffers modified
+// while the writes were going on are kept for the next flush
+void ext2Flush(Ext2 *ext2) {
+  spinlockAcquire(&ext2->LOCK_WRITE);
+  // (only one at a time, sync() has to wait on the one going on)
+  while (ext2->flushing) {
+    spinlockRelease(&ext2->LOCK_WRITE);
+    while (ext2->flushing)
+      asm volatile("pause");
+    spinlockAcquire(&ext2->LOCK_WRITE);
+  }
+  if (!ext2->dirtyCnt && !ext2->metaDirty) {
+    spinlockRelease(&ext2->LOCK_WRITE);
+    return;
+  }
+
+  ext2FlushAllocate(ext2);
+
+  bool meta = ext2->metaDirty;
+  if (meta) {
+    // (the descriptors are all in the block after the superblock's)
+    uint32_t bgdt = ext2->superblock.superblock_idx + 1;
+    uint8_t *data = ext2BufferGet(ext2, 0, bgdt, bgdt, false);
+    memcpy(data, ext2->bgdts, ext2->blockSize);
+  }
+
+  size_t       cnt = 0;
+  Ext2Buffer **buffers = ext2BufferCollect(ext2, false, &cnt);
+  ext2BufferSort(buffers, cnt, ext2BufferAfterPhysical);
+
+  size_t        perBatch = EXT2_WRITEBACK_BATCH * SECTOR_SIZE / ext2->blockSize;
+  Ext2FlushRun *runs = (Ext2FlushRun *)malloc((cnt + 1) * sizeof(Ext2FlushRun));
+  Ext2FlushKey *keys = (Ext2FlushKey *)malloc((cnt + 1) * sizeof(Ext2FlushKey));
+  size_t        requests = 0;
+  size_t        i = 0;
+  while (i < cnt) {
+    if (!buffers[i]->physical) { // (couldn't be allocated, dropped)
+      i++;
+      continue;
+    }
+
+    size_t run = 1;
+    while ((i + run) < cnt && run < perBatch &&
+           buffers[i + run]->physical == (buffers[i]->physical + run))
+      run++;
+
+    Ext2FlushRun *target = &runs[requests++];
+    target->physical = buffers[i]->physical;
+    target->cnt = run;
+    target->data = (uint8_t *)malloc(run * ext2->blockSize);
+    for (size_t j = 0; j < run; j++)
+      memcpy(target->data + j * ext2->blockSize, buffers[i + j]->data,
+             ext2->blockSize);
+    i += run;
+  }
+  for (size_t j = 0; j < cnt; j++) {
+    keys[j].inode = buffers[j]->inode;
+    keys[j].block = buffers[j]->block;
+    keys[j].seq = buffers[j]->seq;
+  }
+  free(buffers);
+
+  Ext2Superblock superblock;
+  if (meta) {
+    memcpy(&superblock, &ext2->superblock, sizeof(Ext2Superblock));
+    ext2->metaDirty = false;
+  }
+  ext2->flushing = true;
+  spinlockRelease(&ext2->LOCK_WRITE);
+
+  for (size_t j = 0; j < requests; j++) {
+    setDiskBytes(ext2->disk, runs[j].data,
+                 BLOCK_TO_LBA(ext2, 0, runs[j].physical),
+                 runs[j].cnt * ext2->blockSize / SECTOR_SIZE);
+    free(runs[j].data);
+  }
+  if (meta)
+    setDiskBytes(ext2->disk, (uint8_t *)&superblock, ext2->offsetSuperblock,
+                 sizeof(Ext2Superblock) / SECTOR_SIZE);
+  free(runs);
+
+  // everything that wasn't touched meanwhile is on the disk now, readers can
+  // go there
+  Ext2Buffer *dropped = 0;
+  spinlockAcquire(&ext2->LOCK_WRITE);
+  spinlockAcquire(&ext2->LOCK_DIRTY);
+  for (size_t j = 0; j < cnt; j++) {
+    Ext2Buffer **browse =
+        &ext2->dirty[ext2BufferHash(keys[j].inode, keys[j].block)];
+    while (*browse && ((*browse)->inode != keys[j].inode ||
+                       (*browse)->block != keys[j].block))
+      browse = &(*browse)->next;
+    Ext2Buffer *buffer = *browse;
+    if (!buffer || buffer->seq != keys[j].seq)
+      continue;
+    *browse = buffer->next;
+    buffer->next = dropped;
+    dropped = buffer;
+    ext2->dirtyCnt--;
+    if (buffer->inode && !buffer->physical) // (its data was lost)
+      ext2->reservedBlocks--;
+  }
+  spinlockRelease(&ext2->LOCK_DIRTY);
+  ext2->flushing = false;
+  spinlockRelease(&ext2->LOCK_WRITE);
+
+  while (dropped) {
+    Ext2Buffer *next = dropped->next;
+    free(dropped->data);
+    free(dropped);
+    dropped = next;
+  }
+  free(keys);
+
+#if EXT2_WRITEBACK_DEBUG
+  debugf("[ext2::writeback] Flushed: blocks{%ld} requests{%ld}\n", cnt,
+         requests);
+#endif
+}
+
+void ext2WritebackThread() {
+  while (true) {
+    uint64_t target = timerTicks + EXT2_WRITEBACK_INTERVAL;
+    while (timerTicks < target)
+      asm volatile("hlt");
+
+    for (MountPoint *browse = firstMountPoint; browse; browse = browse->next) {
+      if (browse->filesystem == FS_EXT2)
+        ext2Flush(EXT2_PTR(browse->fsInfo));
+    }
+  }
+}
+
+void initiateExt2Writeback() {
+  Task *task = taskCreateKernel((size_t)ext2WritebackThread, 0);
+  debugf("[ext2::writeback] Flushing every %dms: id{%d}\n",
+         EXT2_WRITEBACK_INTERVAL, task->id);
+}
@@ -17,11 +17,12 @@ bool fat32Mount(MountPoint *mount) {
   FAT32 *fat = FAT_PTR(mount->fsInfo);
 
   // base offset
+  fat->disk = mount->disk;
   fat->offsetBase = mount->mbr.lba_first_sector; // 2048 (in LBA)
 
   // get first sector
   uint8_t firstSec[SECTOR_SIZE] = {0};
-  getDiskBytes(firstSec, fat->offsetBase, 1);
+  getDiskBytes(fat->disk, firstSec, fat->offsetBase, 1);
 
   // store it
   memcpy(&fat->bootsec, firstSec, sizeof(FAT32BootSector));
@@ -38,11 +39,7 @@ bool fat32Mount(MountPoint *mount) {
       fat->offsetFats +
       fat->bootsec.table_count * fat->bootsec.extended_section.table_size_32;
 
-  for (int i = 0; i < FAT32_CACHE_MAX; i++) {
-    fat->cacheBase[i] = FAT32_CACHE_BAD;
-    fat->cache[i] = malloc(LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster));
-    memset(fat->cache[i], 0, LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster));
-  }
+  fat32FATinit(fat);
 
   // done :")
   return true;
@@ -70,7 +67,9 @@ bool fat32Open(MountPoint *mount, OpenFile *fd, char *filename) {
       FAT_COMB_HIGH_LOW(res.dirEntry.clusterhigh, res.dirEntry.clusterlow);
   memcpy(&dir->dirEnt, &res.dirEntry, sizeof(FAT32DirectoryEntry));
 
-  if (res.dirEntry.attrib & FAT_ATTRIB_DIRECTORY) {
+  if (!(res.dirEntry.attrib & FAT_ATTRIB_DIRECTORY))
+    fat32RunMapInit(&dir->runs, dir->directoryCurr);
+  else {
     size_t len = strlength(filename) + 1;
     fd->dirname = (char *)malloc(len);
     memcpy(fd->dirname, filename, len);
@@ -79,94 +78,75 @@ bool fat32Open(MountPoint *mount, OpenFile *fd, char *filename) {
   return true;
 }
 
+// Pulls the file's [start, end) byte range into the block cache, a run of
+// consecutive clusters at a time
+void fat32Prefetch(FAT32 *fat, FAT32OpenFd *dir, size_t start, size_t end) {
+  int bytesPerCluster = LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
+
+  size_t logical = start / bytesPerCluster;
+  size_t last = DivRoundUp(end, bytesPerCluster);
+  while (logical < last) {
+    size_t   run = 0;
+    uint32_t cluster = fat32RunLookup(fat, dir, logical, &run);
+    if (!cluster)
+      break;
+    if (run > last - logical)
+      run = last - logical;
+    blockCachePrefetch(fat->disk, fat32ClusterToLBA(fat, cluster),
+                       run * fat->bootsec.sectors_per_cluster);
+    logical += run;
+  }
+}
+
 int fat32Read(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit) {
   FAT32       *fat = FAT_PTR(mount->fsInfo);
   FAT32OpenFd *dir = FAT_DIR_PTR(fd->dir);
 
   if (dir->dirEnt.attrib & FAT_ATTRIB_DIRECTORY)
     return 0;
+  if (dir->ptr >= dir->dirEnt.filesize)
+    return 0;
+  if (limit > dir->dirEnt.filesize - dir->ptr)
+    limit = dir->dirEnt.filesize - dir->ptr;
 
   int curr = 0; // will be used to return
   int bytesPerCluster = LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
   // ^ is used everywhere!
 
-  uint8_t  *bytes = (uint8_t *)malloc(bytesPerCluster);
-  int       fatLookupsNeeded = DivRoundUp(limit, bytesPerCluster);
-  uint32_t *fatLookup =
-      fat32FATchain(fat, dir->directoryCurr, fatLookupsNeeded);
+  // sequential streams are prefetched into (and then served from) the block
+  // cache, everything else goes straight to the destination
+  size_t aheadStart = 0;
+  size_t aheadEnd = 0;
+  bool   sequential = blockCacheReadAhead(&dir->readAhead, dir->ptr, limit,
+                                          &aheadStart, &aheadEnd);
+  if (aheadEnd > dir->dirEnt.filesize)
+    aheadEnd = dir->dirEnt.filesize;
+  if (aheadEnd > aheadStart)
+    fat32Prefetch(fat, dir, aheadStart, aheadEnd);
+
+  // one request per physically consecutive run of clusters
+  while (curr < limit) {
+    size_t   run = 0;
+    uint32_t cluster = fat32RunLookup(fat, dir, dir->ptr / bytesPerCluster,
+                                      &run);
+    if (!cluster)
+      break;
+
+    uint32_t skip = dir->ptr % bytesPerCluster;
+    size_t   len = run * bytesPerCluster - skip;
+    if (len > limit - curr)
+      len = limit - curr;
 
-  // optimization: we can use consecutive sectors to make our life easier
-  int consecStart = -1;
-  int consecEnd = 0;
+    size_t lba = fat32ClusterToLBA(fat, cluster);
+    if (buff && sequential)
+      blockCacheReadUnaligned(fat->disk, buff + curr, lba, skip, len);
+    else if (buff) // straight into the destination, no intermediate copies
+      getDiskBytesUnaligned(fat->disk, buff + curr, lba, skip, len);
 
-  // +1 for starting
-  for (int i = 0; i < (fatLookupsNeeded + 1); i++) {
-    if (!fatLookup[i])
-      break;
-    dir->directoryCurr = fatLookup[i];
-    bool last = i == (fatLookupsNeeded - 1);
-    if (consecStart < 0) {
-      // nothing consecutive yet
-      if (!last && fatLookup[i + 1] == (fatLookup[i] + 1)) {
-        // consec starts here
-        consecStart = i;
-        continue;
-      }
-    } else {
-      // we are in a consecutive that started since consecStart
-      if (last || fatLookup[i + 1] != (fatLookup[i] + 1))
-        consecEnd = i; // either last or the end
-      else             // otherwise, we good
-        continue;
-    }
-
-    uint32_t offsetStarting = dir->ptr % bytesPerCluster; // remainder
-    if (consecEnd) {
-      // optimized consecutive cluster reading
-      int      needed = consecEnd - consecStart + 1;
-      uint8_t *optimizedBytes = malloc(needed * bytesPerCluster);
-      getDiskBytes(optimizedBytes,
-                   fat32ClusterToLBA(fat, fatLookup[consecStart]),
-                   needed * fat->bootsec.sectors_per_cluster);
-
-      for (uint32_t i = offsetStarting; i < (needed * bytesPerCluster); i++) {
-        if (curr >= limit || dir->ptr >= dir->dirEnt.filesize) {
-          free(optimizedBytes);
-          goto cleanup;
-        }
-
-        if (buff)
-          buff[curr] = optimizedBytes[i];
-
-        dir->ptr++;
-        curr++;
-      }
-
-      free(optimizedBytes);
-    } else {
-      getDiskBytes(bytes, fat32ClusterToLBA(fat, fatLookup[i]),
-                   fat->bootsec.sectors_per_cluster);
-
-      for (uint32_t i = offsetStarting; i < bytesPerCluster; i++) {
-        if (curr >= limit || dir->ptr >= dir->dirEnt.filesize)
-          goto cleanup;
-
-        if (buff)
-          buff[curr] = bytes[i];
-
-        dir->ptr++;
-        curr++;
-      }
-    }
-
-    // traverse
-    consecStart = -1;
-    consecEnd = 0;
+    dir->ptr += len;
+    curr += len;
   }
 
-cleanup:
-  free(bytes);
-  free(fatLookup);
   return curr;
 }
 
@@ -180,23 +160,13 @@ bool fat32Seek(MountPoint *mount, OpenFile *fd, uint32_t target) {
   if (target > dir->dirEnt.filesize)
     return false;
 
-  int old = dir->ptr;
-  if (old > target) {
-    dir->directoryCurr =
-        FAT_COMB_HIGH_LOW(dir->dirEnt.clusterhigh, dir->dirEnt.clusterlow);
-    old = 0;
-  }
-  dir->ptr = target;
-
-  // this REALLY needs optimization!
-  int toBeSkipped = target / LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
-  int alreadySkipped = old / LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
-  for (int i = 0; i < (toBeSkipped - alreadySkipped); i++) {
-    dir->directoryCurr = fat32FATtraverse(fat, dir->directoryCurr);
-    if (!dir->directoryCurr)
-      return false;
-  }
+  // the chain has to go that far (no need to map it when it's the very end)
+  int bytesPerCluster = LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
+  if (target < dir->dirEnt.filesize &&
+      !fat32RunLookup(fat, dir, target / bytesPerCluster, 0))
+    return false;
 
+  dir->ptr = target;
   return true;
 }
 
@@ -213,6 +183,7 @@ bool fat32Close(MountPoint *mount, OpenFile *fd) {
   FAT32OpenFd *dir = FAT_DIR_PTR(fd->dir);
   if (dir->dirEnt.attrib & FAT_ATTRIB_DIRECTORY && fd->dirname)
     free(fd->dirname);
+  fat32RunMapFree(&dir->runs);
 
   // :p
   free(fd->dir);
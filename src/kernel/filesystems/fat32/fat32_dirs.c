@@ -1,3 +1,4 @@
+#include <block_cache.h>
 #include <fat32.h>
 #include <malloc.h>
 #include <string.h>
@@ -29,8 +30,9 @@ int fat32Getdents64(OpenFile *file, void *start, unsigned int hardlimit) {
       goto cleanup;
 
     uint32_t offsetStarting = fatDir->ptr % bytesPerCluster;
-    getDiskBytes(bytes, fat32ClusterToLBA(fat, fatDir->directoryCurr),
-                 fat->bootsec.sectors_per_cluster);
+    blockCacheRead(fat->disk, bytes,
+                   fat32ClusterToLBA(fat, fatDir->directoryCurr),
+                   fat->bootsec.sectors_per_cluster);
 
     for (uint32_t i = offsetStarting; i < bytesPerCluster;
          i += sizeof(FAT32DirectoryEntry)) {
@@ -1,66 +1,160 @@
+#include <disk.h>
 #include <fat32.h>
 #include <malloc.h>
 #include <system.h>
 #include <util.h>
 
-uint32_t fat32FATcacheLookup(FAT32 *fat, uint32_t offset) {
-  for (int i = 0; i < FAT32_CACHE_MAX; i++) {
-    if (fat->cacheBase[i] == offset)
-      return i;
-  }
+// The (first) FAT is kept in memory, paged in on first use & never evicted
+// (it's only 4 bytes per cluster). Open files decode their cluster chains
+// into runs of physically consecutive clusters, so every read goes out to the
+// disk an extent at a time
+// Copyright (C) 2024 Panagiotis
 
-  return FAT32_CACHE_BAD;
+void fat32FATinit(FAT32 *fat) {
+  size_t sectors = fat->bootsec.extended_section.table_size_32;
+  fat->fatPagesCnt = DivRoundUp(sectors, FAT32_FAT_PAGE_SECTORS);
+  fat->fatPages = (uint32_t **)malloc(fat->fatPagesCnt * sizeof(uint32_t *));
+  memset(fat->fatPages, 0, fat->fatPagesCnt * sizeof(uint32_t *));
 }
 
-void fat32FATcacheAdd(FAT32 *fat, uint32_t offset, uint8_t *bytes) {
-  if (fat->cacheCurr >= FAT32_CACHE_MAX)
-    fat->cacheCurr = 0;
-  fat->cacheBase[fat->cacheCurr] = offset;
-  memcpy(fat->cache[fat->cacheCurr], bytes, SECTOR_SIZE);
-  fat->cacheCurr++;
-}
+// Raw (masked) FAT entry of a cluster, straight from the in-memory table
+uint32_t fat32FATentry(FAT32 *fat, uint32_t cluster) {
+  size_t page = cluster / FAT32_FAT_PAGE_ENTRIES;
+  if (page >= fat->fatPagesCnt) {
+    debugf("[fat32] Cluster outside the FAT! cluster{%x}\n", cluster);
+    return 0;
+  }
 
-void fat32FATfetch(FAT32 *fat, uint32_t offsetSector, uint8_t *bytes) {
-  uint32_t cacheRes = fat32FATcacheLookup(fat, offsetSector);
-  if (cacheRes != FAT32_CACHE_BAD) {
-    memcpy(bytes, fat->cache[cacheRes], SECTOR_SIZE);
-    return;
+  spinlockAcquire(&fat->LOCK_FAT);
+  uint32_t *entries = fat->fatPages[page];
+  uint32_t *spare = 0;
+  if (!entries) {
+    spinlockRelease(&fat->LOCK_FAT);
+
+    size_t sectors = fat->bootsec.extended_section.table_size_32;
+    size_t first = page * FAT32_FAT_PAGE_SECTORS;
+    size_t cnt = sectors - first;
+    if (cnt > FAT32_FAT_PAGE_SECTORS)
+      cnt = FAT32_FAT_PAGE_SECTORS;
+
+    // doesn't need to go through the block cache, it's cached here already.
+    // Read without LOCK_FAT held, whoever installs theirs first wins
+    entries = (uint32_t *)malloc(FAT32_FAT_PAGE_ENTRIES * sizeof(uint32_t));
+    memset(entries, 0, FAT32_FAT_PAGE_ENTRIES * sizeof(uint32_t));
+    getDiskBytes(fat->disk, (uint8_t *)entries, fat->offsetFats + first, cnt);
+
+    spinlockAcquire(&fat->LOCK_FAT);
+    if (fat->fatPages[page]) {
+      spare = entries;
+      entries = fat->fatPages[page];
+    } else
+      fat->fatPages[page] = entries;
   }
-  getDiskBytes(bytes, offsetSector, 1);
-  fat32FATcacheAdd(fat, offsetSector, bytes);
+  uint32_t ret = entries[cluster % FAT32_FAT_PAGE_ENTRIES];
+  spinlockRelease(&fat->LOCK_FAT);
+
+  if (spare)
+    free(spare);
+  return ret & FAT32_CLUSTER_MASK; // remember; we're on FAT32
 }
 
 uint32_t fat32FATtraverse(FAT32 *fat, uint32_t offset) {
-  int bytesPerCluster = SECTOR_SIZE;
+  uint32_t ret = fat32FATentry(fat, offset);
+
+  if (ret >= FAT32_CLUSTER_END) // end of cluster chain
+    return 0;
 
-  uint32_t offsetFAT = offset * 4; // every entry is sizeof(uint32_t) = 4
-  uint32_t offsetSector = fat->offsetFats + (offsetFAT / bytesPerCluster);
-  uint32_t offsetEntry = offsetFAT % bytesPerCluster;
+  if (ret == FAT32_CLUSTER_BAD) // invalid/bad cluster
+    return 0;
 
-  uint8_t *bytes = (uint8_t *)malloc(bytesPerCluster);
-  fat32FATfetch(fat, offsetSector, bytes);
+  return ret;
+}
 
-  uint32_t *retLocation = (uint32_t *)(&bytes[offsetEntry]);
-  uint32_t  ret = (*retLocation) & 0x0FFFFFFF; // remember; we're on FAT32
-  free(bytes);
+void fat32RunMapInit(FAT32RunMap *map, uint32_t start) {
+  memset(map, 0, sizeof(FAT32RunMap));
+  map->next = start;
+}
 
-  if (ret >= 0x0FFFFFF8) // end of cluster chain
-    return 0;
+void fat32RunAppend(FAT32RunMap *map, uint32_t cluster) {
+  uint32_t logical = map->mapped++;
 
-  if (ret == 0x0FFFFFF7) // invalid/bad cluster
+  if (map->cnt) {
+    FAT32Run *last = &map->runs[map->cnt - 1];
+    if (cluster == (last->cluster + last->length)) {
+      last->length++;
+      return;
+    }
+  }
+
+  if (map->cnt == map->capacity) {
+    map->capacity = map->capacity ? map->capacity * 2 : 16;
+    map->runs =
+        (FAT32Run *)realloc(map->runs, map->capacity * sizeof(FAT32Run));
+  }
+
+  FAT32Run *run = &map->runs[map->cnt++];
+  run->logical = logical;
+  run->cluster = cluster;
+  run->length = 1;
+}
+
+// Maps everything up to (and including) logical, if the chain goes that far.
+// Keeps going till the end of the run it's in, so that's never cut short
+void fat32RunMapExtend(FAT32 *fat, FAT32RunMap *map, size_t logical) {
+  while (map->next) {
+    uint32_t cluster = map->next;
+    if (map->mapped > logical) {
+      FAT32Run *last = &map->runs[map->cnt - 1];
+      if (cluster != (last->cluster + last->length))
+        break;
+    }
+    fat32RunAppend(map, cluster);
+    map->next = fat32FATtraverse(fat, cluster);
+  }
+}
+
+// Cluster behind a logical one (0 past the end of the chain). *run (if given)
+// is set to how many clusters from there on are physically consecutive
+uint32_t fat32RunLookup(FAT32 *fat, FAT32OpenFd *fd, size_t logical,
+                        size_t *run) {
+  FAT32RunMap *map = &fd->runs;
+  if (logical >= map->mapped)
+    fat32RunMapExtend(fat, map, logical);
+  if (logical >= map->mapped) {
+    if (run)
+      *run = 0;
     return 0;
+  }
 
-  return ret;
+  // last run starting at (or before) logical
+  size_t low = 0;
+  size_t high = map->cnt - 1;
+  while (low < high) {
+    size_t mid = (low + high + 1) / 2;
+    if (map->runs[mid].logical <= logical)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  FAT32Run *found = &map->runs[low];
+  size_t    in = logical - found->logical;
+  if (run)
+    *run = found->length - in;
+  return found->cluster + in;
 }
 
-// +1 for starting
-uint32_t *fat32FATchain(FAT32 *fat, uint32_t offsetStart, uint32_t amount) {
-  uint32_t *ret = malloc((amount + 1) * sizeof(uint32_t));
-  memset(ret, 0, (amount + 1) * sizeof(uint32_t));
+void fat32RunMapDuplicate(FAT32RunMap *target, FAT32RunMap *source) {
+  memcpy(target, source, sizeof(FAT32RunMap));
+  if (!source->capacity)
+    return;
 
-  ret[0] = offsetStart;
-  for (uint32_t i = 1; i < (amount + 1); i++)
-    ret[i] = fat32FATtraverse(fat, ret[i - 1]);
+  target->runs = (FAT32Run *)malloc(source->capacity * sizeof(FAT32Run));
+  memcpy(target->runs, source->runs, source->cnt * sizeof(FAT32Run));
+}
 
-  return ret;
+void fat32RunMapFree(FAT32RunMap *map) {
+  if (map->runs)
+    free(map->runs);
+  memset(map, 0, sizeof(FAT32RunMap));
 }
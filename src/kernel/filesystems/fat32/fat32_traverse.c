@@ -1,3 +1,4 @@
+#include <block_cache.h>
 #include <disk.h>
 #include <fat32.h>
 #include <malloc.h>
@@ -18,8 +19,8 @@ FAT32TraverseResult fat32Traverse(FAT32 *fat, uint32_t initDirectory,
   int     lfnLast = -1;
 
   while (true) {
-    getDiskBytes(bytes, fat32ClusterToLBA(fat, directory),
-                 fat->bootsec.sectors_per_cluster);
+    blockCacheRead(fat->disk, bytes, fat32ClusterToLBA(fat, directory),
+                   fat->bootsec.sectors_per_cluster);
 
     for (int i = 0; i < LBA_TO_OFFSET(fat->bootsec.sectors_per_cluster);
          i += sizeof(FAT32DirectoryEntry)) {
@@ -70,7 +71,7 @@ FAT32TraverseResult fat32Traverse(FAT32 *fat, uint32_t initDirectory,
         if (found) {
           FAT32TraverseResult ret;
           ret.directory = directory;
-          ret.index = i;
+          ret.index = i / sizeof(FAT32DirectoryEntry);
           memcpy(&ret.dirEntry, dir, sizeof(FAT32DirectoryEntry));
           free(bytes);
           return ret;
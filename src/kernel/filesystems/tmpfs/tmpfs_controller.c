@@ -0,0 +1,374 @@
+#include <bootloader.h>
+#include <linux.h>
+#include <malloc.h>
+#include <page_cache.h>
+#include <paging.h>
+#include <pmm.h>
+#include <string.h>
+#include <system.h>
+#include <timer.h>
+#include <tmpfs.h>
+#include <util.h>
+
+// RAM-backed filesystem (for /tmp & scratch files), nothing here ever touches
+// a disk. File data is copied page by page with the tree unlocked, since the
+// destination might fault in something that needs it (ex: a tmpfs mapping)
+// Copyright (C) 2024 Panagiotis
+
+bool tmpfsMount(MountPoint *mount) {
+  Tmpfs *tmpfs = (Tmpfs *)malloc(sizeof(Tmpfs));
+  memset(tmpfs, 0, sizeof(Tmpfs));
+  tmpfs->nextInode = TMPFS_ROOT_INODE;
+  tmpfs->pagesMax = physicalBuddy.frames / 2;
+  tmpfs->root = tmpfsNodeCreate(tmpfs, 0, "", 0, S_IFDIR | 01777);
+  tmpfs->root->opens = 1; // (never goes away)
+  mount->fsInfo = tmpfs;
+
+  debugf("[tmpfs] Mounted: prefix{%s} limit{%ldKB}\n", mount->prefix,
+         tmpfs->pagesMax * PAGE_SIZE / 1024);
+  return true;
+}
+
+bool tmpfsOpen(MountPoint *mount, OpenFile *fd, char *filename) {
+  Tmpfs *tmpfs = TMPFS_PTR(mount->fsInfo);
+
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  TmpfsNode *node = tmpfsTraverse(tmpfs, filename);
+  if (node && (fd->flags & O_CREAT) && (fd->flags & O_EXCL))
+    goto fail;
+
+  if (!node && (fd->flags & O_CREAT)) {
+    char      *name = 0;
+    size_t     nameLen = 0;
+    TmpfsNode *parent = tmpfsTraverseParent(tmpfs, filename, &name, &nameLen);
+    if (parent)
+      node = tmpfsNodeCreate(tmpfs, parent, name, nameLen,
+                             S_IFREG | ((fd->mode & 07777) ? (fd->mode & 07777)
+                                                            : 0644));
+  }
+  if (!node)
+    goto fail;
+  if ((fd->flags & O_DIRECTORY) && !S_ISDIR(node->mode))
+    goto fail;
+
+  bool truncated = (fd->flags & O_TRUNC) &&
+                   (fd->flags & O_ACCMODE) != O_RDONLY &&
+                   S_ISREG(node->mode) && node->size;
+  if (truncated)
+    tmpfsResize(tmpfs, node, 0);
+  node->opens++;
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+  if (truncated)
+    pageCacheInvalidate(mount, node->inode);
+
+  TmpfsOpenFd *tfd = (TmpfsOpenFd *)malloc(sizeof(TmpfsOpenFd));
+  memset(tfd, 0, sizeof(TmpfsOpenFd));
+  tfd->node = node;
+  fd->dir = tfd;
+
+  if (S_ISDIR(node->mode)) {
+    size_t len = strlength(filename) + 1;
+    fd->dirname = malloc(len);
+    memcpy(fd->dirname, filename, len);
+  }
+  return true;
+
+fail:
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return false;
+}
+
+int tmpfsRead(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit) {
+  Tmpfs       *tmpfs = TMPFS_PTR(mount->fsInfo);
+  TmpfsOpenFd *tfd = TMPFS_FD_PTR(fd->dir);
+  TmpfsNode   *node = tfd->node;
+  if (S_ISDIR(node->mode))
+    return -EISDIR;
+
+  int curr = 0;
+  while (curr < limit) {
+    spinlockAcquire(&tmpfs->LOCK_TMPFS);
+    if (tfd->ptr >= node->size) {
+      spinlockRelease(&tmpfs->LOCK_TMPFS);
+      break;
+    }
+    size_t skip = tfd->ptr % PAGE_SIZE;
+    size_t len = PAGE_SIZE - skip;
+    if (len > limit - curr)
+      len = limit - curr;
+    if (len > node->size - tfd->ptr)
+      len = node->size - tfd->ptr;
+
+    // (so it stays around while it's copied)
+    size_t phys = tmpfsPageGet(tmpfs, node, tfd->ptr / PAGE_SIZE, false);
+    if (phys)
+      PhysicalShare(phys);
+    spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+    if (buff && phys)
+      memcpy(buff + curr, (void *)(phys + bootloader.hhdmOffset + skip), len);
+    else if (buff) // holes read as zeroes
+      memset(buff + curr, 0, len);
+    if (phys)
+      PhysicalRelease(phys);
+
+    tfd->ptr += len;
+    curr += len;
+  }
+
+  return curr;
+}
+
+int tmpfsWrite(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit) {
+  Tmpfs       *tmpfs = TMPFS_PTR(mount->fsInfo);
+  TmpfsOpenFd *tfd = TMPFS_FD_PTR(fd->dir);
+  TmpfsNode   *node = tfd->node;
+  if (S_ISDIR(node->mode))
+    return -EISDIR;
+  if (limit <= 0)
+    return 0;
+
+  bool grown = false;
+  int  curr = 0;
+  while (curr < limit) {
+    spinlockAcquire(&tmpfs->LOCK_TMPFS);
+    if (fd->flags & O_APPEND)
+      tfd->ptr = node->size;
+    size_t skip = tfd->ptr % PAGE_SIZE;
+    size_t len = PAGE_SIZE - skip;
+    if (len > limit - curr)
+      len = limit - curr;
+
+    size_t phys = tmpfsPageGet(tmpfs, node, tfd->ptr / PAGE_SIZE, true);
+    if (!phys) {
+      spinlockRelease(&tmpfs->LOCK_TMPFS);
+      break;
+    }
+    PhysicalShare(phys);
+    if (tfd->ptr + len > node->size) {
+      node->size = tfd->ptr + len;
+      grown = true;
+    }
+    node->mtime = node->ctime = timerTicks / 1000;
+    spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+    memcpy((void *)(phys + bootloader.hhdmOffset + skip), buff + curr, len);
+    PhysicalRelease(phys);
+
+    tfd->ptr += len;
+    curr += len;
+  }
+
+  // mappings share the very same pages, only their size has to be redone
+  if (grown)
+    pageCacheInvalidate(mount, node->inode);
+
+  return curr ? curr : -ENOSPC;
+}
+
+bool tmpfsSeek(MountPoint *mount, OpenFile *fd, uint32_t target) {
+  TMPFS_FD_PTR(fd->dir)->ptr = target; // (past the end makes a hole)
+  return true;
+}
+
+int tmpfsTruncate(MountPoint *mount, OpenFile *fd, size_t length) {
+  Tmpfs     *tmpfs = TMPFS_PTR(mount->fsInfo);
+  TmpfsNode *node = TMPFS_FD_PTR(fd->dir)->node;
+  if (S_ISDIR(node->mode))
+    return -EISDIR;
+
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  tmpfsResize(tmpfs, node, length);
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+  pageCacheInvalidate(mount, node->inode);
+  return 0;
+}
+
+size_t tmpfsGetFilesize(OpenFile *fd) {
+  TmpfsNode *node = TMPFS_FD_PTR(fd->dir)->node;
+  return S_ISDIR(node->mode) ? 0 : node->size;
+}
+
+bool tmpfsClose(MountPoint *mount, OpenFile *fd) {
+  Tmpfs *tmpfs = TMPFS_PTR(mount->fsInfo);
+
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  tmpfsNodePut(tmpfs, TMPFS_FD_PTR(fd->dir)->node);
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+  free(fd->dir);
+  return true;
+}
+
+bool tmpfsDuplicate(OpenFile *original, OpenFile *orphan) {
+  Tmpfs *tmpfs = TMPFS_PTR(orphan->mountPoint->fsInfo);
+
+  orphan->dir = malloc(sizeof(TmpfsOpenFd));
+  memcpy(orphan->dir, original->dir, sizeof(TmpfsOpenFd));
+
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  TMPFS_FD_PTR(orphan->dir)->node->opens++;
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+  if (original->dirname) {
+    size_t len = strlength(original->dirname) + 1;
+    orphan->dirname = (char *)malloc(len);
+    memcpy(orphan->dirname, original->dirname, len);
+  }
+  return true;
+}
+
+void tmpfsStatInternal(TmpfsNode *node, struct stat *target) {
+  memset(target, 0, sizeof(struct stat));
+  target->st_dev = 70; // todo
+  target->st_ino = node->inode;
+  target->st_mode = node->mode;
+  target->st_nlink = S_ISDIR(node->mode) ? 2 : node->links;
+  target->st_blksize = PAGE_SIZE;
+  target->st_size = S_ISDIR(node->mode) ? PAGE_SIZE : node->size;
+  target->st_blocks = node->pagesUsed * (PAGE_SIZE / 512);
+
+  target->st_atime = node->atime;
+  target->st_mtime = node->mtime;
+  target->st_ctime = node->ctime;
+}
+
+bool tmpfsStat(Tmpfs *tmpfs, char *filename, struct stat *target) {
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  TmpfsNode *node = tmpfsTraverse(tmpfs, filename);
+  if (node)
+    tmpfsStatInternal(node, target);
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return node != 0;
+}
+
+bool tmpfsStatFd(Tmpfs *tmpfs, OpenFile *fd, struct stat *target) {
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  tmpfsStatInternal(TMPFS_FD_PTR(fd->dir)->node, target);
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return true;
+}
+
+bool tmpfsDirent(struct linux_dirent64 **dirp, int64_t *allocatedlimit,
+                 unsigned int hardlimit, uint64_t inode, uint32_t mode,
+                 char *name, size_t nameLen, uint64_t next) {
+  size_t reclen = 23 + nameLen + 1;
+  if ((*allocatedlimit + reclen + 2) > hardlimit)
+    return false;
+
+  struct linux_dirent64 *dirent = *dirp;
+  dirent->d_ino = inode;
+  dirent->d_off = next;
+  dirent->d_type = S_ISDIR(mode) ? CDT_DIR : CDT_REG;
+  memcpy(dirent->d_name, name, nameLen);
+  dirent->d_name[nameLen] = '\0';
+  dirent->d_reclen = reclen;
+
+  *allocatedlimit += reclen;
+  *dirp = (struct linux_dirent64 *)((size_t)dirent + reclen);
+  return true;
+}
+
+int tmpfsGetdents64(OpenFile *fd, void *start, unsigned int hardlimit) {
+  Tmpfs       *tmpfs = TMPFS_PTR(fd->mountPoint->fsInfo);
+  TmpfsOpenFd *tfd = TMPFS_FD_PTR(fd->dir);
+  TmpfsNode   *node = tfd->node;
+  if (!S_ISDIR(node->mode))
+    return -ENOTDIR;
+
+  struct linux_dirent64 *dirp = (struct linux_dirent64 *)start;
+  int64_t                allocatedlimit = 0;
+
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  // "." & ".." are orders 0 & 1, children start from 2 (in creation order,
+  // so whatever gets unlinked in the meantime doesn't shift anything)
+  while (tfd->ptr < 2) {
+    TmpfsNode *target = node;
+    if (tfd->ptr && node->parent)
+      target = node->parent;
+    if (!tmpfsDirent(&dirp, &allocatedlimit, hardlimit, target->inode,
+                     S_IFDIR, "..", tfd->ptr + 1, tfd->ptr + 1))
+      goto cleanup;
+    tfd->ptr++;
+  }
+
+  for (TmpfsNode *browse = node->childFirst; browse;
+       browse = browse->siblingNext) {
+    if (browse->order < tfd->ptr)
+      continue;
+    if (!tmpfsDirent(&dirp, &allocatedlimit, hardlimit, browse->inode,
+                     browse->mode, browse->name, browse->nameLen,
+                     browse->order + 1))
+      break;
+    tfd->ptr = browse->order + 1;
+  }
+
+cleanup:
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return allocatedlimit;
+}
+
+int tmpfsUnlink(MountPoint *mount, char *path, bool directory) {
+  Tmpfs *tmpfs = TMPFS_PTR(mount->fsInfo);
+
+  int      ret = 0;
+  uint64_t inode = 0;
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  TmpfsNode *node = tmpfsTraverse(tmpfs, path);
+  if (!node)
+    ret = -ENOENT;
+  else if (node == tmpfs->root)
+    ret = -EBUSY;
+  else if (directory && !S_ISDIR(node->mode))
+    ret = -ENOTDIR;
+  else if (!directory && S_ISDIR(node->mode))
+    ret = -EISDIR;
+  else if (node->childrenCnt)
+    ret = -ENOTEMPTY;
+  else {
+    inode = node->inode;
+    tmpfsNodeUnlink(tmpfs, node);
+  }
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+
+  if (!ret)
+    pageCacheInvalidate(mount, inode);
+  return ret;
+}
+
+int tmpfsMkdir(MountPoint *mount, char *path, int mode) {
+  Tmpfs *tmpfs = TMPFS_PTR(mount->fsInfo);
+
+  int ret = 0;
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  char      *name = 0;
+  size_t     nameLen = 0;
+  TmpfsNode *parent = tmpfsTraverseParent(tmpfs, path, &name, &nameLen);
+  if (!parent)
+    ret = -ENOENT;
+  else if (tmpfsNodeLookup(parent, name, nameLen))
+    ret = -EEXIST;
+  else
+    tmpfsNodeCreate(tmpfs, parent, name, nameLen,
+                    S_IFDIR | ((mode & 07777) ? (mode & 07777) : 0755));
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return ret;
+}
+
+// The file's own pageframe (with a reference for the caller), for the page
+// cache to hand out to mappings as is. 0 past the end of the file
+size_t tmpfsPageShare(OpenFile *fd, size_t index) {
+  Tmpfs     *tmpfs = TMPFS_PTR(fd->mountPoint->fsInfo);
+  TmpfsNode *node = TMPFS_FD_PTR(fd->dir)->node;
+
+  size_t phys = 0;
+  spinlockAcquire(&tmpfs->LOCK_TMPFS);
+  if (index * PAGE_SIZE < node->size)
+    phys = tmpfsPageGet(tmpfs, node, index, true);
+  if (phys)
+    PhysicalShare(phys);
+  spinlockRelease(&tmpfs->LOCK_TMPFS);
+  return phys;
+}
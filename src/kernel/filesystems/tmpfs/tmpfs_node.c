@@ -0,0 +1,251 @@
+#include <bootloader.h>
+#include <linux.h>
+#include <malloc.h>
+#include <paging.h>
+#include <pmm.h>
+#include <string.h>
+#include <system.h>
+#include <timer.h>
+#include <tmpfs.h>
+#include <util.h>
+
+// The in-memory tree: nodes, their (hashed) directory entries & file pages.
+// LOCK_TMPFS has to be held for everything in here
+// Copyright (C) 2024 Panagiotis
+
+// FNV-1a
+uint32_t tmpfsHash(char *name, size_t nameLen) {
+  uint32_t hash = 2166136261;
+  for (size_t i = 0; i < nameLen; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+void tmpfsBucketsInsert(TmpfsNode **buckets, size_t cnt, TmpfsNode *node) {
+  TmpfsNode **bucket = &buckets[node->hash & (cnt - 1)];
+  node->hashNext = *bucket;
+  *bucket = node;
+}
+
+// doubles a crowded directory's buckets
+void tmpfsDirGrow(TmpfsNode *dir) {
+  size_t      cnt = dir->bucketsCnt * 2;
+  TmpfsNode **buckets = (TmpfsNode **)malloc(cnt * sizeof(TmpfsNode *));
+  memset(buckets, 0, cnt * sizeof(TmpfsNode *));
+  for (TmpfsNode *browse = dir->childFirst; browse;
+       browse = browse->siblingNext)
+    tmpfsBucketsInsert(buckets, cnt, browse);
+
+  free(dir->buckets);
+  dir->buckets = buckets;
+  dir->bucketsCnt = cnt;
+}
+
+TmpfsNode *tmpfsNodeLookup(TmpfsNode *dir, char *name, size_t nameLen) {
+  uint32_t   hash = tmpfsHash(name, nameLen);
+  TmpfsNode *browse = dir->buckets[hash & (dir->bucketsCnt - 1)];
+  while (browse) {
+    if (browse->hash == hash && browse->nameLen == nameLen &&
+        memcmp(browse->name, name, nameLen) == 0)
+      return browse;
+    browse = browse->hashNext;
+  }
+  return 0;
+}
+
+TmpfsNode *tmpfsNodeCreate(Tmpfs *tmpfs, TmpfsNode *parent, char *name,
+                           size_t nameLen, uint32_t mode) {
+  TmpfsNode *node = (TmpfsNode *)malloc(sizeof(TmpfsNode) + nameLen + 1);
+  memset(node, 0, sizeof(TmpfsNode) + nameLen + 1);
+  node->inode = tmpfs->nextInode++;
+  node->mode = mode;
+  node->links = 1;
+  node->atime = node->mtime = node->ctime = timerTicks / 1000;
+  node->hash = tmpfsHash(name, nameLen);
+  node->nameLen = nameLen;
+  memcpy(node->name, name, nameLen);
+
+  if (S_ISDIR(mode)) {
+    node->bucketsCnt = TMPFS_DIR_BUCKETS;
+    node->buckets =
+        (TmpfsNode **)malloc(TMPFS_DIR_BUCKETS * sizeof(TmpfsNode *));
+    memset(node->buckets, 0, TMPFS_DIR_BUCKETS * sizeof(TmpfsNode *));
+    node->nextOrder = 2; // (after "." & "..")
+  }
+
+  if (!parent)
+    return node;
+
+  if (parent->childrenCnt >= parent->bucketsCnt * 2)
+    tmpfsDirGrow(parent);
+  tmpfsBucketsInsert(parent->buckets, parent->bucketsCnt, node);
+
+  node->parent = parent;
+  node->order = parent->nextOrder++;
+  node->siblingPrev = parent->childLast;
+  if (parent->childLast)
+    parent->childLast->siblingNext = node;
+  else
+    parent->childFirst = node;
+  parent->childLast = node;
+  parent->childrenCnt++;
+  parent->mtime = parent->ctime = node->ctime;
+  return node;
+}
+
+void tmpfsNodeFree(Tmpfs *tmpfs, TmpfsNode *node) {
+  tmpfsResize(tmpfs, node, 0);
+  if (node->pages)
+    free(node->pages);
+  if (node->buckets)
+    free(node->buckets);
+  free(node);
+}
+
+// Takes a node out of its directory. It's gone right away, unless it's still
+// open somewhere
+void tmpfsNodeUnlink(Tmpfs *tmpfs, TmpfsNode *node) {
+  TmpfsNode  *parent = node->parent;
+  TmpfsNode **browse =
+      &parent->buckets[node->hash & (parent->bucketsCnt - 1)];
+  while (*browse != node)
+    browse = &(*browse)->hashNext;
+  *browse = node->hashNext;
+
+  if (node->siblingPrev)
+    node->siblingPrev->siblingNext = node->siblingNext;
+  else
+    parent->childFirst = node->siblingNext;
+  if (node->siblingNext)
+    node->siblingNext->siblingPrev = node->siblingPrev;
+  else
+    parent->childLast = node->siblingPrev;
+  parent->childrenCnt--;
+  parent->mtime = parent->ctime = timerTicks / 1000;
+
+  node->parent = 0;
+  node->links = 0;
+  if (!node->opens)
+    tmpfsNodeFree(tmpfs, node);
+}
+
+// An fd let go of it
+void tmpfsNodePut(Tmpfs *tmpfs, TmpfsNode *node) {
+  if (!node->opens) {
+    debugf("[tmpfs] Tried to put an unopened node! inode{%ld}\n",
+           node->inode);
+    panic();
+  }
+  if (!--node->opens && !node->links)
+    tmpfsNodeFree(tmpfs, node);
+}
+
+// absolute path (within the mount) -> node
+TmpfsNode *tmpfsTraverse(Tmpfs *tmpfs, char *path) {
+  TmpfsNode *curr = tmpfs->root;
+  size_t     i = 0;
+  while (path[i]) {
+    if (path[i] == '/') {
+      i++;
+      continue;
+    }
+
+    size_t len = 0;
+    while (path[i + len] && path[i + len] != '/')
+      len++;
+    if (!S_ISDIR(curr->mode))
+      return 0;
+
+    if (len == 1 && path[i] == '.')
+      ;
+    else if (len == 2 && path[i] == '.' && path[i + 1] == '.')
+      curr = curr->parent ? curr->parent : curr;
+    else
+      curr = tmpfsNodeLookup(curr, path + i, len);
+    if (!curr)
+      return 0;
+    i += len;
+  }
+  return curr;
+}
+
+// Splits a path into its parent directory (returned) & last component
+TmpfsNode *tmpfsTraverseParent(Tmpfs *tmpfs, char *path, char **name,
+                               size_t *nameLen) {
+  size_t len = strlength(path);
+  while (len > 1 && path[len - 1] == '/')
+    len--;
+  size_t start = len;
+  while (start && path[start - 1] != '/')
+    start--;
+
+  *name = path + start;
+  *nameLen = len - start;
+  if (!*nameLen || *nameLen > 255)
+    return 0;
+
+  char *parentPath = (char *)malloc(start + 1);
+  memcpy(parentPath, path, start);
+  parentPath[start] = '\0';
+  TmpfsNode *parent = tmpfsTraverse(tmpfs, parentPath);
+  free(parentPath);
+
+  if (!parent || !S_ISDIR(parent->mode))
+    return 0;
+  return parent;
+}
+
+// Pageframe behind a file's page, allocated (zeroed) if it's a hole & asked
+// to. 0 if there's none (or no memory/space is left)
+size_t tmpfsPageGet(Tmpfs *tmpfs, TmpfsNode *node, size_t index,
+                    bool allocate) {
+  if (index < node->pagesCapacity && node->pages[index])
+    return node->pages[index];
+  if (!allocate || tmpfs->pages >= tmpfs->pagesMax)
+    return 0;
+
+  if (index >= node->pagesCapacity) {
+    size_t capacity = node->pagesCapacity ? node->pagesCapacity : 16;
+    while (capacity <= index)
+      capacity *= 2;
+    node->pages = (size_t *)realloc(node->pages, capacity * sizeof(size_t));
+    memset(&node->pages[node->pagesCapacity], 0,
+           (capacity - node->pagesCapacity) * sizeof(size_t));
+    node->pagesCapacity = capacity;
+  }
+
+  size_t phys = PhysicalAllocatePageZeroed();
+  if (!phys)
+    return 0;
+  node->pages[index] = phys;
+  node->pagesUsed++;
+  tmpfs->pages++;
+  return phys;
+}
+
+// Pages past the new size are given back, what's left of the last one is
+// zeroed (so it reads as such if the file grows again)
+void tmpfsResize(Tmpfs *tmpfs, TmpfsNode *node, size_t size) {
+  if (size < node->size) {
+    for (size_t i = DivRoundUp(size, PAGE_SIZE); i < node->pagesCapacity;
+         i++) {
+      if (!node->pages[i])
+        continue;
+      PhysicalRelease(node->pages[i]);
+      node->pages[i] = 0;
+      node->pagesUsed--;
+      tmpfs->pages--;
+    }
+
+    size_t tail = size % PAGE_SIZE;
+    size_t phys = tmpfsPageGet(tmpfs, node, size / PAGE_SIZE, false);
+    if (tail && phys)
+      memset((void *)(phys + bootloader.hhdmOffset + tail), 0,
+             PAGE_SIZE - tail);
+  }
+
+  node->size = size;
+  node->mtime = node->ctime = timerTicks / 1000;
+}
@@ -6,16 +6,22 @@
 #include <string.h>
 #include <system.h>
 #include <task.h>
+#include <tmpfs.h>
 #include <util.h>
 #include <vfs.h>
 
 // Simple VFS abstraction to manage filesystems
 // Copyright (C) 2024 Panagiotis
 
+void initiateVfs() {
+  openFileCache = slabCacheCreate("OpenFile", sizeof(OpenFile), 0, 0);
+  specialFileCache = slabCacheCreate("SpecialFile", sizeof(SpecialFile), 0, 0);
+}
+
 OpenFile *fsRegisterNode(Task *task) {
   spinlockCntWriteAcquire(&task->WLOCK_FILES);
   OpenFile *ret =
-      LinkedListAllocate((void **)&task->firstFile, sizeof(OpenFile));
+      LinkedListAllocateCache((void **)&task->firstFile, openFileCache);
   spinlockCntWriteRelease(&task->WLOCK_FILES);
   return ret;
 }
@@ -61,11 +67,16 @@ OpenFile *fsOpenGeneric(char *filename, Task *task, int flags, int mode) {
     return target;
   }
 
-  MountPoint *mnt = fsDetermineMountPoint(safeFilename);
+  // known not to exist (& not about to be created)
+  uint64_t    generation = fsDcacheGeneration();
+  bool        creating = flags & O_CREAT;
+  MountPoint *mnt = 0;
+  if (creating || !fsDcachePathMissing(safeFilename))
+    mnt = fsDetermineMountPoint(safeFilename);
   if (!mnt) {
     // no mountpoint for this
     fsUnregisterNode(task, target);
-    free(target);
+    slabFree(target);
     free(safeFilename);
     return 0;
   }
@@ -73,14 +84,19 @@ OpenFile *fsOpenGeneric(char *filename, Task *task, int flags, int mode) {
   target->handlers = &fsSpecific;
 
   bool res = fsSpecificOpen(safeFilename, mnt, target);
+  // (O_DIRECTORY also fails on ones that exist)
+  if (!res && !(flags & (O_CREAT | O_DIRECTORY)))
+    fsDcachePathMiss(safeFilename, generation);
   free(safeFilename);
 
   if (!res) {
     // failed to open
     fsUnregisterNode(task, target);
-    free(target);
+    slabFree(target);
     return 0;
   }
+  if (creating)
+    fsDcachePathsChanged();
 
   if (target->handlers->open)
     target->handlers->open(target);
@@ -89,7 +105,7 @@ OpenFile *fsOpenGeneric(char *filename, Task *task, int flags, int mode) {
 
 // returns an ORPHAN!
 OpenFile *fsUserDuplicateNodeUnsafe(OpenFile *original) {
-  OpenFile *orphan = (OpenFile *)malloc(sizeof(OpenFile));
+  OpenFile *orphan = (OpenFile *)slabAllocate(openFileCache);
   orphan->next = 0; // duh
 
   memcpy((void *)((size_t)orphan + sizeof(orphan->next)),
@@ -98,7 +114,7 @@ OpenFile *fsUserDuplicateNodeUnsafe(OpenFile *original) {
 
   if (original->handlers->duplicate &&
       !original->handlers->duplicate(original, orphan)) {
-    free(orphan);
+    slabFree(orphan);
     return 0;
   }
 
@@ -177,7 +193,7 @@ bool fsCloseGeneric(OpenFile *file, Task *task) {
   fsUnregisterNode(task, file);
 
   bool res = file->handlers->close ? file->handlers->close(file) : true;
-  free(file);
+  slabFree(file);
   return res;
 }
 
@@ -256,6 +272,9 @@ int fsReadlink(void *task, char *path, char *buf, int size) {
   case FS_EXT2:
     ret = ext2Readlink((Ext2 *)(mnt->fsInfo), safeFilename, buf, size);
     break;
+  case FS_TMPFS: // (no symbolic links)
+    ret = -EINVAL;
+    break;
   default:
     debugf("[vfs] Tried to readLink() with bad filesystem! id{%d}\n",
            mnt->filesystem);
@@ -265,3 +284,102 @@ int fsReadlink(void *task, char *path, char *buf, int size) {
   free(safeFilename);
   return ret;
 }
+
+int fsTruncate(OpenFile *file, size_t length) {
+  if (file->mountPoint == MOUNT_POINT_SPECIAL)
+    return -EINVAL;
+  if (!(file->flags & (O_WRONLY | O_RDWR)))
+    return -EBADF;
+  return fsSpecificTruncate(file, length);
+}
+
+// resolves a path for the operations below, 0 if it's special or nowhere
+MountPoint *fsUserResolve(void *task, char *filename, char **safeFilename,
+                          int *error) {
+  Task *target = task;
+  *safeFilename = fsSanitize(target->cwd, filename);
+  if (fsUserGetSpecialByFilename(task, *safeFilename)) {
+    *error = -EPERM;
+    return 0;
+  }
+
+  MountPoint *mnt = fsDetermineMountPoint(*safeFilename);
+  if (!mnt)
+    *error = -ENOENT;
+  return mnt;
+}
+
+int fsUserUnlinkGeneric(void *task, char *filename, bool directory) {
+  char       *safeFilename = 0;
+  int         ret = -1;
+  MountPoint *mnt = fsUserResolve(task, filename, &safeFilename, &ret);
+  if (!mnt) {
+    free(safeFilename);
+    return ret;
+  }
+
+  char *strippedFilename = fsStripMountpoint(safeFilename, mnt);
+  switch (mnt->filesystem) {
+  case FS_FATFS:
+    ret = -EROFS;
+    break;
+  case FS_EXT2:
+    if (directory) {
+      debugf("[vfs] todo: ext2 directory removal!\n");
+      ret = -ENOSYS;
+    } else
+      ret = ext2Unlink(mnt, strippedFilename);
+    break;
+  case FS_TMPFS:
+    ret = tmpfsUnlink(mnt, strippedFilename, directory);
+    break;
+  default:
+    debugf("[vfs] Tried to unlink() with bad filesystem! id{%d}\n",
+           mnt->filesystem);
+    break;
+  }
+
+  free(safeFilename);
+  return ret;
+}
+
+int fsUserUnlink(void *task, char *filename) {
+  return fsUserUnlinkGeneric(task, filename, false);
+}
+
+int fsUserRmdir(void *task, char *filename) {
+  return fsUserUnlinkGeneric(task, filename, true);
+}
+
+int fsUserMkdir(void *task, char *filename, int mode) {
+  char       *safeFilename = 0;
+  int         ret = -1;
+  MountPoint *mnt = fsUserResolve(task, filename, &safeFilename, &ret);
+  if (!mnt) {
+    free(safeFilename);
+    return ret;
+  }
+
+  char *strippedFilename = fsStripMountpoint(safeFilename, mnt);
+  switch (mnt->filesystem) {
+  case FS_FATFS:
+    ret = -EROFS;
+    break;
+  case FS_EXT2:
+    debugf("[vfs] todo: ext2 directory creation!\n");
+    ret = -ENOSYS;
+    break;
+  case FS_TMPFS:
+    ret = tmpfsMkdir(mnt, strippedFilename, mode);
+    break;
+  default:
+    debugf("[vfs] Tried to mkdir() with bad filesystem! id{%d}\n",
+           mnt->filesystem);
+    break;
+  }
+  if (ret == 0)
+    fsDcachePathsChanged();
+
+  free(safeFilename);
+  return ret;
+}
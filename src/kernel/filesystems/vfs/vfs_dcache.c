@@ -0,0 +1,201 @@
+#include <malloc.h>
+#include <string.h>
+#include <system.h>
+#include <util.h>
+#include <vfs.h>
+
+// Dentry (path component lookup) cache: repeated lookups of the same paths,
+// and of the ones that don't exist (PATH searches, the dynamic loader probing
+// library directories), get resolved in memory
+// Copyright (C) 2024 Panagiotis
+
+Spinlock LOCK_DCACHE = ATOMIC_FLAG_INIT;
+
+// FNV-1a over the name, mixed with where it's looked up from
+uint32_t fsDcacheHash(void *fs, uint64_t parent, char *name, size_t nameLen) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < nameLen; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  hash ^= (uint32_t)parent * 0x9e3779b1;
+  hash ^= (uint32_t)((size_t)fs >> 4);
+  return hash;
+}
+
+/* Helpers (LOCK_DCACHE has to be held) */
+
+void fsDcacheLruRemove(Dentry *dentry) {
+  if (dentry->lruPrev)
+    dentry->lruPrev->lruNext = dentry->lruNext;
+  else
+    dcache.lruFirst = dentry->lruNext;
+  if (dentry->lruNext)
+    dentry->lruNext->lruPrev = dentry->lruPrev;
+  else
+    dcache.lruLast = dentry->lruPrev;
+  dentry->lruPrev = 0;
+  dentry->lruNext = 0;
+}
+
+void fsDcacheLruPush(Dentry *dentry) {
+  dentry->lruPrev = 0;
+  dentry->lruNext = dcache.lruFirst;
+  if (dcache.lruFirst)
+    dcache.lruFirst->lruPrev = dentry;
+  else
+    dcache.lruLast = dentry;
+  dcache.lruFirst = dentry;
+}
+
+Dentry *fsDcacheFindUnsafe(void *fs, uint64_t parent, char *name,
+                           size_t nameLen, uint32_t hash) {
+  Dentry *browse = dcache.buckets[hash % DCACHE_BUCKETS];
+  while (browse) {
+    if (browse->hash == hash && browse->fs == fs && browse->parent == parent &&
+        browse->nameLen == nameLen && memcmp(browse->name, name, nameLen) == 0)
+      return browse;
+    browse = browse->hashNext;
+  }
+  return 0;
+}
+
+void fsDcacheRemoveUnsafe(Dentry *dentry) {
+  Dentry **browse = &dcache.buckets[dentry->hash % DCACHE_BUCKETS];
+  while (*browse != dentry)
+    browse = &(*browse)->hashNext;
+  *browse = dentry->hashNext;
+
+  fsDcacheLruRemove(dentry);
+  dcache.cnt--;
+  free(dentry);
+}
+
+/* Generic operations */
+
+// Returns true if (parent, name) is known, with inode being 0 if it's known
+// NOT to exist
+bool fsDcacheLookup(void *fs, uint64_t parent, char *name, size_t nameLen,
+                    uint64_t *inode) {
+  uint32_t hash = fsDcacheHash(fs, parent, name, nameLen);
+
+  spinlockAcquire(&LOCK_DCACHE);
+  Dentry *dentry = fsDcacheFindUnsafe(fs, parent, name, nameLen, hash);
+  if (dentry && parent == DCACHE_PATH &&
+      dentry->generation != dcache.generation) {
+    fsDcacheRemoveUnsafe(dentry);
+    dentry = 0;
+  }
+  if (!dentry) {
+    dcache.misses++;
+    spinlockRelease(&LOCK_DCACHE);
+    return false;
+  }
+
+  if (dentry->inode)
+    dcache.hits++;
+  else
+    dcache.negativeHits++;
+  fsDcacheLruRemove(dentry);
+  fsDcacheLruPush(dentry);
+  *inode = dentry->inode;
+  spinlockRelease(&LOCK_DCACHE);
+
+  return true;
+}
+
+// Where things stand before a filesystem lookup, for fsDcacheInsert()
+uint64_t fsDcacheGeneration() {
+  spinlockAcquire(&LOCK_DCACHE);
+  uint64_t ret = dcache.generation;
+  spinlockRelease(&LOCK_DCACHE);
+  return ret;
+}
+
+// Records the result of a lookup that started at generation. Anything that
+// changed meanwhile might've made it stale already, so it's dropped then
+void fsDcacheInsert(void *fs, uint64_t parent, char *name, size_t nameLen,
+                    uint64_t inode, uint64_t generation) {
+  uint32_t hash = fsDcacheHash(fs, parent, name, nameLen);
+
+  spinlockAcquire(&LOCK_DCACHE);
+  if (generation != dcache.generation) {
+    spinlockRelease(&LOCK_DCACHE);
+    return;
+  }
+  Dentry *dentry = fsDcacheFindUnsafe(fs, parent, name, nameLen, hash);
+  if (dentry) { // raced with someone else, just refresh it
+    dentry->inode = inode;
+    dentry->generation = dcache.generation;
+    spinlockRelease(&LOCK_DCACHE);
+    return;
+  }
+
+  dentry = (Dentry *)malloc(sizeof(Dentry) + nameLen + 1);
+  memset(dentry, 0, sizeof(Dentry));
+  dentry->fs = fs;
+  dentry->parent = parent;
+  dentry->inode = inode;
+  dentry->generation = dcache.generation;
+  dentry->hash = hash;
+  dentry->nameLen = nameLen;
+  memcpy(dentry->name, name, nameLen);
+  dentry->name[nameLen] = '\0';
+
+  dentry->hashNext = dcache.buckets[hash % DCACHE_BUCKETS];
+  dcache.buckets[hash % DCACHE_BUCKETS] = dentry;
+  fsDcacheLruPush(dentry);
+  dcache.cnt++;
+
+  while (dcache.cnt > DCACHE_MAX)
+    fsDcacheRemoveUnsafe(dcache.lruLast);
+  spinlockRelease(&LOCK_DCACHE);
+}
+
+// Has to be called whenever a directory entry is created/removed/renamed
+void fsDcacheInvalidate(void *fs, uint64_t parent, char *name, size_t nameLen) {
+  uint32_t hash = fsDcacheHash(fs, parent, name, nameLen);
+
+  spinlockAcquire(&LOCK_DCACHE);
+  Dentry *dentry = fsDcacheFindUnsafe(fs, parent, name, nameLen, hash);
+  if (dentry)
+    fsDcacheRemoveUnsafe(dentry);
+  dcache.generation++;
+  spinlockRelease(&LOCK_DCACHE);
+}
+
+// Drops everything of a filesystem that's going away (its fsInfo can be
+// reused by the next mount)
+void fsDcachePurge(void *fs) {
+  spinlockAcquire(&LOCK_DCACHE);
+  Dentry *browse = dcache.lruFirst;
+  while (browse) {
+    Dentry *next = browse->lruNext;
+    if (browse->fs == fs)
+      fsDcacheRemoveUnsafe(browse);
+    browse = next;
+  }
+  dcache.generation++;
+  spinlockRelease(&LOCK_DCACHE);
+}
+
+/* Whole paths (sanitized & absolute), only negative ones */
+
+bool fsDcachePathMissing(char *safeFilename) {
+  uint64_t inode = 0;
+  return fsDcacheLookup(0, DCACHE_PATH, safeFilename, strlength(safeFilename),
+                        &inode) &&
+         !inode;
+}
+
+void fsDcachePathMiss(char *safeFilename, uint64_t generation) {
+  fsDcacheInsert(0, DCACHE_PATH, safeFilename, strlength(safeFilename), 0,
+                 generation);
+}
+
+// Has to be called whenever something's created, removed or mounted
+void fsDcachePathsChanged() {
+  spinlockAcquire(&LOCK_DCACHE);
+  dcache.generation++;
+  spinlockRelease(&LOCK_DCACHE);
+}
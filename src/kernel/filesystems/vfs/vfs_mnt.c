@@ -6,6 +6,7 @@
 #include <string.h>
 #include <system.h>
 #include <task.h>
+#include <tmpfs.h>
 #include <util.h>
 #include <vfs.h>
 
@@ -16,6 +17,8 @@ bool fsUnmount(MountPoint *mnt) {
   debugf("[vfs] Tried to unmount!\n");
   panic();
   LinkedListUnregister((void **)&firstMountPoint, mnt);
+  if (mnt->fsInfo)
+    fsDcachePurge(mnt->fsInfo);
 
   // todo!
   // switch (mnt->filesystem) {
@@ -25,14 +28,14 @@ bool fsUnmount(MountPoint *mnt) {
   // }
 
   free(mnt->prefix);
-  free(mnt);
+  slabFree(mnt);
 
   return true;
 }
 
-bool isFat(mbr_partition *mbr) {
+bool isFat(uint32_t disk, mbr_partition *mbr) {
   uint8_t *rawArr = (uint8_t *)malloc(SECTOR_SIZE);
-  getDiskBytes(rawArr, mbr->lba_first_sector, 1);
+  getDiskBytes(disk, rawArr, mbr->lba_first_sector, 1);
 
   bool ret = (rawArr[66] == 0x28 || rawArr[66] == 0x29);
 
@@ -66,7 +69,7 @@ MountPoint *fsMount(char *prefix, CONNECTOR connector, uint32_t disk,
       return 0;
     }
 
-    if (isFat(&mount->mbr)) {
+    if (isFat(disk, &mount->mbr)) {
       mount->filesystem = FS_FATFS;
       ret = fat32Mount(mount);
     } else if (isExt2(&mount->mbr)) {
@@ -74,6 +77,10 @@ MountPoint *fsMount(char *prefix, CONNECTOR connector, uint32_t disk,
       ret = ext2Mount(mount);
     }
     break;
+  case CONNECTOR_TMPFS: // (no disk behind it)
+    mount->filesystem = FS_TMPFS;
+    ret = tmpfsMount(mount);
+    break;
   default:
     debugf("[vfs] Tried to mount with bad connector! id{%d}\n", connector);
     ret = 0;
@@ -85,6 +92,9 @@ MountPoint *fsMount(char *prefix, CONNECTOR connector, uint32_t disk,
     return 0;
   }
 
+  // whatever was missing under the prefix might be there now
+  fsDcachePathsChanged();
+
   if (!systemDiskInit && strlength(prefix) == 1 && prefix[0] == '/')
     systemDiskInit = true;
   return mount;
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <system.h>
 #include <task.h>
+#include <tmpfs.h>
 #include <util.h>
 #include <vfs.h>
 
@@ -25,6 +26,9 @@ bool fsSpecificClose(OpenFile *file) {
   case FS_EXT2:
     res = ext2Close(file->mountPoint, file);
     break;
+  case FS_TMPFS:
+    res = tmpfsClose(file->mountPoint, file);
+    break;
   default:
     debugf("[vfs] Tried to close with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -45,6 +49,9 @@ bool fsSpecificOpen(char *filename, MountPoint *mnt, OpenFile *target) {
   case FS_EXT2:
     res = ext2Open(mnt, target, strippedFilename);
     break;
+  case FS_TMPFS:
+    res = tmpfsOpen(mnt, target, strippedFilename);
+    break;
   default:
     debugf("[vfs] Tried to open with bad filesystem! id{%d}\n",
            target->mountPoint->filesystem);
@@ -63,6 +70,9 @@ int fsSpecificRead(OpenFile *file, uint8_t *out, size_t limit) {
   case FS_EXT2:
     ret = ext2Read(file->mountPoint, file, out, limit);
     break;
+  case FS_TMPFS:
+    ret = tmpfsRead(file->mountPoint, file, out, limit);
+    break;
   default:
     debugf("[vfs] Tried to read with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -73,15 +83,17 @@ int fsSpecificRead(OpenFile *file, uint8_t *out, size_t limit) {
 }
 
 int fsSpecificWrite(OpenFile *file, uint8_t *in, size_t limit) {
-  if (1 == 1) // todo!
-    return 0;
-
-  uint32_t ret = 0;
+  int ret = 0;
   switch (file->mountPoint->filesystem) {
-  case FS_FATFS: {
-    // a
+  case FS_FATFS: // (read-only)
+    ret = 0;
+    break;
+  case FS_EXT2:
+    ret = ext2Write(file->mountPoint, file, in, limit);
+    break;
+  case FS_TMPFS:
+    ret = tmpfsWrite(file->mountPoint, file, in, limit);
     break;
-  }
   default:
     debugf("[vfs] Tried to write with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -92,13 +104,14 @@ int fsSpecificWrite(OpenFile *file, uint8_t *in, size_t limit) {
 }
 
 bool fsSpecificWriteSync(OpenFile *file) {
-  if (1 == 1) // todo!
-    return false;
-
   bool ret = false;
   switch (file->mountPoint->filesystem) {
-  case FS_FATFS:
-    // a
+  case FS_FATFS: // (read-only, nothing to sync)
+  case FS_TMPFS:  // (nowhere to sync to)
+    ret = true;
+    break;
+  case FS_EXT2:
+    ret = ext2Sync(file->mountPoint);
     break;
   default:
     debugf("[vfs] Tried to writeSync with bad filesystem! id{%d}\n",
@@ -109,6 +122,26 @@ bool fsSpecificWriteSync(OpenFile *file) {
   return ret;
 }
 
+int fsSpecificTruncate(OpenFile *file, size_t length) {
+  int ret = -EINVAL;
+  switch (file->mountPoint->filesystem) {
+  case FS_FATFS:
+    ret = -EROFS;
+    break;
+  case FS_EXT2:
+    ret = ext2Truncate(file->mountPoint, file, length);
+    break;
+  case FS_TMPFS:
+    ret = tmpfsTruncate(file->mountPoint, file, length);
+    break;
+  default:
+    debugf("[vfs] Tried to truncate with bad filesystem! id{%d}\n",
+           file->mountPoint->filesystem);
+    break;
+  }
+  return ret;
+}
+
 size_t fsSpecificGetFilesize(OpenFile *file) {
   switch (file->mountPoint->filesystem) {
   case FS_FATFS:
@@ -117,6 +150,9 @@ size_t fsSpecificGetFilesize(OpenFile *file) {
   case FS_EXT2:
     return ext2GetFilesize(file);
     break;
+  case FS_TMPFS:
+    return tmpfsGetFilesize(file);
+    break;
   default:
     debugf("[vfs] Tried to getFilesize with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -143,6 +179,11 @@ int fsSpecificSeek(OpenFile *file, int target, int offset, int whence) {
       target += ((Ext2OpenFd *)file->dir)->ptr;
     ret = ext2Seek(file->mountPoint, file, target);
     break;
+  case FS_TMPFS:
+    if (whence == SEEK_CURR)
+      target += ((TmpfsOpenFd *)file->dir)->ptr;
+    ret = tmpfsSeek(file->mountPoint, file, target);
+    break;
   default:
     debugf("[vfs] Tried to seek with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -160,6 +201,8 @@ bool fsSpecificDuplicateNodeUnsafe(OpenFile *original, OpenFile *orphan) {
   case FS_FATFS:
     orphan->dir = malloc(sizeof(FAT32OpenFd));
     memcpy(orphan->dir, original->dir, sizeof(FAT32OpenFd));
+    fat32RunMapDuplicate(&FAT_DIR_PTR(orphan->dir)->runs,
+                         &FAT_DIR_PTR(original->dir)->runs);
 
     if (original->dirname) {
       size_t len = strlength(original->dirname) + 1;
@@ -171,19 +214,11 @@ bool fsSpecificDuplicateNodeUnsafe(OpenFile *original, OpenFile *orphan) {
     orphan->dir = malloc(sizeof(Ext2OpenFd));
     memcpy(orphan->dir, original->dir, sizeof(Ext2OpenFd));
 
-    Ext2       *ext2 = EXT2_PTR(orphan->mountPoint->fsInfo);
     Ext2OpenFd *dir = EXT2_DIR_PTR(orphan->dir);
     Ext2OpenFd *dirOriginal = EXT2_DIR_PTR(original->dir);
 
-    if (dir->lookup.tmp1) {
-      dir->lookup.tmp1 = malloc(ext2->blockSize);
-      memcpy(dir->lookup.tmp1, dirOriginal->lookup.tmp1, ext2->blockSize);
-    }
-
-    if (dir->lookup.tmp2) {
-      dir->lookup.tmp2 = malloc(ext2->blockSize);
-      memcpy(dir->lookup.tmp2, dirOriginal->lookup.tmp2, ext2->blockSize);
-    }
+    ext2ExtentMapDuplicate(&dir->extents, &dirOriginal->extents);
+    ext2InodeOpen(EXT2_PTR(orphan->mountPoint->fsInfo), dir->inodeNum);
 
     if (original->dirname) {
       size_t len = strlength(original->dirname) + 1;
@@ -191,6 +226,9 @@ bool fsSpecificDuplicateNodeUnsafe(OpenFile *original, OpenFile *orphan) {
       memcpy(orphan->dirname, original->dirname, len);
     }
     break;
+  case FS_TMPFS:
+    return tmpfsDuplicate(original, orphan);
+    break;
   default:
     debugf("[vfs] Tried to duplicateNode with bad filesystem! id{%d}\n",
            orphan->mountPoint->filesystem);
@@ -209,6 +247,9 @@ int fsSpecificStat(OpenFile *fd, stat *target) {
   case FS_EXT2:
     ret = ext2StatFd(fd->mountPoint->fsInfo, fd, target);
     break;
+  case FS_TMPFS:
+    ret = tmpfsStatFd(fd->mountPoint->fsInfo, fd, target);
+    break;
   default:
     debugf("[vfs] Tried to stat with bad filesystem! id{%d}\n",
            fd->mountPoint->filesystem);
@@ -233,6 +274,9 @@ int fsSpecificGetdents64(OpenFile *file, void *task,
   case FS_EXT2:
     ret = ext2Getdents64(file, dirp, count);
     break;
+  case FS_TMPFS:
+    ret = tmpfsGetdents64(file, dirp, count);
+    break;
   default:
     debugf("[vfs] Tried to getdents64 with bad filesystem! id{%d}\n",
            file->mountPoint->filesystem);
@@ -38,8 +38,8 @@ bool fsUserOpenSpecial(void **firstSpecial, char *filename, void *taskPtr,
   Task *task = (Task *)taskPtr;
 
   spinlockCntWriteAcquire(&task->WLOCK_SPECIAL);
-  SpecialFile *target = (SpecialFile *)LinkedListAllocate(
-      (void **)(firstSpecial), sizeof(SpecialFile));
+  SpecialFile *target = (SpecialFile *)LinkedListAllocateCache(
+      (void **)(firstSpecial), specialFileCache);
   spinlockCntWriteRelease(&task->WLOCK_SPECIAL);
 
   size_t filenameLen = strlength(filename) + 1; // null terminated
@@ -55,7 +55,7 @@ bool fsUserOpenSpecial(void **firstSpecial, char *filename, void *taskPtr,
 
 // returns an ORPHAN!
 SpecialFile *fsUserDuplicateSpecialNodeUnsafe(SpecialFile *original) {
-  SpecialFile *orphan = (SpecialFile *)malloc(sizeof(SpecialFile));
+  SpecialFile *orphan = (SpecialFile *)slabAllocate(specialFileCache);
   orphan->next = 0; // duh
 
   memcpy((void *)((size_t)orphan + sizeof(orphan->next)),
@@ -3,6 +3,7 @@
 #include <linux.h>
 #include <malloc.h>
 #include <task.h>
+#include <tmpfs.h>
 #include <util.h>
 #include <vfs.h>
 
@@ -24,6 +25,12 @@ bool fsStatByFilename(void *task, char *filename, stat *target) {
     return special->handlers->stat(0, target) == 0;
   }
 
+  uint64_t generation = fsDcacheGeneration();
+  if (fsDcachePathMissing(safeFilename)) {
+    free(safeFilename);
+    return false;
+  }
+
   MountPoint *mnt = fsDetermineMountPoint(safeFilename);
   bool        ret = false;
   char       *strippedFilename = fsStripMountpoint(safeFilename, mnt);
@@ -34,12 +41,17 @@ bool fsStatByFilename(void *task, char *filename, stat *target) {
   case FS_EXT2:
     ret = ext2Stat(mnt->fsInfo, strippedFilename, target);
     break;
+  case FS_TMPFS:
+    ret = tmpfsStat(mnt->fsInfo, strippedFilename, target);
+    break;
   default:
     debugf("[vfs] Tried to stat with bad filesystem! id{%d}\n",
            mnt->filesystem);
     break;
   }
 
+  if (!ret)
+    fsDcachePathMiss(safeFilename, generation);
   free(safeFilename);
   return ret;
 }
@@ -64,6 +76,9 @@ bool fsLstatByFilename(void *task, char *filename, stat *target) {
   case FS_EXT2:
     ret = ext2Lstat(mnt->fsInfo, strippedFilename, target);
     break;
+  case FS_TMPFS: // (no symbolic links either)
+    ret = tmpfsStat(mnt->fsInfo, strippedFilename, target);
+    break;
   default:
     debugf("[vfs] Tried to stat with bad filesystem! id{%d}\n",
            mnt->filesystem);
@@ -3,7 +3,9 @@
 #include <paging.h>
 #include <stdarg.h>
 #include <system.h>
+#include <task.h>
 #include <util.h>
+#include <vma.h>
 
 // System framebuffer manager
 // Copyright (C) 2024 Panagiotis
@@ -65,13 +67,22 @@ int fbUserIoctl(OpenFile *fd, uint64_t request, void *arg) {
 
 size_t fbUserMmap(size_t addr, size_t length, int prot, int flags, OpenFile *fd,
                   size_t pgoffset) {
-  size_t targPages = DivRoundUp(length, PAGE_SIZE);
+  // todo: get rid of hardcoded location!
+  size_t base = 0x100000000000;
+  length = DivRoundUp(length, PAGE_SIZE) * PAGE_SIZE;
+
+  // an area like any other, so munmap() & MAP_FIXED see it. The framebuffer
+  // can sit inside the buddy's range, so its pages are marked as device ones
+  // that nothing ever refcounts or releases
+  vmaUnmap(currentTask, base, base + length);
+  vmaInsert(currentTask, base, base + length,
+            VMA_READ | VMA_WRITE | VMA_SHARED | VMA_DEVICE);
+
+  // 2MiB pages for the most part (when the framebuffer's aligned to them)
   size_t physStart = VirtualToPhysical((size_t)framebuffer);
-  for (int i = 0; i < targPages; i++) {
-    VirtualMap(0x100000000000 + i * PAGE_SIZE, physStart + i * PAGE_SIZE,
-               PF_RW | PF_USER);
-  } // todo: get rid of hardcoded location!
-  return 0x100000000000;
+  VirtualMapRegionByLength(base, physStart, length,
+                           PF_RW | PF_USER | PF_SHARED | PF_DEVICE);
+  return base;
 }
 
 int fbUserStat(OpenFile *fd, stat *target) {
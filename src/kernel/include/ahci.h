@@ -1,3 +1,4 @@
+#include "block_device.h"
 #include "pci.h"
 #include "types.h"
 
@@ -386,6 +387,9 @@ static const AHCI_DEVICE ahci_ids[] = {
 #define ATA_CMD_READ_DMA_EX 0x25
 #define ATA_CMD_WRITE_DMA 0xCA
 #define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_IDENTIFY 0xEC
 
 #define HBA_PxCMD_ST 0x0001
 #define HBA_PxCMD_FRE 0x0010
@@ -410,7 +414,17 @@ static const AHCI_DEVICE ahci_ids[] = {
 #define HBA_PORT_IPM_ACTIVE 1
 #define HBA_PORT_DET_PRESENT 3
 
+#define HBA_PxIS_DHRS (1 << 0) // D2H register FIS (non-queued completion)
+#define HBA_PxIS_SDBS (1 << 3) // Set device bits FIS (queued completion)
+#define HBA_PxIS_IFS (1 << 27)
+#define HBA_PxIS_HBDS (1 << 28)
+#define HBA_PxIS_HBFS (1 << 29)
 #define HBA_PxIS_TFES (1 << 30)
+#define HBA_PxIS_ERRORS                                                        \
+  (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
+#define AHCI_CAP_SNCQ (1 << 30)                     // supports NCQ
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // command slots
 
 typedef volatile struct tagHBA_PORT {
   uint32_t clb;       // 0x00, command list base address, 1K-byte aligned
@@ -543,7 +557,18 @@ typedef struct tagHBA_CMD_TBL {
   prdt_entry[1]; // Physical region descriptor table entries, 0 ~ 65535
 } HBA_CMD_TBL;
 
-#define AHCI_CALC_PRDT(sectors) ((uint16_t)((sectors - 1) >> 4) + 1)
+// One PRDT entry covers up to 4M of physically contiguous memory
+#define AHCI_PRDT_BYTES_MAX (4 * 1024 * 1024)
+
+// Largest single command the block device layer gets to send
+#define AHCI_SECTORS_MAX 512
+
+// Every command slot gets its own table, big enough to describe the largest
+// command page by page: 64 pages + 1 for an unaligned start of every (merged)
+// segment, which keeps the tables 128-byte aligned as well
+#define AHCI_PRDT_MAX (64 + BLOCK_MERGE_MAX)
+#define AHCI_CMD_TBL_SIZE                                                      \
+  (sizeof(HBA_CMD_TBL) + (AHCI_PRDT_MAX - 1) * sizeof(HBA_PRDT_ENTRY))
 
 typedef enum {
   FIS_TYPE_REG_H2D = 0x27,   // Register FIS - host to device
@@ -556,11 +581,27 @@ typedef enum {
   FIS_TYPE_DEV_BITS = 0xA1,  // Set device bits FIS - device to host
 } FIS_TYPE;
 
+// Per-port request queue: every command slot is a request in flight. Issuers
+// sleep (or poll, when they can't) until the interrupt handler reaps theirs
+typedef struct AhciPortQueue {
+  bool     ncq;   // READ/WRITE FPDMA QUEUED, instead of one command at a time
+  uint32_t slots; // usable command slots (min of HBA slots & device depth)
+
+  // slot bitmaps, only touched with interrupts off
+  volatile uint32_t busy;   // handed out to an issuer
+  volatile uint32_t issued; // sent to the HBA, not reaped yet
+  volatile uint32_t done;   // reaped, waiting for its issuer
+  volatile uint32_t failed; // reaped with an error
+
+  struct Task *waiters[32]; // sleeping issuer of every slot (if any)
+} AhciPortQueue;
+
 typedef struct ahci ahci;
 
 struct ahci {
   void              *clbVirt[32];
   void              *ctbaVirt[32];
+  AhciPortQueue      queues[32];
   uint32_t           sata; // bitmap (32 ports -> 32 bits)
   const AHCI_DEVICE *bsdInfo;
   HBA_MEM           *mem;
@@ -571,5 +612,7 @@ bool ahciRead(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
               uint32_t starth, uint32_t count, uint8_t *buff);
 bool ahciWrite(ahci *ahciPtr, uint32_t portId, HBA_PORT *port, uint32_t startl,
                uint32_t starth, uint32_t count, uint8_t *buff);
+bool ahciBlockTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                       BlockSegment *segments, int cnt, bool write);
 
 #endif
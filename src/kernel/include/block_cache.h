@@ -0,0 +1,77 @@
+#include "disk.h"
+#include "types.h"
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+// Kernel-wide cache of disk sectors, in chunks of one pageframe
+#define BLOCK_CACHE_SECTORS 8 // 4096 / SECTOR_SIZE
+#define BLOCK_CACHE_BUCKETS 1024
+
+// Sized from the RAM available at boot (1/BLOCK_CACHE_RAM_SHARE of it)
+#define BLOCK_CACHE_RAM_SHARE 32
+#define BLOCK_CACHE_MIN 64    // chunks (256KiB)
+#define BLOCK_CACHE_MAX 16384 // chunks (64MiB)
+
+// Sequential read-ahead window (in bytes), grows from MIN to MAX by doubling.
+// MAX is the biggest single transfer getDiskBytes() issues
+#define READ_AHEAD_MIN (16 * 1024)
+#define READ_AHEAD_MAX (256 * 1024)
+
+typedef struct BlockCacheEntry BlockCacheEntry;
+struct BlockCacheEntry {
+  BlockCacheEntry *hashNext;
+
+  // LRU list, most recently used first
+  BlockCacheEntry *lruPrev;
+  BlockCacheEntry *lruNext;
+
+  uint32_t device;
+  uint32_t chunk; // LBA / BLOCK_CACHE_SECTORS
+  uint8_t *data;  // pageframe (through the HHDM)
+
+  // Pinned entries are never recycled: they're being copied out of (refs)
+  // or read from the disk, without LOCK_BLOCK_CACHE held (loading)
+  uint32_t      refs;
+  volatile bool loading;
+};
+
+typedef struct BlockCache {
+  BlockCacheEntry *buckets[BLOCK_CACHE_BUCKETS];
+  BlockCacheEntry *lruFirst;
+  BlockCacheEntry *lruLast;
+
+  size_t entries;
+  size_t capacity;
+
+  // statistics
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t prefetched; // chunks brought in by read-ahead
+} BlockCache;
+
+// Per open file access pattern (kept by the filesystems' open fds)
+typedef struct ReadAhead {
+  size_t next;   // where a sequential read() would continue from
+  size_t ahead;  // already prefetched up to here
+  size_t window; // current window size (0 while the access is random)
+} ReadAhead;
+
+BlockCache blockCache;
+
+void initiateBlockCache();
+
+void blockCacheRead(uint32_t device, uint8_t *target_address, uint32_t LBA,
+                    size_t sector_count);
+void blockCacheReadUnaligned(uint32_t device, uint8_t *target_address,
+                             uint32_t LBA, size_t offset, size_t length);
+void blockCachePrefetch(uint32_t device, uint32_t LBA, size_t sector_count);
+void blockCacheInvalidate(uint32_t device, uint32_t LBA, size_t sector_count);
+
+bool blockCacheReadAhead(ReadAhead *ra, size_t ptr, size_t len, size_t *start,
+                         size_t *end);
+
+int blockCacheStats(char *out, size_t limit);
+
+#endif
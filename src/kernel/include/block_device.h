@@ -0,0 +1,96 @@
+#include "spinlock.h"
+#include "types.h"
+
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+// Registered in discovery order: disk 0 is sda, disk 1 is sdb and so on
+#define BLOCK_DEVICES_MAX 26
+
+// Queued requests (same direction, consecutive sectors) are merged into a
+// single command, up to this many of them
+#define BLOCK_MERGE_MAX 16
+
+// Requests waiting for longer than this (in timer ticks, ~ms) are dispatched
+// before anything else, so the elevator can't starve far away regions
+#define BLOCK_REQUEST_EXPIRE 500
+
+// One piece of a (vectored) transfer
+typedef struct BlockSegment {
+  uint8_t *buff;
+  uint32_t bytes;
+} BlockSegment;
+
+typedef struct BlockDevice BlockDevice;
+
+// Driver side: moves sectors [LBA, LBA + sectors) from/into the segments
+// (whose sizes add up to exactly that). Returns whether it succeeded
+typedef bool (*BlockTransfer)(BlockDevice *device, uint64_t LBA,
+                              uint32_t sectors, BlockSegment *segments,
+                              int cnt, bool write);
+
+typedef enum BLOCK_REQUEST_STATE {
+  BLOCK_REQUEST_QUEUED = 0,
+  BLOCK_REQUEST_DISPATCHED = 1,
+  BLOCK_REQUEST_DONE = 2,
+  BLOCK_REQUEST_FAILED = 3,
+} BLOCK_REQUEST_STATE;
+
+typedef struct BlockRequest BlockRequest;
+struct BlockRequest {
+  BlockRequest *next; // in the device's queue, sorted by LBA
+
+  uint64_t LBA;
+  uint32_t sectors;
+  uint8_t *buff;
+  bool     write;
+
+  // address space buff lives in (0 for kernel memory), since the drivers
+  // resolve it through whatever's loaded when dispatching
+  uint64_t *pagedir;
+
+  uint64_t     expires; // timerTicks deadline
+  volatile int state;
+
+  // the submitter only sleeps in the queue while it isn't dispatching
+  // anything itself, it's only woken up when this is set
+  struct Task *waiter;
+  bool         sleeping;
+};
+
+struct BlockDevice {
+  uint32_t id;
+  char     name[8]; // sda, sdb, ...
+
+  uint64_t sectors;    // capacity (0 if unknown)
+  uint32_t maxSectors; // biggest single command
+  uint32_t depth;      // commands the driver handles concurrently
+
+  BlockTransfer transfer;
+  void         *driver; // driver specific (ex: the controller)
+  uint32_t      port;   // driver specific (ex: port on the controller)
+
+  // request queue (elevator with deadlines)
+  Spinlock      LOCK_QUEUE;
+  BlockRequest *queue;
+  uint32_t      inflight; // commands dispatched from the queue
+  uint64_t      head;     // where the last dispatched command ended
+
+  // statistics
+  uint64_t requests;
+  uint64_t dispatches;
+  uint64_t merged; // requests that rode along another one's command
+};
+
+BlockDevice *blockDevices[BLOCK_DEVICES_MAX];
+uint32_t     blockDevicesCnt;
+
+BlockDevice *blockDeviceRegister(BlockTransfer transfer, void *driver,
+                                 uint32_t port, uint64_t sectors,
+                                 uint32_t maxSectors, uint32_t depth);
+BlockDevice *blockDeviceGet(uint32_t id);
+
+bool blockDeviceTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                         uint8_t *buff, bool write);
+
+#endif
@@ -26,8 +26,12 @@ typedef struct {
 bool openDisk(uint32_t disk, uint8_t partition, mbr_partition *out);
 bool validateMbr(uint8_t *mbrSector);
 
-void getDiskBytes(uint8_t *target_address, uint32_t LBA, size_t sector_count);
-void setDiskBytes(const uint8_t *target_address, uint32_t LBA,
+// disk: block device id (0 for sda, 1 for sdb, ...)
+void getDiskBytes(uint32_t disk, uint8_t *target_address, uint32_t LBA,
+                  size_t sector_count);
+void getDiskBytesUnaligned(uint32_t disk, uint8_t *target_address,
+                           uint32_t LBA, size_t offset, size_t length);
+void setDiskBytes(uint32_t disk, const uint8_t *target_address, uint32_t LBA,
                   uint8_t sector_count);
 
 #endif
\ No newline at end of file
@@ -62,6 +62,11 @@ typedef struct {
 #define PT_LOPROC 0x70000000
 #define PT_HIPROC 0x7fffffff
 
+// Segment flags (p_flags)
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
 enum Elf_Ident {
   EI_MAG0 = 0,       // 0x7F
   EI_MAG1 = 1,       // 'E'
@@ -1,3 +1,5 @@
+#include "block_cache.h"
+#include "spinlock.h"
 #include "types.h"
 #include "vfs.h"
 
@@ -22,6 +24,19 @@
 #define EXT2_R_F_JOURNAL_REPLAY 0x0004
 #define EXT2_R_F_JOURNAL_DEVICE 0x0008
 
+// Optional feature flags
+#define EXT2_O_F_DIR_INDEX 0x0020
+
+// Inode flags
+#define EXT2_INDEX_FL 0x00001000 // hashed (htree) directory
+
+// Directory entry types
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR 2
+
+// Superblock flags
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 // FileSystem State
 #define EXT2_FS_S_CLEAN 1
 #define EXT2_FS_S_ERRORS 2
@@ -50,7 +65,23 @@ typedef struct Ext2SuperblockExtended {
   uint32_t journal_device;
   uint32_t orphan_head;
 
-  char reserved[1024 - 236];
+  // ext3+ (the ones we care about at least)
+  uint32_t hash_seed[4];
+  uint8_t  def_hash_version;
+  uint8_t  jnl_backup_type;
+  uint16_t desc_size;
+  uint32_t default_mount_opts;
+  uint32_t first_meta_bg;
+  uint32_t mkfs_time;
+  uint32_t jnl_blocks[17];
+  uint32_t blocks_count_hi;
+  uint32_t r_blocks_count_hi;
+  uint32_t free_blocks_hi;
+  uint16_t min_extra_isize;
+  uint16_t want_extra_isize;
+  uint32_t flags;
+
+  char reserved[1024 - 356];
 } Ext2SuperblockExtended;
 
 typedef struct Ext2Superblock {
@@ -131,7 +162,129 @@ typedef struct Ext2Directory {
   char     filename[0];
 } Ext2Directory;
 
+// In-memory inodes, hashed by number & reference counted. Unused ones stay
+// around (up to EXT2_INODE_CACHE_MAX of them) and get evicted in LRU order
+#define EXT2_INODE_CACHE_BUCKETS 256
+#define EXT2_INODE_CACHE_MAX 1024
+
+typedef struct Ext2InodeCached Ext2InodeCached;
+struct Ext2InodeCached {
+  Ext2InodeCached *hashNext;
+
+  // LRU list of unused (refs == 0) inodes, most recently used first
+  Ext2InodeCached *lruPrev;
+  Ext2InodeCached *lruNext;
+
+  uint32_t  inodeNum;
+  uint32_t  refs;
+  Ext2Inode inode;
+
+  volatile bool loading; // being read in, with LOCK_CACHE dropped
+  bool          updated; // written to meanwhile, what was read is outdated
+};
+
+typedef struct Ext2InodeCache {
+  Spinlock         LOCK_CACHE;
+  Ext2InodeCached *buckets[EXT2_INODE_CACHE_BUCKETS];
+  Ext2InodeCached *lruFirst;
+  Ext2InodeCached *lruLast;
+
+  size_t cnt;
+  size_t unused;
+
+  // statistics
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} Ext2InodeCache;
+
+// Hashed directories (dir_index): block 0 holds the root of a (shallow)
+// B-tree of name hashes, pointing to the leaf blocks holding the entries
+#define EXT2_HTREE_LEVELS_MAX 2
+
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_UNSIGNED 3 // added to the above for unsigned char variants
+
+typedef struct Ext2HtreeRootInfo {
+  uint32_t reserved_zero;
+  uint8_t  hash_version;
+  uint8_t  info_length;
+  uint8_t  indirect_levels;
+  uint8_t  unused_flags;
+} __attribute__((packed)) Ext2HtreeRootInfo;
+
+typedef struct Ext2HtreeEntry {
+  uint32_t hash; // (the first one holds the limit & count instead)
+  uint32_t block;
+} __attribute__((packed)) Ext2HtreeEntry;
+
+typedef struct Ext2HtreeCountLimit {
+  uint16_t limit;
+  uint16_t count;
+} __attribute__((packed)) Ext2HtreeCountLimit;
+
+// Directories without an index get an in-memory name hash table, built the
+// first time they're searched. Only the most recently used ones are kept
+#define EXT2_DIR_INDEX_MAX 64
+
+typedef struct Ext2DirIndexEntry Ext2DirIndexEntry;
+struct Ext2DirIndexEntry {
+  Ext2DirIndexEntry *next;
+
+  uint32_t hash;
+  uint32_t inode;
+  uint8_t  nameLen;
+  char     name[0];
+};
+
+typedef struct Ext2DirIndex Ext2DirIndex;
+struct Ext2DirIndex {
+  Ext2DirIndex *next; // most recently used first
+
+  uint32_t            dirInode;
+  size_t              bucketsCnt; // power of 2
+  Ext2DirIndexEntry **buckets;
+};
+
+// Writes are held in memory as dirty buffers (metadata blocks by their
+// number, file data by its inode & logical block) till the writeback thread,
+// a sync or too many of them flush everything out in sorted batches. File
+// data only gets blocks allocated then, so every file ends up in as few
+// extents as possible
+#define EXT2_DIRTY_BUCKETS 256
+#define EXT2_DIRTY_MAX 4096          // buffers, writers flush past this
+#define EXT2_WRITE_CHUNK 65536       // bytes copied in per LOCK_WRITE hold
+#define EXT2_WRITEBACK_INTERVAL 5000 // ms
+#define EXT2_WRITEBACK_BATCH 128     // sectors per disk write
+
+typedef struct Ext2Buffer Ext2Buffer;
+struct Ext2Buffer {
+  Ext2Buffer *next;
+
+  uint32_t inode;    // owner of file data (0 for metadata)
+  uint32_t block;    // logical block of file data, physical one of metadata
+  uint32_t physical; // where it goes (0 for file data that isn't allocated)
+  uint8_t *data;
+
+  uint64_t seq; // of its last modification, so flushes know what changed
+};
+
+// Open inodes (every fd & page cache handle counts), so unlinked ones are
+// only freed once the last of them is closed
+typedef struct Ext2OpenInode Ext2OpenInode;
+struct Ext2OpenInode {
+  Ext2OpenInode *next;
+
+  uint32_t inode;
+  uint32_t opens;
+  bool     orphan; // no links left, freed on the last close
+};
+
 typedef struct Ext2 {
+  uint32_t disk; // (for the block cache)
+
   // various offsets
   size_t offsetBase;
   size_t offsetSuperblock;
@@ -150,28 +303,57 @@ typedef struct Ext2 {
   // max block size is 8KiB and bgdts are forced to be 1 block long soooooo
   Ext2BlockGroup *bgdts; // regular old array
   Ext2Superblock  superblock;
-} Ext2;
 
-typedef struct Ext2LookupControl {
-  // uint8_t  blockPtr;
-  // ^ 0 -> singly, 1 -> doubly, 2 -> triply
+  Ext2InodeCache inodeCache;
 
-  uint32_t *tmp1;
-  size_t    tmp1Block;
+  Spinlock      LOCK_DIR_INDEX;
+  Ext2DirIndex *dirIndexFirst;
+  size_t        dirIndexCnt;
 
-  uint32_t *tmp2;
-  size_t    tmp2Block;
-} Ext2LookupControl;
+  Spinlock    LOCK_WRITE; // held by every modification (& flush setup)
+  Spinlock    LOCK_DIRTY; // of the dirty buffer table
+  Ext2Buffer *dirty[EXT2_DIRTY_BUCKETS];
+  size_t      dirtyCnt;
+  bool        metaDirty; // superblock & block group descriptors
+  uint64_t    dirtySeq;
+  bool        flushing; // writing out (without LOCK_WRITE held)
+  uint32_t    reservedBlocks; // free ones spoken for by unallocated data
+
+  Spinlock       LOCK_OPEN_INODES;
+  Ext2OpenInode *openInodes;
+
+  // bumped whenever a file's size or layout changes, so open fds know their
+  // inode copy & extent map need to be refreshed
+  uint64_t generation;
+} Ext2;
+
+// Logical -> physical block runs of a file
+typedef struct Ext2Extent {
+  uint32_t logical;  // first block inside the file
+  uint32_t physical; // first block on the disk (0 for holes)
+  uint32_t length;   // in blocks
+} Ext2Extent;
+
+// Built lazily (in logical order) as the file gets accessed further, so block
+// lookups are a binary search instead of an indirect block walk
+typedef struct Ext2ExtentMap {
+  Ext2Extent *extents;
+  size_t      cnt;
+  size_t      capacity;
+  size_t      mapped; // logical blocks covered so far
+} Ext2ExtentMap;
 
 typedef struct Ext2OpenFd {
-  Ext2LookupControl lookup;
-  // ^ serves as our inodeCurr somewhat
+  Ext2ExtentMap extents;
+  uint64_t      generation;
 
   // size_t   blockNum;
   uint64_t ptr;
 
   uint32_t  inodeNum;
   Ext2Inode inode;
+
+  ReadAhead readAhead;
 } Ext2OpenFd;
 
 #define EXT2_PTR(a) ((Ext2 *)(a))
@@ -200,25 +382,75 @@ bool   ext2StatFd(Ext2 *ext2, OpenFile *fd, struct stat *target);
 bool   ext2Seek(MountPoint *mount, OpenFile *fd, uint32_t target);
 size_t ext2GetFilesize(OpenFile *fd);
 int    ext2Readlink(Ext2 *ext2, char *path, char *buf, int size);
+void   ext2OpenFdRefresh(Ext2 *ext2, Ext2OpenFd *fd);
 
 // ext2_util.c
 void ext2BlkIdBitmapFetch(Ext2 *ext2, uint8_t *tmp, size_t group);
 bool ext2BlkIdBitmapGet(Ext2 *ext2, uint8_t *tmp, size_t index);
 
-void ext2BlockFetchInit(Ext2 *ext2, Ext2LookupControl *control);
-void ext2BlockFetchCleanup(Ext2LookupControl *control);
-
-uint32_t  ext2BlockFetch(Ext2 *ext2, Ext2Inode *ino, Ext2LookupControl *control,
-                         size_t curr);
-uint32_t *ext2BlockChain(Ext2 *ext2, Ext2OpenFd *fd, size_t curr,
-                         size_t blocks);
+uint32_t ext2IndirectFetch(Ext2 *ext2, uint32_t block, size_t index);
+uint32_t ext2BlockFetch(Ext2 *ext2, Ext2Inode *ino, size_t curr);
+
+// ext2_alloc.c
+uint32_t ext2BlockAllocate(Ext2 *ext2, uint32_t goal);
+void     ext2BlockFree(Ext2 *ext2, uint32_t block);
+uint32_t ext2InodeAllocate(Ext2 *ext2, uint32_t parent, bool directory);
+void     ext2InodeFree(Ext2 *ext2, uint32_t inode, bool directory);
+void     ext2BlockMapSet(Ext2 *ext2, Ext2Inode *ino, size_t logical,
+                         uint32_t physical);
+void     ext2BlocksRelease(Ext2 *ext2, Ext2Inode *ino, size_t from);
+
+// ext2_writeback.c
+uint8_t *ext2BufferGet(Ext2 *ext2, uint32_t inode, uint32_t block,
+                       uint32_t physical, bool fill);
+uint8_t *ext2BufferGetFrom(Ext2 *ext2, uint32_t inode, uint32_t block,
+                           uint32_t physical, bool fill, uint8_t *contents);
+bool     ext2BufferRead(Ext2 *ext2, uint32_t inode, uint32_t block,
+                        size_t offset, uint8_t *target, size_t length);
+size_t   ext2BufferCleanRun(Ext2 *ext2, uint32_t inode, uint32_t block,
+                            size_t run);
+bool     ext2BufferReserve(Ext2 *ext2, uint32_t inode, uint32_t block);
+void     ext2BufferForget(Ext2 *ext2, uint32_t inode, uint32_t from);
+void     ext2MetaRead(Ext2 *ext2, uint32_t block, size_t offset,
+                      uint8_t *target, size_t length);
+void     ext2Flush(Ext2 *ext2);
+void     initiateExt2Writeback();
+
+// ext2_write.c
+int      ext2Write(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit);
+int      ext2Truncate(MountPoint *mount, OpenFile *fd, size_t length);
+uint32_t ext2Create(MountPoint *mount, char *path, int mode);
+int      ext2Unlink(MountPoint *mount, char *path);
+void     ext2InodeOpen(Ext2 *ext2, uint32_t inode);
+void     ext2InodeClose(Ext2 *ext2, uint32_t inode);
+bool     ext2Sync(MountPoint *mount);
+void     ext2InodeStore(Ext2 *ext2, uint32_t inodeNum, Ext2Inode *inode);
+
+// ext2_extents.c
+uint32_t ext2ExtentLookup(Ext2 *ext2, Ext2OpenFd *fd, size_t block,
+                          size_t *run);
+void     ext2ExtentMapDuplicate(Ext2ExtentMap *target, Ext2ExtentMap *source);
+void     ext2ExtentMapFree(Ext2ExtentMap *map);
 
 // ext2_traverse.c
-Ext2Inode *ext2InodeFetch(Ext2 *ext2, size_t inode);
-uint32_t   ext2Traverse(Ext2 *ext2, size_t initInode, char *search,
-                        size_t searchLength);
-uint32_t   ext2TraversePath(Ext2 *ext2, char *path, size_t initInode,
-                            bool follow);
+void     ext2InodeFetch(Ext2 *ext2, size_t inode, Ext2Inode *target);
+uint32_t ext2Traverse(Ext2 *ext2, size_t initInode, char *search,
+                      size_t searchLength);
+uint32_t ext2TraversePath(Ext2 *ext2, char *path, size_t initInode,
+                          bool follow);
+
+// ext2_htree.c
+bool     ext2HtreeLookup(Ext2 *ext2, Ext2Inode *ino, char *search,
+                         size_t searchLength, uint32_t *ret);
+uint32_t ext2DirIndexLookup(Ext2 *ext2, uint32_t dirInode, Ext2Inode *ino,
+                            char *search, size_t searchLength);
+void     ext2DirIndexInvalidate(Ext2 *ext2, uint32_t dirInode);
+
+// ext2_inode.c
+Ext2Inode *ext2InodeGet(Ext2 *ext2, uint32_t inodeNum);
+void       ext2InodePut(Ext2 *ext2, Ext2Inode *inode);
+void       ext2InodeCacheUpdate(Ext2 *ext2, uint32_t inodeNum,
+                                Ext2Inode *inode);
 
 // ext2_dirs.c
 int ext2Getdents64(OpenFile *file, void *start, unsigned int hardlimit);
@@ -5,6 +5,7 @@
 #define NULL_H
 
 VfsHandlers handleNull;
+VfsHandlers handleBlockCache;
 
 void initiateFakefs();
 
@@ -1,3 +1,5 @@
+#include "block_cache.h"
+#include "spinlock.h"
 #include "types.h"
 #include "vfs.h"
 
@@ -28,7 +30,9 @@
 #define FAT_COMB_HIGH_LOW(clusterhigh, clusterlow)                             \
   (((uint32_t)clusterhigh << 16) | clusterlow)
 
-#define FAT_INODE_GEN(directory, index) ((directory) * 100 + (index))
+// unique per directory entry: (cluster holding it, entry in that cluster)
+#define FAT_INODE_GEN(directory, index)                                        \
+  (((uint64_t)(directory) << 16) | (uint16_t)(index))
 
 typedef struct FAT32DirectoryEntry {
   char    name[8];
@@ -96,9 +100,22 @@ typedef struct FAT32LFN {
 } __attribute__((packed)) FAT32LFN;
 // fat->bootsec.table_count * fat->bootsec.extended_section.table_size_32
 
-#define FAT32_CACHE_BAD 0xFFFFFFFF
-#define FAT32_CACHE_MAX 32
+// The FAT is cached in memory a page (of entries) at a time, loaded the first
+// time anything inside it is looked up
+#define FAT32_FAT_PAGE_ENTRIES 1024
+#define FAT32_FAT_PAGE_SECTORS (FAT32_FAT_PAGE_ENTRIES * 4 / SECTOR_SIZE)
+
+#define FAT32_CLUSTER_MASK 0x0FFFFFFF
+#define FAT32_CLUSTER_BAD 0x0FFFFFF7
+#define FAT32_CLUSTER_END 0x0FFFFFF8
+
 typedef struct FAT32 {
+  uint32_t disk; // (for the block cache)
+
+  Spinlock   LOCK_FAT;
+  uint32_t **fatPages;
+  size_t     fatPagesCnt;
+
   // various offsets
   size_t offsetBase;
   size_t offsetFats;
@@ -106,21 +123,37 @@ typedef struct FAT32 {
 
   // better "waste" some memory to be safe
   FAT32BootSector bootsec;
-
-  // store old FATs for easier lookup
-  uint8_t *cache[FAT32_CACHE_MAX];
-  uint32_t cacheBase[FAT32_CACHE_MAX];
-  int      cacheCurr;
 } FAT32;
 
+// Logical -> physical cluster runs of a file
+typedef struct FAT32Run {
+  uint32_t logical; // first cluster inside the file
+  uint32_t cluster; // first cluster on the disk
+  uint32_t length;  // in clusters
+} FAT32Run;
+
+// Built lazily (in logical order) as the file gets accessed further, so a
+// chain is only ever walked once & reads go out an extent at a time
+typedef struct FAT32RunMap {
+  FAT32Run *runs;
+  size_t    cnt;
+  size_t    capacity;
+  size_t    mapped; // logical clusters covered so far
+  uint32_t  next;   // cluster following the mapped ones (0 at the end)
+} FAT32RunMap;
+
 typedef struct FAT32OpenFd {
+  FAT32RunMap runs;
+
   uint32_t ptr;
 
-  uint8_t  index; // x / 32
+  uint16_t index; // x / 32
   uint32_t directoryStarting;
   uint32_t directoryCurr;
 
   FAT32DirectoryEntry dirEnt;
+
+  ReadAhead readAhead;
 } FAT32OpenFd;
 
 // fat32_controller.c
@@ -138,13 +171,18 @@ void          fat32LFNmemcpy(uint8_t *lfnName, FAT32LFN *lfn, int index);
 unsigned long fat32UnixTime(unsigned short fat_date, unsigned short fat_time);
 
 // fat32_fat.c
-uint32_t  fat32FATtraverse(FAT32 *fat, uint32_t offset);
-uint32_t *fat32FATchain(FAT32 *fat, uint32_t offsetStart, uint32_t amount);
+void     fat32FATinit(FAT32 *fat);
+uint32_t fat32FATtraverse(FAT32 *fat, uint32_t offset);
+uint32_t fat32RunLookup(FAT32 *fat, FAT32OpenFd *fd, size_t logical,
+                        size_t *run);
+void     fat32RunMapInit(FAT32RunMap *map, uint32_t start);
+void     fat32RunMapDuplicate(FAT32RunMap *target, FAT32RunMap *source);
+void     fat32RunMapFree(FAT32RunMap *map);
 
 // fat32_traverse.c
 typedef struct FAT32TraverseResult {
   uint32_t            directory;
-  uint8_t             index; // x / 32
+  uint16_t            index; // x / 32
   FAT32DirectoryEntry dirEntry;
 } FAT32TraverseResult;
 FAT32TraverseResult fat32Traverse(FAT32 *fat, uint32_t initDirectory,
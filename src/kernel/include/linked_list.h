@@ -1,3 +1,4 @@
+#include "slab.h"
 #include "util.h"
 
 #ifndef LINKED_LIST_H
@@ -11,6 +12,7 @@ struct LLheader {
 };
 
 void *LinkedListAllocate(void **LLfirstPtr, uint32_t structSize);
+void *LinkedListAllocateCache(void **LLfirstPtr, SlabCache *cache);
 bool  LinkedListUnregister(void **LLfirstPtr, const void *LLtarget);
 bool  LinkedListRemove(void **LLfirstPtr, void *LLtarget);
 bool  LinkedListDuplicate(void **LLfirstPtrSource, void **LLfirstPtrTarget,
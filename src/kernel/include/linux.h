@@ -491,6 +491,10 @@ struct sigaction {
 #define MAP_HUGE_SHIFT 26
 #define MAP_HUGE_MASK 0x3f
 
+/* Flags to `mremap'.  */
+#define MREMAP_MAYMOVE 1
+#define MREMAP_FIXED 2
+
 /* Flags to `msync'.  */
 #define MS_ASYNC 1      /* Sync memory asynchronously.  */
 #define MS_SYNC 4       /* Synchronous memory sync.  */
@@ -775,6 +779,7 @@ struct statx {
           working directory. */
 
 #define AT_SYMLINK_NOFOLLOW 0x100 /* Do not follow symbolic links.  */
+#define AT_REMOVEDIR 0x200        /* Remove directory, not a file.  */
 
 // include/asm-generic/errno-base.h
 #define EPERM 1    /* Operation not permitted */
@@ -15,4 +15,10 @@ int     ACQUIRE_LOCK(Spinlock *lock);
 int     RELEASE_LOCK(Spinlock *lock);
 int     INITIAL_LOCK(Spinlock *lock);
 
+// heap segments (through -DMMAP/-DMUNMAP)
+void  *heapMmap(size_t size);
+int    heapMunmap(void *ptr, size_t size);
+size_t heapUsage(); // bytes the kernel heap holds from the PMM
+void   heapDumpStats();
+
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "pci.h"
+#include "slab.h"
 #include "types.h"
 
 #ifndef NIC_CONTROLLER_H
@@ -100,6 +101,8 @@ struct NIC {
 
 NIC *selectedNIC;
 
+SlabCache *socketCache;
+
 void initiateNetworking();
 
 // returns UNINITIALIZED!! NIC struct
@@ -0,0 +1,124 @@
+#include "block_device.h"
+#include "pci.h"
+#include "types.h"
+
+#ifndef NVME_H
+#define NVME_H
+
+// https://nvmexpress.org/specifications/ (base specification 1.4)
+
+#define NVME_SUBCLASS 0x08
+#define NVME_PROG_IF 0x02
+
+// Controller registers
+#define NVME_REG_CAP 0x00   // capabilities (64 bits)
+#define NVME_REG_VS 0x08    // version
+#define NVME_REG_INTMS 0x0C // interrupt mask set
+#define NVME_REG_INTMC 0x10 // interrupt mask clear
+#define NVME_REG_CC 0x14    // controller configuration
+#define NVME_REG_CSTS 0x1C  // controller status
+#define NVME_REG_AQA 0x24   // admin queue attributes
+#define NVME_REG_ASQ 0x28   // admin submission queue base (64 bits)
+#define NVME_REG_ACQ 0x30   // admin completion queue base (64 bits)
+#define NVME_REG_DOORBELLS 0x1000
+
+#define NVME_CAP_MQES(cap) ((cap) & 0xFFFF)
+#define NVME_CAP_DSTRD(cap) (((cap) >> 32) & 0xF)
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_IOSQES (6 << 16) // 64 byte submission entries
+#define NVME_CC_IOCQES (4 << 20) // 16 byte completion entries
+
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1)
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+
+// I/O commands
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+// Queue sizes (entries) are capped at this, so every command id fits in a
+// bitmap
+#define NVME_QUEUE_SIZE_MAX 64
+#define NVME_ADMIN_QUEUE_SIZE 16
+
+// Largest single command the block device layer gets to send
+#define NVME_SECTORS_MAX 512
+
+typedef struct NVMeCommand {
+  uint8_t  opcode;
+  uint8_t  flags;
+  uint16_t cid;
+  uint32_t nsid;
+  uint64_t rsvd;
+  uint64_t mptr;
+  uint64_t prp1;
+  uint64_t prp2;
+  uint32_t cdw10;
+  uint32_t cdw11;
+  uint32_t cdw12;
+  uint32_t cdw13;
+  uint32_t cdw14;
+  uint32_t cdw15;
+} __attribute__((packed)) NVMeCommand;
+
+typedef struct NVMeCompletion {
+  uint32_t result;
+  uint32_t rsvd;
+  uint16_t sqHead;
+  uint16_t sqId;
+  uint16_t cid;
+  uint16_t status; // bit 0 is the phase tag
+} __attribute__((packed)) NVMeCompletion;
+
+// A submission/completion queue pair. Every command in flight is a slot
+// (whose index is the command id), with its own PRP list page
+typedef struct NVMeQueue {
+  uint16_t id;
+  uint16_t size;
+
+  volatile NVMeCommand    *sq;
+  volatile NVMeCompletion *cq;
+  volatile uint32_t       *sqDoorbell;
+  volatile uint32_t       *cqDoorbell;
+
+  uint16_t sqTail;
+  uint16_t cqHead;
+  uint8_t  phase; // of completion entries that are new
+
+  uint64_t *prpLists; // a page per slot
+
+  // slot bitmaps, only touched with interrupts off
+  volatile uint64_t busy;
+  volatile uint64_t done;
+
+  uint16_t     status[NVME_QUEUE_SIZE_MAX]; // of every reaped slot
+  struct Task *waiters[NVME_QUEUE_SIZE_MAX]; // sleeping issuer of every slot
+} NVMeQueue;
+
+typedef struct NVMe {
+  volatile uint8_t *regs;
+  uint32_t          doorbellStride;
+
+  NVMeQueue admin;
+  NVMeQueue io; // one pair is enough for a single CPU
+
+  uint32_t nsid;
+  uint64_t sectors;
+  uint32_t maxSectors;
+
+  BlockDevice *device;
+} NVMe;
+
+bool initiateNVMe(PCIdevice *device);
+bool nvmeTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                  BlockSegment *segments, int cnt, bool write);
+
+#endif
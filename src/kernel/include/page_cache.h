@@ -0,0 +1,56 @@
+#include "rbtree.h"
+#include "spinlock.h"
+#include "types.h"
+#include "vfs.h"
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+// Files nobody maps anymore stay cached (for the next exec() of the same
+// binary), up to this many of them
+#define PAGE_CACHE_UNUSED_MAX 32
+
+typedef struct PageCachePage {
+  RBnode node; // keyed by index
+  size_t index;
+  size_t phys; // the cache holds one reference on it (0 if it failed to load)
+
+  volatile bool loading; // being read in, with LOCK_PAGES dropped
+} PageCachePage;
+
+typedef struct PageCacheFile PageCacheFile;
+struct PageCacheFile {
+  PageCacheFile *next;
+
+  // identity: same (mount point, inode) means the same pages
+  MountPoint *mnt;
+  uint64_t    inode;
+
+  OpenFile *file; // private handle, only used for filling in pages
+  size_t    size;
+
+  Spinlock LOCK_HANDLE; // one page read through the handle at a time
+
+  uint32_t refs;    // users (areas mapping it, loaders)
+  uint64_t lastUse; // for evicting unused files, oldest first
+  bool     stale;   // file was modified, goes away with its last user
+
+  Spinlock LOCK_PAGES;
+  RBroot   pages;
+  size_t   pagesCnt;
+};
+
+PageCacheFile *firstPageCacheFile;
+
+PageCacheFile *pageCacheOpen(OpenFile *file);
+void           pageCacheHold(PageCacheFile *cache);
+void           pageCacheClose(PageCacheFile *cache);
+void           pageCacheInvalidate(MountPoint *mnt, uint64_t inode);
+
+size_t pageCacheGet(PageCacheFile *cache, size_t index);
+size_t pageCacheRead(PageCacheFile *cache, size_t offset, uint8_t *out,
+                     size_t limit);
+
+void pageCacheDumpStats();
+
+#endif
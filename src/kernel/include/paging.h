@@ -14,6 +14,8 @@
 #define PF_PS (1 << 7)      // Page size (valid for PD and PDPT only)
 #define PF_GLOBAL (1 << 8)  // Indicates the page is globally cached
 #define PF_SHARED (1 << 9)  // Userland page is shared
+#define PF_COW (1 << 10)    // Userland page is copy-on-write (write-protected)
+#define PF_DEVICE (1 << 11) // Userland page maps device memory (not refcounted)
 // #define PF_SYSTEM (1 << 9)  // Page used by the kernel
 
 // Virtual address' bitmasks and shifts
@@ -47,11 +49,17 @@
 
 #define PAGE_MASK(x) ((1 << (x)) - 1)
 
+// Page fault error code
+#define PF_ERR_PRESENT (1 << 0) // Protection violation (not a missing page)
+#define PF_ERR_WRITE (1 << 1)   // Caused by a write
+#define PF_ERR_USER (1 << 2)    // Happened in userland (CPL==3)
+
 // Sizes & lengths
 #define USER_STACK_PAGES (0x30)
 #define PAGE_SIZE 0x1000
 #define PAGE_SIZE_LARGE 0x200000
 #define PAGE_SIZE_HUGE 0x40000000
+#define PAGE_LARGE_PAGES (PAGE_SIZE_LARGE / PAGE_SIZE)
 
 // Processes' heap & stack locations
 #define USER_MMAP_START 0x700000000000
@@ -60,24 +68,48 @@
 
 #define P_PHYS_ADDR(x) ((x) & ~0xFFF)
 
+// PCIDs (CR3's low 12 bits), handed out to the most recently loaded pagedirs
+#define PCID_SLOTS 64
+#define CR3_NOFLUSH (1ULL << 63) // keep the tagged entries on a CR3 write
+
 void initiatePaging();
 
 void VirtualMapL(uint64_t *pagedir, uint64_t virt_addr, uint64_t phys_addr,
                  uint64_t flags);
 void VirtualMap(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
-// uint32_t VirtualUnmap(uint32_t virt_addr);
+uint64_t VirtualUnmapL(uint64_t *pagedir, uint64_t virt_addr);
+void     VirtualProtectL(uint64_t *pagedir, uint64_t virt_addr, bool writable);
 size_t VirtualToPhysical(size_t virt_addr);
 
+// 2MiB pages (split back into 4KiB ones whenever something touches a part)
+void VirtualMapLargeL(uint64_t *pagedir, uint64_t virt_addr, uint64_t phys_addr,
+                      uint64_t flags);
+void VirtualMapRegionByLength(uint64_t virt_addr, uint64_t phys_addr,
+                              uint64_t length, uint64_t flags);
+uint64_t  VirtualUnmapLargeL(uint64_t *pagedir, uint64_t virt_addr);
+void      VirtualProtectLargeL(uint64_t *pagedir, uint64_t virt_addr,
+                               bool writable);
+bool      VirtualLargeVacant(uint64_t *pagedir, uint64_t virt_addr);
+void      VirtualReleaseLarge(uint64_t entry);
+uint64_t *VirtualGetLargeEntry(uint64_t *pagedir, uint64_t virt_addr);
+bool      VirtualPromoteL(uint64_t *pagedir, uint64_t virt_addr);
+
 uint64_t *GetPageDirectory();
 void      ChangePageDirectory(uint64_t *pd);
 void      ChangePageDirectoryUnsafe(uint64_t *pd);
 void      ChangePageDirectoryFake(uint64_t *pd);
+uint64_t  VirtualCr3(uint64_t *pd);
+void      VirtualInvalidate(uint64_t *pagedir, uint64_t virt_addr);
+void      VirtualFlushL(uint64_t *pagedir);
 
 uint64_t *PageDirectoryAllocate();
 void      PageDirectoryFree(uint64_t *page_dir);
 
 void PageDirectoryUserDuplicate(uint64_t *source, uint64_t *target);
 
+uint64_t *VirtualGetEntry(uint64_t *pagedir, uint64_t virt_addr);
+bool      VirtualPageFault(uint64_t virt_addr, uint64_t error);
+
 void invalidate(uint64_t vaddr);
 
 #endif
\ No newline at end of file
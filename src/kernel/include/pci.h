@@ -46,6 +46,13 @@ typedef enum PCI_DEVICES {
 #define PCI_CAPABILITIES_PTR 0x34
 #define PCI_INTERRUPT_LINE 0x3C
 #define PCI_MIN_GRANT 0x3E
+
+// BAR bits
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_64 0x4 // (memory) type: 64 bits wide, spans the next BAR too
+
+// Capability IDs
+#define PCI_CAP_ID_VENDOR 0x09
 // PCI Class codes
 #define PCI_CLASS_CODE_UNCLASSIFIED 0x0
 #define PCI_CLASS_CODE_MASS_STORAGE_CONTROLLER 0x1
@@ -118,6 +125,8 @@ typedef enum PCI_DRIVER {
   PCI_DRIVER_AHCI,
   PCI_DRIVER_RTL8139,
   PCI_DRIVER_RTL8169,
+  PCI_DRIVER_VIRTIO_BLK,
+  PCI_DRIVER_NVME,
 } PCI_DRIVER;
 
 typedef enum PCI_DRIVER_CATEGORY {
@@ -150,6 +159,9 @@ void initiatePCI();
 int  FilterDevice(uint8_t bus, uint8_t slot, uint8_t function);
 void GetDevice(PCIdevice *device, uint8_t bus, uint8_t slot, uint8_t function);
 void GetGeneralDevice(PCIdevice *device, PCIgeneralDevice *out);
+uint64_t GetBarAddress(PCIgeneralDevice *details, uint8_t bar);
+uint16_t ConfigReadWord(uint8_t bus, uint8_t slot, uint8_t func,
+                        uint8_t offset);
 void ConfigWriteDword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset,
                       uint32_t conf);
 
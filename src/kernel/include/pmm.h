@@ -4,8 +4,71 @@
 #include "bitmap.h"
 #include "types.h"
 
-DS_Bitmap physical;
+// Buddy allocator: free blocks of 2^order contiguous pageframes
+// no vmalloc-like facility exists (kernel allocations are physically
+// contiguous), so large orders are needed: 0..18 (largest block is 1GiB)
+#define BUDDY_MAX_ORDER 19
+#define BUDDY_ORDER_NONE 0xff
+#define BUDDY_ORDER_SLAB 0xfe // (allocated frame holding a slab, see slab.c)
+
+typedef struct BuddyFreeBlock BuddyFreeBlock;
+struct BuddyFreeBlock {
+  // stored inside the free block itself (through the HHDM)
+  BuddyFreeBlock *next;
+  BuddyFreeBlock *prev;
+};
+
+typedef struct PhysicalBuddy {
+  BuddyFreeBlock *freeList[BUDDY_MAX_ORDER];
+  size_t          freeBlocks[BUDDY_MAX_ORDER];
+
+  uint8_t  *order; // per pageframe: order of the free block it starts, if any
+                   // (or BUDDY_ORDER_SLAB)
+  uint16_t *refs;  // per pageframe: mappings sharing it (0/1 means private)
+  size_t   frames;
+  size_t   freePages;
+} PhysicalBuddy;
+
+// Per-CPU magazines of single pageframes, refilled from/drained to the buddy
+// in batches. Only the bootstrap processor runs kernel code for now, so
+// there's exactly one of them (the indexing is kept for when SMP comes)
+#define PMM_CPUS 1
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+typedef struct PhysicalMagazine {
+  size_t frames[PMM_MAGAZINE_SIZE]; // physical addresses
+  int    cnt;
+} PhysicalMagazine;
+
+typedef struct PhysicalCpuCache {
+  PhysicalMagazine zeroed;
+  PhysicalMagazine dirty;
+
+  // statistics
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t refills;
+  uint64_t drains;
+} PhysicalCpuCache;
+
+DS_Bitmap        physical; // mirrors the buddy's state (debugging & dumps)
+PhysicalBuddy    physicalBuddy;
+PhysicalCpuCache physicalCpuCache[PMM_CPUS];
 
 void initiatePMM();
 
+size_t PhysicalAllocate(size_t pages);
+void   PhysicalFree(size_t phys, size_t pages);
+
+size_t PhysicalAllocatePage();
+size_t PhysicalAllocatePageZeroed();
+void   PhysicalFreePage(size_t phys);
+
+void PhysicalShare(size_t phys);
+bool PhysicalShared(size_t phys);
+void PhysicalRelease(size_t phys);
+
+void PhysicalDumpStats();
+
 #endif
@@ -0,0 +1,34 @@
+#include "types.h"
+
+#ifndef RBTREE_H
+#define RBTREE_H
+
+// Intrusive red-black tree: embed an RBnode in the struct that needs ordering,
+// do the (type-specific) binary search to find the link & call
+// RBTreeInsertColor() to rebalance
+
+typedef struct RBnode RBnode;
+struct RBnode {
+  RBnode *parent;
+  RBnode *left;
+  RBnode *right;
+  bool    red;
+};
+
+typedef struct RBroot {
+  RBnode *node;
+} RBroot;
+
+#define RB_ENTRY(ptr, type, member)                                            \
+  ((type *)((size_t)(ptr) - offsetof(type, member)))
+
+void RBTreeLink(RBnode *node, RBnode *parent, RBnode **link);
+void RBTreeInsertColor(RBnode *node, RBroot *root);
+void RBTreeErase(RBnode *node, RBroot *root);
+
+RBnode *RBTreeFirst(RBroot *root);
+RBnode *RBTreeLast(RBroot *root);
+RBnode *RBTreeNext(RBnode *node);
+RBnode *RBTreePrev(RBnode *node);
+
+#endif
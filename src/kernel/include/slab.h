@@ -0,0 +1,77 @@
+#include "spinlock.h"
+#include "types.h"
+
+#ifndef SLAB_H
+#define SLAB_H
+
+// Object caches for hot fixed-size kernel structures. Every slab is a single
+// pageframe (marked as such in the buddy) with its header at the start, so
+// the slab & cache of any object is found by masking its address. Objects are
+// handed out from per-CPU magazines, refilled from/drained to slabs in batches
+
+// only the bootstrap processor runs kernel code for now (like the PMM's)
+#define SLAB_CPUS 1
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_MAGAZINE_BATCH 16
+
+#define SLAB_ALIGN 16
+#define SLAB_EMPTY_MAX 2 // empty slabs a cache holds on to
+
+// general purpose caches (LinkedListAllocate(), packets), bigger goes to malloc
+#define SLAB_SIZED_CNT 8
+#define SLAB_SIZED_MAX 1536
+
+typedef void (*SlabHook)(void *obj);
+
+typedef struct SlabCache SlabCache;
+
+typedef struct Slab Slab;
+struct Slab {
+  Slab      *next;
+  Slab      *prev;
+  SlabCache *cache;
+  uint16_t   freeCnt;
+  uint16_t   free[]; // stack of free object indexes
+};
+
+typedef struct SlabMagazine {
+  void *objects[SLAB_MAGAZINE_SIZE];
+  int   cnt;
+} SlabMagazine;
+
+struct SlabCache {
+  SlabCache *next;
+  char       name[24];
+  Spinlock   LOCK_SLAB; // slab lists (magazines are CPU-local)
+
+  size_t   objSize;
+  size_t   perSlab;
+  size_t   offset; // of the first object in a slab
+  SlabHook ctor;   // on every object of a new slab
+  SlabHook dtor;   // on every object of a slab that's given back
+
+  Slab  *partial;
+  Slab  *full;
+  Slab  *empty;
+  size_t emptyCnt;
+
+  SlabMagazine cpu[SLAB_CPUS];
+
+  // statistics
+  uint64_t slabs;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+void initiateSlab();
+
+SlabCache *slabCacheCreate(char *name, size_t size, SlabHook ctor,
+                           SlabHook dtor);
+void      *slabAllocate(SlabCache *cache);
+void      *slabAllocateSized(size_t size);
+void       slabFree(void *obj);
+void       slabDumpStats();
+
+#endif
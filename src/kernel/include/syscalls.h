@@ -53,6 +53,7 @@ extern VfsHandlers stdio;
 VfsHandlers pipeReadEnd;
 VfsHandlers pipeWriteEnd;
 
+void initiatePipes();
 bool pipeCloseEnd(OpenFile *readFd);
 int  pipeOpen(int *fds);
 
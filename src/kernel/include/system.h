@@ -16,6 +16,9 @@ void     outportw(unsigned short port, unsigned short data);
 uint32_t inportl(uint16_t portid);
 void     outportl(uint16_t portid, uint32_t value);
 
+// Time Stamp Counter
+uint64_t rdtsc();
+
 // Model Specific Registers (MSRs)
 uint64_t rdmsr(uint32_t msrid);
 uint64_t wrmsr(uint32_t msrid, uint64_t value);
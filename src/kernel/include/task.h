@@ -2,6 +2,7 @@
 #include "system.h"
 #include "types.h"
 #include "vfs.h"
+#include "vma.h"
 
 #ifndef TASK_H
 #define TASK_H
@@ -24,7 +25,8 @@ typedef enum TASK_STATE {
   TASK_STATE_READY = 1,
   TASK_STATE_IDLE = 2,
   TASK_STATE_WAITING_INPUT = 3,
-  TASK_STATE_CREATED = 4, // just made by taskCreate()
+  TASK_STATE_CREATED = 4,      // just made by taskCreate()
+  TASK_STATE_WAITING_DISK = 5, // sleeping until its disk I/O completes
 } TASK_STATE;
 
 #define NCCS 32
@@ -67,8 +69,8 @@ struct Task {
   uint64_t heap_start;
   uint64_t heap_end;
 
-  uint64_t mmap_start;
-  uint64_t mmap_end;
+  SpinlockCnt WLOCK_VMA;
+  RBroot      vmas;
 
   termios  term;
   uint32_t tmpRecV;
@@ -98,6 +100,8 @@ SpinlockCnt TASK_LL_MODIFY;
 Task *firstTask;
 Task *currentTask;
 
+SlabCache *taskCache;
+
 bool tasksInitiated;
 
 void  initiateTasks();
@@ -113,6 +117,7 @@ void  taskKillChildren(Task *task);
 void  taskFreeChildren(Task *task);
 uint8_t taskGetState(uint32_t id);
 Task   *taskGet(uint32_t id);
+bool    taskCanSleep();
 int16_t taskGenerateId();
 int     taskChangeCwd(char *newdir);
 int     taskFork(AsmPassedInterrupt *cpu, uint64_t rsp);
@@ -0,0 +1,99 @@
+#include "spinlock.h"
+#include "types.h"
+#include "vfs.h"
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+// RAM-backed filesystem: nodes live in memory only, with file contents in
+// whole pageframes straight from the PMM (which mmap() shares as they are)
+// and directories hashing their children by name
+
+#define TMPFS_ROOT_INODE 1
+#define TMPFS_DIR_BUCKETS 8 // initially, doubled whenever it gets crowded
+
+typedef struct TmpfsNode TmpfsNode;
+struct TmpfsNode {
+  TmpfsNode *hashNext; // in the parent's buckets
+
+  // parent's children, in creation order (what getdents64() walks)
+  TmpfsNode *siblingPrev;
+  TmpfsNode *siblingNext;
+
+  TmpfsNode *parent;
+  uint64_t   order; // in the parent, never reused (getdents64() cursors)
+  uint64_t   inode;
+  uint32_t   mode; // S_IF* type | permissions
+  uint32_t   links;
+  uint32_t   opens; // fds, an unlinked node goes away with the last one
+
+  uint64_t atime;
+  uint64_t mtime;
+  uint64_t ctime;
+
+  // regular files: a pageframe per page (0 for holes)
+  size_t  size;
+  size_t *pages;
+  size_t  pagesCapacity;
+  size_t  pagesUsed;
+
+  // directories
+  TmpfsNode **buckets;
+  size_t      bucketsCnt;
+  TmpfsNode  *childFirst;
+  TmpfsNode  *childLast;
+  size_t      childrenCnt;
+  uint64_t    nextOrder;
+
+  uint32_t hash;
+  size_t   nameLen;
+  char     name[];
+};
+
+typedef struct Tmpfs {
+  Spinlock   LOCK_TMPFS; // whole tree (data copies happen outside of it)
+  TmpfsNode *root;
+  uint64_t   nextInode;
+  size_t     pages;    // in use by file contents
+  size_t     pagesMax; // (half of physical memory)
+} Tmpfs;
+
+typedef struct TmpfsOpenFd {
+  TmpfsNode *node;
+  size_t     ptr; // byte offset for files, next entry order for directories
+} TmpfsOpenFd;
+
+#define TMPFS_PTR(a) ((Tmpfs *)(a))
+#define TMPFS_FD_PTR(a) ((TmpfsOpenFd *)(a))
+
+// tmpfs_node.c
+TmpfsNode *tmpfsNodeCreate(Tmpfs *tmpfs, TmpfsNode *parent, char *name,
+                           size_t nameLen, uint32_t mode);
+TmpfsNode *tmpfsNodeLookup(TmpfsNode *dir, char *name, size_t nameLen);
+void       tmpfsNodeUnlink(Tmpfs *tmpfs, TmpfsNode *node);
+void       tmpfsNodePut(Tmpfs *tmpfs, TmpfsNode *node);
+TmpfsNode *tmpfsTraverse(Tmpfs *tmpfs, char *path);
+TmpfsNode *tmpfsTraverseParent(Tmpfs *tmpfs, char *path, char **name,
+                               size_t *nameLen);
+size_t     tmpfsPageGet(Tmpfs *tmpfs, TmpfsNode *node, size_t index,
+                        bool allocate);
+void       tmpfsResize(Tmpfs *tmpfs, TmpfsNode *node, size_t size);
+
+// tmpfs_controller.c
+bool   tmpfsMount(MountPoint *mount);
+bool   tmpfsOpen(MountPoint *mount, OpenFile *fd, char *filename);
+int    tmpfsRead(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit);
+int    tmpfsWrite(MountPoint *mount, OpenFile *fd, uint8_t *buff, int limit);
+bool   tmpfsSeek(MountPoint *mount, OpenFile *fd, uint32_t target);
+int    tmpfsTruncate(MountPoint *mount, OpenFile *fd, size_t length);
+size_t tmpfsGetFilesize(OpenFile *fd);
+bool   tmpfsClose(MountPoint *mount, OpenFile *fd);
+bool   tmpfsDuplicate(OpenFile *original, OpenFile *orphan);
+bool   tmpfsStat(Tmpfs *tmpfs, char *filename, struct stat *target);
+bool   tmpfsStatFd(Tmpfs *tmpfs, OpenFile *fd, struct stat *target);
+int    tmpfsGetdents64(OpenFile *fd, void *start, unsigned int hardlimit);
+int    tmpfsUnlink(MountPoint *mount, char *path, bool directory);
+int    tmpfsMkdir(MountPoint *mount, char *path, int mode);
+size_t tmpfsPageShare(OpenFile *fd, size_t index);
+
+#endif
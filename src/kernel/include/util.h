@@ -18,10 +18,27 @@
 #define SPLIT_32_HIGHER(value) ((value) >> 16)
 #define SPLIT_32_LOWER(value) ((value) & 0xFFFF)
 
+// ERMS without FSRM has a startup cost on short strings
+#define MEM_REP_THRESHOLD 256
+
+bool memErms; // enhanced "rep movsb/stosb"
+bool memFsrm; // fast short "rep movsb"
+
+void  initiateMemoryOps();
 void *memcpy(void *restrict dstptr, const void *restrict srcptr, size_t size);
 void *memmove(void *dstptr, const void *srcptr, size_t size);
 void  memset(void *_dst, int val, size_t len);
 int   memcmp(const void *aptr, const void *bptr, size_t size);
+void  copyPage(void *dst, const void *src);
+void  zeroPage(void *dst);
+
+// the variants memcpy() & memset() pick from
+void *memcpyRep(void *restrict dstptr, const void *restrict srcptr,
+                size_t size);
+void *memcpyUnrolled(void *restrict dstptr, const void *restrict srcptr,
+                     size_t size);
+void  memsetRep(void *_dst, int val, size_t len);
+void  memsetUnrolled(void *_dst, int val, size_t len);
 int   rand(void);
 void  srand(unsigned int seed);
 void  hexDump(const char *desc, const void *addr, const int len, int perLine);
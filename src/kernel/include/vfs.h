@@ -1,12 +1,13 @@
 #include "disk.h"
 #include "linux.h"
+#include "slab.h"
 #include "types.h"
 
 #ifndef FS_CONTROLLER_H
 #define FS_CONTROLLER_H
 
-typedef enum FS { FS_FATFS, FS_EXT2 } FS;
-typedef enum CONNECTOR { CONNECTOR_AHCI } CONNECTOR;
+typedef enum FS { FS_FATFS, FS_EXT2, FS_TMPFS } FS;
+typedef enum CONNECTOR { CONNECTOR_AHCI, CONNECTOR_TMPFS } CONNECTOR;
 
 // Accordingly to fatfs
 #define FS_MODE_READ 0x01
@@ -119,6 +120,9 @@ struct SpecialFile {
 
 MountPoint *firstMountPoint;
 
+SlabCache *openFileCache;
+SlabCache *specialFileCache;
+
 // "global" special files
 SpecialFile *firstGlobalSpecial;
 
@@ -126,6 +130,8 @@ SpecialFile *firstGlobalSpecial;
 #define SEEK_CURR 1 // current + offset
 #define SEEK_END 2  // end + offset
 
+void initiateVfs();
+
 OpenFile *fsKernelOpen(char *filename, int flags, uint32_t mode);
 bool      fsKernelClose(OpenFile *file);
 
@@ -144,6 +150,10 @@ bool     fsWriteSync(OpenFile *file);
 void     fsReadFullFile(OpenFile *file, uint8_t *out);
 int      fsReadlink(void *task, char *path, char *buf, int size);
 uint32_t fsGetFilesize(OpenFile *file);
+int      fsTruncate(OpenFile *file, size_t length);
+int      fsUserUnlink(void *task, char *filename);
+int      fsUserRmdir(void *task, char *filename);
+int      fsUserMkdir(void *task, char *filename, int mode);
 
 // vfs_sanitize.c
 char *fsStripMountpoint(const char *filename, MountPoint *mnt);
@@ -160,6 +170,7 @@ bool   fsSpecificOpen(char *filename, MountPoint *mnt, OpenFile *target);
 int    fsSpecificRead(OpenFile *file, uint8_t *out, size_t limit);
 int    fsSpecificWrite(OpenFile *file, uint8_t *in, size_t limit);
 bool   fsSpecificWriteSync(OpenFile *file);
+int    fsSpecificTruncate(OpenFile *file, size_t length);
 size_t fsSpecificGetFilesize(OpenFile *file);
 bool   fsSpecificDuplicateNodeUnsafe(OpenFile *original, OpenFile *orphan);
 int    fsSpecificSeek(OpenFile *file, int target, int offset, int whence);
@@ -170,6 +181,64 @@ MountPoint *fsMount(char *prefix, CONNECTOR connector, uint32_t disk,
 bool        fsUnmount(MountPoint *mnt);
 MountPoint *fsDetermineMountPoint(char *filename);
 
+// vfs_dcache.c
+// Dentry cache: (filesystem, parent directory, name) -> inode, where inode 0
+// is a negative entry ("doesn't exist"). Filesystems consult it for every path
+// component before going to the disk, while the VFS itself remembers whole
+// (sanitized) paths that don't exist, so they fail before the mount lookup
+#define DCACHE_BUCKETS 1024
+#define DCACHE_MAX 4096
+
+// parent of whole path entries (not tied to any filesystem)
+#define DCACHE_PATH ((uint64_t)-1)
+
+typedef struct Dentry Dentry;
+struct Dentry {
+  Dentry *hashNext;
+
+  // LRU list, most recently used first
+  Dentry *lruPrev;
+  Dentry *lruNext;
+
+  void    *fs; // fsInfo of the mount point
+  uint64_t parent;
+  uint64_t inode;
+
+  uint64_t generation; // whole path entries are stale past this
+  uint32_t hash;
+  size_t   nameLen;
+  char     name[];
+};
+
+typedef struct Dcache {
+  Dentry *buckets[DCACHE_BUCKETS];
+  Dentry *lruFirst;
+  Dentry *lruLast;
+  size_t  cnt;
+
+  // bumped by anything that can make a missing path appear
+  uint64_t generation;
+
+  // statistics
+  uint64_t hits;
+  uint64_t negativeHits;
+  uint64_t misses;
+} Dcache;
+
+Dcache dcache;
+
+bool     fsDcacheLookup(void *fs, uint64_t parent, char *name, size_t nameLen,
+                        uint64_t *inode);
+uint64_t fsDcacheGeneration();
+void     fsDcacheInsert(void *fs, uint64_t parent, char *name, size_t nameLen,
+                        uint64_t inode, uint64_t generation);
+void     fsDcacheInvalidate(void *fs, uint64_t parent, char *name,
+                            size_t nameLen);
+void     fsDcachePurge(void *fs);
+bool     fsDcachePathMissing(char *safeFilename);
+void     fsDcachePathMiss(char *safeFilename, uint64_t generation);
+void     fsDcachePathsChanged();
+
 // vfs_special.c
 OpenFile *fsUserSpecialDummyGen(void *task, int fd, SpecialFile *special,
                                 int flags, int mode);
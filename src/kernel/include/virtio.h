@@ -0,0 +1,126 @@
+#include "pci.h"
+#include "types.h"
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+// Modern (1.x) virtio over PCI: https://docs.oasis-open.org/virtio/virtio/v1.2/
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+// Device status
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_VERSION_1 32
+
+// Vendor specific PCI capabilities (cfg_type)
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+// ISR status
+#define VIRTIO_ISR_QUEUE 1
+#define VIRTIO_ISR_CONFIG 2
+
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+typedef struct VirtioPciCommonCfg {
+  // whole device
+  uint32_t device_feature_select;
+  uint32_t device_feature;
+  uint32_t driver_feature_select;
+  uint32_t driver_feature;
+  uint16_t msix_config;
+  uint16_t num_queues;
+  uint8_t  device_status;
+  uint8_t  config_generation;
+
+  // about the queue picked by queue_select
+  uint16_t queue_select;
+  uint16_t queue_size;
+  uint16_t queue_msix_vector;
+  uint16_t queue_enable;
+  uint16_t queue_notify_off;
+  uint32_t queue_desc_lo;
+  uint32_t queue_desc_hi;
+  uint32_t queue_driver_lo;
+  uint32_t queue_driver_hi;
+  uint32_t queue_device_lo;
+  uint32_t queue_device_hi;
+} __attribute__((packed)) VirtioPciCommonCfg;
+
+/* Split virtqueues */
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2 // device writes (instead of reads) the buffer
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+// Queues are capped at this size, so their descriptors fit in a bitmap
+#define VIRTQ_SIZE_MAX 64
+
+typedef struct VirtqDesc {
+  uint64_t addr; // physical
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} __attribute__((packed)) VirtqDesc;
+
+typedef struct VirtqAvail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+} __attribute__((packed)) VirtqAvail;
+
+typedef struct VirtqUsedElem {
+  uint32_t id;
+  uint32_t len;
+} __attribute__((packed)) VirtqUsedElem;
+
+typedef struct VirtqUsed {
+  uint16_t      flags;
+  uint16_t      idx;
+  VirtqUsedElem ring[];
+} __attribute__((packed)) VirtqUsed;
+
+typedef struct Virtqueue {
+  uint16_t index;
+  uint16_t size;
+
+  VirtqDesc           *desc;
+  volatile VirtqAvail *avail;
+  volatile VirtqUsed  *used;
+  volatile uint16_t   *notify;
+
+  uint16_t lastUsed; // used ring entries reaped so far
+} Virtqueue;
+
+typedef struct VirtioDevice {
+  volatile VirtioPciCommonCfg *common;
+  volatile uint8_t            *isr;
+  volatile uint8_t            *config; // device specific
+
+  size_t   notifyBase;
+  uint32_t notifyMultiplier;
+
+  uint64_t features; // negotiated
+} VirtioDevice;
+
+bool virtioInitiate(VirtioDevice *virtio, PCIdevice *device,
+                    PCIgeneralDevice *details, uint64_t wanted);
+bool virtioHasFeature(VirtioDevice *virtio, uint32_t bit);
+bool virtioQueueSetup(VirtioDevice *virtio, Virtqueue *queue, uint16_t index);
+void virtioReady(VirtioDevice *virtio);
+
+void virtioQueuePublish(Virtqueue *queue, uint16_t head);
+void virtioQueueNotify(Virtqueue *queue);
+
+#endif
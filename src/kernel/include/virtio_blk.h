@@ -0,0 +1,92 @@
+#include "block_device.h"
+#include "pci.h"
+#include "types.h"
+#include "virtio.h"
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#define VIRTIO_BLK_DEVICE_TRANSITIONAL 0x1001
+#define VIRTIO_BLK_DEVICE 0x1042
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_MQ 12
+
+// Request types & statuses
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+
+// Request queues used (when the device offers more than one)
+#define VIRTIO_BLK_QUEUES_MAX 4
+
+// Largest single command the block device layer gets to send
+#define VIRTIO_BLK_SECTORS_MAX 512
+
+// Data descriptors per request: 64 pages + 1 for an unaligned start of every
+// (merged) segment, same as AHCI's PRDT
+#define VIRTIO_BLK_SEGMENTS_MAX (64 + BLOCK_MERGE_MAX)
+
+typedef struct VirtioBlkConfig {
+  uint64_t capacity; // in sectors
+  uint32_t size_max;
+  uint32_t seg_max;
+  uint16_t cylinders;
+  uint8_t  heads;
+  uint8_t  sectors;
+  uint32_t blk_size;
+  uint8_t  physical_block_exp;
+  uint8_t  alignment_offset;
+  uint16_t min_io_size;
+  uint32_t opt_io_size;
+  uint8_t  writeback;
+  uint8_t  unused0;
+  uint16_t num_queues;
+} __attribute__((packed)) VirtioBlkConfig;
+
+typedef struct VirtioBlkHeader {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} __attribute__((packed)) VirtioBlkHeader;
+
+// Every request in flight takes up a single ring descriptor, pointing to an
+// indirect table (header, data segments, status) of the slot with the same
+// index
+typedef struct VirtioBlkSlot {
+  VirtqDesc       table[VIRTIO_BLK_SEGMENTS_MAX + 2];
+  VirtioBlkHeader header;
+  uint8_t         status;
+} __attribute__((aligned(16))) VirtioBlkSlot;
+
+typedef struct VirtioBlkQueue {
+  Virtqueue      vq;
+  VirtioBlkSlot *slots;
+
+  // slot bitmaps, only touched with interrupts off
+  volatile uint64_t busy;
+  volatile uint64_t done;
+
+  struct Task *waiters[VIRTQ_SIZE_MAX]; // sleeping issuer of every slot
+} VirtioBlkQueue;
+
+typedef struct VirtioBlk {
+  VirtioDevice   virtio;
+  VirtioBlkQueue queues[VIRTIO_BLK_QUEUES_MAX];
+  uint32_t       queuesCnt;
+
+  uint32_t segmentsMax; // data descriptors per request
+  uint32_t sizeMax;     // bytes per data descriptor
+  bool     readonly;
+
+  BlockDevice *device;
+} VirtioBlk;
+
+bool initiateVirtioBlk(PCIdevice *device);
+bool virtioBlkTransfer(BlockDevice *device, uint64_t LBA, uint32_t sectors,
+                       BlockSegment *segments, int cnt, bool write);
+
+#endif
@@ -0,0 +1,48 @@
+#include "page_cache.h"
+#include "rbtree.h"
+#include "types.h"
+
+#ifndef VMA_H
+#define VMA_H
+
+// Virtual Memory Area flags
+#define VMA_READ (1 << 0)
+#define VMA_WRITE (1 << 1)
+#define VMA_EXEC (1 << 2)
+#define VMA_SHARED (1 << 3) // survives fork() as the same pages
+#define VMA_DEVICE (1 << 4) // device memory, mapped up front & never released
+
+typedef struct VMA VMA;
+struct VMA {
+  RBnode node; // keyed by start
+
+  size_t   start; // page aligned
+  size_t   end;   // page aligned, exclusive
+  uint32_t flags;
+
+  // file backing (0 for anonymous areas)
+  PageCacheFile *file;
+  size_t         offset; // file offset of start, page aligned
+  size_t         limit;  // file offset past which the area reads as zero
+};
+
+typedef struct Task Task;
+
+VMA   *vmaFind(Task *task, size_t addr);
+VMA   *vmaInsert(Task *task, size_t start, size_t end, uint32_t flags);
+VMA   *vmaInsertFile(Task *task, size_t start, size_t end, uint32_t flags,
+                     PageCacheFile *file, size_t offset, size_t limit);
+size_t vmaFindHole(Task *task, size_t hint, size_t length);
+void   vmaPopulate(Task *task, size_t start, size_t end);
+bool   vmaFault(Task *task, size_t addr, uint64_t error);
+bool   vmaAccessible(Task *task, size_t addr, size_t len, bool write);
+
+void   vmaUnmap(Task *task, size_t start, size_t end);
+bool   vmaProtect(Task *task, size_t start, size_t end, uint32_t prot);
+size_t vmaRemap(Task *task, size_t start, size_t oldLen, size_t newLen,
+                bool mayMove);
+
+void vmaDuplicate(Task *source, Task *target);
+void vmaFree(Task *task);
+
+#endif
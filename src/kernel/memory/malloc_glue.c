@@ -5,29 +5,48 @@
 
 #define DEBUG_DLMALLOC_GLUE 0
 
-void *last = 0;
-void *sbrk(long increment) {
-#if DEBUG_DLMALLOC_GLUE
-  debugf("[dlmalloc::sbrk] size{%lx}\n", increment);
-#endif
-  if (increment < 0)
-    return 0; // supposed to release, whatever.
-  if (!increment)
-    return last;
-  // return 0;
+// The heap is made out of page-granular segments (no sbrk()): dlmalloc maps
+// them through these as it grows, big allocations get their own, and they're
+// given back to the PMM as soon as they (or their tails) go unused. Always
+// called with malloc_global_mutex held
+size_t heapPages = 0;
+size_t heapPagesPeak = 0;
 
-  uint64_t blocks = DivRoundUp(increment, BLOCK_SIZE);
+void *heapMmap(size_t size) {
+  uint64_t blocks = DivRoundUp(size, BLOCK_SIZE);
   void    *virt = VirtualAllocate(blocks);
-  memset(virt, 0, blocks * BLOCK_SIZE);
+  memset(virt, 0, blocks * BLOCK_SIZE); // (dlmalloc expects MMAP_CLEARS)
 
-  last = (void *)((size_t)virt + increment);
+  heapPages += blocks;
+  if (heapPages > heapPagesPeak)
+    heapPagesPeak = heapPages;
 
 #if DEBUG_DLMALLOC_GLUE
-  debugf("[dlmalloc::sbrk] found{%lx}\n", virt);
+  debugf("[dlmalloc::mmap] size{%lx} found{%lx}\n", size, virt);
 #endif
   return virt;
 }
 
+// can be a whole segment or just its tail (when trimming)
+int heapMunmap(void *ptr, size_t size) {
+#if DEBUG_DLMALLOC_GLUE
+  debugf("[dlmalloc::munmap] ptr{%lx} size{%lx}\n", ptr, size);
+#endif
+  if ((size_t)ptr % BLOCK_SIZE || size % BLOCK_SIZE)
+    return -1;
+
+  VirtualFree(ptr, size / BLOCK_SIZE);
+  heapPages -= size / BLOCK_SIZE;
+  return 0;
+}
+
+size_t heapUsage() { return heapPages * BLOCK_SIZE; }
+
+void heapDumpStats() {
+  printf("[heap] segments{%ldKB} peak{%ldKB}\n", heapPages * BLOCK_SIZE / 1024,
+         heapPagesPeak * BLOCK_SIZE / 1024);
+}
+
 int  __errnoF = 0;
 int *__errno_location = &__errnoF;
 // void __errno() { return &__errnoF; }
@@ -0,0 +1,289 @@
+#include <bootloader.h>
+#include <linked_list.h>
+#include <malloc.h>
+#include <page_cache.h>
+#include <paging.h>
+#include <pmm.h>
+#include <slab.h>
+#include <system.h>
+#include <tmpfs.h>
+#include <util.h>
+#include <vfs.h>
+
+// Unified page cache for regular (ext2/FAT32/tmpfs) files: file pages are read
+// in once and then shared by every mapping of the same file, be it mmap() or
+// the ELF loader. Pages are filled on demand, from the page fault handler
+// Copyright (C) 2024 Panagiotis
+
+#define PAGE_CACHE_DEBUG 0
+
+Spinlock LOCK_PAGE_CACHE = ATOMIC_FLAG_INIT;
+
+uint64_t pageCacheClock = 0;
+uint64_t pageCacheHits = 0;
+uint64_t pageCacheMisses = 0;
+uint64_t pageCacheEvictions = 0;
+
+PageCachePage *pageCacheFindUnsafe(PageCacheFile *cache, size_t index) {
+  RBnode *node = cache->pages.node;
+  while (node) {
+    PageCachePage *page = RB_ENTRY(node, PageCachePage, node);
+    if (index < page->index)
+      node = node->left;
+    else if (index > page->index)
+      node = node->right;
+    else
+      return page;
+  }
+  return 0;
+}
+
+void pageCacheLinkUnsafe(PageCacheFile *cache, PageCachePage *page) {
+  RBnode **link = &cache->pages.node;
+  RBnode  *parent = 0;
+  while (*link) {
+    parent = *link;
+    if (page->index < RB_ENTRY(parent, PageCachePage, node)->index)
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+  RBTreeLink(&page->node, parent, link);
+  RBTreeInsertColor(&page->node, &cache->pages);
+}
+
+// drops every page & the private handle (LOCK_PAGE_CACHE has to be held and
+// the file has to be unlinked already)
+void pageCacheDestroy(PageCacheFile *cache) {
+  while (cache->pages.node) {
+    PageCachePage *page = RB_ENTRY(cache->pages.node, PageCachePage, node);
+    RBTreeErase(&page->node, &cache->pages);
+    if (page->phys)
+      PhysicalRelease(page->phys);
+    free(page);
+  }
+
+  if (cache->file->handlers->close)
+    cache->file->handlers->close(cache->file);
+  slabFree(cache->file);
+  slabFree(cache);
+}
+
+// keeps the amount of unused (cached-only) files within PAGE_CACHE_UNUSED_MAX
+void pageCacheTrimUnsafe() {
+  while (true) {
+    int            unused = 0;
+    PageCacheFile *oldest = 0;
+    for (PageCacheFile *browse = firstPageCacheFile; browse;
+         browse = browse->next) {
+      if (browse->refs)
+        continue;
+      unused++;
+      if (!oldest || browse->lastUse < oldest->lastUse)
+        oldest = browse;
+    }
+    if (unused <= PAGE_CACHE_UNUSED_MAX)
+      break;
+
+    LinkedListUnregister((void **)&firstPageCacheFile, oldest);
+    pageCacheEvictions++;
+    pageCacheDestroy(oldest);
+  }
+}
+
+// Returns the (referenced) cache of a regular file, or 0 if it can't be cached
+PageCacheFile *pageCacheOpen(OpenFile *file) {
+  if (file->mountPoint == MOUNT_POINT_SPECIAL || file->handlers != &fsSpecific)
+    return 0;
+
+  stat statbuf = {0};
+  if (!fsStat(file, &statbuf))
+    return 0;
+
+  spinlockAcquire(&LOCK_PAGE_CACHE);
+  PageCacheFile *browse = firstPageCacheFile;
+  while (browse) {
+    if (browse->mnt == file->mountPoint && browse->inode == statbuf.st_ino)
+      break;
+    browse = browse->next;
+  }
+  if (browse) {
+    browse->refs++;
+    browse->lastUse = pageCacheClock++;
+    spinlockRelease(&LOCK_PAGE_CACHE);
+    return browse;
+  }
+
+  OpenFile *handle = fsUserDuplicateNodeUnsafe(file);
+  if (!handle) {
+    spinlockRelease(&LOCK_PAGE_CACHE);
+    return 0;
+  }
+
+  PageCacheFile *cache = (PageCacheFile *)LinkedListAllocate(
+      (void **)&firstPageCacheFile, sizeof(PageCacheFile));
+  cache->mnt = file->mountPoint;
+  cache->inode = statbuf.st_ino;
+  cache->file = handle;
+  cache->size = fsGetFilesize(handle);
+  cache->refs = 1;
+  cache->lastUse = pageCacheClock++;
+  spinlockRelease(&LOCK_PAGE_CACHE);
+
+#if PAGE_CACHE_DEBUG
+  debugf("[page_cache] New file: inode{%lx} size{%lx}\n", cache->inode,
+         cache->size);
+#endif
+  return cache;
+}
+
+void pageCacheHold(PageCacheFile *cache) {
+  spinlockAcquire(&LOCK_PAGE_CACHE);
+  cache->refs++;
+  spinlockRelease(&LOCK_PAGE_CACHE);
+}
+
+void pageCacheClose(PageCacheFile *cache) {
+  spinlockAcquire(&LOCK_PAGE_CACHE);
+  if (!cache->refs) {
+    debugf("[page_cache] Closing an unused file! inode{%lx}\n", cache->inode);
+    panic();
+  }
+  cache->refs--;
+  cache->lastUse = pageCacheClock++;
+  if (!cache->refs && cache->stale)
+    pageCacheDestroy(cache);
+  else if (!cache->refs)
+    pageCacheTrimUnsafe();
+  spinlockRelease(&LOCK_PAGE_CACHE);
+}
+
+// After a file's contents change: new users get freshly read pages, while
+// existing ones keep what they have till they let go of it
+void pageCacheInvalidate(MountPoint *mnt, uint64_t inode) {
+  spinlockAcquire(&LOCK_PAGE_CACHE);
+  PageCacheFile *browse = firstPageCacheFile;
+  while (browse) {
+    if (browse->mnt == mnt && browse->inode == inode)
+      break;
+    browse = browse->next;
+  }
+  if (browse) {
+    LinkedListUnregister((void **)&firstPageCacheFile, browse);
+    if (browse->refs)
+      browse->stale = true;
+    else
+      pageCacheDestroy(browse);
+  }
+  spinlockRelease(&LOCK_PAGE_CACHE);
+}
+
+// Reads the file's page at index into a new pageframe, with no locks held.
+// Returns 0 if out of memory
+size_t pageCacheLoad(PageCacheFile *cache, size_t index) {
+  // tmpfs pages are the file itself, so they're shared instead of copied
+  if (cache->mnt->filesystem == FS_TMPFS) {
+    size_t phys = tmpfsPageShare(cache->file, index);
+    if (phys)
+      return phys;
+  }
+
+  size_t phys = PhysicalAllocatePageZeroed();
+  if (!phys)
+    return 0;
+
+  size_t offset = index * PAGE_SIZE;
+  if (offset < cache->size) {
+    size_t len = cache->size - offset;
+    if (len > PAGE_SIZE)
+      len = PAGE_SIZE;
+    spinlockAcquire(&cache->LOCK_HANDLE);
+    fsSpecificSeek(cache->file, offset, 0, SEEK_SET);
+    fsRead(cache->file, (uint8_t *)(phys + bootloader.hhdmOffset), len);
+    spinlockRelease(&cache->LOCK_HANDLE);
+  }
+
+  return phys;
+}
+
+// Physical address of the file's page at index, read in if not cached yet.
+// Anything past the end of the file reads as zero. The cache keeps its own
+// reference, so mappings need to PhysicalShare() it. The page is linked as
+// loading before the read, so LOCK_PAGES isn't held across it & others
+// asking for the same page wait on it instead. Returns 0 if out of memory
+size_t pageCacheGet(PageCacheFile *cache, size_t index) {
+  spinlockAcquire(&cache->LOCK_PAGES);
+  PageCachePage *page = pageCacheFindUnsafe(cache, index);
+  while (page && page->loading) {
+    spinlockRelease(&cache->LOCK_PAGES);
+    while (page->loading)
+      asm volatile("pause");
+    spinlockAcquire(&cache->LOCK_PAGES);
+  }
+  if (page && page->phys) {
+    pageCacheHits++;
+    spinlockRelease(&cache->LOCK_PAGES);
+    return page->phys;
+  }
+
+  pageCacheMisses++;
+  if (!page) {
+    page = (PageCachePage *)malloc(sizeof(PageCachePage));
+    memset(page, 0, sizeof(PageCachePage));
+    page->index = index;
+    pageCacheLinkUnsafe(cache, page);
+    cache->pagesCnt++;
+  }
+  page->loading = true; // (or again, if an earlier load ran out of memory)
+  spinlockRelease(&cache->LOCK_PAGES);
+
+  size_t phys = pageCacheLoad(cache, index);
+
+  spinlockAcquire(&cache->LOCK_PAGES);
+  page->phys = phys;
+  page->loading = false;
+  spinlockRelease(&cache->LOCK_PAGES);
+
+  return phys;
+}
+
+// Plain read() through the cache (ex: ELF headers), returns the amount read
+size_t pageCacheRead(PageCacheFile *cache, size_t offset, uint8_t *out,
+                     size_t limit) {
+  if (offset >= cache->size)
+    return 0;
+  if (limit > cache->size - offset)
+    limit = cache->size - offset;
+
+  size_t done = 0;
+  while (done < limit) {
+    size_t phys = pageCacheGet(cache, (offset + done) / PAGE_SIZE);
+    if (!phys)
+      break;
+    size_t inPage = (offset + done) % PAGE_SIZE;
+    size_t len = PAGE_SIZE - inPage;
+    if (len > limit - done)
+      len = limit - done;
+    memcpy(out + done, (void *)(phys + bootloader.hhdmOffset + inPage), len);
+    done += len;
+  }
+
+  return done;
+}
+
+void pageCacheDumpStats() {
+  size_t files = 0;
+  size_t pages = 0;
+  spinlockAcquire(&LOCK_PAGE_CACHE);
+  for (PageCacheFile *browse = firstPageCacheFile; browse;
+       browse = browse->next) {
+    files++;
+    pages += browse->pagesCnt;
+  }
+  spinlockRelease(&LOCK_PAGE_CACHE);
+
+  printf("[page_cache] files{%ld} cached{%ldKB} hits{%ld} misses{%ld} "
+         "evictions{%ld}\n",
+         files, pages * PAGE_SIZE / 1024, pageCacheHits, pageCacheMisses,
+         pageCacheEvictions);
+}
@@ -25,6 +25,43 @@
 #define HHDMoffset (bootloader.hhdmOffset)
 uint64_t *globalPagedir = 0;
 
+// Process-context identifiers: every address space that's been loaded lately
+// gets its own tag on the TLB entries it leaves behind, so switching back &
+// forth doesn't flush anything. Slot i hands out PCID i + 1 (0 is for boot)
+typedef struct PagingPcid {
+  uint64_t *pagedir;
+  bool      stale; // has to be flushed on its next load
+} PagingPcid;
+
+bool       pcidSupported = false;
+bool       invpcidSupported = false;
+PagingPcid pagingPcids[PCID_SLOTS];
+int        pagingPcidNext = 0;
+
+void initiatePcid() {
+  uint32_t eax = 0x1, ebx = 0, ecx = 0, edx = 0;
+  cpuid(&eax, &ebx, &ecx, &edx);
+  uint64_t cr3 = 0;
+  asm volatile("movq %%cr3,%0" : "=r"(cr3));
+  // CR4.PCIDE can't be set while the current CR3 carries a tag
+  if (!((ecx >> 17) & 1) || cr3 & 0xfff) {
+    debugf("[paging] No PCID support, TLBs get flushed on every switch!\n");
+    return;
+  }
+
+  eax = 0x7, ebx = 0, ecx = 0, edx = 0;
+  cpuid(&eax, &ebx, &ecx, &edx);
+  invpcidSupported = (ebx >> 10) & 1;
+
+  uint64_t cr4 = 0;
+  asm volatile("movq %%cr4, %0" : "=r"(cr4));
+  cr4 |= 1 << 17;
+  asm volatile("movq %0, %%cr4" ::"r"(cr4));
+  pcidSupported = true;
+
+  debugf("[paging] PCID enabled! invpcid{%d}\n", invpcidSupported);
+}
+
 void initiatePaging() {
   // debugf("phys{%lx} virt{%lx}\n", bootloader.kernelPhysBase,
   //        bootloader.kernelVirtBase);
@@ -90,6 +127,15 @@ void initiatePaging() {
   uint64_t pdVirt = pdPhys + bootloader.hhdmOffset;
   globalPagedir = (uint64_t *)pdVirt;
 
+  // Write-protect (CR0.WP): copy-on-write pages have to fault on kernel writes
+  // as well (ex: read() into a forked process' buffer)
+  uint64_t cr0 = 0;
+  asm volatile("movq %%cr0, %0" : "=r"(cr0));
+  cr0 |= 1 << 16;
+  asm volatile("movq %0, %%cr0" ::"r"(cr0));
+
+  initiatePcid();
+
   // VirtualSeek(bootloader.hhdmOffset);
 }
 
@@ -99,21 +145,119 @@ void VirtualMapRegionByLength(uint64_t virt_addr, uint64_t phys_addr,
   debugf("[paging::map::region] virt{%lx} phys{%lx} len{%lx}\n", virt_addr,
          phys_addr, length);
 #endif
-  uint32_t pagesAmnt = DivRoundUp(length, PAGE_SIZE);
-  for (int i = 0; i < pagesAmnt; i++) {
-    uint64_t xvirt = virt_addr + i * PAGE_SIZE;
-    uint64_t xphys = phys_addr + i * PAGE_SIZE;
-    VirtualMap(xvirt, xphys, flags);
+  // 2MiB pages wherever both sides line up
+  uint64_t end = virt_addr + DivRoundUp(length, PAGE_SIZE) * PAGE_SIZE;
+  while (virt_addr < end) {
+    if (!(virt_addr % PAGE_SIZE_LARGE) && !(phys_addr % PAGE_SIZE_LARGE) &&
+        virt_addr + PAGE_SIZE_LARGE <= end) {
+      VirtualMapLargeL(globalPagedir, virt_addr, phys_addr, flags);
+      virt_addr += PAGE_SIZE_LARGE;
+      phys_addr += PAGE_SIZE_LARGE;
+      continue;
+    }
+    VirtualMap(virt_addr, phys_addr, flags);
+    virt_addr += PAGE_SIZE;
+    phys_addr += PAGE_SIZE;
   }
 }
 
 // Will NOT check for the current task and update it's pagedir (on the struct)!
-void ChangePageDirectoryUnsafe(uint64_t *pd) {
+// the PCID table is also touched by the scheduler, keep interrupts off
+uint64_t pagingCpuLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void pagingCpuUnlock(uint64_t rflags) {
+  if (rflags & (1 << 9)) // IF
+    asm volatile("sti" ::: "memory");
+}
+
+int VirtualPcidSlot(uint64_t *pagedir, bool assign) {
+  for (int i = 0; i < PCID_SLOTS; i++) {
+    if (pagingPcids[i].pagedir == pagedir)
+      return i;
+  }
+  if (!assign)
+    return -1;
+
+  // round-robin eviction, the slot's old entries go on the first load
+  int slot = pagingPcidNext;
+  pagingPcidNext = (pagingPcidNext + 1) % PCID_SLOTS;
+  pagingPcids[slot].pagedir = pagedir;
+  pagingPcids[slot].stale = true;
+  return slot;
+}
+
+// The value to load CR3 with for pd: tagged with its PCID (and without a
+// flush, unless it's been modified since it was last loaded) if supported
+uint64_t VirtualCr3(uint64_t *pd) {
   uint64_t targ = VirtualToPhysical((size_t)pd);
   if (!targ) {
     debugf("[paging] Could not change to pd{%lx}!\n", pd);
     panic();
   }
+  if (!pcidSupported)
+    return targ;
+
+  uint64_t rflags = pagingCpuLock();
+  int      slot = VirtualPcidSlot(pd, true);
+  targ |= slot + 1;
+  if (!pagingPcids[slot].stale)
+    targ |= CR3_NOFLUSH;
+  pagingPcids[slot].stale = false;
+  pagingCpuUnlock(rflags);
+
+  return targ;
+}
+
+// Invalidates virt_addr on pagedir's TLB entries, even when it's not the
+// loaded one (those have to be dealt with before it gets loaded again)
+void VirtualInvalidate(uint64_t *pagedir, uint64_t virt_addr) {
+  virt_addr = AMD64_MM_ADDRSX(virt_addr);
+  if (pagedir == globalPagedir)
+    invalidate(virt_addr);
+  if (!pcidSupported)
+    return;
+
+  uint64_t rflags = pagingCpuLock();
+  if (virt_addr >= 0xffff800000000000) {
+    // kernel half is shared by everyone
+    for (int i = 0; i < PCID_SLOTS; i++) {
+      if (pagingPcids[i].pagedir != globalPagedir)
+        pagingPcids[i].stale = true;
+    }
+  } else if (pagedir != globalPagedir) {
+    int slot = VirtualPcidSlot(pagedir, false);
+    if (slot >= 0 && invpcidSupported) {
+      struct {
+        uint64_t pcid;
+        uint64_t addr;
+      } desc = {slot + 1, virt_addr};
+      asm volatile("invpcid %0, %1" ::"m"(desc), "r"((uint64_t)0) : "memory");
+    } else if (slot >= 0)
+      pagingPcids[slot].stale = true;
+  }
+  pagingCpuUnlock(rflags);
+}
+
+// Drops all of pagedir's TLB entries
+void VirtualFlushL(uint64_t *pagedir) {
+  if (pcidSupported) {
+    uint64_t rflags = pagingCpuLock();
+    int      slot = VirtualPcidSlot(pagedir, false);
+    if (slot >= 0)
+      pagingPcids[slot].stale = true;
+    pagingCpuUnlock(rflags);
+  }
+
+  if (pagedir == globalPagedir)
+    ChangePageDirectoryUnsafe(pagedir);
+}
+
+void ChangePageDirectoryUnsafe(uint64_t *pd) {
+  uint64_t targ = VirtualCr3(pd);
   asm volatile("movq %0, %%cr3" ::"r"(targ));
 
   globalPagedir = pd;
@@ -137,13 +281,16 @@ void ChangePageDirectory(uint64_t *pd) {
 
 uint64_t *GetPageDirectory() { return (uint64_t *)globalPagedir; }
 
-void invalidate(uint64_t vaddr) { asm volatile("invlpg %0" ::"m"(vaddr)); }
+void invalidate(uint64_t vaddr) {
+  asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+}
 
 size_t VirtAllocPhys() {
-  size_t phys = BitmapAllocatePageframe(&physical);
-
-  void *virt = (void *)(phys + HHDMoffset);
-  memset(virt, 0, PAGE_SIZE);
+  size_t phys = PhysicalAllocatePageZeroed();
+  if (!phys) {
+    debugf("[paging] Physical memory ran out for page tables!\n");
+    panic();
+  }
 
   return phys;
 }
@@ -154,6 +301,47 @@ void VirtualMap(uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
   VirtualMapL(globalPagedir, virt_addr, phys_addr, flags);
 }
 
+// Entry of the page directory covering virt_addr (the one a 2MiB page takes),
+// allocating the levels above it if asked to. 0 if it's under a 1GiB page
+uint64_t *VirtualGetPdeUnsafe(uint64_t *pagedir, uint64_t virt_addr,
+                              bool allocate) {
+  virt_addr = AMD64_MM_STRIPSX(virt_addr);
+
+  uint64_t *pml4e = &pagedir[PML4E(virt_addr)];
+  if (!(*pml4e & PF_PRESENT)) {
+    if (!allocate)
+      return 0;
+    *pml4e = VirtAllocPhys() | PF_PRESENT | PF_RW | PF_USER;
+  }
+  size_t *pdp = (size_t *)(PTE_GET_ADDR(*pml4e) + HHDMoffset);
+
+  uint64_t *pdpte = &pdp[PDPTE(virt_addr)];
+  if (!(*pdpte & PF_PRESENT)) {
+    if (!allocate)
+      return 0;
+    *pdpte = VirtAllocPhys() | PF_PRESENT | PF_RW | PF_USER;
+  } else if (*pdpte & PF_PS)
+    return 0;
+  size_t *pd = (size_t *)(PTE_GET_ADDR(*pdpte) + HHDMoffset);
+
+  return &pd[PDE(virt_addr)];
+}
+
+// Breaks a 2MiB page up into 4KiB ones (same pageframes & flags), for when
+// only part of it gets unmapped, protected or copied on write
+void VirtualSplitUnsafe(uint64_t *pagedir, uint64_t *pde,
+                        uint64_t virt_addr) {
+  uint64_t  phys = PTE_GET_ADDR(*pde) & ~(PAGE_SIZE_LARGE - 1);
+  uint64_t  flags = PTE_GET_FLAGS(*pde) & ~PF_PS;
+  size_t    table = VirtAllocPhys();
+  uint64_t *pt = (uint64_t *)(table + HHDMoffset);
+  for (int i = 0; i < PAGE_LARGE_PAGES; i++)
+    pt[i] = (phys + i * PAGE_SIZE) | flags;
+
+  *pde = table | PF_PRESENT | PF_RW | PF_USER;
+  VirtualInvalidate(pagedir, virt_addr & ~(PAGE_SIZE_LARGE - 1));
+}
+
 void VirtualMapL(uint64_t *pagedir, uint64_t virt_addr, uint64_t phys_addr,
                  uint64_t flags) {
   if (virt_addr % PAGE_SIZE) {
@@ -163,42 +351,200 @@ void VirtualMapL(uint64_t *pagedir, uint64_t virt_addr, uint64_t phys_addr,
   }
   virt_addr = AMD64_MM_STRIPSX(virt_addr);
 
-  uint32_t pml4_index = PML4E(virt_addr);
-  uint32_t pdp_index = PDPTE(virt_addr);
-  uint32_t pd_index = PDE(virt_addr);
-  uint32_t pt_index = PTE(virt_addr);
-
   spinlockCntWriteAcquire(&WLOCK_PAGING);
-  if (!(pagedir[pml4_index] & PF_PRESENT)) {
-    size_t target = VirtAllocPhys();
-    pagedir[pml4_index] = target | PF_PRESENT | PF_RW | PF_USER;
-  }
-  size_t *pdp = (size_t *)(PTE_GET_ADDR(pagedir[pml4_index]) + HHDMoffset);
-
-  if (!(pdp[pdp_index] & PF_PRESENT)) {
-    size_t target = VirtAllocPhys();
-    pdp[pdp_index] = target | PF_PRESENT | PF_RW | PF_USER;
-  }
-  size_t *pd = (size_t *)(PTE_GET_ADDR(pdp[pdp_index]) + HHDMoffset);
-
-  if (!(pd[pd_index] & PF_PRESENT)) {
-    size_t target = VirtAllocPhys();
-    pd[pd_index] = target | PF_PRESENT | PF_RW | PF_USER;
+  uint64_t *pde = VirtualGetPdeUnsafe(pagedir, virt_addr, true);
+  if (!pde) {
+    debugf("[paging] Tried to map inside a 1GiB page! virt{%lx}\n",
+           virt_addr);
+    panic();
   }
-  size_t *pt = (size_t *)(PTE_GET_ADDR(pd[pd_index]) + HHDMoffset);
+  if (!(*pde & PF_PRESENT))
+    *pde = VirtAllocPhys() | PF_PRESENT | PF_RW | PF_USER;
+  else if (*pde & PF_PS)
+    VirtualSplitUnsafe(pagedir, pde, virt_addr);
+  size_t  *pt = (size_t *)(PTE_GET_ADDR(*pde) + HHDMoffset);
+  uint32_t pt_index = PTE(virt_addr);
 
   if (pt[pt_index] & PF_PRESENT)
     debugf("[paging] Overwrite (without unmapping) WARN! virt{%lx} phys{%lx}\n",
            virt_addr, phys_addr);
   pt[pt_index] = (P_PHYS_ADDR(phys_addr)) | PF_PRESENT | flags; // | PF_RW
 
-  invalidate(virt_addr);
+  VirtualInvalidate(pagedir, virt_addr);
   spinlockCntWriteRelease(&WLOCK_PAGING);
 #if ELF_DEBUG
   debugf("[paging] Mapped virt{%lx} to phys{%lx}\n", virt_addr, phys_addr);
 #endif
 }
 
+// Maps a whole 2MiB page (both addresses have to be aligned to it). Whatever
+// page table was there has to be empty already
+void VirtualMapLargeL(uint64_t *pagedir, uint64_t virt_addr, uint64_t phys_addr,
+                      uint64_t flags) {
+  if (virt_addr % PAGE_SIZE_LARGE || phys_addr % PAGE_SIZE_LARGE) {
+    debugf("[paging] Tried to map non-aligned 2MiB page! virt{%lx} "
+           "phys{%lx}\n",
+           virt_addr, phys_addr);
+    panic();
+  }
+  virt_addr = AMD64_MM_STRIPSX(virt_addr);
+
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pde = VirtualGetPdeUnsafe(pagedir, virt_addr, true);
+  if (!pde) {
+    debugf("[paging] Tried to map inside a 1GiB page! virt{%lx}\n",
+           virt_addr);
+    panic();
+  }
+
+  bool table = *pde & PF_PRESENT && !(*pde & PF_PS);
+  if (*pde & PF_PRESENT && *pde & PF_PS)
+    debugf("[paging] Overwrite (without unmapping) WARN! virt{%lx} phys{%lx}\n",
+           virt_addr, phys_addr);
+  else if (table) {
+    uint64_t *pt = (uint64_t *)(PTE_GET_ADDR(*pde) + HHDMoffset);
+    for (int i = 0; i < PAGE_LARGE_PAGES; i++) {
+      if (pt[i] & PF_PRESENT) {
+        debugf("[paging] Tried to map a 2MiB page over 4KiB ones! "
+               "virt{%lx}\n",
+               virt_addr);
+        panic();
+      }
+    }
+    PhysicalFreePage(PTE_GET_ADDR(*pde));
+  }
+  *pde = phys_addr | PF_PRESENT | PF_PS | flags;
+
+  VirtualInvalidate(pagedir, virt_addr);
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+}
+
+// Lookup of a 2MiB page's entry (0 if there's none, or it's split up)
+uint64_t *VirtualGetLargeEntry(uint64_t *pagedir, uint64_t virt_addr) {
+  uint64_t *pde = VirtualGetPdeUnsafe(pagedir, virt_addr, false);
+  if (!pde || !(*pde & PF_PRESENT) || !(*pde & PF_PS))
+    return 0;
+  return pde;
+}
+
+// Like VirtualGetEntry(), but splits up a 2MiB page covering virt_addr first
+uint64_t *VirtualGetEntrySplitUnsafe(uint64_t *pagedir, uint64_t virt_addr) {
+  uint64_t *pde = VirtualGetLargeEntry(pagedir, virt_addr);
+  if (pde)
+    VirtualSplitUnsafe(pagedir, pde, virt_addr);
+  return VirtualGetEntry(pagedir, virt_addr);
+}
+
+// Returns the old entry of a whole 2MiB page (0 if there wasn't one)
+uint64_t VirtualUnmapLargeL(uint64_t *pagedir, uint64_t virt_addr) {
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pde = VirtualGetLargeEntry(pagedir, virt_addr);
+  uint64_t  entry = 0;
+  if (pde) {
+    entry = *pde;
+    *pde = 0;
+    VirtualInvalidate(pagedir, virt_addr);
+  }
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+  return entry;
+}
+
+void VirtualProtectLargeL(uint64_t *pagedir, uint64_t virt_addr,
+                          bool writable) {
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pde = VirtualGetLargeEntry(pagedir, virt_addr);
+  if (pde) {
+    if (!writable)
+      *pde &= ~PF_RW;
+    else if (!(*pde & PF_COW))
+      *pde |= PF_RW;
+    VirtualInvalidate(pagedir, virt_addr);
+  }
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+}
+
+// Whether nothing at all is mapped in the 2MiB range of virt_addr (so a large
+// page can take its place)
+bool VirtualLargeVacant(uint64_t *pagedir, uint64_t virt_addr) {
+  spinlockCntReadAcquire(&WLOCK_PAGING);
+  uint64_t *pde = VirtualGetPdeUnsafe(pagedir, virt_addr, false);
+  bool      vacant = true;
+  if (!pde) {
+    // missing levels (vacant) or a 1GiB page (not)
+    uint64_t pml4e = pagedir[PML4E(AMD64_MM_STRIPSX(virt_addr))];
+    size_t  *pdp = (size_t *)(PTE_GET_ADDR(pml4e) + HHDMoffset);
+    vacant = !(pml4e & PF_PRESENT) ||
+             !(pdp[PDPTE(AMD64_MM_STRIPSX(virt_addr))] & PF_PRESENT);
+  } else if (*pde & PF_PS)
+    vacant = !(*pde & PF_PRESENT);
+  else if (*pde & PF_PRESENT) {
+    uint64_t *pt = (uint64_t *)(PTE_GET_ADDR(*pde) + HHDMoffset);
+    for (int i = 0; vacant && i < PAGE_LARGE_PAGES; i++) {
+      if (pt[i] & PF_PRESENT)
+        vacant = false;
+    }
+  }
+  spinlockCntReadRelease(&WLOCK_PAGING);
+  return vacant;
+}
+
+// Drops the references of all pageframes behind a 2MiB page's entry
+void VirtualReleaseLarge(uint64_t entry) {
+  if (entry & PF_DEVICE)
+    return;
+  uint64_t phys = PTE_GET_ADDR(entry) & ~(PAGE_SIZE_LARGE - 1);
+  for (int i = 0; i < PAGE_LARGE_PAGES; i++)
+    PhysicalRelease(phys + i * PAGE_SIZE);
+}
+
+// Collapses a fully populated 2MiB range of private 4KiB pages (of the same
+// flags) into a single large page, by copying them over into one contiguous
+// block. Returns true if it did
+bool VirtualPromoteL(uint64_t *pagedir, uint64_t virt_addr) {
+  virt_addr = AMD64_MM_STRIPSX(virt_addr) & ~(PAGE_SIZE_LARGE - 1);
+  uint64_t ignored = PF_ACCESS | PF_DIRTY;
+
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pde = VirtualGetPdeUnsafe(pagedir, virt_addr, false);
+  if (!pde || !(*pde & PF_PRESENT) || *pde & PF_PS) {
+    spinlockCntWriteRelease(&WLOCK_PAGING);
+    return false;
+  }
+
+  uint64_t *pt = (uint64_t *)(PTE_GET_ADDR(*pde) + HHDMoffset);
+  uint64_t  flags = PTE_GET_FLAGS(pt[0]) & ~ignored;
+  bool      eligible = !(flags & (PF_COW | PF_SHARED | PF_DEVICE));
+  for (int i = 0; eligible && i < PAGE_LARGE_PAGES; i++) {
+    if (!(pt[i] & PF_PRESENT) || (PTE_GET_FLAGS(pt[i]) & ~ignored) != flags ||
+        PhysicalShared(PTE_GET_ADDR(pt[i])))
+      eligible = false;
+  }
+
+  size_t large = eligible ? PhysicalAllocate(PAGE_LARGE_PAGES) : 0;
+  if (!large) {
+    spinlockCntWriteRelease(&WLOCK_PAGING);
+    return false;
+  }
+  for (int i = 0; i < PAGE_LARGE_PAGES; i++)
+    copyPage((void *)(large + i * PAGE_SIZE + HHDMoffset),
+             (void *)(PTE_GET_ADDR(pt[i]) + HHDMoffset));
+
+  size_t table = PTE_GET_ADDR(*pde);
+  *pde = large | flags | PF_PS;
+  for (int i = 0; i < PAGE_LARGE_PAGES; i++)
+    VirtualInvalidate(pagedir, virt_addr + i * PAGE_SIZE);
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+
+  for (int i = 0; i < PAGE_LARGE_PAGES; i++)
+    PhysicalRelease(PTE_GET_ADDR(pt[i]));
+  PhysicalFreePage(table);
+
+#if PAGING_DEBUG
+  debugf("[paging] Promoted to a 2MiB page! virt{%lx}\n", virt_addr);
+#endif
+  return true;
+}
+
 size_t VirtualToPhysical(size_t virt_addr) {
   if (!globalPagedir)
     return 0;
@@ -228,16 +574,20 @@ size_t VirtualToPhysical(size_t virt_addr) {
 
   if (!(pdp[pdp_index] & PF_PRESENT))
     goto error;
-  /*else if (pdp[pdp_index] & PF_PRESENT && pdp[pdp_index] & PF_PS)
-    return (void *)(PTE_GET_ADDR(pdp[pdp_index] +
-                                 (virt_addr & PAGE_MASK(12 + 9 + 9))));*/
+  else if (pdp[pdp_index] & PF_PS) {
+    size_t phys = PTE_GET_ADDR(pdp[pdp_index]) & ~(PAGE_SIZE_HUGE - 1);
+    spinlockCntReadRelease(&WLOCK_PAGING);
+    return phys + (virt_addr_init & (PAGE_SIZE_HUGE - 1));
+  }
   size_t *pd = (size_t *)(PTE_GET_ADDR(pdp[pdp_index]) + HHDMoffset);
 
   if (!(pd[pd_index] & PF_PRESENT))
     goto error;
-  /*else if (pd[pd_index] & PF_PRESENT && pd[pd_index] & PF_PS)
-    return (
-        void *)(PTE_GET_ADDR(pd[pd_index] + (virt_addr & PAGE_MASK(12 + 9))));*/
+  else if (pd[pd_index] & PF_PS) {
+    size_t phys = PTE_GET_ADDR(pd[pd_index]) & ~(PAGE_SIZE_LARGE - 1);
+    spinlockCntReadRelease(&WLOCK_PAGING);
+    return phys + (virt_addr_init & (PAGE_SIZE_LARGE - 1));
+  }
   size_t *pt = (size_t *)(PTE_GET_ADDR(pd[pd_index]) + HHDMoffset);
 
   if (pt[pt_index] & PF_PRESENT) {
@@ -251,9 +601,32 @@ error:
   return 0;
 }
 
-uint32_t VirtualUnmap(uint32_t virt_addr) {
-  // not really used anywhere atm, sooooo idc
-  return 0;
+// Returns the old entry (so the caller can deal with the pageframe)
+uint64_t VirtualUnmapL(uint64_t *pagedir, uint64_t virt_addr) {
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pte = VirtualGetEntrySplitUnsafe(pagedir, virt_addr);
+  uint64_t  entry = 0;
+  if (pte && *pte & PF_PRESENT) {
+    entry = *pte;
+    *pte = 0;
+    VirtualInvalidate(pagedir, virt_addr);
+  }
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+  return entry;
+}
+
+// Copy-on-write pages stay read-only, their write fault will handle it
+void VirtualProtectL(uint64_t *pagedir, uint64_t virt_addr, bool writable) {
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  uint64_t *pte = VirtualGetEntrySplitUnsafe(pagedir, virt_addr);
+  if (pte && *pte & PF_PRESENT) {
+    if (!writable)
+      *pte &= ~PF_RW;
+    else if (!(*pte & PF_COW))
+      *pte |= PF_RW;
+    VirtualInvalidate(pagedir, virt_addr);
+  }
+  spinlockCntWriteRelease(&WLOCK_PAGING);
 }
 
 uint64_t *PageDirectoryAllocate() {
@@ -263,7 +636,7 @@ uint64_t *PageDirectoryAllocate() {
   }
   uint64_t *out = VirtualAllocate(1);
 
-  memset(out, 0, PAGE_SIZE);
+  zeroPage(out);
 
   uint64_t *model = taskGet(KERNEL_TASK_ID)->pagedir;
   for (int i = 0; i < 512; i++)
@@ -288,30 +661,64 @@ void PageDirectoryFree(uint64_t *page_dir) {
       size_t *pd = (size_t *)(PTE_GET_ADDR(pdp[pdp_index]) + HHDMoffset);
 
       for (int pd_index = 0; pd_index < 512; pd_index++) {
-        if (!(pd[pd_index] & PF_PRESENT) || pd[pd_index] & PF_PS)
+        if (!(pd[pd_index] & PF_PRESENT))
+          continue;
+        if (pd[pd_index] & PF_PS) {
+          if (pd[pd_index] & PF_USER)
+            VirtualReleaseLarge(pd[pd_index]);
           continue;
+        }
         size_t *pt = (size_t *)(PTE_GET_ADDR(pd[pd_index]) + HHDMoffset);
 
         for (int pt_index = 0; pt_index < 512; pt_index++) {
           if (!(pt[pt_index] & PF_PRESENT) || pt[pt_index] & PF_PS)
             continue;
 
-          // we only free mappings related to userland (ones from ELF)
-          if (!(pt[pt_index] & PF_USER))
+          // we only free mappings related to userland (ones from ELF), and
+          // never device memory
+          if (!(pt[pt_index] & PF_USER) || pt[pt_index] & PF_DEVICE)
             continue;
 
           uint64_t phys = PTE_GET_ADDR(pt[pt_index]);
-          BitmapFreePageframe(&physical, (void *)phys);
+          PhysicalRelease(phys);
         }
       }
     }
   }
 
   spinlockCntWriteRelease(&WLOCK_PAGING);
+
+  // a future pagedir in the same spot mustn't inherit its TLB entries
+  if (pcidSupported) {
+    uint64_t rflags = pagingCpuLock();
+    int      slot = VirtualPcidSlot(page_dir, false);
+    if (slot >= 0)
+      pagingPcids[slot].pagedir = 0;
+    pagingCpuUnlock(rflags);
+  }
 }
 
+// Same as below, for a whole 2MiB page (WLOCK_PAGING has to be write-held)
+void PageDirectoryLargeDuplicate(uint64_t *pde, uint64_t *target,
+                                 size_t virt) {
+  size_t phys = PTE_GET_ADDR(*pde) & ~(PAGE_SIZE_LARGE - 1);
+  if (!(*pde & PF_SHARED))
+    *pde = (*pde & ~PF_RW) | PF_COW;
+  for (int i = 0; !(*pde & PF_DEVICE) && i < PAGE_LARGE_PAGES; i++)
+    PhysicalShare(phys + i * PAGE_SIZE);
+
+  uint64_t flags =
+      PTE_GET_FLAGS(*pde) & ~(PF_PRESENT | PF_PS | PF_ACCESS | PF_DIRTY);
+
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+  VirtualMapLargeL(target, virt, phys, flags);
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+}
+
+// The source's entries get rewritten (write-protected), so this walks it with
+// the write lock held, only dropping it while mapping into the target
 void PageDirectoryUserDuplicate(uint64_t *source, uint64_t *target) {
-  spinlockCntReadAcquire(&WLOCK_PAGING);
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
   for (int pml4_index = 0; pml4_index < 512; pml4_index++) {
     if (!(source[pml4_index] & PF_PRESENT) || source[pml4_index] & PF_PS)
       continue;
@@ -323,8 +730,15 @@ void PageDirectoryUserDuplicate(uint64_t *source, uint64_t *target) {
       size_t *pd = (size_t *)(PTE_GET_ADDR(pdp[pdp_index]) + HHDMoffset);
 
       for (int pd_index = 0; pd_index < 512; pd_index++) {
-        if (!(pd[pd_index] & PF_PRESENT) || pd[pd_index] & PF_PS)
+        if (!(pd[pd_index] & PF_PRESENT))
           continue;
+        if (pd[pd_index] & PF_PS) {
+          if (pd[pd_index] & PF_USER)
+            PageDirectoryLargeDuplicate(
+                &pd[pd_index], target,
+                BITS_TO_VIRT_ADDR(pml4_index, pdp_index, pd_index, 0));
+          continue;
+        }
         size_t *pt = (size_t *)(PTE_GET_ADDR(pd[pd_index]) + HHDMoffset);
 
         for (int pt_index = 0; pt_index < 512; pt_index++) {
@@ -335,26 +749,104 @@ void PageDirectoryUserDuplicate(uint64_t *source, uint64_t *target) {
           if (!(pt[pt_index] & PF_USER))
             continue;
 
-          size_t physSource = PTE_GET_ADDR(pt[pt_index]);
-          size_t physTarget = (pt[pt_index] & PF_SHARED)
-                                  ? physSource
-                                  : BitmapAllocatePageframe(&physical);
+          // no copying: both sides point to the same pageframe, with private
+          // pages becoming read-only until someone writes to them. Even ones
+          // that are read-only already, so a later mprotect() can't make a
+          // frame both sides map writable
+          size_t phys = PTE_GET_ADDR(pt[pt_index]);
+          if (!(pt[pt_index] & PF_SHARED))
+            pt[pt_index] = (pt[pt_index] & ~PF_RW) | PF_COW;
+          if (!(pt[pt_index] & PF_DEVICE))
+            PhysicalShare(phys);
 
           size_t virt =
               BITS_TO_VIRT_ADDR(pml4_index, pdp_index, pd_index, pt_index);
+          uint64_t flags =
+              PTE_GET_FLAGS(pt[pt_index]) & ~(PF_PRESENT | PF_ACCESS | PF_DIRTY);
 
-          void *ptrSource = (void *)(physSource + HHDMoffset);
-          void *ptrTarget = (void *)(physTarget + HHDMoffset);
-
-          memcpy(ptrTarget, ptrSource, PAGE_SIZE);
-
-          spinlockCntReadRelease(&WLOCK_PAGING);
-          VirtualMapL(target, virt, physTarget, PF_RW | PF_USER);
-          spinlockCntReadAcquire(&WLOCK_PAGING);
+          spinlockCntWriteRelease(&WLOCK_PAGING);
+          VirtualMapL(target, virt, phys, flags);
+          spinlockCntWriteAcquire(&WLOCK_PAGING);
         }
       }
     }
   }
 
-  spinlockCntReadRelease(&WLOCK_PAGING);
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+
+  // the source's entries got write-protected, flush them
+  VirtualFlushL(source);
+}
+
+// Lookup of a 4K page's entry (without allocating anything on the way)
+uint64_t *VirtualGetEntry(uint64_t *pagedir, uint64_t virt_addr) {
+  virt_addr = AMD64_MM_STRIPSX(virt_addr);
+
+  if (!(pagedir[PML4E(virt_addr)] & PF_PRESENT) ||
+      pagedir[PML4E(virt_addr)] & PF_PS)
+    return 0;
+  size_t *pdp =
+      (size_t *)(PTE_GET_ADDR(pagedir[PML4E(virt_addr)]) + HHDMoffset);
+
+  if (!(pdp[PDPTE(virt_addr)] & PF_PRESENT) || pdp[PDPTE(virt_addr)] & PF_PS)
+    return 0;
+  size_t *pd = (size_t *)(PTE_GET_ADDR(pdp[PDPTE(virt_addr)]) + HHDMoffset);
+
+  if (!(pd[PDE(virt_addr)] & PF_PRESENT) || pd[PDE(virt_addr)] & PF_PS)
+    return 0;
+  size_t *pt = (size_t *)(PTE_GET_ADDR(pd[PDE(virt_addr)]) + HHDMoffset);
+
+  return &pt[PTE(virt_addr)];
+}
+
+// Write to a copy-on-write page: either take it over (if nobody else is using
+// it anymore) or give the writer its own copy
+bool VirtualResolveCow(uint64_t *pte, uint64_t virt_addr) {
+  size_t phys = PTE_GET_ADDR(*pte);
+  if (!PhysicalShared(phys)) {
+    *pte = (*pte & ~PF_COW) | PF_RW;
+    VirtualInvalidate(globalPagedir, virt_addr);
+    return true;
+  }
+
+  size_t copy = PhysicalAllocatePage();
+  if (!copy)
+    return false;
+  copyPage((void *)(copy + HHDMoffset), (void *)(phys + HHDMoffset));
+
+  *pte = P_PHYS_ADDR(copy) | (PTE_GET_FLAGS(*pte) & ~PF_COW) | PF_RW;
+  VirtualInvalidate(globalPagedir, virt_addr);
+
+  PhysicalRelease(phys);
+  return true;
+}
+
+// Called on every page fault, returns true if it was resolved (& execution
+// can just continue)
+bool VirtualPageFault(uint64_t virt_addr, uint64_t error) {
+  if (!globalPagedir || virt_addr >= USER_STACK_BOTTOM)
+    return false;
+
+  // mprotect()'d areas don't get to copy-on-write
+  VMA *vma = tasksInitiated ? vmaFind(currentTask, virt_addr) : 0;
+  if (vma && error & PF_ERR_WRITE && !(vma->flags & VMA_WRITE))
+    return false;
+
+  bool resolved = false;
+  spinlockCntWriteAcquire(&WLOCK_PAGING);
+  // a written copy-on-write 2MiB page is only copied 4KiB at a time
+  uint64_t *pde = VirtualGetLargeEntry(globalPagedir, virt_addr);
+  if (pde && *pde & PF_COW && error & PF_ERR_PRESENT && error & PF_ERR_WRITE)
+    VirtualSplitUnsafe(globalPagedir, pde, virt_addr);
+  uint64_t *pte = VirtualGetEntry(globalPagedir, virt_addr & ~0xFFF);
+  if (pte && *pte & PF_PRESENT && *pte & PF_COW && error & PF_ERR_PRESENT &&
+      error & PF_ERR_WRITE)
+    resolved = VirtualResolveCow(pte, virt_addr & ~0xFFF);
+  spinlockCntWriteRelease(&WLOCK_PAGING);
+
+  // lazily backed memory (anonymous mmap() & brk() regions)
+  if (!resolved && tasksInitiated)
+    resolved = vmaFault(currentTask, virt_addr, error);
+
+  return resolved;
 }
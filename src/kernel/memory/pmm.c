@@ -8,50 +8,377 @@
 // Physical memory space manager/allocator
 // Copyright (C) 2024 Panagiotis
 
+// Binary buddy allocator: every order keeps a doubly linked list of free
+// blocks (stored inside the free memory itself) and the per-frame order array
+// tells if a block's buddy is free & of the same size, for coalescing. The
+// bitmap is kept around as a mirror of what's used, for dumps & sanity checks.
+
+#define PMM_DEBUG 0
+
+Spinlock LOCK_PMM = ATOMIC_FLAG_INIT;
+
+// LOCK_PMM is also taken with interrupts off (magazine refills & drains, page
+// faults), so it's never held with them on: a holder getting preempted would
+// leave those spinning forever
+uint64_t physicalLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  spinlockAcquire(&LOCK_PMM);
+  return rflags;
+}
+
+void physicalUnlock(uint64_t rflags) {
+  spinlockRelease(&LOCK_PMM);
+  if (rflags & (1 << 9)) // IF
+    asm volatile("sti" ::: "memory");
+}
+
+BuddyFreeBlock *buddyBlock(size_t frame) {
+  return (BuddyFreeBlock *)(frame * BLOCK_SIZE + bootloader.hhdmOffset);
+}
+
+size_t buddyFrame(BuddyFreeBlock *block) {
+  return ((size_t)block - bootloader.hhdmOffset) / BLOCK_SIZE;
+}
+
+void buddyListPush(size_t frame, uint8_t order) {
+  BuddyFreeBlock *block = buddyBlock(frame);
+  block->prev = 0;
+  block->next = physicalBuddy.freeList[order];
+  if (block->next)
+    block->next->prev = block;
+  physicalBuddy.freeList[order] = block;
+
+  physicalBuddy.order[frame] = order;
+  physicalBuddy.freeBlocks[order]++;
+}
+
+void buddyListRemove(size_t frame, uint8_t order) {
+  BuddyFreeBlock *block = buddyBlock(frame);
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    physicalBuddy.freeList[order] = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+
+  physicalBuddy.order[frame] = BUDDY_ORDER_NONE;
+  physicalBuddy.freeBlocks[order]--;
+}
+
+// merge with free buddies for as long as possible, then put it on a list
+void buddyFreeBlock(size_t frame, uint8_t order) {
+  while (order < BUDDY_MAX_ORDER - 1) {
+    size_t buddy = frame ^ (1UL << order);
+    if (buddy >= physicalBuddy.frames || physicalBuddy.order[buddy] != order)
+      break;
+    buddyListRemove(buddy, order);
+    frame &= ~(1UL << order);
+    order++;
+  }
+  buddyListPush(frame, order);
+}
+
+// frees an arbitrary (not necessarily aligned) range of pageframes, by
+// splitting it into the largest naturally aligned blocks
+void buddyFreeRange(size_t frame, size_t count) {
+  for (size_t i = frame; i < frame + count; i++) {
+    if (!BitmapGet(&physical, i)) {
+      debugf("[pmm::free] Double free detected! phys{%lx}\n", i * BLOCK_SIZE);
+      panic();
+    }
+  }
+  MarkBlocks(&physical, frame, count, 0);
+  physicalBuddy.freePages += count;
+
+  while (count) {
+    uint8_t order = 0;
+    while (order < BUDDY_MAX_ORDER - 1 && !(frame & (1UL << order)) &&
+           (1UL << (order + 1)) <= count)
+      order++;
+    buddyFreeBlock(frame, order);
+    frame += 1UL << order;
+    count -= 1UL << order;
+  }
+}
+
+size_t buddyAllocate(size_t pages) {
+  uint8_t order = 0;
+  while ((1UL << order) < pages)
+    order++;
+  if (order >= BUDDY_MAX_ORDER)
+    return INVALID_BLOCK;
+
+  uint8_t current = order;
+  while (current < BUDDY_MAX_ORDER && !physicalBuddy.freeList[current])
+    current++;
+  if (current >= BUDDY_MAX_ORDER)
+    return INVALID_BLOCK;
+
+  size_t frame = buddyFrame(physicalBuddy.freeList[current]);
+  buddyListRemove(frame, current);
+
+  // split it up until it's the size we need
+  while (current > order) {
+    current--;
+    buddyListPush(frame + (1UL << current), current);
+  }
+
+  MarkBlocks(&physical, frame, 1UL << order, 1);
+  physicalBuddy.freePages -= 1UL << order;
+
+  // give back the tail we won't be using (non power-of-two requests)
+  if ((1UL << order) > pages)
+    buddyFreeRange(frame + pages, (1UL << order) - pages);
+
+  return frame;
+}
+
+size_t PhysicalAllocate(size_t pages) {
+  if (!pages)
+    return 0;
+
+  uint64_t rflags = physicalLock();
+  size_t frame = buddyAllocate(pages);
+  physicalUnlock(rflags);
+
+  if (frame == INVALID_BLOCK)
+    return 0;
+
+#if PMM_DEBUG
+  debugf("[pmm::alloc] Found region: phys{%lx} pages{%lx}\n",
+         frame * BLOCK_SIZE, pages);
+#endif
+  return frame * BLOCK_SIZE;
+}
+
+void PhysicalFree(size_t phys, size_t pages) {
+  size_t frame = phys / BLOCK_SIZE;
+  if (phys % BLOCK_SIZE || frame + pages > physicalBuddy.frames) {
+    debugf("[pmm::free] Invalid region! phys{%lx} pages{%lx}\n", phys, pages);
+    panic();
+  }
+
+  uint64_t rflags = physicalLock();
+  buddyFreeRange(frame, pages);
+  physicalUnlock(rflags);
+}
+
+/* Per-CPU pageframe caches */
+
+int physicalCpuId() { return 0; } // bootstrap processor only (for now)
+
+// the magazines are CPU-local: keeping interrupts off is enough
+uint64_t physicalCacheLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void physicalCacheUnlock(uint64_t rflags) {
+  if (rflags & (1 << 9)) // IF
+    asm volatile("sti" ::: "memory");
+}
+
+// grabs a batch from the buddy (preferably a single contiguous block)
+void physicalCacheRefill(PhysicalMagazine *magazine, PhysicalCpuCache *cache) {
+  uint64_t rflags = physicalLock();
+  size_t frame = buddyAllocate(PMM_MAGAZINE_BATCH);
+  if (frame != INVALID_BLOCK) {
+    for (int i = 0; i < PMM_MAGAZINE_BATCH; i++)
+      magazine->frames[magazine->cnt++] = (frame + i) * BLOCK_SIZE;
+  } else {
+    // too fragmented, pick up whatever is left
+    for (int i = 0; i < PMM_MAGAZINE_BATCH; i++) {
+      frame = buddyAllocate(1);
+      if (frame == INVALID_BLOCK)
+        break;
+      magazine->frames[magazine->cnt++] = frame * BLOCK_SIZE;
+    }
+  }
+  physicalUnlock(rflags);
+
+  // zero the whole batch in one go, instead of on every allocation
+  if (magazine == &cache->zeroed) {
+    for (int i = 0; i < magazine->cnt; i++)
+      zeroPage((void *)(magazine->frames[i] + bootloader.hhdmOffset));
+  }
+
+  cache->refills++;
+}
+
+void physicalCacheDrain(PhysicalMagazine *magazine, PhysicalCpuCache *cache) {
+  uint64_t rflags = physicalLock();
+  for (int i = 0; i < PMM_MAGAZINE_BATCH; i++)
+    buddyFreeRange(magazine->frames[--magazine->cnt] / BLOCK_SIZE, 1);
+  physicalUnlock(rflags);
+
+  cache->drains++;
+}
+
+size_t physicalCachePop(bool zeroed) {
+  PhysicalCpuCache *cache = &physicalCpuCache[physicalCpuId()];
+  PhysicalMagazine *preferred = zeroed ? &cache->zeroed : &cache->dirty;
+  PhysicalMagazine *fallback = zeroed ? &cache->dirty : &cache->zeroed;
+  uint64_t          rflags = physicalCacheLock();
+
+  size_t phys = 0;
+  bool   clean = false;
+  if (preferred->cnt) {
+    phys = preferred->frames[--preferred->cnt];
+    clean = zeroed;
+    cache->hits++;
+  } else if (fallback->cnt) {
+    phys = fallback->frames[--fallback->cnt];
+    clean = !zeroed;
+    cache->hits++;
+  } else {
+    cache->misses++;
+    physicalCacheRefill(preferred, cache);
+    if (preferred->cnt) {
+      phys = preferred->frames[--preferred->cnt];
+      clean = zeroed;
+    }
+  }
+
+  physicalCacheUnlock(rflags);
+
+  if (phys && zeroed && !clean)
+    zeroPage((void *)(phys + bootloader.hhdmOffset));
+  return phys;
+}
+
+size_t PhysicalAllocatePage() { return physicalCachePop(false); }
+size_t PhysicalAllocatePageZeroed() { return physicalCachePop(true); }
+
+void PhysicalFreePage(size_t phys) {
+  if (!phys || phys % BLOCK_SIZE || phys / BLOCK_SIZE >= physicalBuddy.frames) {
+    debugf("[pmm::free] Invalid pageframe! phys{%lx}\n", phys);
+    panic();
+  }
+
+  PhysicalCpuCache *cache = &physicalCpuCache[physicalCpuId()];
+  uint64_t          rflags = physicalCacheLock();
+  if (cache->dirty.cnt == PMM_MAGAZINE_SIZE)
+    physicalCacheDrain(&cache->dirty, cache);
+  cache->dirty.frames[cache->dirty.cnt++] = phys;
+  physicalCacheUnlock(rflags);
+}
+
+/* Pageframe reference counts (copy-on-write & shared mappings) */
+
+// frames outside of the buddy (MMIO) aren't refcounted
+void PhysicalShare(size_t phys) {
+  if (phys / BLOCK_SIZE >= physicalBuddy.frames)
+    return;
+  uint16_t *ref = &physicalBuddy.refs[phys / BLOCK_SIZE];
+  uint64_t rflags = physicalLock();
+  *ref = *ref ? *ref + 1 : 2;
+  physicalUnlock(rflags);
+}
+
+bool PhysicalShared(size_t phys) {
+  if (phys / BLOCK_SIZE >= physicalBuddy.frames)
+    return false;
+  return physicalBuddy.refs[phys / BLOCK_SIZE] > 1;
+}
+
+// drops a mapping's reference, freeing the pageframe if it was the last one
+void PhysicalRelease(size_t phys) {
+  if (phys / BLOCK_SIZE >= physicalBuddy.frames)
+    return;
+  uint16_t *ref = &physicalBuddy.refs[phys / BLOCK_SIZE];
+  bool      last = false;
+  uint64_t rflags = physicalLock();
+  if (*ref > 2)
+    (*ref)--;
+  else if (*ref == 2)
+    *ref = 0; // back to a single (private) owner
+  else
+    last = true;
+  physicalUnlock(rflags);
+
+  if (last)
+    PhysicalFreePage(phys);
+}
+
+void PhysicalDumpStats() {
+  printf("[pmm] free{%ldKB}", physicalBuddy.freePages * BLOCK_SIZE / 1024);
+  for (int i = 0; i < PMM_CPUS; i++) {
+    PhysicalCpuCache *cache = &physicalCpuCache[i];
+    printf("\n[pmm] cpu%d: hits{%ld} misses{%ld} refills{%ld} drains{%ld} "
+           "zeroed{%d} dirty{%d}",
+           i, cache->hits, cache->misses, cache->refills, cache->drains,
+           cache->zeroed.cnt, cache->dirty.cnt);
+  }
+  printf("\n");
+}
+
 void initiatePMM() {
   DS_Bitmap *bitmap = &physical; // pointer to pmm bitmap (used later)
   bitmap->ready = false;         // for bitmap dependency of vmm
 
-  physical.BitmapSizeInBlocks = DivRoundUp(bootloader.mmTotal, BLOCK_SIZE);
+  // cover up to the end of the last usable entry (there can be holes!)
+  size_t highest = 0;
+  for (int i = 0; i < bootloader.mmEntryCnt; i++) {
+    struct limine_memmap_entry *entry = bootloader.mmEntries[i];
+    if (entry->type == LIMINE_MEMMAP_USABLE &&
+        entry->base + entry->length > highest)
+      highest = entry->base + entry->length;
+  }
+
+  physical.BitmapSizeInBlocks = DivRoundUp(highest, BLOCK_SIZE);
   physical.BitmapSizeInBytes = DivRoundUp(physical.BitmapSizeInBlocks, 8);
+  physicalBuddy.frames = physical.BitmapSizeInBlocks;
 
+  size_t refsOffset =
+      DivRoundUp(physical.BitmapSizeInBytes + physicalBuddy.frames, 8) * 8;
+  size_t metadataSize = refsOffset + physicalBuddy.frames * sizeof(uint16_t);
   struct limine_memmap_entry *mm = 0;
 
   for (int i = 0; i < bootloader.mmEntryCnt; i++) {
     struct limine_memmap_entry *entry = bootloader.mmEntries[i];
-    if (entry->type != LIMINE_MEMMAP_USABLE ||
-        entry->length < physical.BitmapSizeInBytes)
+    if (entry->type != LIMINE_MEMMAP_USABLE || entry->length < metadataSize)
       continue;
     mm = entry;
     break;
   }
 
   if (!mm) {
-    debugf("[pmm] Not enough memory: required{%lx}!\n",
-           physical.BitmapSizeInBytes);
+    debugf("[pmm] Not enough memory: required{%lx}!\n", metadataSize);
     panic();
     return;
   }
 
   size_t bitmapStartPhys = mm->base;
   physical.Bitmap = (uint8_t *)(bitmapStartPhys + bootloader.hhdmOffset);
+  physicalBuddy.order = physical.Bitmap + physical.BitmapSizeInBytes;
+  physicalBuddy.refs = (uint16_t *)(physical.Bitmap + refsOffset);
 
+  // everything is used, until proven otherwise
   memset(physical.Bitmap, 0xff, physical.BitmapSizeInBytes);
-  for (int i = 0; i < bootloader.mmEntryCnt; i++) {
-    struct limine_memmap_entry *entry = bootloader.mmEntries[i];
-    if (entry->type == LIMINE_MEMMAP_USABLE)
-      MarkRegion(bitmap, (void *)entry->base, entry->length, 0);
-  }
+  memset(physicalBuddy.order, BUDDY_ORDER_NONE, physicalBuddy.frames);
+  memset(physicalBuddy.refs, 0, physicalBuddy.frames * sizeof(uint16_t));
+
+  size_t metadataEnd = bitmapStartPhys + metadataSize;
   for (int i = 0; i < bootloader.mmEntryCnt; i++) {
     struct limine_memmap_entry *entry = bootloader.mmEntries[i];
     if (entry->type != LIMINE_MEMMAP_USABLE)
-      MarkRegion(bitmap, (void *)entry->base, entry->length, 1);
-  }
+      continue;
 
-  MarkRegion(bitmap, (void *)bitmapStartPhys, physical.BitmapSizeInBytes, 1);
+    size_t start = DivRoundUp(entry->base, BLOCK_SIZE);
+    size_t end = (entry->base + entry->length) / BLOCK_SIZE;
+    if (entry == mm)
+      start = DivRoundUp(metadataEnd, BLOCK_SIZE);
+    if (!start) // physical address 0 doubles as the error value
+      start = 1;
+    if (end > start)
+      buddyFreeRange(start, end - start);
+  }
 
-  debugf("[pmm] Bitmap initiated: bitmapStartPhys{0x%lx} size{%lx}\n",
-         bitmapStartPhys, physical.BitmapSizeInBytes);
+  debugf("[pmm] Buddy initiated: metadataPhys{0x%lx} size{%lx} free{%ldMB}\n",
+         bitmapStartPhys, metadataSize,
+         (physicalBuddy.freePages * BLOCK_SIZE) / 1024 / 1024);
 
   // BitmapDumpBlocks(bitmap);
   bitmap->ready = true;
@@ -0,0 +1,275 @@
+#include <bootloader.h>
+#include <malloc.h>
+#include <paging.h>
+#include <pmm.h>
+#include <slab.h>
+#include <string.h>
+#include <system.h>
+#include <util.h>
+
+// Slab allocator, for structures that come & go all the time (open files,
+// tasks, sockets, packets, linked list nodes) instead of going through
+// dlmalloc & its global lock. Objects keep their constructed state while
+// cached, free ones are tracked by index so they're never written over
+// Copyright (C) 2024 Panagiotis
+
+#define SLAB_DEBUG 0
+
+Spinlock   LOCK_SLAB_CACHES = ATOMIC_FLAG_INIT;
+SlabCache *firstSlabCache = 0;
+
+size_t     slabSizes[SLAB_SIZED_CNT] = {16, 32, 64, 128, 256, 512, 1024, 1536};
+SlabCache *slabSized[SLAB_SIZED_CNT];
+
+int slabCpuId() { return 0; } // bootstrap processor only (for now)
+
+// the magazines are CPU-local: keeping interrupts off is enough
+uint64_t slabCpuLock() {
+  uint64_t rflags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  return rflags;
+}
+
+void slabCpuUnlock(uint64_t rflags) {
+  if (rflags & (1 << 9)) // IF
+    asm volatile("sti" ::: "memory");
+}
+
+/* Slabs themselves (LOCK_SLAB has to be held) */
+
+void slabListPush(Slab **list, Slab *slab) {
+  slab->prev = 0;
+  slab->next = *list;
+  if (slab->next)
+    slab->next->prev = slab;
+  *list = slab;
+}
+
+void slabListRemove(Slab **list, Slab *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+void *slabObject(SlabCache *cache, Slab *slab, size_t index) {
+  return (void *)((size_t)slab + cache->offset + index * cache->objSize);
+}
+
+Slab *slabGrow(SlabCache *cache) {
+  size_t phys = PhysicalAllocatePage();
+  if (!phys)
+    return 0;
+  physicalBuddy.order[phys / PAGE_SIZE] = BUDDY_ORDER_SLAB;
+
+  Slab *slab = (Slab *)(phys + bootloader.hhdmOffset);
+  memset(slab, 0, sizeof(Slab));
+  slab->cache = cache;
+  // lowest addresses are handed out first
+  for (size_t i = 0; i < cache->perSlab; i++)
+    slab->free[slab->freeCnt++] = cache->perSlab - 1 - i;
+  if (cache->ctor) {
+    for (size_t i = 0; i < cache->perSlab; i++)
+      cache->ctor(slabObject(cache, slab, i));
+  }
+
+  cache->slabs++;
+  return slab;
+}
+
+void slabRelease(SlabCache *cache, Slab *slab) {
+  if (cache->dtor) {
+    for (size_t i = 0; i < cache->perSlab; i++)
+      cache->dtor(slabObject(cache, slab, i));
+  }
+
+  size_t phys = (size_t)slab - bootloader.hhdmOffset;
+  physicalBuddy.order[phys / PAGE_SIZE] = BUDDY_ORDER_NONE;
+  PhysicalFreePage(phys);
+  cache->slabs--;
+}
+
+void *slabTakeUnsafe(SlabCache *cache) {
+  Slab *slab = cache->partial;
+  if (!slab && cache->empty) {
+    slab = cache->empty;
+    slabListRemove(&cache->empty, slab);
+    cache->emptyCnt--;
+    slabListPush(&cache->partial, slab);
+  } else if (!slab) {
+    slab = slabGrow(cache);
+    if (!slab)
+      return 0;
+    slabListPush(&cache->partial, slab);
+  }
+
+  void *obj = slabObject(cache, slab, slab->free[--slab->freeCnt]);
+  if (!slab->freeCnt) {
+    slabListRemove(&cache->partial, slab);
+    slabListPush(&cache->full, slab);
+  }
+  return obj;
+}
+
+void slabPutUnsafe(SlabCache *cache, void *obj) {
+  Slab  *slab = (Slab *)((size_t)obj & ~(PAGE_SIZE - 1));
+  size_t offset = (size_t)obj - (size_t)slab - cache->offset;
+  if (slab->cache != cache || offset % cache->objSize ||
+      slab->freeCnt >= cache->perSlab) {
+    debugf("[slab] Bad free! cache{%s} obj{%lx}\n", cache->name, obj);
+    panic();
+  }
+
+  if (!slab->freeCnt) {
+    slabListRemove(&cache->full, slab);
+    slabListPush(&cache->partial, slab);
+  }
+  slab->free[slab->freeCnt++] = offset / cache->objSize;
+  if (slab->freeCnt < cache->perSlab)
+    return;
+
+  slabListRemove(&cache->partial, slab);
+  if (cache->emptyCnt < SLAB_EMPTY_MAX) {
+    slabListPush(&cache->empty, slab);
+    cache->emptyCnt++;
+  } else
+    slabRelease(cache, slab);
+}
+
+/* Caches */
+
+SlabCache *slabCacheCreate(char *name, size_t size, SlabHook ctor,
+                           SlabHook dtor) {
+  SlabCache *cache = (SlabCache *)malloc(sizeof(SlabCache));
+  memset(cache, 0, sizeof(SlabCache));
+  size_t nameLen = strlength(name);
+  if (nameLen > sizeof(cache->name) - 1)
+    nameLen = sizeof(cache->name) - 1;
+  memcpy(cache->name, name, nameLen);
+  cache->objSize = DivRoundUp(size ? size : 1, SLAB_ALIGN) * SLAB_ALIGN;
+  cache->ctor = ctor;
+  cache->dtor = dtor;
+
+  // as many objects as the header (with its index stack) leaves room for
+  size_t perSlab = (PAGE_SIZE - sizeof(Slab)) /
+                   (cache->objSize + sizeof(uint16_t));
+  while (perSlab &&
+         DivRoundUp(sizeof(Slab) + perSlab * sizeof(uint16_t), SLAB_ALIGN) *
+                     SLAB_ALIGN +
+                 perSlab * cache->objSize >
+             PAGE_SIZE)
+    perSlab--;
+  if (!perSlab) {
+    debugf("[slab] Object too large! cache{%s} size{%lx}\n", name, size);
+    panic();
+  }
+  cache->perSlab = perSlab;
+  cache->offset =
+      DivRoundUp(sizeof(Slab) + perSlab * sizeof(uint16_t), SLAB_ALIGN) *
+      SLAB_ALIGN;
+
+  spinlockAcquire(&LOCK_SLAB_CACHES);
+  cache->next = firstSlabCache;
+  firstSlabCache = cache;
+  spinlockRelease(&LOCK_SLAB_CACHES);
+
+#if SLAB_DEBUG
+  debugf("[slab] New cache: name{%s} size{%lx} perSlab{%ld}\n", cache->name,
+         cache->objSize, cache->perSlab);
+#endif
+  return cache;
+}
+
+void *slabAllocate(SlabCache *cache) {
+  SlabMagazine *magazine = &cache->cpu[slabCpuId()];
+  uint64_t      rflags = slabCpuLock();
+
+  if (magazine->cnt)
+    cache->hits++;
+  else {
+    cache->misses++;
+    spinlockAcquire(&cache->LOCK_SLAB);
+    while (magazine->cnt < SLAB_MAGAZINE_BATCH) {
+      void *obj = slabTakeUnsafe(cache);
+      if (!obj)
+        break;
+      magazine->objects[magazine->cnt++] = obj;
+    }
+    spinlockRelease(&cache->LOCK_SLAB);
+  }
+
+  void *obj = 0;
+  if (magazine->cnt) {
+    obj = magazine->objects[--magazine->cnt];
+    cache->allocs++;
+  }
+  slabCpuUnlock(rflags);
+
+  if (!obj)
+    debugf("[slab] Out of memory! cache{%s}\n", cache->name);
+  return obj;
+}
+
+// from the smallest general purpose cache that fits (or malloc() if none)
+void *slabAllocateSized(size_t size) {
+  for (int i = 0; i < SLAB_SIZED_CNT; i++) {
+    if (size <= slabSizes[i])
+      return slabAllocate(slabSized[i]);
+  }
+  return malloc(size);
+}
+
+// anything not on a slab came from slabAllocateSized()'s malloc() fallback
+bool slabOwns(void *obj) {
+  size_t frame = ((size_t)obj - bootloader.hhdmOffset) / PAGE_SIZE;
+  return (size_t)obj >= bootloader.hhdmOffset &&
+         frame < physicalBuddy.frames &&
+         physicalBuddy.order[frame] == BUDDY_ORDER_SLAB;
+}
+
+void slabFree(void *obj) {
+  if (!obj)
+    return;
+  if (!slabOwns(obj)) {
+    free(obj);
+    return;
+  }
+
+  SlabCache    *cache = ((Slab *)((size_t)obj & ~(PAGE_SIZE - 1)))->cache;
+  SlabMagazine *magazine = &cache->cpu[slabCpuId()];
+  uint64_t      rflags = slabCpuLock();
+
+  if (magazine->cnt == SLAB_MAGAZINE_SIZE) {
+    spinlockAcquire(&cache->LOCK_SLAB);
+    for (int i = 0; i < SLAB_MAGAZINE_BATCH; i++)
+      slabPutUnsafe(cache, magazine->objects[--magazine->cnt]);
+    spinlockRelease(&cache->LOCK_SLAB);
+  }
+  magazine->objects[magazine->cnt++] = obj;
+  cache->frees++;
+  slabCpuUnlock(rflags);
+}
+
+void slabDumpStats() {
+  spinlockAcquire(&LOCK_SLAB_CACHES);
+  for (SlabCache *cache = firstSlabCache; cache; cache = cache->next) {
+    if (!cache->allocs)
+      continue;
+    printf("[slab] %-14s size{%4ld} active{%ld/%ld} slabs{%ld} "
+           "hits{%ld} misses{%ld}\n",
+           cache->name, cache->objSize, cache->allocs - cache->frees,
+           cache->slabs * cache->perSlab, cache->slabs, cache->hits,
+           cache->misses);
+  }
+  spinlockRelease(&LOCK_SLAB_CACHES);
+}
+
+void initiateSlab() {
+  char name[24];
+  for (int i = 0; i < SLAB_SIZED_CNT; i++) {
+    snprintf(name, sizeof(name), "size-%ld", slabSizes[i]);
+    slabSized[i] = slabCacheCreate(name, slabSizes[i], 0, 0);
+  }
+}
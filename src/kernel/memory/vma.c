@@ -0,0 +1,512 @@
+#include <bootloader.h>
+#include <linux.h>
+#include <malloc.h>
+#include <page_cache.h>
+#include <paging.h>
+#include <pmm.h>
+#include <system.h>
+#include <task.h>
+#include <util.h>
+#include <vma.h>
+
+// Per-task virtual memory areas, kept in a red-black tree (by start address).
+// Anonymous regions are only recorded here and get backed by (zeroed)
+// pageframes on their first touch, file-backed ones by page cache pages
+// Copyright (C) 2024 Panagiotis
+
+#define VMA_DEBUG 0
+
+// mmap() placement: from USER_MMAP_START up to the stack
+#define VMA_MMAP_LIMIT (USER_STACK_BOTTOM - USER_STACK_PAGES * PAGE_SIZE)
+
+uint64_t vmaPageFlags(VMA *vma) {
+  uint64_t flags = PF_USER;
+  if (vma->flags & VMA_WRITE)
+    flags |= PF_RW;
+  if (vma->flags & VMA_SHARED)
+    flags |= PF_SHARED;
+  if (vma->flags & VMA_DEVICE)
+    flags |= PF_DEVICE;
+  return flags;
+}
+
+/* Tree helpers (WLOCK_VMA has to be held) */
+
+VMA *vmaFindUnsafe(Task *task, size_t addr) {
+  RBnode *node = task->vmas.node;
+  while (node) {
+    VMA *vma = RB_ENTRY(node, VMA, node);
+    if (addr < vma->start)
+      node = node->left;
+    else if (addr >= vma->end)
+      node = node->right;
+    else
+      return vma;
+  }
+  return 0;
+}
+
+// lowest area that ends after addr (contains it, or is the next one)
+VMA *vmaFindNextUnsafe(Task *task, size_t addr) {
+  RBnode *node = task->vmas.node;
+  VMA    *candidate = 0;
+  while (node) {
+    VMA *vma = RB_ENTRY(node, VMA, node);
+    if (addr < vma->end) {
+      candidate = vma;
+      node = node->left;
+    } else
+      node = node->right;
+  }
+  return candidate;
+}
+
+VMA *vmaNext(VMA *vma) {
+  RBnode *node = RBTreeNext(&vma->node);
+  return node ? RB_ENTRY(node, VMA, node) : 0;
+}
+
+VMA *vmaPrev(VMA *vma) {
+  RBnode *node = RBTreePrev(&vma->node);
+  return node ? RB_ENTRY(node, VMA, node) : 0;
+}
+
+void vmaLinkUnsafe(Task *task, VMA *vma) {
+  RBnode **link = &task->vmas.node;
+  RBnode  *parent = 0;
+  while (*link) {
+    parent = *link;
+    if (vma->start < RB_ENTRY(parent, VMA, node)->start)
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+  RBTreeLink(&vma->node, parent, link);
+  RBTreeInsertColor(&vma->node, &task->vmas);
+}
+
+VMA *vmaAllocate(size_t start, size_t end, uint32_t flags) {
+  VMA *vma = (VMA *)malloc(sizeof(VMA));
+  memset(vma, 0, sizeof(VMA));
+  vma->start = start;
+  vma->end = end;
+  vma->flags = flags;
+  return vma;
+}
+
+void vmaEraseUnsafe(Task *task, VMA *vma) {
+  RBTreeErase(&vma->node, &task->vmas);
+  if (vma->file)
+    pageCacheClose(vma->file);
+  free(vma);
+}
+
+// cuts an area in two at addr, returns the upper half
+VMA *vmaSplitUnsafe(Task *task, VMA *vma, size_t addr) {
+  VMA *upper = vmaAllocate(addr, vma->end, vma->flags);
+  if (vma->file) {
+    pageCacheHold(vma->file);
+    upper->file = vma->file;
+    upper->offset = vma->offset + (addr - vma->start);
+    upper->limit = vma->limit;
+  }
+  vma->end = addr; // start (the key) stays the same
+  vmaLinkUnsafe(task, upper);
+  return upper;
+}
+
+// makes sure no area crosses start or end
+void vmaIsolateUnsafe(Task *task, size_t start, size_t end) {
+  VMA *vma = vmaFindUnsafe(task, start);
+  if (vma && vma->start < start)
+    vmaSplitUnsafe(task, vma, start);
+  vma = vmaFindUnsafe(task, end);
+  if (vma && vma->start < end)
+    vmaSplitUnsafe(task, vma, end);
+}
+
+/* Generic operations */
+
+VMA *vmaFind(Task *task, size_t addr) {
+  spinlockCntReadAcquire(&task->WLOCK_VMA);
+  VMA *vma = vmaFindUnsafe(task, addr);
+  spinlockCntReadRelease(&task->WLOCK_VMA);
+  return vma;
+}
+
+// Records [start, end) as a new area, merging it with any touching ones of the
+// same flags. The range has to be free (see vmaUnmap())
+VMA *vmaInsert(Task *task, size_t start, size_t end, uint32_t flags) {
+  return vmaInsertFile(task, start, end, flags, 0, 0, 0);
+}
+
+// Same, for an area backed by file (from offset on, which has to be page
+// aligned). Past limit (a file offset) it reads as zero, like ELF .bss does.
+// File-backed areas are never merged
+VMA *vmaInsertFile(Task *task, size_t start, size_t end, uint32_t flags,
+                   PageCacheFile *file, size_t offset, size_t limit) {
+  start = start & ~(PAGE_SIZE - 1);
+  end = DivRoundUp(end, PAGE_SIZE) * PAGE_SIZE;
+  if (end <= start)
+    return 0;
+
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  VMA *next = vmaFindNextUnsafe(task, start);
+  if (next && next->start < end) {
+    debugf("[vma] Overlapping insertion! start{%lx} end{%lx}\n", start, end);
+    panic();
+  }
+  VMA *prev = next ? vmaPrev(next) : 0;
+  if (!next && task->vmas.node)
+    prev = RB_ENTRY(RBTreeLast(&task->vmas), VMA, node);
+
+  VMA *target = 0;
+  if (!file && prev && !prev->file && prev->end == start &&
+      prev->flags == flags) {
+    prev->end = end;
+    target = prev;
+  } else {
+    target = vmaAllocate(start, end, flags);
+    if (file) {
+      pageCacheHold(file);
+      target->file = file;
+      target->offset = offset;
+      target->limit = limit;
+    }
+    vmaLinkUnsafe(task, target);
+  }
+
+  // swallow the next one, if they now touch
+  if (!file && next && !next->file && next->start == target->end &&
+      next->flags == flags) {
+    target->end = next->end;
+    vmaEraseUnsafe(task, next);
+  }
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+
+#if VMA_DEBUG
+  debugf("[vma] Inserted: id{%d} start{%lx} end{%lx} flags{%x}\n", task->id,
+         start, end, flags);
+#endif
+  return target;
+}
+
+// First-fit free range for mmap(), recycling holes left by munmap()
+size_t vmaFindHole(Task *task, size_t hint, size_t length) {
+  length = DivRoundUp(length, PAGE_SIZE) * PAGE_SIZE;
+
+  spinlockCntReadAcquire(&task->WLOCK_VMA);
+  size_t out = 0;
+  if (hint && !(hint % PAGE_SIZE) && hint >= USER_MMAP_START &&
+      hint + length <= VMA_MMAP_LIMIT) {
+    VMA *next = vmaFindNextUnsafe(task, hint);
+    if (!next || next->start >= hint + length)
+      out = hint;
+  }
+
+  // big areas start on 2MiB boundaries, so they can be backed by large pages
+  size_t align = length >= PAGE_SIZE_LARGE ? PAGE_SIZE_LARGE : PAGE_SIZE;
+  size_t candidate = USER_MMAP_START;
+  VMA   *browse = vmaFindNextUnsafe(task, candidate);
+  while (!out) {
+    if (!browse || browse->start >= candidate + length) {
+      if (candidate + length <= VMA_MMAP_LIMIT)
+        out = candidate;
+      break;
+    }
+    if (browse->end > candidate)
+      candidate = DivRoundUp(browse->end, align) * align;
+    browse = vmaNext(browse);
+  }
+  spinlockCntReadRelease(&task->WLOCK_VMA);
+
+  return out;
+}
+
+// Whether the (aligned) 2MiB range around page is entirely inside the area
+bool vmaLargeFits(VMA *vma, size_t page) {
+  size_t base = page & ~(PAGE_SIZE_LARGE - 1);
+  return base >= vma->start && base + PAGE_SIZE_LARGE <= vma->end;
+}
+
+// Anonymous memory gets a whole 2MiB page on its first touch, as long as the
+// area covers all of it and nothing's been mapped there yet. Otherwise 4KiB
+// pages are handed out, and promoted once all 512 of them are present
+bool vmaBackLarge(Task *task, VMA *vma, size_t page) {
+  size_t base = page & ~(PAGE_SIZE_LARGE - 1);
+  if (!vmaLargeFits(vma, page) || !VirtualLargeVacant(task->pagedir, base))
+    return false;
+
+  size_t phys = PhysicalAllocate(PAGE_LARGE_PAGES);
+  if (!phys)
+    return false;
+  memset((void *)(phys + bootloader.hhdmOffset), 0, PAGE_SIZE_LARGE);
+  VirtualMapLargeL(task->pagedir, base, phys, vmaPageFlags(vma));
+
+#if VMA_DEBUG
+  debugf("[vma] Backed with a 2MiB page! addr{%lx}\n", base);
+#endif
+  return true;
+}
+
+// Backs a single page of an area. Private file pages are mapped as
+// copy-on-write, so nobody ever writes to the cached ones. A private copy is
+// handed out right away on a write (no point in faulting twice) or whenever
+// the page continues past the area's backing data
+bool vmaBackPage(Task *task, VMA *vma, size_t page, bool write) {
+  if (!vma->file) {
+    if (vmaBackLarge(task, vma, page))
+      return true;
+    size_t phys = PhysicalAllocatePageZeroed();
+    if (!phys)
+      return false;
+    VirtualMapL(task->pagedir, page, phys, vmaPageFlags(vma));
+    if (vmaLargeFits(vma, page))
+      VirtualPromoteL(task->pagedir, page);
+    return true;
+  }
+
+  size_t offset = vma->offset + (page - vma->start);
+  size_t cached = pageCacheGet(vma->file, offset / PAGE_SIZE);
+  if (!cached)
+    return false;
+
+  if (offset + PAGE_SIZE > vma->limit ||
+      (write && !(vma->flags & VMA_SHARED))) {
+    size_t copy = PhysicalAllocatePageZeroed();
+    if (!copy)
+      return false;
+    size_t len = offset < vma->limit ? vma->limit - offset : 0;
+    if (len > PAGE_SIZE)
+      len = PAGE_SIZE;
+    memcpy((void *)(copy + bootloader.hhdmOffset),
+           (void *)(cached + bootloader.hhdmOffset), len);
+    VirtualMapL(task->pagedir, page, copy, vmaPageFlags(vma));
+    return true;
+  }
+
+  PhysicalShare(cached);
+  uint64_t flags =
+      vma->flags & VMA_SHARED ? vmaPageFlags(vma) : (PF_USER | PF_COW);
+  VirtualMapL(task->pagedir, page, cached, flags);
+  return true;
+}
+
+// Backs [start, end) right away, for whenever the kernel is about to write
+// there on the task's behalf (ex: from another address space on execve())
+void vmaPopulate(Task *task, size_t start, size_t end) {
+  start = start & ~(PAGE_SIZE - 1);
+  for (size_t page = start; page < end; page += PAGE_SIZE) {
+    VMA *vma = vmaFind(task, page);
+    if (!vma) {
+      debugf("[vma] Tried to populate outside any area! addr{%lx}\n", page);
+      panic();
+    }
+
+    uint64_t *pte = VirtualGetEntry(task->pagedir, page);
+    if ((pte && *pte & PF_PRESENT) || VirtualGetLargeEntry(task->pagedir, page))
+      continue;
+    if (!vmaBackPage(task, vma, page, true)) {
+      debugf("[vma] Out of memory while populating! addr{%lx}\n", page);
+      panic();
+    }
+  }
+}
+
+// Not-present page fault: lazily back the page if it belongs to an area
+bool vmaFault(Task *task, size_t addr, uint64_t error) {
+  if (error & PF_ERR_PRESENT)
+    return false; // protection violation
+
+  VMA *vma = vmaFind(task, addr);
+  if (!vma || !(vma->flags & (VMA_READ | VMA_WRITE | VMA_EXEC)))
+    return false;
+  if (vma->flags & VMA_DEVICE)
+    return false; // there's no memory to back device areas with
+  if (error & PF_ERR_WRITE && !(vma->flags & VMA_WRITE))
+    return false;
+
+  return vmaBackPage(task, vma, addr & ~(PAGE_SIZE - 1), error & PF_ERR_WRITE);
+}
+
+// Whether [addr, addr + len) lies in areas the task may read (or write) from,
+// for syscalls to check user buffers before the kernel touches them. With
+// CR0.WP on, a kernel write to a read-only page would otherwise be fatal
+bool vmaAccessible(Task *task, size_t addr, size_t len, bool write) {
+  if (!len)
+    return true;
+  if (addr + len < addr || addr + len > USER_STACK_BOTTOM)
+    return false;
+
+  uint32_t needed = write ? VMA_WRITE : (VMA_READ | VMA_WRITE | VMA_EXEC);
+  size_t   end = addr + len;
+  size_t   covered = addr;
+  spinlockCntReadAcquire(&task->WLOCK_VMA);
+  VMA *browse = vmaFindNextUnsafe(task, addr);
+  while (browse && browse->start <= covered && covered < end) {
+    if (!(browse->flags & needed))
+      break;
+    covered = browse->end;
+    browse = vmaNext(browse);
+  }
+  spinlockCntReadRelease(&task->WLOCK_VMA);
+
+  return covered >= end;
+}
+
+// Gets rid of every area (& their pageframes) in [start, end)
+void vmaUnmap(Task *task, size_t start, size_t end) {
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  vmaIsolateUnsafe(task, start, end);
+
+  VMA *browse = vmaFindNextUnsafe(task, start);
+  while (browse && browse->start < end) {
+    VMA *next = vmaNext(browse);
+    for (size_t page = browse->start; page < browse->end; page += PAGE_SIZE) {
+      if (vmaLargeFits(browse, page) && !(page % PAGE_SIZE_LARGE) &&
+          VirtualGetLargeEntry(task->pagedir, page)) {
+        VirtualReleaseLarge(VirtualUnmapLargeL(task->pagedir, page));
+        page += PAGE_SIZE_LARGE - PAGE_SIZE;
+        continue;
+      }
+      uint64_t entry = VirtualUnmapL(task->pagedir, page);
+      if (entry & PF_PRESENT && !(entry & PF_DEVICE))
+        PhysicalRelease(PTE_GET_ADDR(entry));
+    }
+    vmaEraseUnsafe(task, browse);
+    browse = next;
+  }
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+}
+
+// Changes the (VMA_READ/WRITE/EXEC) protection of [start, end). Fails if part
+// of the range isn't mapped. Note that x86 can't make present pages
+// inaccessible without unmapping them, so PROT_NONE only stops new pages from
+// being backed & existing ones from being written to
+bool vmaProtect(Task *task, size_t start, size_t end, uint32_t prot) {
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  size_t covered = start;
+  VMA   *browse = vmaFindNextUnsafe(task, start);
+  while (browse && browse->start <= covered && covered < end) {
+    covered = browse->end;
+    browse = vmaNext(browse);
+  }
+  if (covered < end) {
+    spinlockCntWriteRelease(&task->WLOCK_VMA);
+    return false;
+  }
+
+  vmaIsolateUnsafe(task, start, end);
+  browse = vmaFindNextUnsafe(task, start);
+  while (browse && browse->start < end) {
+    browse->flags = (browse->flags & ~(VMA_READ | VMA_WRITE | VMA_EXEC)) | prot;
+    for (size_t page = browse->start; page < browse->end; page += PAGE_SIZE) {
+      if (vmaLargeFits(browse, page) && !(page % PAGE_SIZE_LARGE) &&
+          VirtualGetLargeEntry(task->pagedir, page)) {
+        VirtualProtectLargeL(task->pagedir, page, prot & VMA_WRITE);
+        page += PAGE_SIZE_LARGE - PAGE_SIZE;
+        continue;
+      }
+      VirtualProtectL(task->pagedir, page, prot & VMA_WRITE);
+    }
+    browse = vmaNext(browse);
+  }
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+
+  return true;
+}
+
+// Resizes (and possibly moves) the area at [start, start + oldLen). Returns
+// the new location or a negative errno
+size_t vmaRemap(Task *task, size_t start, size_t oldLen, size_t newLen,
+                bool mayMove) {
+  oldLen = DivRoundUp(oldLen, PAGE_SIZE) * PAGE_SIZE;
+  newLen = DivRoundUp(newLen, PAGE_SIZE) * PAGE_SIZE;
+
+  VMA *vma = vmaFind(task, start);
+  if (!vma || start + oldLen > vma->end || !newLen)
+    return -EFAULT;
+
+  if (newLen <= oldLen) {
+    vmaUnmap(task, start + newLen, start + oldLen);
+    return start;
+  }
+
+  // grow in place, if nothing's in the way
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  vmaIsolateUnsafe(task, start, start + oldLen);
+  vma = vmaFindUnsafe(task, start);
+  VMA *next = vmaNext(vma);
+  if (start + newLen <= VMA_MMAP_LIMIT &&
+      (!next || next->start >= start + newLen)) {
+    vma->end = start + newLen;
+    if (!vma->file && next && !next->file && next->start == vma->end &&
+        next->flags == vma->flags) {
+      vma->end = next->end;
+      vmaEraseUnsafe(task, next);
+    }
+    spinlockCntWriteRelease(&task->WLOCK_VMA);
+    return start;
+  }
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+
+  if (!mayMove)
+    return -ENOMEM;
+
+  size_t target = vmaFindHole(task, 0, newLen);
+  if (!target)
+    return -ENOMEM;
+
+  // move the page table entries over (no copying needed)
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  vma = vmaFindUnsafe(task, start);
+  for (size_t i = 0; i < oldLen; i += PAGE_SIZE) {
+    if (!((start + i) % PAGE_SIZE_LARGE) && !(target % PAGE_SIZE_LARGE) &&
+        i + PAGE_SIZE_LARGE <= oldLen &&
+        VirtualGetLargeEntry(task->pagedir, start + i)) {
+      uint64_t entry = VirtualUnmapLargeL(task->pagedir, start + i);
+      VirtualMapLargeL(task->pagedir, target + i,
+                       PTE_GET_ADDR(entry) & ~(PAGE_SIZE_LARGE - 1),
+                       PTE_GET_FLAGS(entry) &
+                           ~(PF_PRESENT | PF_PS | PF_ACCESS | PF_DIRTY));
+      i += PAGE_SIZE_LARGE - PAGE_SIZE;
+      continue;
+    }
+    uint64_t entry = VirtualUnmapL(task->pagedir, start + i);
+    if (entry & PF_PRESENT)
+      VirtualMapL(task->pagedir, target + i, PTE_GET_ADDR(entry),
+                  PTE_GET_FLAGS(entry) & ~(PF_PRESENT | PF_ACCESS | PF_DIRTY));
+  }
+  // re-key the area itself, so any file backing goes along
+  RBTreeErase(&vma->node, &task->vmas);
+  vma->start = target;
+  vma->end = target + newLen;
+  vmaLinkUnsafe(task, vma);
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+
+  return target;
+}
+
+void vmaDuplicate(Task *source, Task *target) {
+  spinlockCntReadAcquire(&source->WLOCK_VMA);
+  for (RBnode *node = RBTreeFirst(&source->vmas); node;
+       node = RBTreeNext(node)) {
+    VMA *vma = RB_ENTRY(node, VMA, node);
+    VMA *copy = vmaAllocate(vma->start, vma->end, vma->flags);
+    if (vma->file) {
+      pageCacheHold(vma->file);
+      copy->file = vma->file;
+      copy->offset = vma->offset;
+      copy->limit = vma->limit;
+    }
+    vmaLinkUnsafe(target, copy);
+  }
+  spinlockCntReadRelease(&source->WLOCK_VMA);
+}
+
+void vmaFree(Task *task) {
+  spinlockCntWriteAcquire(&task->WLOCK_VMA);
+  while (task->vmas.node)
+    vmaEraseUnsafe(task, RB_ENTRY(task->vmas.node, VMA, node));
+  spinlockCntWriteRelease(&task->WLOCK_VMA);
+}
@@ -35,12 +35,8 @@ void initiateVMM() {
   virtual.ready = true;
 }
 
-Spinlock LOCK_VMM = ATOMIC_FLAG_INIT;
-
 void *VirtualAllocate(int pages) {
-  spinlockAcquire(&LOCK_VMM);
-  size_t phys = (size_t)BitmapAllocate(&physical, pages);
-  spinlockRelease(&LOCK_VMM);
+  size_t phys = PhysicalAllocate(pages);
 
   if (!phys) {
     debugf("[vmm::alloc] Physical kernel memory ran out!\n");
@@ -66,9 +62,7 @@ bool VirtualFree(void *ptr, int pages) {
     panic();
   }
 
-  spinlockAcquire(&LOCK_VMM);
-  MarkRegion(&physical, (void *)phys, pages * BLOCK_SIZE, 0);
-  spinlockRelease(&LOCK_VMM);
+  PhysicalFree(phys, pages);
 
   return 1;
 }
@@ -78,12 +78,16 @@ void schedule(uint64_t rsp) {
       (AsmPassedInterrupt *)(next->whileTssRsp - sizeof(AsmPassedInterrupt));
   memcpy(iretqRsp, &next->registers, sizeof(AsmPassedInterrupt));
 
+  // Same address space (ex: between kernel tasks) means no CR3 write at all,
+  // otherwise the TLB entries are kept around under the pagedir's PCID
+  uint64_t cr3 =
+      next->pagedir == GetPageDirectory() ? 0 : VirtualCr3(next->pagedir);
+
   // Pass off control to our assembly finalization code that:
   //   - uses the tssRsp to iretq (give control back)
-  //   - applies the new pagetable
+  //   - applies the new pagetable (if it changed)
   //   - cleanups old killed task (if necessary)
   // .. basically replaces all (not needed!) stuff
   ChangePageDirectoryFake(next->pagedir); // just for globalPagedir to update
-  asm_finalize_sched((size_t)iretqRsp, VirtualToPhysical((size_t)next->pagedir),
-                     old);
+  asm_finalize_sched((size_t)iretqRsp, cr3, old);
 }
@@ -20,9 +20,10 @@ void stackGenerateMutual(Task *task) {
   for (int i = 0; i < USER_STACK_PAGES; i++) {
     size_t virt_addr =
         USER_STACK_BOTTOM - USER_STACK_PAGES * 0x1000 + i * 0x1000;
-    VirtualMap(virt_addr, BitmapAllocatePageframe(&physical), PF_USER | PF_RW);
-    memset((void *)virt_addr, 0, PAGE_SIZE);
+    VirtualMap(virt_addr, PhysicalAllocatePageZeroed(), PF_USER | PF_RW);
   }
+  vmaInsert(task, USER_STACK_BOTTOM - USER_STACK_PAGES * 0x1000,
+            USER_STACK_BOTTOM, VMA_READ | VMA_WRITE);
 }
 
 typedef struct StackStorePtrStyle {
@@ -37,6 +38,7 @@ StackStorePtrStyle stackStorePtrStyle(Task *target, int ptrc, char **ptrv) {
   uint8_t *argStart = (uint8_t *)target->heap_end;
   taskAdjustHeap(target, target->heap_end + argSpace, &target->heap_start,
                  &target->heap_end);
+  vmaPopulate(target, (size_t)argStart, target->heap_end);
   size_t ellapsed = 0;
   for (int i = 0; i < ptrc; i++) {
     uint32_t len = strlength(ptrv[i]) + 1; // null terminator
@@ -65,6 +67,7 @@ void stackGenerateUser(Task *target, uint32_t argc, char **argv, uint32_t envc,
   int *randomByteStart = (int *)target->heap_end;
   taskAdjustHeap(target, target->heap_end + sizeof(int) * 4,
                  &target->heap_start, &target->heap_end);
+  vmaPopulate(target, (size_t)randomByteStart, target->heap_end);
   for (int i = 0; i < 4; i++) {
     int thing = 0;
     while (!thing)
@@ -6,9 +6,11 @@
 #include <paging.h>
 #include <pmm.h>
 #include <schedule.h>
+#include <slab.h>
 #include <stack.h>
 #include <string.h>
 #include <syscalls.h>
+#include <system.h>
 #include <task.h>
 #include <util.h>
 #include <vmm.h>
@@ -57,7 +59,7 @@ Task *taskCreate(uint32_t id, uint64_t rip, bool kernel_task, uint64_t *pagedir,
     debugf("[scheduler] Something went wrong with init!\n");
     panic();
   }
-  Task *target = (Task *)malloc(sizeof(Task));
+  Task *target = (Task *)slabAllocate(taskCache);
   memset(target, 0, sizeof(Task));
   browse->next = target;
   spinlockCntWriteRelease(&TASK_LL_MODIFY);
@@ -93,9 +95,6 @@ Task *taskCreate(uint32_t id, uint64_t rip, bool kernel_task, uint64_t *pagedir,
   target->heap_start = USER_HEAP_START;
   target->heap_end = USER_HEAP_START;
 
-  target->mmap_start = USER_MMAP_START;
-  target->mmap_end = USER_MMAP_START;
-
   taskAttachDefTermios(target);
 
   return target;
@@ -124,19 +123,9 @@ void taskAdjustHeap(Task *task, size_t new_heap_end, size_t *start,
   size_t new_page_top = DivRoundUp(new_heap_end, PAGE_SIZE);
 
   if (new_page_top > old_page_top) {
-    size_t num = new_page_top - old_page_top;
-
-    for (size_t i = 0; i < num; i++) {
-      size_t virt = old_page_top * PAGE_SIZE + i * PAGE_SIZE;
-      if (VirtualToPhysical(virt))
-        continue;
-
-      size_t phys = BitmapAllocatePageframe(&physical);
-
-      VirtualMap(virt, phys, PF_RW | PF_USER);
-
-      memset((void *)virt, 0, PAGE_SIZE);
-    }
+    // only recorded, pages are backed on their first touch (vmaFault())
+    vmaInsert(task, old_page_top * PAGE_SIZE, new_page_top * PAGE_SIZE,
+              VMA_READ | VMA_WRITE);
   } else if (new_page_top < old_page_top) {
     debugf("[task] New page is lower than old page: id{%d}\n", task->id);
     taskKill(task->id, 139);
@@ -259,9 +248,10 @@ void taskKillCleanup(Task *task) {
   }
 
   PageDirectoryFree(task->pagedir);
+  vmaFree(task);
   VirtualFree((void *)task->whileTssRsp, USER_STACK_PAGES);
   VirtualFree((void *)task->whileSyscallRsp, USER_STACK_PAGES);
-  free(task);
+  slabFree(task);
 
   // taskKillChildren(task); // wait()
   taskFreeChildren(task);
@@ -310,6 +300,14 @@ uint8_t taskGetState(uint32_t id) {
   return browse->state;
 }
 
+// Only tasks in the middle of a system call (with interrupts on) can give the
+// CPU away while waiting on a device. Anything else (boot, the kernel task,
+// page faults) has to poll instead
+bool taskCanSleep() {
+  return tasksInitiated && currentTask->id != KERNEL_TASK_ID &&
+         currentTask->systemCallInProgress && checkInterrupts();
+}
+
 int16_t taskGenerateId() {
   spinlockCntReadAcquire(&TASK_LL_MODIFY);
   Task    *browse = firstTask;
@@ -389,7 +387,7 @@ int taskFork(AsmPassedInterrupt *cpu, uint64_t rsp) {
     debugf("[scheduler] Something went wrong with init!\n");
     panic();
   }
-  Task *target = (Task *)malloc(sizeof(Task));
+  Task *target = (Task *)slabAllocate(taskCache);
   memset(target, 0, sizeof(Task));
   browse->next = target;
   spinlockCntWriteRelease(&TASK_LL_MODIFY);
@@ -421,8 +419,7 @@ int taskFork(AsmPassedInterrupt *cpu, uint64_t rsp) {
   target->heap_start = currentTask->heap_start;
   target->heap_end = currentTask->heap_end;
 
-  target->mmap_start = currentTask->mmap_start;
-  target->mmap_end = currentTask->mmap_end;
+  vmaDuplicate(currentTask, target);
 
   target->term = currentTask->term;
 
@@ -455,7 +452,8 @@ int taskFork(AsmPassedInterrupt *cpu, uint64_t rsp) {
 }
 
 void initiateTasks() {
-  firstTask = (Task *)malloc(sizeof(Task));
+  taskCache = slabCacheCreate("Task", sizeof(Task), 0, 0);
+  firstTask = (Task *)slabAllocate(taskCache);
   memset(firstTask, 0, sizeof(Task));
 
   currentTask = firstTask;
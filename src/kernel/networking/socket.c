@@ -2,6 +2,7 @@
 #include <ipv4.h>
 #include <linked_list.h>
 #include <malloc.h>
+#include <slab.h>
 #include <socket.h>
 #include <system.h>
 #include <tcp.h>
@@ -16,7 +17,7 @@ Socket *netSocketConnect(NIC *nic, SOCKET_PROT protocol,
   if (!nic)
     return 0;
   Socket *target =
-      LinkedListAllocate((void **)&nic->firstSocket, sizeof(Socket));
+      LinkedListAllocateCache((void **)&nic->firstSocket, socketCache);
 
   target->client_port = source_port;
   target->server_port = destination_port;
@@ -119,17 +120,14 @@ socketPacketHeader *netSocketRecv(Socket *socket) {
   if (!target)
     return 0;
 
-  size_t              totalSize = sizeof(socketPacketHeader) + target->size;
-  socketPacketHeader *final = (socketPacketHeader *)malloc(totalSize);
-  memcpy(final, target, totalSize);
-
-  // First unregisters, so the interrupt handler should have no problem browsing
-  // through the list...
-  LinkedListRemove((void **)&socket->firstPacket, target);
-  return final;
+  // Handed out as is (no copy), so the interrupt handler should have no
+  // problem browsing through the list...
+  LinkedListUnregister((void **)&socket->firstPacket, target);
+  target->next = 0;
+  return target;
 }
 
 void netSocketRecvCleanup(socketPacketHeader *packet) {
-  // just in case
-  free(packet);
+  // (it's a linked list node, off the slab allocator)
+  slabFree(packet);
 }
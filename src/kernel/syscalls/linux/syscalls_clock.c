@@ -3,6 +3,7 @@
 #include <system.h>
 #include <task.h>
 #include <timer.h>
+#include <vma.h>
 
 // #define SYSCALL_NANOSLEEP 35
 // static int syscallNanosleep() {
@@ -12,6 +13,8 @@
 
 #define SYSCALL_CLOCK_GETTIME 228
 static int syscallClockGettime(int which, timespec *spec) {
+  if (!vmaAccessible(currentTask, (size_t)spec, sizeof(timespec), true))
+    return -EFAULT;
   switch (which) {
   case CLOCK_REALTIME:
     spec->tv_sec = timerTicks / 1000;
@@ -4,6 +4,7 @@
 #include <system.h>
 #include <task.h>
 #include <util.h>
+#include <vma.h>
 
 #define SYSCALL_GETPID 39
 static uint32_t syscallGetPid() { return currentTask->id; }
@@ -19,6 +20,8 @@ static int syscallGetcwd(char *buff, size_t size) {
 #endif
     return -ERANGE;
   }
+  if (!vmaAccessible(currentTask, (size_t)buff, realLength, true))
+    return -EFAULT;
   memcpy(buff, currentTask->cwd, realLength);
 
   return realLength;
@@ -33,6 +36,8 @@ char machine[] = "x86_64";
 
 #define SYSCALL_UNAME 63
 static int syscallUname(struct old_utsname *utsname) {
+  if (!vmaAccessible(currentTask, (size_t)utsname, sizeof(*utsname), true))
+    return -EFAULT;
   memcpy(utsname->sysname, sysname, sizeof(sysname));
   memcpy(utsname->nodename, nodename, sizeof(nodename));
   memcpy(utsname->release, release, sizeof(release));
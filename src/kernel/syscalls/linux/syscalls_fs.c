@@ -5,6 +5,7 @@
 #include <syscalls.h>
 #include <task.h>
 #include <util.h>
+#include <vma.h>
 
 #define SYSCALL_READ 0
 static int syscallRead(int fd, char *str, uint32_t count) {
@@ -15,6 +16,8 @@ static int syscallRead(int fd, char *str, uint32_t count) {
 #endif
     return -EBADF;
   }
+  if (!vmaAccessible(currentTask, (size_t)str, count, true))
+    return -EFAULT;
   uint32_t read = fsRead(browse, (uint8_t *)str, count);
   return read;
 }
@@ -28,6 +31,8 @@ static int syscallWrite(int fd, char *str, uint32_t count) {
 #endif
     return -EBADF;
   }
+  if (!vmaAccessible(currentTask, (size_t)str, count, false))
+    return -EFAULT;
 
   uint32_t writtenBytes = fsWrite(browse, (uint8_t *)str, count);
   return writtenBytes;
@@ -63,6 +68,8 @@ static int syscallStat(char *filename, stat *statbuf) {
 #if DEBUG_SYSCALLS_EXTRA
   debugf("[syscalls::stat] filename{%s}\n", filename);
 #endif
+  if (!vmaAccessible(currentTask, (size_t)statbuf, sizeof(stat), true))
+    return -EFAULT;
   bool ret = fsStatByFilename(currentTask, filename, statbuf);
   if (!ret) {
 #if DEBUG_SYSCALLS_FAILS
@@ -80,6 +87,8 @@ static int syscallFstat(int fd, stat *statbuf) {
   OpenFile *file = fsUserGetNode(currentTask, fd);
   if (!file)
     return -EBADF;
+  if (!vmaAccessible(currentTask, (size_t)statbuf, sizeof(stat), true))
+    return -EFAULT;
 
   bool ret = fsStat(file, statbuf);
   if (!ret) {
@@ -94,6 +103,8 @@ static int syscallFstat(int fd, stat *statbuf) {
 
 #define SYSCALL_LSTAT 6
 static int syscallLstat(char *filename, stat *statbuf) {
+  if (!vmaAccessible(currentTask, (size_t)statbuf, sizeof(stat), true))
+    return -EFAULT;
   bool ret = fsLstatByFilename(currentTask, filename, statbuf);
   if (!ret) {
 #if DEBUG_SYSCALLS_FAILS
@@ -140,6 +151,8 @@ static int syscallIoctl(int fd, unsigned long request, void *arg) {
 
 #define SYSCALL_WRITEV 20
 static int syscallWriteV(uint32_t fd, iovec *iov, uint32_t ioVcnt) {
+  if (!vmaAccessible(currentTask, (size_t)iov, ioVcnt * sizeof(iovec), false))
+    return -EFAULT;
   int cnt = 0;
   for (int i = 0; i < ioVcnt; i++) {
     iovec *curr = (iovec *)((size_t)iov + i * sizeof(iovec));
@@ -160,6 +173,8 @@ static int syscallWriteV(uint32_t fd, iovec *iov, uint32_t ioVcnt) {
 
 #define SYSCALL_READV 19
 static int syscallReadV(uint32_t fd, iovec *iov, uint32_t ioVcnt) {
+  if (!vmaAccessible(currentTask, (size_t)iov, ioVcnt * sizeof(iovec), false))
+    return -EFAULT;
   int cnt = 0;
   for (int i = 0; i < ioVcnt; i++) {
     iovec *curr = (iovec *)((size_t)iov + i * sizeof(iovec));
@@ -181,7 +196,7 @@ static int syscallReadV(uint32_t fd, iovec *iov, uint32_t ioVcnt) {
 #define SYSCALL_ACCESS 21
 static int syscallAccess(char *filename, int mode) {
   struct stat buf;
-  return syscallStat(filename, &buf);
+  return fsStatByFilename(currentTask, filename, &buf) ? 0 : -1;
 }
 
 #define SYSCALL_DUP 32
@@ -255,8 +270,52 @@ static int syscallFcntl(int fd, int cmd, uint64_t arg) {
   }
 }
 
+#define SYSCALL_FSYNC 74
+static int syscallFsync(int fd) {
+  OpenFile *file = fsUserGetNode(currentTask, fd);
+  if (!file)
+    return -EBADF;
+  return fsWriteSync(file) ? 0 : -EIO;
+}
+
+#define SYSCALL_FDATASYNC 75
+static int syscallFdatasync(int fd) { return syscallFsync(fd); }
+
+#define SYSCALL_FTRUNCATE 77
+static int syscallFtruncate(int fd, int64_t length) {
+  if (length < 0)
+    return -EINVAL;
+  OpenFile *file = fsUserGetNode(currentTask, fd);
+  if (!file)
+    return -EBADF;
+  return fsTruncate(file, length);
+}
+
+#define SYSCALL_UNLINK 87
+static int syscallUnlink(char *pathname) {
+  if (!pathname)
+    return -EFAULT;
+  return fsUserUnlink(currentTask, pathname);
+}
+
+#define SYSCALL_MKDIR 83
+static int syscallMkdir(char *pathname, int mode) {
+  if (!pathname)
+    return -EFAULT;
+  return fsUserMkdir(currentTask, pathname, mode);
+}
+
+#define SYSCALL_RMDIR 84
+static int syscallRmdir(char *pathname) {
+  if (!pathname)
+    return -EFAULT;
+  return fsUserRmdir(currentTask, pathname);
+}
+
 #define SYSCALL_READLINK 89
 static int syscallReadlink(char *path, char *buf, int size) {
+  if (size < 0 || !vmaAccessible(currentTask, (size_t)buf, size, true))
+    return -EFAULT;
   return fsReadlink(currentTask, path, buf, size);
 }
 
@@ -272,6 +331,8 @@ static int syscallGetdents64(unsigned int fd, struct linux_dirent64 *dirp,
   }
   if (!browse->handlers->getdents64)
     return -ENOTDIR;
+  if (!vmaAccessible(currentTask, (size_t)dirp, count, true))
+    return -EFAULT;
   return browse->handlers->getdents64(browse, currentTask, dirp, count);
 }
 
@@ -365,6 +426,29 @@ static int syscallOpenat(int dirfd, char *pathname, int flags, int mode) {
   return -ENOSYS;
 }
 
+#define SYSCALL_MKDIRAT 258
+static int syscallMkdirat(int dirfd, char *pathname, int mode) {
+  if (pathname[0] == '/' || dirfd == AT_FDCWD) // absolute or relative to cwd
+    return syscallMkdir(pathname, mode);
+
+#if DEBUG_SYSCALLS_STUB
+  debugf("[syscalls::mkdirat] todo: partial sanitization!\n");
+#endif
+  return -ENOSYS;
+}
+
+#define SYSCALL_UNLINKAT 263
+static int syscallUnlinkat(int dirfd, char *pathname, int flags) {
+  if (pathname[0] == '/' || dirfd == AT_FDCWD) // absolute or relative to cwd
+    return flags & AT_REMOVEDIR ? syscallRmdir(pathname)
+                                : syscallUnlink(pathname);
+
+#if DEBUG_SYSCALLS_STUB
+  debugf("[syscalls::unlinkat] todo: partial sanitization!\n");
+#endif
+  return -ENOSYS;
+}
+
 #define SYSCALL_FACCESSAT 269
 static int syscallFaccessat(int dirfd, char *pathname, int mode) {
   if (pathname[0] == '\0') { // by fd
@@ -392,6 +476,8 @@ static int syscallFaccessat(int dirfd, char *pathname, int mode) {
 #define SYSCALL_STATX 332
 static int syscallStatx(int dirfd, char *pathname, int flags, uint32_t mask,
                         struct statx *buff) {
+  if (!vmaAccessible(currentTask, (size_t)buff, sizeof(struct statx), true))
+    return -EFAULT;
   struct stat simple = {0};
   if (pathname[0] == '\0') { // by fd
     OpenFile *file = fsUserGetNode(currentTask, dirfd);
@@ -493,5 +579,13 @@ void syscallRegFs() {
   registerSyscall(SYSCALL_FCNTL, syscallFcntl);
   registerSyscall(SYSCALL_STATX, syscallStatx);
   registerSyscall(SYSCALL_READLINK, syscallReadlink);
+  registerSyscall(SYSCALL_UNLINK, syscallUnlink);
+  registerSyscall(SYSCALL_UNLINKAT, syscallUnlinkat);
+  registerSyscall(SYSCALL_MKDIR, syscallMkdir);
+  registerSyscall(SYSCALL_MKDIRAT, syscallMkdirat);
+  registerSyscall(SYSCALL_RMDIR, syscallRmdir);
+  registerSyscall(SYSCALL_FTRUNCATE, syscallFtruncate);
+  registerSyscall(SYSCALL_FSYNC, syscallFsync);
+  registerSyscall(SYSCALL_FDATASYNC, syscallFdatasync);
   // registerSyscall(SYSCALL_FACCESSAT2, syscallFaccessat2);
 }
\ No newline at end of file
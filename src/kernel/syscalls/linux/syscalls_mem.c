@@ -1,53 +1,80 @@
 #include <linux.h>
+#include <page_cache.h>
 #include <paging.h>
 #include <syscalls.h>
 #include <task.h>
 #include <util.h>
 
+// PROT_* and VMA_* (READ/WRITE/EXEC) share the same bits
+#define PROT_TO_VMA(prot) ((prot) & (PROT_READ | PROT_WRITE | PROT_EXEC))
+
+// where a new mapping goes (0 if nowhere)
+static size_t mmapPlace(size_t addr, size_t length, int flags) {
+  if (!(flags & MAP_FIXED))
+    return vmaFindHole(currentTask, addr, length);
+
+  vmaUnmap(currentTask, addr, addr + length); // replaces whatever's there
+  return addr;
+}
+
 #define SYSCALL_MMAP 9
 static uint64_t syscallMmap(size_t addr, size_t length, int prot, int flags,
                             int fd, size_t pgoffset) {
   length = DivRoundUp(length, 0x1000) * 0x1000;
   /* No point in DEBUG_SYSCALLS_ARGS'ing here */
+  if (!length || (flags & MAP_FIXED && addr % PAGE_SIZE))
+    return -EINVAL;
 
-  if (!addr && fd == -1 &&
-      (flags & ~MAP_FIXED & ~MAP_PRIVATE) ==
-          MAP_ANONYMOUS) { // before: !addr &&
-    size_t curr = currentTask->mmap_end;
+  if (fd == -1 && flags & MAP_ANONYMOUS) {
+    size_t base = mmapPlace(addr, length, flags);
+    if (!base)
+      return -ENOMEM;
 #if DEBUG_SYSCALLS_EXTRA
-    debugf("[syscalls::mmap] No placement preference, no file descriptor: "
-           "addr{%lx} length{%lx}\n",
-           curr, length);
+    debugf("[syscalls::mmap] Anonymous: addr{%lx} length{%lx} flags{%x}\n",
+           base, length, flags);
 #endif
-    taskAdjustHeap(currentTask, currentTask->mmap_end + length,
-                   &currentTask->mmap_start, &currentTask->mmap_end);
-    memset((void *)curr, 0, length);
-#if DEBUG_SYSCALLS_EXTRA
-    debugf("[syscalls::mmap] Found addr{%lx}\n", curr);
-#endif
-    return curr;
-  } else if (!addr && fd == -1 &&
-             (flags & ~MAP_FIXED & ~MAP_PRIVATE & ~MAP_SHARED) ==
-                 MAP_ANONYMOUS &&
-             (flags & ~MAP_FIXED & ~MAP_PRIVATE & ~MAP_ANONYMOUS) ==
-                 MAP_SHARED) {
-    size_t base = currentTask->mmap_end;
-    size_t pages = DivRoundUp(length, PAGE_SIZE);
-    currentTask->mmap_end += pages * PAGE_SIZE;
-
-    for (int i = 0; i < pages; i++)
-      VirtualMap(base + i * PAGE_SIZE, BitmapAllocatePageframe(&physical),
-                 PF_RW | PF_USER | PF_SHARED);
+
+    if (flags & MAP_SHARED) {
+      // has to be the same pages across fork(), so backed right away
+      vmaInsert(currentTask, base, base + length,
+                PROT_TO_VMA(prot) | VMA_SHARED);
+      uint64_t pageFlags = PF_USER | PF_SHARED | (prot & PROT_WRITE ? PF_RW : 0);
+      for (size_t i = 0; i < length; i += PAGE_SIZE)
+        VirtualMap(base + i, PhysicalAllocatePageZeroed(), pageFlags);
+    } else // zero-filled on first touch, no memset() needed
+      vmaInsert(currentTask, base, base + length, PROT_TO_VMA(prot));
 
     return base;
   } else if (fd != -1) {
     OpenFile *file = fsUserGetNode(currentTask, fd);
-    if (!file || file->mountPoint != MOUNT_POINT_SPECIAL)
-      return -1;
+    if (!file)
+      return -EBADF;
+
+    if (file->mountPoint == MOUNT_POINT_SPECIAL) {
+      if (!file->handlers->mmap)
+        return -1;
+      return file->handlers->mmap(addr, length, prot, flags, file, pgoffset);
+    }
 
-    if (!file->handlers->mmap)
-      return -1;
-    return file->handlers->mmap(addr, length, prot, flags, file, pgoffset);
+    // regular file: faulted in from the page cache (the offset is in bytes)
+    if (pgoffset % PAGE_SIZE || !(flags & (MAP_SHARED | MAP_PRIVATE)))
+      return -EINVAL;
+    PageCacheFile *cache = pageCacheOpen(file);
+    if (!cache)
+      return -ENODEV;
+
+    size_t base = mmapPlace(addr, length, flags);
+    if (base)
+      vmaInsertFile(currentTask, base, base + length,
+                    PROT_TO_VMA(prot) | (flags & MAP_SHARED ? VMA_SHARED : 0),
+                    cache, pgoffset, (size_t)-1);
+    pageCacheClose(cache);
+#if DEBUG_SYSCALLS_EXTRA
+    debugf("[syscalls::mmap] File: addr{%lx} length{%lx} flags{%x} "
+           "offset{%lx}\n",
+           base, length, flags, pgoffset);
+#endif
+    return base ? base : (uint64_t)-ENOMEM;
   }
 
 #if DEBUG_SYSCALLS_STUB
@@ -61,9 +88,22 @@ static uint64_t syscallMmap(size_t addr, size_t length, int prot, int flags,
   return -1;
 }
 
+#define SYSCALL_MPROTECT 10
+static int syscallMprotect(size_t addr, size_t len, int prot) {
+  if (addr % PAGE_SIZE)
+    return -EINVAL;
+  len = DivRoundUp(len, PAGE_SIZE) * PAGE_SIZE;
+  if (!vmaProtect(currentTask, addr, addr + len, PROT_TO_VMA(prot)))
+    return -ENOMEM;
+  return 0;
+}
+
 #define SYSCALL_MUNMAP 11
 static int syscallMunmap(uint64_t addr, size_t len) {
-  // todo
+  if (addr % PAGE_SIZE || !len)
+    return -EINVAL;
+  len = DivRoundUp(len, PAGE_SIZE) * PAGE_SIZE;
+  vmaUnmap(currentTask, addr, addr + len);
   return 0;
 }
 
@@ -87,8 +127,18 @@ static uint64_t syscallBrk(uint64_t brk) {
   return currentTask->heap_end;
 }
 
+#define SYSCALL_MREMAP 25
+static size_t syscallMremap(size_t old, size_t oldLen, size_t newLen, int flags,
+                            size_t newAddr) {
+  if (old % PAGE_SIZE || flags & ~MREMAP_MAYMOVE)
+    return -EINVAL; // MREMAP_FIXED isn't supported (yet)
+  return vmaRemap(currentTask, old, oldLen, newLen, flags & MREMAP_MAYMOVE);
+}
+
 void syscallRegMem() {
   registerSyscall(SYSCALL_MMAP, syscallMmap);
+  registerSyscall(SYSCALL_MPROTECT, syscallMprotect);
   registerSyscall(SYSCALL_MUNMAP, syscallMunmap);
   registerSyscall(SYSCALL_BRK, syscallBrk);
+  registerSyscall(SYSCALL_MREMAP, syscallMremap);
 }
\ No newline at end of file
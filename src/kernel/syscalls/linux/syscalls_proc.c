@@ -6,11 +6,16 @@
 #include <system.h>
 #include <task.h>
 #include <util.h>
+#include <vma.h>
 
 // process lifetime system calls (send help)
 
 #define SYSCALL_PIPE 22
-static int syscallPipe(int *fds) { return pipeOpen(fds); }
+static int syscallPipe(int *fds) {
+  if (!vmaAccessible(currentTask, (size_t)fds, 2 * sizeof(int), true))
+    return -EFAULT;
+  return pipeOpen(fds);
+}
 
 #define SYSCALL_FORK 57
 static int syscallFork() {
@@ -95,6 +100,9 @@ static int syscallWait4(int pid, int *wstatus, int options, struct rusage *ru) {
          options & WNOHANG, options & WUNTRACED, options & WSTOPPED,
          options & WEXITED, options & WCONTINUED, options & WNOWAIT);
 #endif
+  if (wstatus &&
+      !vmaAccessible(currentTask, (size_t)wstatus, sizeof(int), true))
+    return -EFAULT;
 
   asm volatile("sti");
 
@@ -105,7 +113,9 @@ static int syscallWait4(int pid, int *wstatus, int options, struct rusage *ru) {
       spinlockCntReadAcquire(&TASK_LL_MODIFY);
       Task *browse = firstTask;
       while (browse) {
-        if (browse->state == TASK_STATE_READY && browse->parent == currentTask)
+        if ((browse->state == TASK_STATE_READY ||
+             browse->state == TASK_STATE_WAITING_DISK) &&
+            browse->parent == currentTask)
           amnt++;
         browse = browse->next;
       }
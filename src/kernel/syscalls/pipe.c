@@ -3,6 +3,7 @@
 #include <kb.h>
 #include <linux.h>
 #include <malloc.h>
+#include <slab.h>
 #include <syscalls.h>
 #include <task.h>
 
@@ -25,6 +26,13 @@ struct PipeSpecific {
   PipeInfo *info;
 };
 
+SlabCache *pipeSpecificCache;
+
+void initiatePipes() {
+  pipeSpecificCache =
+      slabCacheCreate("PipeSpecific", sizeof(PipeSpecific), 0, 0);
+}
+
 int pipeOpen(int *fds) {
   int readFd = fsUserOpen(currentTask, "/dev/stdout", O_RDONLY, 0);
   int writeFd = fsUserOpen(currentTask, "/dev/stdout", O_WRONLY, 0);
@@ -46,11 +54,11 @@ int pipeOpen(int *fds) {
   info->readFds = 1;
   info->writeFds = 1;
 
-  PipeSpecific *readSpec = (PipeSpecific *)malloc(sizeof(PipeSpecific));
+  PipeSpecific *readSpec = (PipeSpecific *)slabAllocate(pipeSpecificCache);
   readSpec->write = false;
   readSpec->info = info;
 
-  PipeSpecific *writeSpec = (PipeSpecific *)malloc(sizeof(PipeSpecific));
+  PipeSpecific *writeSpec = (PipeSpecific *)slabAllocate(pipeSpecificCache);
   writeSpec->write = true;
   writeSpec->info = info;
 
@@ -68,7 +76,7 @@ bad_error:
 }
 
 bool pipeDuplicate(OpenFile *original, OpenFile *orphan) {
-  orphan->dir = malloc(sizeof(PipeSpecific));
+  orphan->dir = slabAllocate(pipeSpecificCache);
   memcpy(orphan->dir, original->dir, sizeof(PipeSpecific));
 
   PipeSpecific *spec = (PipeSpecific *)original->dir;
@@ -176,7 +184,7 @@ bool pipeCloseEnd(OpenFile *readFd) {
     free(pipe);
   }
 
-  free(spec);
+  slabFree(spec);
 
   return true;
 }
@@ -120,6 +120,7 @@ void initiateSyscalls() {
 
   // Filesystem operations
   syscallRegFs();
+  initiatePipes();
 
   // Memory management
   syscallRegMem();
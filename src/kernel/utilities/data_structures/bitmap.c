@@ -113,6 +113,10 @@ void *BitmapAllocate(DS_Bitmap *bitmap, size_t blocks) {
   if (blocks == 0)
     return 0;
 
+  // physical memory is handed out by the buddy allocator (pmm.c)
+  if (bitmap == &physical)
+    return (void *)PhysicalAllocate(blocks);
+
   size_t pickedRegion = FindFreeRegion(bitmap, blocks);
   if (pickedRegion == INVALID_BLOCK)
     return 0;
@@ -122,12 +126,19 @@ void *BitmapAllocate(DS_Bitmap *bitmap, size_t blocks) {
 }
 
 void BitmapFree(DS_Bitmap *bitmap, void *base, size_t blocks) {
+  if (bitmap == &physical) {
+    PhysicalFree((size_t)base, blocks);
+    return;
+  }
   MarkRegion(bitmap, base, BLOCK_SIZE * blocks, 0);
 }
 
 /* Pageframes (1 block) */
 
 size_t BitmapAllocatePageframe(DS_Bitmap *bitmap) {
+  if (bitmap == &physical)
+    return PhysicalAllocatePage();
+
   size_t pickedRegion = FindFreeRegion(bitmap, 1);
   // if (pickedRegion == INVALID_BLOCK) {
   //   printf("no!");
@@ -142,5 +153,9 @@ size_t BitmapAllocatePageframe(DS_Bitmap *bitmap) {
 }
 
 void BitmapFreePageframe(DS_Bitmap *bitmap, void *addr) {
+  if (bitmap == &physical) {
+    PhysicalFreePage((size_t)addr);
+    return;
+  }
   MarkRegion(bitmap, addr, BLOCK_SIZE * 1, 0);
 }
\ No newline at end of file
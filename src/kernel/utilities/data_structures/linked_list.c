@@ -1,5 +1,6 @@
 #include <linked_list.h>
 #include <malloc.h>
+#include <slab.h>
 #include <util.h>
 
 // Linked Lists (singly, non-circular); basically just allocated structs
@@ -17,10 +18,8 @@
  * +=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
  */
 
-void *LinkedListAllocate(void **LLfirstPtr, uint32_t structSize) {
-  LLheader *target = (LLheader *)malloc(structSize);
-  memset(target, 0, structSize);
-
+// appends an already allocated node
+void LinkedListAppend(void **LLfirstPtr, LLheader *target) {
   LLheader *curr = (LLheader *)(*LLfirstPtr);
   while (1) {
     if (curr == 0) {
@@ -37,6 +36,20 @@ void *LinkedListAllocate(void **LLfirstPtr, uint32_t structSize) {
   }
 
   target->next = 0; // null ptr
+}
+
+// nodes come from the slab allocator (freed by LinkedListRemove()/slabFree())
+void *LinkedListAllocate(void **LLfirstPtr, uint32_t structSize) {
+  LLheader *target = (LLheader *)slabAllocateSized(structSize);
+  memset(target, 0, structSize);
+  LinkedListAppend(LLfirstPtr, target);
+  return target;
+}
+
+void *LinkedListAllocateCache(void **LLfirstPtr, SlabCache *cache) {
+  LLheader *target = (LLheader *)slabAllocate(cache);
+  memset(target, 0, cache->objSize);
+  LinkedListAppend(LLfirstPtr, target);
   return target;
 }
 
@@ -65,7 +78,7 @@ bool LinkedListUnregister(void **LLfirstPtr, const void *LLtarget) {
 
 bool LinkedListRemove(void **LLfirstPtr, void *LLtarget) {
   bool res = LinkedListUnregister(LLfirstPtr, LLtarget);
-  free(LLtarget);
+  slabFree(LLtarget);
   return res;
 }
 
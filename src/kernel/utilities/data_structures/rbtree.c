@@ -0,0 +1,244 @@
+#include <rbtree.h>
+
+// Red-black trees (intrusive, parent-linked). Leaves are NULL & always black
+// Copyright (C) 2024 Panagiotis
+
+void RBTreeRotateLeft(RBroot *root, RBnode *node) {
+  RBnode *pivot = node->right;
+
+  node->right = pivot->left;
+  if (pivot->left)
+    pivot->left->parent = node;
+
+  pivot->parent = node->parent;
+  if (!node->parent)
+    root->node = pivot;
+  else if (node == node->parent->left)
+    node->parent->left = pivot;
+  else
+    node->parent->right = pivot;
+
+  pivot->left = node;
+  node->parent = pivot;
+}
+
+void RBTreeRotateRight(RBroot *root, RBnode *node) {
+  RBnode *pivot = node->left;
+
+  node->left = pivot->right;
+  if (pivot->right)
+    pivot->right->parent = node;
+
+  pivot->parent = node->parent;
+  if (!node->parent)
+    root->node = pivot;
+  else if (node == node->parent->right)
+    node->parent->right = pivot;
+  else
+    node->parent->left = pivot;
+
+  pivot->right = node;
+  node->parent = pivot;
+}
+
+void RBTreeLink(RBnode *node, RBnode *parent, RBnode **link) {
+  node->parent = parent;
+  node->left = 0;
+  node->right = 0;
+  node->red = true;
+  *link = node;
+}
+
+void RBTreeInsertColor(RBnode *node, RBroot *root) {
+  RBnode *parent;
+  while ((parent = node->parent) && parent->red) {
+    RBnode *grandparent = parent->parent; // a red node is never the root
+    if (parent == grandparent->left) {
+      RBnode *uncle = grandparent->right;
+      if (uncle && uncle->red) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right) {
+        node = parent;
+        RBTreeRotateLeft(root, node);
+        parent = node->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      RBTreeRotateRight(root, grandparent);
+    } else {
+      RBnode *uncle = grandparent->left;
+      if (uncle && uncle->red) {
+        parent->red = false;
+        uncle->red = false;
+        grandparent->red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left) {
+        node = parent;
+        RBTreeRotateRight(root, node);
+        parent = node->parent;
+      }
+      parent->red = false;
+      grandparent->red = true;
+      RBTreeRotateLeft(root, grandparent);
+    }
+  }
+  root->node->red = false;
+}
+
+void RBTreeTransplant(RBroot *root, RBnode *old, RBnode *new) {
+  if (!old->parent)
+    root->node = new;
+  else if (old == old->parent->left)
+    old->parent->left = new;
+  else
+    old->parent->right = new;
+  if (new)
+    new->parent = old->parent;
+}
+
+// node may be NULL (a leaf), hence the separate parent
+void RBTreeEraseColor(RBroot *root, RBnode *node, RBnode *parent) {
+  while (node != root->node && (!node || !node->red)) {
+    if (node == parent->left) {
+      RBnode *sibling = parent->right;
+      if (sibling->red) {
+        sibling->red = false;
+        parent->red = true;
+        RBTreeRotateLeft(root, parent);
+        sibling = parent->right;
+      }
+      if ((!sibling->left || !sibling->left->red) &&
+          (!sibling->right || !sibling->right->red)) {
+        sibling->red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!sibling->right || !sibling->right->red) {
+        sibling->left->red = false;
+        sibling->red = true;
+        RBTreeRotateRight(root, sibling);
+        sibling = parent->right;
+      }
+      sibling->red = parent->red;
+      parent->red = false;
+      if (sibling->right)
+        sibling->right->red = false;
+      RBTreeRotateLeft(root, parent);
+      node = root->node;
+    } else {
+      RBnode *sibling = parent->left;
+      if (sibling->red) {
+        sibling->red = false;
+        parent->red = true;
+        RBTreeRotateRight(root, parent);
+        sibling = parent->left;
+      }
+      if ((!sibling->left || !sibling->left->red) &&
+          (!sibling->right || !sibling->right->red)) {
+        sibling->red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!sibling->left || !sibling->left->red) {
+        sibling->right->red = false;
+        sibling->red = true;
+        RBTreeRotateLeft(root, sibling);
+        sibling = parent->left;
+      }
+      sibling->red = parent->red;
+      parent->red = false;
+      if (sibling->left)
+        sibling->left->red = false;
+      RBTreeRotateRight(root, parent);
+      node = root->node;
+    }
+  }
+  if (node)
+    node->red = false;
+}
+
+void RBTreeErase(RBnode *node, RBroot *root) {
+  RBnode *child;
+  RBnode *parent;
+  bool    removedRed = node->red;
+
+  if (!node->left) {
+    child = node->right;
+    parent = node->parent;
+    RBTreeTransplant(root, node, node->right);
+  } else if (!node->right) {
+    child = node->left;
+    parent = node->parent;
+    RBTreeTransplant(root, node, node->left);
+  } else {
+    // swap in the in-order successor
+    RBnode *successor = node->right;
+    while (successor->left)
+      successor = successor->left;
+    removedRed = successor->red;
+    child = successor->right;
+
+    if (successor->parent == node)
+      parent = successor;
+    else {
+      parent = successor->parent;
+      RBTreeTransplant(root, successor, successor->right);
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    RBTreeTransplant(root, node, successor);
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->red = node->red;
+  }
+
+  if (!removedRed)
+    RBTreeEraseColor(root, child, parent);
+}
+
+RBnode *RBTreeFirst(RBroot *root) {
+  RBnode *node = root->node;
+  while (node && node->left)
+    node = node->left;
+  return node;
+}
+
+RBnode *RBTreeLast(RBroot *root) {
+  RBnode *node = root->node;
+  while (node && node->right)
+    node = node->right;
+  return node;
+}
+
+RBnode *RBTreeNext(RBnode *node) {
+  if (node->right) {
+    node = node->right;
+    while (node->left)
+      node = node->left;
+    return node;
+  }
+  while (node->parent && node == node->parent->right)
+    node = node->parent;
+  return node->parent;
+}
+
+RBnode *RBTreePrev(RBnode *node) {
+  if (node->left) {
+    node = node->left;
+    while (node->right)
+      node = node->right;
+    return node;
+  }
+  while (node->parent && node == node->parent->left)
+    node = node->parent;
+  return node->parent;
+}
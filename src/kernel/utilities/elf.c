@@ -3,6 +3,7 @@
 #include <elf.h>
 #include <fb.h>
 #include <malloc.h>
+#include <page_cache.h>
 #include <paging.h>
 #include <pmm.h>
 #include <stack.h>
@@ -44,53 +45,91 @@ bool elf_check_file(Elf64_Ehdr *hdr) {
   return true;
 }
 
-void elfProcessLoad(Elf64_Phdr *elf_phdr, uint8_t *out, size_t base) {
-  // Map the (current) program page
-  uint64_t pagesRequired = DivRoundUp(elf_phdr->p_memsz, 0x1000) + 1;
-  for (int j = 0; j < pagesRequired; j++) {
-    size_t vaddr = (elf_phdr->p_vaddr & ~0xFFF) + j * 0x1000;
-    size_t paddr = BitmapAllocatePageframe(&physical);
-    VirtualMap(base + vaddr, paddr, PF_USER | PF_RW);
-  }
+// Reads the ELF & program headers through the page cache, laid out at their
+// file offsets (as if the whole file was read). Returns 0 if it's not a valid
+// ELF
+uint8_t *elfReadHeaders(PageCacheFile *image) {
+  Elf64_Ehdr ehdr = {0};
+  if (pageCacheRead(image, 0, (uint8_t *)&ehdr, sizeof(Elf64_Ehdr)) !=
+          sizeof(Elf64_Ehdr) ||
+      !elf_check_file(&ehdr))
+    return 0;
 
-  // Copy the required info
-  memcpy((void *)(base + elf_phdr->p_vaddr), out + elf_phdr->p_offset,
-         elf_phdr->p_filesz);
+  size_t size = ehdr.e_phoff + ehdr.e_phnum * ehdr.e_phentsize;
+  if (size < sizeof(Elf64_Ehdr))
+    size = sizeof(Elf64_Ehdr);
+  uint8_t *out = (uint8_t *)malloc(size);
+  if (pageCacheRead(image, 0, out, size) != size) {
+    free(out);
+    return 0;
+  }
+  return out;
+}
 
-  // wtf is this? (needed)
-  if (elf_phdr->p_memsz > elf_phdr->p_filesz)
-    memset((void *)(base + elf_phdr->p_vaddr + elf_phdr->p_filesz), 0,
-           elf_phdr->p_memsz - elf_phdr->p_filesz);
+// Maps a PT_LOAD segment as areas of the task: the file part is served
+// (copy-on-write) straight from the page cache, so everyone running the same
+// binary shares its pages, while the rest (.bss) is anonymous memory
+void elfProcessLoad(Task *task, PageCacheFile *image, Elf64_Phdr *elf_phdr,
+                    size_t base) {
+  size_t start = (base + elf_phdr->p_vaddr) & ~(PAGE_SIZE - 1);
+  size_t fileEnd =
+      DivRoundUp(base + elf_phdr->p_vaddr + elf_phdr->p_filesz, PAGE_SIZE) *
+      PAGE_SIZE;
+  size_t end =
+      DivRoundUp(base + elf_phdr->p_vaddr + elf_phdr->p_memsz, PAGE_SIZE) *
+      PAGE_SIZE;
+  if (!elf_phdr->p_filesz)
+    fileEnd = start;
+
+  uint32_t flags = VMA_READ;
+  if (elf_phdr->p_flags & PF_W)
+    flags |= VMA_WRITE;
+  if (elf_phdr->p_flags & PF_X)
+    flags |= VMA_EXEC;
+
+  // later segments win over whatever page they overlap (like MAP_FIXED)
+  vmaUnmap(task, start, end > fileEnd ? end : fileEnd);
+
+  // (p_memsz - p_filesz) reads as zero, since the area's limit is p_filesz
+  if (fileEnd > start)
+    vmaInsertFile(task, start, fileEnd, flags, image,
+                  elf_phdr->p_offset & ~(PAGE_SIZE - 1),
+                  elf_phdr->p_offset + elf_phdr->p_filesz);
+  if (end > fileEnd)
+    vmaInsert(task, fileEnd, end, flags);
 }
 
 Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
                  char **envv, bool startup) {
-  // Open & read executable file
+  // Open executable file, its contents are served by the page cache
   OpenFile *dir = fsKernelOpen(filepath, FS_MODE_READ, 0);
   if (!dir) {
     debugf("[elf] Could not open %s\n", filepath);
     return 0;
   }
-  size_t filesize = fsGetFilesize(dir);
+  PageCacheFile *image = pageCacheOpen(dir);
+  fsKernelClose(dir);
+  if (!image) {
+    debugf("[elf] Could not cache %s\n", filepath);
+    return 0;
+  }
+  size_t filesize = image->size;
 #if ELF_DEBUG
   debugf("[elf] Executing %s: filesize{%d}\n", filepath, filesize);
 #endif
-  uint8_t *out = (uint8_t *)malloc(filesize);
-  fsReadFullFile(dir, out);
-  fsKernelClose(dir);
+  uint8_t *out = elfReadHeaders(image);
 
   // Cast ELF32 header
   Elf64_Ehdr *elf_ehdr = (Elf64_Ehdr *)(out);
 
-  if (!elf_check_file(elf_ehdr)) {
+  if (!out) {
     debugf("[elf] File %s is not a valid cavOS ELF32 executable!\n", filepath);
+    pageCacheClose(image);
     return 0;
   }
 
   // Create a new page directory which is later used by the process
-  uint64_t *oldpagedir = GetPageDirectory();
   uint64_t *pagedir = PageDirectoryAllocate();
-  ChangePageDirectory(pagedir);
 
 #if ELF_DEBUG
   debugf("\n[elf_ehdr] entry=%x type=%d arch=%d\n", elf_ehdr->e_entry,
@@ -109,9 +148,11 @@ Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
     panic();
   }
 
-  Elf64_Phdr *tls = 0;
-  size_t      interpreterEntry = 0;
-  size_t      interpreterBase = 0x100000000000; // todo: not hardcode
+  Elf64_Phdr    *tls = 0;
+  PageCacheFile *interpreter = 0;
+  uint8_t       *interpreterOut = 0;
+  size_t         interpreterEntry = 0;
+  size_t         interpreterBase = 0x100000000000; // todo: not hardcode
   // Loop through the multiple ELF32 program header tables
   for (int i = 0; i < elf_ehdr->e_phnum; i++) {
     Elf64_Phdr *elf_phdr = (Elf64_Phdr *)((size_t)out + elf_ehdr->e_phoff +
@@ -121,50 +162,55 @@ Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
         debugf("[elf] What devil-sent ELF binary has more than one TLS "
                "section? %s\n",
                filepath);
-        ChangePageDirectory(oldpagedir);
         free(out);
+        pageCacheClose(image);
         return 0;
       }
       tls = elf_phdr;
       continue;
-    } else if (elf_phdr->p_type == 3) {
-      char     *interpreterFilename = (char *)(out + elf_phdr->p_offset);
-      OpenFile *interpreter =
+    } else if (elf_phdr->p_type == PT_INTERP) {
+      char *interpreterFilename = (char *)malloc(elf_phdr->p_filesz + 1);
+      pageCacheRead(image, elf_phdr->p_offset, (uint8_t *)interpreterFilename,
+                    elf_phdr->p_filesz);
+      interpreterFilename[elf_phdr->p_filesz] = '\0';
+
+      OpenFile *interpreterFile =
           fsKernelOpen(interpreterFilename, FS_MODE_READ, 0);
-      if (!interpreter) {
-        debugf("[elf] Interpreter path{%s} could not be found!\n");
+      if (!interpreterFile) {
+        debugf("[elf] Interpreter path{%s} could not be found!\n",
+               interpreterFilename);
         panic();
       }
-      size_t size = fsGetFilesize(interpreter);
-
-      uint8_t *interpreterContents = (uint8_t *)malloc(size);
-      fsReadFullFile(interpreter, interpreterContents);
-      fsKernelClose(interpreter);
+      interpreter = pageCacheOpen(interpreterFile);
+      fsKernelClose(interpreterFile);
+      interpreterOut = interpreter ? elfReadHeaders(interpreter) : 0;
 
-      Elf64_Ehdr *interpreterEhdr = (Elf64_Ehdr *)(interpreterContents);
-      if (interpreterEhdr->e_type != 3) { // ET_DYN
+      Elf64_Ehdr *interpreterEhdr = (Elf64_Ehdr *)(interpreterOut);
+      if (!interpreterEhdr || interpreterEhdr->e_type != 3) { // ET_DYN
         debugf("[elf::dyn] Interpreter{%s} isn't really of type ET_DYN!\n",
                interpreterFilename);
         panic();
       }
       interpreterEntry = interpreterEhdr->e_entry;
-      for (int i = 0; i < interpreterEhdr->e_phnum; i++) {
-        Elf64_Phdr *interpreterPhdr =
-            (Elf64_Phdr *)((size_t)interpreterContents +
-                           interpreterEhdr->e_phoff +
-                           i * interpreterEhdr->e_phentsize);
-        if (interpreterPhdr->p_type != PT_LOAD)
-          continue;
-        elfProcessLoad(interpreterPhdr, interpreterContents, interpreterBase);
-      }
-      free(interpreterContents);
-
+      free(interpreterFilename);
       continue;
     }
+  }
+
+  Task *target =
+      taskCreate(id,
+                 interpreterEntry ? (interpreterBase + interpreterEntry)
+                                  : elf_ehdr->e_entry,
+                 false, pagedir, argc, argv);
+
+  // Nothing is read in yet, pages get faulted in on their first touch
+  for (int i = 0; i < elf_ehdr->e_phnum; i++) {
+    Elf64_Phdr *elf_phdr = (Elf64_Phdr *)((size_t)out + elf_ehdr->e_phoff +
+                                          i * elf_ehdr->e_phentsize);
     if (elf_phdr->p_type != PT_LOAD)
       continue;
 
-    elfProcessLoad(elf_phdr, out, 0);
+    elfProcessLoad(target, image, elf_phdr, 0);
 
 #if ELF_DEBUG
     debugf("[elf] Program header: type{%d} offset{%x} vaddr{%x} size{%x} "
@@ -174,6 +220,20 @@ Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
 #endif
   }
 
+  if (interpreter) {
+    Elf64_Ehdr *interpreterEhdr = (Elf64_Ehdr *)(interpreterOut);
+    for (int i = 0; i < interpreterEhdr->e_phnum; i++) {
+      Elf64_Phdr *interpreterPhdr =
+          (Elf64_Phdr *)((size_t)interpreterOut + interpreterEhdr->e_phoff +
+                         i * interpreterEhdr->e_phentsize);
+      if (interpreterPhdr->p_type != PT_LOAD)
+        continue;
+      elfProcessLoad(target, interpreter, interpreterPhdr, interpreterBase);
+    }
+    free(interpreterOut);
+    pageCacheClose(interpreter);
+  }
+
   // For the foreseeable future ;)
 #if ELF_DEBUG
   // for (int i = 0; i < elf_ehdr->e_shnum; i++) {
@@ -188,15 +248,6 @@ Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
   debugf("[elf] New pagedir: offset{%x}\n", pagedir);
 #endif
 
-  // Done loading into the pagedir
-  ChangePageDirectory(oldpagedir);
-
-  Task *target =
-      taskCreate(id,
-                 interpreterEntry ? (interpreterBase + interpreterEntry)
-                                  : elf_ehdr->e_entry,
-                 false, pagedir, argc, argv);
-
   // libc takes care of tls lmao
   /*if (tls) {
     ChangePageDirectory(pagedir);
@@ -228,6 +279,7 @@ Task *elfExecute(char *filepath, uint32_t argc, char **argv, uint32_t envc,
   // User stack generation: the stack itself, AUXs, etc...
   stackGenerateUser(target, argc, argv, envc, envv, out, filesize, elf_ehdr);
   free(out);
+  pageCacheClose(image);
 
   void **a = (void **)(&target->firstSpecialFile);
   fsUserOpenSpecial(a, "/dev/stdin", target, 0, &stdio);
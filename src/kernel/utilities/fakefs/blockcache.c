@@ -0,0 +1,52 @@
+#include <block_cache.h>
+#include <fakefs.h>
+#include <task.h>
+#include <util.h>
+
+// /proc/blockcache: block cache statistics, as plain text
+// Copyright (C) 2024 Panagiotis
+
+int blockCacheSpecialRead(OpenFile *fd, uint8_t *out, size_t limit) {
+  char buff[256] = {0};
+  int  len = blockCacheStats(buff, sizeof(buff));
+  if (fd->pointer >= len)
+    return 0;
+
+  size_t cnt = len - fd->pointer;
+  if (cnt > limit)
+    cnt = limit;
+  memcpy(out, buff + fd->pointer, cnt);
+  fd->pointer += cnt;
+  return cnt;
+}
+
+int blockCacheSpecialStat(OpenFile *fd, stat *target) {
+  target->st_dev = 70;
+  target->st_ino = rand(); // todo!
+  target->st_mode = S_IFREG | S_IRUSR;
+  target->st_nlink = 1;
+  target->st_uid = 0;
+  target->st_gid = 0;
+  target->st_rdev = 0;
+  target->st_blksize = 0x1000;
+  target->st_size = 0; // generated on read (like procfs)
+  target->st_blocks = 0;
+  target->st_atime = 69;
+  target->st_mtime = 69;
+  target->st_ctime = 69;
+
+  return 0;
+}
+
+int blockCacheSpecialIoctl(OpenFile *fd, uint64_t request, void *arg) {
+  return -ENOTTY;
+}
+bool blockCacheSpecialDuplicate() { return true; }
+
+VfsHandlers handleBlockCache = {.read = blockCacheSpecialRead,
+                                .write = 0,
+                                .stat = blockCacheSpecialStat,
+                                .duplicate = blockCacheSpecialDuplicate,
+                                .ioctl = blockCacheSpecialIoctl,
+                                .mmap = 0,
+                                .getdents64 = 0};
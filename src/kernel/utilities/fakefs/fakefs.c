@@ -4,4 +4,6 @@
 void initiateFakefs() {
   fsUserOpenSpecial((void **)(&firstGlobalSpecial), "/dev/null", currentTask,
                     -1, &handleNull);
+  fsUserOpenSpecial((void **)(&firstGlobalSpecial), "/proc/blockcache",
+                    currentTask, -1, &handleBlockCache);
 }
@@ -7,11 +7,14 @@
 #include <icmp.h>
 #include <kb.h>
 #include <malloc.h>
+#include <malloc_glue.h>
+#include <page_cache.h>
 #include <paging.h>
 #include <pci.h>
 #include <pmm.h>
 #include <rtc.h>
 #include <shell.h>
+#include <slab.h>
 #include <string.h>
 #include <system.h>
 #include <task.h>
@@ -107,7 +110,7 @@ void readDisk() {
   snprintf(choice, 200, "reading disk{0} LBA{%d}:", lba);
 
   uint8_t *rawArr = (uint8_t *)malloc(SECTOR_SIZE);
-  getDiskBytes(rawArr, lba, 1);
+  getDiskBytes(0, rawArr, lba, 1);
 
   hexDump(choice, rawArr, SECTOR_SIZE, 16);
 
@@ -140,6 +143,10 @@ void launch_shell(int n) {
       echo(ch);
     } else if (strEql(ch, "dump")) {
       printf("\n");
+      PhysicalDumpStats();
+      pageCacheDumpStats();
+      slabDumpStats();
+      heapDumpStats();
       BitmapDumpBlocks(&physical);
     } else if (strEql(ch, "help")) {
       help();
@@ -1,58 +1,149 @@
+#include <system.h>
 #include <util.h>
 
 // Utilities used inside source code
 // Copyright (C) 2024 Panagiotis
 
-#define LONG_MASK (sizeof(unsigned long) - 1)
-void memset(void *_dst, int val, size_t len) {
-  unsigned char *dst = _dst;
-  unsigned long *ldst;
-  unsigned long  lval =
-      (val & 0xFF) *
-      (-1ul /
-       255); // the multiplier becomes 0x0101... of the same length as long
-
-  if (len >= 16) // optimize only if it's worth it (limit is a guess)
-  {
-    while ((uintptr_t)dst & LONG_MASK) {
-      *dst++ = val;
-      len--;
-    }
-    ldst = (void *)dst;
-    while (len > sizeof(long)) {
-      *ldst++ = lval;
-      len -= sizeof(long);
-    }
-    dst = (void *)ldst;
+// Memory operations are dispatched on what the CPU reports: "rep movsb" &
+// "rep stosb" when they're fast (ERMS, or FSRM for short copies too) and
+// 64-bit unrolled loops otherwise. Everything starts off with the loops, as
+// they are used long before initiateMemoryOps() runs
+
+typedef uint64_t __attribute__((may_alias)) memWord;
+
+void initiateMemoryOps() {
+  uint32_t eax = 0x0, ebx = 0, ecx = 0, edx = 0;
+  cpuid(&eax, &ebx, &ecx, &edx);
+  if (eax >= 0x7) {
+    eax = 0x7, ebx = 0, ecx = 0, edx = 0;
+    cpuid(&eax, &ebx, &ecx, &edx);
+    memErms = (ebx >> 9) & 1;
+    memFsrm = (edx >> 4) & 1;
+  }
+
+  debugf("[util::mem] Memory operations: erms{%d} fsrm{%d}\n", memErms,
+         memFsrm);
+}
+
+void *memcpyRep(void *restrict dstptr, const void *restrict srcptr,
+                size_t size) {
+  void *dst = dstptr;
+  asm volatile("rep movsb" : "+D"(dst), "+S"(srcptr), "+c"(size)::"memory");
+  return dstptr;
+}
+
+void *memcpyUnrolled(void *restrict dstptr, const void *restrict srcptr,
+                     size_t size) {
+  uint8_t       *dst = (uint8_t *)dstptr;
+  const uint8_t *src = (const uint8_t *)srcptr;
+
+  // whole chunk's read before it's written, so it's fine for memmove()ing
+  // to lower addresses as well
+  while (size >= 32) {
+    memWord a = ((const memWord *)src)[0];
+    memWord b = ((const memWord *)src)[1];
+    memWord c = ((const memWord *)src)[2];
+    memWord d = ((const memWord *)src)[3];
+    ((memWord *)dst)[0] = a;
+    ((memWord *)dst)[1] = b;
+    ((memWord *)dst)[2] = c;
+    ((memWord *)dst)[3] = d;
+    dst += 32;
+    src += 32;
+    size -= 32;
+  }
+  while (size >= 8) {
+    *(memWord *)dst = *(const memWord *)src;
+    dst += 8;
+    src += 8;
+    size -= 8;
+  }
+  while (size--)
+    *dst++ = *src++;
+  return dstptr;
+}
+
+void *memcpy(void *restrict dstptr, const void *restrict srcptr, size_t size) {
+  if (memErms && (memFsrm || size >= MEM_REP_THRESHOLD))
+    return memcpyRep(dstptr, srcptr, size);
+  return memcpyUnrolled(dstptr, srcptr, size);
+}
+
+void memsetRep(void *_dst, int val, size_t len) {
+  asm volatile("rep stosb" : "+D"(_dst), "+c"(len) : "a"(val) : "memory");
+}
+
+void memsetUnrolled(void *_dst, int val, size_t len) {
+  uint8_t *dst = (uint8_t *)_dst;
+  // the multiplier becomes 0x0101... of the same length as the word
+  memWord word = (val & 0xFF) * (-1ul / 255);
+
+  while (len >= 32) {
+    ((memWord *)dst)[0] = word;
+    ((memWord *)dst)[1] = word;
+    ((memWord *)dst)[2] = word;
+    ((memWord *)dst)[3] = word;
+    dst += 32;
+    len -= 32;
+  }
+  while (len >= 8) {
+    *(memWord *)dst = word;
+    dst += 8;
+    len -= 8;
   }
   while (len--)
     *dst++ = val;
 }
 
-void *memcpy(void *restrict dstptr, const void *restrict srcptr, size_t size) {
-  unsigned char       *dst = (unsigned char *)dstptr;
-  const unsigned char *src = (const unsigned char *)srcptr;
-  for (size_t i = 0; i < size; i++)
-    dst[i] = src[i];
-  return dstptr;
+void memset(void *_dst, int val, size_t len) {
+  if (memErms && len >= MEM_REP_THRESHOLD)
+    memsetRep(_dst, val, len);
+  else
+    memsetUnrolled(_dst, val, len);
 }
 
 void *memmove(void *dstptr, const void *srcptr, size_t size) {
-  unsigned char       *dst = (unsigned char *)dstptr;
-  const unsigned char *src = (const unsigned char *)srcptr;
-  if (dst < src) {
-    for (size_t i = 0; i < size; i++)
-      dst[i] = src[i];
-  } else {
-    for (size_t i = size; i != 0; i--)
-      dst[i - 1] = src[i - 1];
+  uint8_t       *dst = (uint8_t *)dstptr;
+  const uint8_t *src = (const uint8_t *)srcptr;
+  // forward copies are fine unless dst overlaps the tail of src
+  if (dst <= src || dst >= src + size)
+    return memcpy(dstptr, srcptr, size);
+
+  dst += size;
+  src += size;
+  while (size >= 32) {
+    dst -= 32;
+    src -= 32;
+    memWord a = ((const memWord *)src)[0];
+    memWord b = ((const memWord *)src)[1];
+    memWord c = ((const memWord *)src)[2];
+    memWord d = ((const memWord *)src)[3];
+    ((memWord *)dst)[3] = d;
+    ((memWord *)dst)[2] = c;
+    ((memWord *)dst)[1] = b;
+    ((memWord *)dst)[0] = a;
+    size -= 32;
+  }
+  while (size >= 8) {
+    dst -= 8;
+    src -= 8;
+    *(memWord *)dst = *(const memWord *)src;
+    size -= 8;
   }
+  while (size--)
+    *--dst = *--src;
   return dstptr;
 }
 
+// no rep variant: "repe cmpsb" is slow everywhere, words it is
 int memcmp(const void *aptr, const void *bptr, size_t size) {
-  const unsigned char *a = (const unsigned char *)aptr;
-  const unsigned char *b = (const unsigned char *)bptr;
+  const uint8_t *a = (const uint8_t *)aptr;
+  const uint8_t *b = (const uint8_t *)bptr;
+  while (size >= 8 && *(const memWord *)a == *(const memWord *)b) {
+    a += 8;
+    b += 8;
+    size -= 8;
+  }
   for (size_t i = 0; i < size; i++) {
     if (a[i] < b[i])
       return -1;
@@ -62,6 +153,17 @@ int memcmp(const void *aptr, const void *bptr, size_t size) {
   return 0;
 }
 
+// Whole (aligned) pages: quadword string instructions are fast on every CPU
+void copyPage(void *dst, const void *src) {
+  size_t cnt = 0x1000 / sizeof(uint64_t);
+  asm volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(cnt)::"memory");
+}
+
+void zeroPage(void *dst) {
+  size_t cnt = 0x1000 / sizeof(uint64_t);
+  asm volatile("rep stosq" : "+D"(dst), "+c"(cnt) : "a"(0ul) : "memory");
+}
+
 static unsigned long int next = 1;
 
 int rand(void) {